@@ -14,7 +14,15 @@
 /********************************************************************************/
 /* Header File */
 #include "usb_host_config.h"
+#include "usb_layout_cache.h"
+#include "usb_host_sched.h"
+#include "usb_enum_prof.h"
+#include "usb_key.h"
+#include "event.h"
+#include "irq.h"
 #include "gpio.h"
+#include "gamepad.h"
+#include "mouse.h"
 
 #define DEF_XBOX360_VID                 0x045E
 #define DEF_XBOX360_PID                 0x028E
@@ -22,12 +30,156 @@
 #define DEF_XBOX360_ITF_SUBCLASS        0x5D
 #define DEF_XBOX360_ITF_PROTOCOL        0x01
 
+_Static_assert( DEF_KM_DEV_NUM * sizeof( HOST_CTL ) <= DEF_KM_DEV_RAM_MAX, "DEF_KM_DEV_NUM exceeds DEF_KM_DEV_RAM_MAX" );
+_Static_assert( DEF_KM_DEV_NUM > DEF_KM_DEV_HID_RESERVE + 1, "DEF_KM_DEV_NUM leaves no HOST_CTL to a nested HUB" );
+
 /*******************************************************************************/
 /* Variable Definition */
 uint8_t  DevDesc_Buf[ 18 ];                                                     // Device Descriptor Buffer
 uint8_t  Com_Buf[ DEF_COM_BUF_LEN ];                                            // General Buffer
 struct   _ROOT_HUB_DEVICE RootHubDev;
 struct   __HOST_CTL HostCtl[ DEF_TOTAL_ROOT_HUB * DEF_ONE_USB_SUP_DEV_TOTAL ];
+static uint32_t KM_DescHash;                                                    // Layout cache key of the device being enumerated
+
+/* Interrupt endpoint polling is run by the SOF scheduler, results that need
+ * control transfers are posted to the main loop */
+#define DEF_KM_ROOT_PORT                0xFF                                    // HubPort value of the root device
+#define DEF_KM_NO_PORT                  0xFE
+static volatile uint16_t KM_TickMs;                                             // 1mS tick of TIM3
+
+/* Port node whose device answers at address 0, from its port reset until
+ * SET_ADDRESS. Only one device may be there at a time, the other ports
+ * wait in debounce until it is released. */
+static uint8_t KM_Addr0Port = DEF_KM_NO_PORT;
+
+/* Live interface list, compacted on every teardown. Slot numbers index the
+ * ready bitmap, both only change with the USBFS interrupt masked. */
+#if ( DEF_KM_LIVE_MAX > 32 )
+#error "DEF_KM_LIVE_MAX: the ready bitmap holds 32 slots"
+#endif
+#if ( DEF_KM_LIVE_MAX < ( DEF_KM_DEV_NUM * DEF_INTERFACE_NUM_MAX ) )
+#error "DEF_KM_LIVE_MAX: too small for every interface of a full device pool"
+#endif
+typedef struct
+{
+    uint8_t  Index;                                                             // HostCtl index
+    uint8_t  IntfNum;
+    uint8_t  Kind;                                                              // KM_LIVE_xxx
+} KM_LIVE;
+
+static KM_LIVE KM_Live[ DEF_KM_LIVE_MAX ];
+static uint8_t KM_LiveNum;
+static volatile uint32_t KM_LiveReady;                                          // Slots with a new report, set by KM_PollDone
+
+/* Enumeration pipeline, one request per main loop pass. It takes the root
+ * device from its bus reset, a HUB port device from its address 0 on, one
+ * device at a time. */
+#define KM_ENUM_IDLE                    0
+#define KM_ENUM_SETTLE                  1                                       // Wait for the attach to settle
+#define KM_ENUM_RESET                   2                                       // Bus reset
+#define KM_ENUM_ATTACH                  3                                       // Wait for a stable attach after reset
+#define KM_ENUM_DEV_DESC                4
+#define KM_ENUM_SET_ADDR                5
+#define KM_ENUM_ADDR_WAIT               6                                       // SET_ADDRESS recovery
+#define KM_ENUM_CFG_HEAD                7                                       // First 9 bytes, for wTotalLength
+#define KM_ENUM_CFG_DESC                8
+#define KM_ENUM_SET_CFG                 9
+#define KM_ENUM_CLASS                   10
+#define KM_ENUM_REPORT_DESC             11                                      // HID, per interface, skipped on a layout cache hit
+#define KM_ENUM_SET_IDLE                12                                      // HID, per interface, by report class
+#define KM_ENUM_LED                     13                                      // HID, keyboard LEDs off
+#define KM_ENUM_XBOX_LED                14                                      // Xbox360, player LEDs, per interface
+#define KM_ENUM_HUB_DESC                15                                      // HUB, number of ports
+#define KM_ENUM_HUB_POWER               16                                      // HUB, per port
+
+static struct
+{
+    uint8_t  State;
+    uint8_t  Issued;                                                            // Request of the current step submitted
+    uint8_t  Retry;                                                             // Enumeration attempts
+    uint8_t  RepRetry;
+    uint8_t  Stable;                                                            // Consecutive attach checks
+    uint8_t  ItfNum;                                                            // Interface of the HID steps, port of the HUB steps
+    uint8_t  CfgVal;
+    uint8_t  LedBuf[ 2 ];
+    uint8_t  Node;                                                              // Port node, DEF_KM_ROOT_PORT for the root device
+    uint8_t  Addr;                                                              // Device being enumerated, copied to its node
+    uint8_t  NewAddr;
+    uint8_t  Speed;
+    uint8_t  Ep0Size;
+    uint8_t  Type;
+    uint8_t  PortNum;                                                           // Ports of a HUB
+    uint16_t CfgLen;
+    uint16_t Time;                                                              // Step start, KM_TickMs
+    uint16_t Poll;
+    uint16_t Wait;
+} KM_Enum;
+
+/* Keyboard lighting report in the control transfer slot. The lighting
+ * state itself is SetReport_Value of the interface, SetReport_Flag marks
+ * a value not sent yet: toggles while a report is queued or in flight
+ * only move the value, and the next report carries the latest one. */
+static struct
+{
+    uint8_t  Issued;                                                            // Report submitted, result not taken yet
+    uint8_t  Index;                                                             // Interface of the report in flight
+    uint8_t  IntfNum;
+    uint8_t  Retry;                                                             // Failed attempts of the same interface
+    uint8_t  Buf[ 2 ];                                                          // [ReportID,] value
+} KM_Led;
+
+/* Recovery of a STALLed endpoint, one request at a time through the
+ * control transfer slot */
+#define KM_STALL_IDLE                   0
+#define KM_STALL_CLEAR                  1                                       // CLEAR_FEATURE(ENDPOINT_HALT), per IN endpoint on the interface step
+#define KM_STALL_SET_ITF                2                                       // SET_INTERFACE, alternate setting 0
+#define KM_STALL_SET_IDLE               3
+
+static struct
+{
+    uint8_t  State;
+    uint8_t  Issued;                                                            // Request submitted, result not taken yet
+    uint8_t  Index;                                                             // HostCtl index of the device
+    uint8_t  HubPort;
+    uint8_t  IntfNum;
+    uint8_t  InNum;                                                             // IN endpoint being cleared
+    uint8_t  Cnt;                                                               // Recovery step, InEndpStallCnt
+} KM_Stall;
+
+/* HUB port requests of the port state machines in the control transfer
+ * slot. A port node holds the sequence from its GET_STATUS until it has
+ * acted on the result, see HUB_PortRequest. */
+static struct
+{
+    uint8_t  Issued;                                                            // Request submitted, result not taken yet
+    uint8_t  Node;                                                              // Port node holding the sequence, DEF_KM_NO_PORT if none
+    uint8_t  Chg;                                                               // Change bits not acknowledged yet
+    uint8_t  Buf[ 4 ];                                                          // wPortStatus, wPortChange
+} KM_Hub = { 0, DEF_KM_NO_PORT };
+
+/* Player LED pattern sent to an Xbox360 controller after its enumeration */
+static const uint8_t KM_XboxLedInit[ 3 ] = { 0x01, 0x03, 0x06 };
+
+static void KM_EnumStart( void );
+static void KM_EnumStartPort( uint8_t hub_port );
+static void KM_EnumFinish( uint8_t s );
+static void KM_StallDone( uint8_t s );
+static void KM_StallReset( uint8_t s );
+
+/* Per-device poll interval override, used with DEF_POLL_OVERRIDE_MODE 1.
+ * An Interval of 0 takes DEF_POLL_FS_INTERVAL or DEF_POLL_LS_INTERVAL. */
+typedef struct
+{
+    uint16_t Vid;
+    uint16_t Pid;
+    uint8_t  Interval;
+} KM_POLL_OVERRIDE;
+
+static const KM_POLL_OVERRIDE KM_PollOverrideTab[ ] =
+{
+    /* { 0x046D, 0xC077, 0 }, */
+    { 0x0000, 0x0000, 0 }                                                       // End of table
+};
 
 /*******************************************************************************/
 /* Interrupt Function Declaration */
@@ -63,8 +215,8 @@ void TIM3_Init( uint16_t arr, uint16_t psc )
 
     /* Configure timer3 interrupt */
     NVIC_InitStructure.NVIC_IRQChannel = TIM3_IRQn;
-    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 1;
-    NVIC_InitStructure.NVIC_IRQChannelSubPriority = 2;
+    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = IRQ_PREEMPT_TICK;
+    NVIC_InitStructure.NVIC_IRQChannelSubPriority = IRQ_SUB_TICK;
     NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
     NVIC_Init( &NVIC_InitStructure );
 
@@ -84,53 +236,151 @@ void TIM3_Init( uint16_t arr, uint16_t psc )
  */
 void TIM3_IRQHandler( void )
 {
-    uint8_t index;
-    uint8_t hub_port;
-    uint8_t intf_num, in_num;
-
+    IRQ_STAT_ENTER( IRQ_ID_TICK, TIM3->CNT );
     if( TIM_GetITStatus( TIM3, TIM_IT_Update ) != RESET )
     {
         /* Clear interrupt flag */
         TIM_ClearITPendingBit( TIM3, TIM_IT_Update );
 
-        /* USB HID/Xbox Device Input Endpoint Timing */
-        if( RootHubDev.bStatus >= ROOT_DEV_SUCCESS )
+        /* Asynchronous transfer timeout */
+        USBFSH_AsyncTick( );
+        KM_TickMs++;
+        EVT_Tick( );
+        ProcessAutofire_IRQ( );
+        ProcessMouseSpeed_IRQ( );
+    }
+    IRQ_STAT_EXIT( IRQ_ID_TICK );
+}
+
+/*********************************************************************
+ * @fn      KM_CtrlTaken
+ *
+ * @brief   Whether the control transfer slot holds a request whose
+ *          result its submitter has not taken yet. The enumeration,
+ *          the keyboard lighting, the STALL recovery and the HUB port
+ *          requests share the slot, none submits while this is set.
+ *
+ * @return  1 if taken.
+ */
+static uint8_t KM_CtrlTaken( void )
+{
+    return KM_Enum.Issued || KM_Led.Issued || KM_Stall.Issued || KM_Hub.Issued;
+}
+
+/*********************************************************************
+ * @fn      KM_TreeReset
+ *
+ * @brief   Forget the device tree: root device, every HUB port node
+ *          and every device structure.
+ *
+ * @return  none
+ */
+static void KM_TreeReset( void )
+{
+    memset( &RootHubDev.bStatus, 0, sizeof( ROOT_HUB_DEVICE ) );
+    memset( HostCtl, 0, sizeof( HostCtl ) );
+    KM_Addr0Port = DEF_KM_NO_PORT;
+    KM_Hub.Issued = 0;
+    KM_Hub.Node = DEF_KM_NO_PORT;
+}
+
+/*********************************************************************
+ * @fn      KM_DevAlloc
+ *
+ * @brief   Find a free device structure for a device behind a HUB.
+ *          A structure is in use while a port node refers to it.
+ *
+ * @para    reserve: Structures that must stay free after this one.
+ *
+ * @return  HostCtl index, 0 if the pool is exhausted.
+ */
+static uint8_t KM_DevAlloc( uint8_t reserve )
+{
+    uint8_t index, node;
+    uint8_t first = 0, free = 0;
+
+    for( index = 1; index < DEF_ONE_USB_SUP_DEV_TOTAL; index++ )
+    {
+        for( node = 0; node < DEF_KM_PORT_NODE_NUM; node++ )
         {
-            index = RootHubDev.DeviceIndex;
-            if( ( RootHubDev.bType == USB_DEV_CLASS_HID ) || ( RootHubDev.bType == DEF_DEV_TYPE_XBOX360 ) )
+            if( RootHubDev.Device[ node ].bPort && ( RootHubDev.Device[ node ].DeviceIndex == index ) )
             {
-                for( intf_num = 0; intf_num < HostCtl[ index ].InterfaceNum; intf_num++ )
-                {
-                    for( in_num = 0; in_num < HostCtl[ index ].Interface[ intf_num ].InEndpNum; in_num++ )
-                    {
-                        HostCtl[ index ].Interface[ intf_num ].InEndpTimeCount[ in_num ]++;
-                    }
-                }
+                break;
             }
-            else if( RootHubDev.bType == USB_DEV_CLASS_HUB )
+        }
+        if( node >= DEF_KM_PORT_NODE_NUM )
+        {
+            if( first == 0 )
             {
-                HostCtl[ index ].Interface[ 0 ].InEndpTimeCount[ 0 ]++;
-                for( hub_port = 0; hub_port < RootHubDev.bPortNum; hub_port++ )
-                {
-                    if( RootHubDev.Device[ hub_port ].bStatus >= ROOT_DEV_SUCCESS )
-                    {
-                        index = RootHubDev.Device[ hub_port ].DeviceIndex;
+                first = index;
+            }
+            free++;
+        }
+    }
+    return ( free > reserve ) ? first : 0;
+}
 
-                        if( ( RootHubDev.Device[ hub_port ].bType == USB_DEV_CLASS_HID ) || ( RootHubDev.Device[ hub_port ].bType == DEF_DEV_TYPE_XBOX360 ) )
-                        {
-                            for( intf_num = 0; intf_num < HostCtl[ index ].InterfaceNum; intf_num++ )
-                            {
-                                for( in_num = 0; in_num < HostCtl[ index ].Interface[ intf_num ].InEndpNum; in_num++ )
-                                {
-                                    HostCtl[ index ].Interface[ intf_num ].InEndpTimeCount[ in_num ]++;
-                                }
-                            }
-                        }
-                    }
-                }
+/*********************************************************************
+ * @fn      KM_AddrAlloc
+ *
+ * @brief   Find a free USB address for a device behind a HUB. The root
+ *          device keeps USB_DEVICE_ADDR, an address is in use while a
+ *          port node holds it.
+ *
+ * @return  USB address, 0 if none is left.
+ */
+static uint8_t KM_AddrAlloc( void )
+{
+    uint8_t addr, node;
+
+    for( addr = USB_DEVICE_ADDR + 1; addr <= USBFS_USB_ADDR_MASK; addr++ )
+    {
+        for( node = 0; node < DEF_KM_PORT_NODE_NUM; node++ )
+        {
+            if( RootHubDev.Device[ node ].bPort && ( RootHubDev.Device[ node ].bAddress == addr ) )
+            {
+                break;
             }
         }
+        if( node >= DEF_KM_PORT_NODE_NUM )
+        {
+            return addr;
+        }
+    }
+    return 0;
+}
+
+/*********************************************************************
+ * @fn      KM_NodeEp0
+ *
+ * @brief   Endpoint 0 size of the device of a port node.
+ *
+ * @para    node: Port node, DEF_KM_ROOT_PORT for the root device.
+ *
+ * @return  bMaxPacketSize0.
+ */
+static uint8_t KM_NodeEp0( uint8_t node )
+{
+    return ( node == DEF_KM_ROOT_PORT ) ? RootHubDev.bEp0MaxPks : RootHubDev.Device[ node ].bEp0MaxPks;
+}
+
+/*********************************************************************
+ * @fn      KM_NodeIsHub
+ *
+ * @brief   Whether a HUB is attached to a port node, or to the USB
+ *          host port.
+ *
+ * @para    node: Port node, DEF_KM_ROOT_PORT for the root device.
+ *
+ * @return  1 for a HUB.
+ */
+static uint8_t KM_NodeIsHub( uint8_t node )
+{
+    if( node == DEF_KM_ROOT_PORT )
+    {
+        return RootHubDev.bType == USB_DEV_CLASS_HUB;
     }
+    return RootHubDev.Device[ node ].bType == USB_DEV_CLASS_HUB;
 }
 
 /*********************************************************************
@@ -207,156 +457,6 @@ void USBH_AnalyseType( uint8_t *pdev_buf, uint8_t *pcfg_buf, uint8_t *ptype )
     }
 }
 
-/*********************************************************************
- * @fn      USBH_EnumRootDevice
- *
- * @brief   Generally enumerate a device connected to host port.
- *
- * @para    index: USB host port
- *
- * @return  Enumeration result
- */
-uint8_t USBH_EnumRootDevice( void )
-{
-    uint8_t  s;
-    uint8_t  enum_cnt;
-    uint8_t  cfg_val;
-    uint16_t i;
-    uint16_t len;
-
-    DUG_PRINTF( "Enum:\r\n" );
-
-    enum_cnt = 0;
-ENUM_START:
-    /* Delay and wait for the device to stabilize */
-    Delay_Ms( 100 );
-    enum_cnt++;
-    Delay_Ms( 8 << enum_cnt );
-
-    /* Reset the USB device and wait for the USB device to reconnect */
-    USBFSH_ResetRootHubPort( 0 );
-    for( i = 0, s = 0; i < DEF_RE_ATTACH_TIMEOUT; i++ )
-    {
-        if( USBFSH_EnableRootHubPort( &RootHubDev.bSpeed ) == ERR_SUCCESS )
-        {
-            i = 0;
-            s++;
-            if( s > 6 )
-            {
-                break;
-            }
-        }
-        Delay_Ms( 1 );
-    }
-    if( i )
-    {
-        /* Determine whether the maximum number of retries has been reached, and retry if not reached */
-        if( enum_cnt <= 5 )
-        {
-            goto ENUM_START;
-        }
-        return ERR_USB_DISCON;
-    }
-
-    /* Get USB device device descriptor */
-    DUG_PRINTF("Get DevDesc: ");
-    s = USBFSH_GetDeviceDescr( &RootHubDev.bEp0MaxPks, DevDesc_Buf );
-    if( s == ERR_SUCCESS )
-    {
-        /* Print USB device device descriptor */
-#if DEF_DEBUG_PRINTF
-        for( i = 0; i < 18; i++ )
-        {
-            DUG_PRINTF( "%02x ", DevDesc_Buf[ i ] );
-        }
-        DUG_PRINTF("\r\n"); 
-#endif
-    }
-    else
-    {
-        /* Determine whether the maximum number of retries has been reached, and retry if not reached */
-        DUG_PRINTF( "Err(%02x)\r\n", s );
-        if( enum_cnt <= 5 )
-        {
-            goto ENUM_START;
-        }
-        return DEF_DEV_DESCR_GETFAIL;
-    }
-
-    /* Set the USB device address */
-    DUG_PRINTF("Set DevAddr: ");
-    RootHubDev.bAddress = (uint8_t)( USB_DEVICE_ADDR );
-    s = USBFSH_SetUsbAddress( RootHubDev.bEp0MaxPks, RootHubDev.bAddress );
-    if( s == ERR_SUCCESS )
-    {
-        DUG_PRINTF( "OK\r\n" );
-
-        RootHubDev.bAddress = USB_DEVICE_ADDR;
-    }
-    else
-    {
-        /* Determine whether the maximum number of retries has been reached, and retry if not reached */
-        DUG_PRINTF( "Err(%02x)\r\n", s );
-        if( enum_cnt <= 5 )
-        {
-            goto ENUM_START;
-        }
-        return DEF_DEV_ADDR_SETFAIL;
-    }
-    Delay_Ms( 5 );
-
-    /* Get the USB device configuration descriptor */
-    DUG_PRINTF("Get CfgDesc: ");
-    s = USBFSH_GetConfigDescr( RootHubDev.bEp0MaxPks, Com_Buf, DEF_COM_BUF_LEN, &len );
-    if( s == ERR_SUCCESS )
-    {
-        cfg_val = ( (PUSB_CFG_DESCR)Com_Buf )->bConfigurationValue;
-        
-        /* Print USB device configuration descriptor  */
-#if DEF_DEBUG_PRINTF
-        for( i = 0; i < len; i++ )
-        {
-            DUG_PRINTF( "%02x ", Com_Buf[ i ] );
-        }
-        DUG_PRINTF("\r\n");
-#endif
-
-        /* Simply analyze USB device type  */
-        USBH_AnalyseType( DevDesc_Buf, Com_Buf, &RootHubDev.bType );
-        DUG_PRINTF( "DevType: %02x\r\n", RootHubDev.bType );
-    }
-    else
-    {
-        /* Determine whether the maximum number of retries has been reached, and retry if not reached */
-        DUG_PRINTF( "Err(%02x)\r\n", s );
-        if( enum_cnt <= 5 )
-        {
-            goto ENUM_START;
-        }
-        return DEF_CFG_DESCR_GETFAIL;
-    }
-
-    /* Set USB device configuration value */
-    DUG_PRINTF("Set Cfg: ");
-    s = USBFSH_SetUsbConfig( RootHubDev.bEp0MaxPks, cfg_val );
-    if( s == ERR_SUCCESS )
-    {
-        DUG_PRINTF( "OK\r\n" );
-    }
-    else
-    {
-        /* Determine whether the maximum number of retries has been reached, and retry if not reached */
-        DUG_PRINTF( "Err(%02x)\r\n", s );
-        if( enum_cnt <= 5 )
-        {
-            goto ENUM_START;
-        }
-        return ERR_USB_UNSUPPORT;
-    }
-
-    return ERR_SUCCESS;
-}
-
 /*********************************************************************
  * @fn      KM_AnalyzeConfigDesc
  *
@@ -366,7 +466,7 @@ ENUM_START:
  *
  * @return  The result of the analysis.
  */
-uint8_t KM_AnalyzeConfigDesc( uint8_t index, uint8_t ep0_size  )
+uint8_t KM_AnalyzeConfigDesc( uint8_t index )
 {
     uint8_t  s = 0;
     uint16_t i;
@@ -403,12 +503,10 @@ uint8_t KM_AnalyzeConfigDesc( uint8_t index, uint8_t ep0_size  )
                     if( ( (PUSB_ITF_DESCR)( &Com_Buf[ i ] ) )->bInterfaceProtocol == 0x01 ) // Keyboard
                     {
                         HostCtl[ index ].Interface[ num ].Type = DEC_KEY;
-                        HID_SetIdle( ep0_size, num, 0, 0 );
                     }
                     else if( ( (PUSB_ITF_DESCR)( &Com_Buf[ i ] ) )->bInterfaceProtocol == 0x02 ) // Mouse
                     {
                         HostCtl[ index ].Interface[ num ].Type = DEC_MOUSE;
-                        HID_SetIdle( ep0_size, num, 0, 0 );
                     }
                     s = ERR_SUCCESS;
                     i += Com_Buf[ i ];
@@ -498,361 +596,131 @@ uint8_t KM_AnalyzeConfigDesc( uint8_t index, uint8_t ep0_size  )
 }
 
 /*********************************************************************
- * @fn      KM_AnalyzeHidReportDesc
+ * @fn      KM_ApplyHidReportLayout
  *
- * @brief   Analyze keyboard and mouse report descriptor.
+ * @brief   Derive the keyboard LED settings from the parsed report
+ *          layout, whether it was just parsed or restored from the
+ *          layout cache.
  *
  * @para    index: USB host port
+ *          intf_num: Interface number.
  *
- * @return  The result of the analysis.
+ * @return  none
  */
-void KM_AnalyzeHidReportDesc( uint8_t index, uint8_t intf_num )
+static void KM_ApplyHidReportLayout( uint8_t index, uint8_t intf_num )
 {
-    uint8_t  id = 0x00;
-    uint8_t  led = 0x00;
-    uint8_t  size, type, tag;
-    uint8_t  report_size;
-    uint8_t  report_cnt;
-    uint16_t report_bits;
+    Interface *itf = &HostCtl[ index ].Interface[ intf_num ];
 
-    uint16_t i = 0;
+    if( itf->HIDRptDesc.type != REPORT_TYPE_KEYBOARD )
+    {
+        return;
+    }
 
-    /* Usage Page(Generic Desktop), Usage(Kyeboard) */
-    if( ( Com_Buf[ i + 0 ] == 0x05 ) && ( Com_Buf[ i + 1 ] == 0x01 ) &&
-        ( Com_Buf[ i + 2 ] == 0x09 ) && ( Com_Buf[ i + 3 ] == 0x06 ) )
+    /* Save report ID for output */
+    if( itf->HIDRptDesc.led.report_id && ( itf->IDFlag == 0 ) )
     {
-        i += 4;
-        report_size = 0;
-        report_cnt = 0;
-        report_bits = 0;
+        itf->IDFlag = 1;
+        itf->ReportID = itf->HIDRptDesc.led.report_id;
+    }
+    itf->LED_Usage_Min = itf->HIDRptDesc.led.usage_min;
+    itf->LED_Usage_Max = itf->HIDRptDesc.led.usage_max;
 
-        while( i < HostCtl[ index ].Interface[ intf_num ].HidDescLen )
+    if( itf->HIDRptDesc.led.bits == 8 )
+    {
+        if( itf->SetReport_Swi == 0 )
         {
-            /* Item Size, Item Type, Item Tag */
-            size = Com_Buf[ i ] & 0x03;
-            type = Com_Buf[ i ] & 0x0C;
-            tag = Com_Buf[ i ] & 0xF0;
-
-            switch( type )
-            {
-                /* MAIN */
-                case 0x00:
-                    switch( tag )
-                    {
-                        /* Output */
-                        case 0x90:
-                            if( led )
-                            {
-                                report_bits += report_cnt * report_size;
-
-                                /* Save report ID for output */
-                                if( ( id != 0 ) && ( HostCtl[ index ].Interface[ intf_num ].IDFlag == 0 ) )
-                                {
-                                    HostCtl[ index ].Interface[ intf_num ].IDFlag = 1;
-                                    HostCtl[ index ].Interface[ intf_num ].ReportID = id;
-                                }
-                            }
-                            i++;
-                            break;
-
-                        default:
-                            i++;
-                            break;
-                    }
-                    break;
-
-                /* Global */
-                case 0x04:
-                    switch( tag )
-                    {
-                        /* Report ID */
-                        case 0x80:
-                            i++;
-                            id = Com_Buf[ i ];
-                            break;
-
-                        /* Report Count */
-                        case 0x90:
-                            i++;
-                            report_cnt = Com_Buf[ i ];
-                            break;
-
-                        /* Report Size */
-                        case 0x70:
-                            i++;
-                            report_size = Com_Buf[ i ];
-                            break;
-
-                        /* Usage Page */
-                        case 0x00:
-                            i++;
-                            if( Com_Buf[ i ] == 0x08 )      // LED
-                            {
-                                led = 1;
-                            }
-                            else
-                            {
-                                led = 0;
-                            }
-                            break;
-
-                        default:
-                            i++;
-                            break;
-                    }
-                    break;
-
-                /* Local */
-                case 0x08:
-                    switch( tag )
-                    {
-                        /* Usage Minimum */
-                        case 0x10:
-                            i++;
-                            if( led )
-                            {
-                                HostCtl[ index ].Interface[ intf_num ].LED_Usage_Min = Com_Buf[ i ];
-                            }
-                            break;
-
-                        /* Usage Maximum */
-                        case 0x20:
-                            i++;
-                            if( led )
-                            {
-                                HostCtl[ index ].Interface[ intf_num ].LED_Usage_Max = Com_Buf[ i ];
-                            }
-                            break;
-
-                        default:
-                            i++;
-                            break;
-                    }
-                    break;
-
-                default:
-                    i++;
-                    break;
-            }
-            i += size;
+            itf->SetReport_Swi = 1;
         }
+    }
+    else
+    {
+        itf->SetReport_Swi = 0;
+    }
+}
 
-        if( report_bits == 8 )
-        {
-            if( HostCtl[ index ].Interface[ intf_num ].SetReport_Swi == 0 )
-            {
-                HostCtl[ index ].Interface[ intf_num ].SetReport_Swi = 1;
-            }
-        }
-        else
-        {
-            HostCtl[ index ].Interface[ intf_num ].SetReport_Swi = 0;
-        }
+/*********************************************************************
+ * @fn      KM_HidIdleDuration
+ *
+ * @brief   SET_IDLE duration of an interface, chosen by the class of
+ *          its reports. Needs the parsed report descriptor.
+ *
+ * @return  Duration in 4mS units, DEF_HID_IDLE_NONE for no request.
+ */
+static uint8_t KM_HidIdleDuration( Interface *itf )
+{
+    if( ( itf->Type == DEC_KEY ) || ( itf->HIDRptDesc.type == REPORT_TYPE_KEYBOARD ) )
+    {
+        return DEF_HID_IDLE_KEYBOARD;
+    }
+    if( ( itf->Type == DEC_MOUSE ) || ( itf->HIDRptDesc.type == REPORT_TYPE_MOUSE ) )
+    {
+        return DEF_HID_IDLE_MOUSE;
+    }
+    if( itf->HIDRptDesc.type == REPORT_TYPE_JOYSTICK )
+    {
+        return DEF_HID_IDLE_JOYSTICK;
     }
+    return DEF_HID_IDLE_OTHER;
 }
 
 /*********************************************************************
- * @fn      KM_DealHidReportDesc
+ * @fn      KM_AnalyzeHidReportDesc
  *
- * @brief   Get and analyze keyboard and mouse report descriptor.
+ * @brief   Analyze the HID report descriptor held in Com_Buf in a single
+ *          pass. The parser fills in the input field layout and, for
+ *          keyboards, the LED output report used for lighting.
  *
  * @para    index: USB host port
+ *          intf_num: Interface number.
  *
- * @return  The result of the acquisition and analysis.
+ * @return  none
  */
-uint8_t KM_DealHidReportDesc( uint8_t index, uint8_t ep0_size )
+void KM_AnalyzeHidReportDesc( uint8_t index, uint8_t intf_num )
 {
-    uint8_t  s;
-    uint8_t  num, num_tmp;
-    uint8_t  getrep_cnt;
-#if DEF_DEBUG_PRINTF
-    uint16_t i;
-#endif
-
-    getrep_cnt = 0;
-    num_tmp = HostCtl[ index ].InterfaceNum;
-    while( num_tmp )
-    {
-        num = HostCtl[ index ].InterfaceNum - num_tmp;
-        if( HostCtl[ index ].Interface[ num ].HidDescLen )
-        {
-GETREP_START:
-            getrep_cnt++;
-            
-            /* Get HID report descriptor */
-            DUG_PRINTF("Get Interface%x RepDesc: ", num );
-            s = HID_GetHidDesr( ep0_size, num, Com_Buf, &HostCtl[ index ].Interface[ num ].HidDescLen );
-            if( s == ERR_SUCCESS )
-            {
-                /* Print HID report descriptor */
-#if DEF_DEBUG_PRINTF
-                for( i = 0; i < HostCtl[ index ].Interface[ num ].HidDescLen; i++ )
-                {
-                    DUG_PRINTF( "%02x " , Com_Buf[ i ]);
-                }
-                DUG_PRINTF("\r\n");
-#endif
-
-                /* Analyze Report Descriptor */
-                KM_AnalyzeHidReportDesc( index, num );
-                parse_report_descriptor(Com_Buf, (uint16_t)HostCtl[ index ].Interface[ num ].HidDescLen , &HostCtl[ index ].Interface[ num ].HIDRptDesc);
-                
-                //Init circular buffer
-                FifoInit(&HostCtl[ index ].Interface[ num ].buffer);
-
-                num_tmp--;
-            }
-            else
-            {
-                DUG_PRINTF( "Err(%02x)\r\n", s );
-                if( getrep_cnt <= 5 )
-                {
-                    goto GETREP_START;
-                }
+    Interface *itf = &HostCtl[ index ].Interface[ intf_num ];
 
-                return DEF_REP_DESCR_GETFAIL;
-            }
-        }
-        else
-        {
-            num_tmp--;
-        }
-    }
+    parse_report_descriptor( Com_Buf, itf->HidDescLen, &itf->HIDRptDesc );
+    itf->HIDRptDesc.vid = ( (PUSB_DEV_DESCR)DevDesc_Buf )->idVendor;
+    itf->HIDRptDesc.pid = ( (PUSB_DEV_DESCR)DevDesc_Buf )->idProduct;
 
-    return s;
+    KM_ApplyHidReportLayout( index, intf_num );
 }
 
 /*********************************************************************
- * @fn      USBH_EnumHidDevice
+ * @fn      KM_RestoreHidReportDesc
  *
- * @brief   Enumerate HID device.
+ * @brief   Restore all report layouts of a device from the layout cache,
+ *          skipping the report descriptor requests and the parser.
  *
  * @para    index: USB host port
  *
- * @return  The result of the enumeration.
+ * @return  ERR_SUCCESS on a cache hit.
  */
-uint8_t USBH_EnumHidDevice( uint8_t index, uint8_t ep0_size )
+static uint8_t KM_RestoreHidReportDesc( uint8_t index )
 {
-    uint8_t  s;
-    uint8_t  intf_num;
-#if DEF_DEBUG_PRINTF
-    uint8_t  i;
-#endif
-
-
-    DUG_PRINTF( "Enum Hid:\r\n" );
-    
-    /* Analyze HID class device configuration descriptor and save relevant parameters */
-    DUG_PRINTF("Analyze CfgDesc: ");
-    s = KM_AnalyzeConfigDesc( index, ep0_size );
-    if( s == ERR_SUCCESS )
-    {
-        DUG_PRINTF( "OK\r\n" );
-    }
-    else
-    {
-        DUG_PRINTF( "Err(%02x)\r\n", s );
-        return s;
-    }
-
-    /* Get the string descriptor contained in the configuration descriptor if it exists */
-    if( Com_Buf[ 6 ] )
-    {
-        DUG_PRINTF("Get StringDesc4: ");
-        s = USBFSH_GetStrDescr( ep0_size, Com_Buf[ 6 ], Com_Buf );
-        if( s == ERR_SUCCESS )
-        {
-            /* Print the string descriptor contained in the configuration descriptor */
-#if DEF_DEBUG_PRINTF
-            for( i = 0; i < Com_Buf[ 0 ]; i++ )
-            {
-                DUG_PRINTF( "%02x ", Com_Buf[ i ] );
-            }
-            DUG_PRINTF("\r\n");
-#endif
-        }
-        else
-        {
-            DUG_PRINTF( "Err(%02x)\r\n", s );
-        }
-    }
-
-    /* Get HID report descriptor */
-    s = KM_DealHidReportDesc( index, ep0_size );
-    
-    /* Get USB vendor string descriptor  */
-    if( DevDesc_Buf[ 14 ] )
-    {
-        DUG_PRINTF("Get StringDesc1: ");
-        s = USBFSH_GetStrDescr( ep0_size, DevDesc_Buf[ 14 ], Com_Buf );
-        if( s == ERR_SUCCESS )
-        {
-            /* Print USB vendor string descriptor */
-#if DEF_DEBUG_PRINTF
-            for( i = 0; i < Com_Buf[ 0 ]; i++ )
-            {
-                DUG_PRINTF( "%02x ", Com_Buf[ i ]);
-            }
-            DUG_PRINTF("\r\n");
-#endif
-        }
-        else
-        {
-            DUG_PRINTF( "Err(%02x)\r\n", s );
-        }
-    }
+    const LCACHE_RECORD *prec;
+    uint8_t num;
 
-    /* Get USB product string descriptor */
-    if( DevDesc_Buf[ 15 ] )
+    prec = LCACHE_Find( ( (PUSB_DEV_DESCR)DevDesc_Buf )->idVendor, ( (PUSB_DEV_DESCR)DevDesc_Buf )->idProduct, KM_DescHash );
+    if( ( prec == NULL ) || ( prec->InterfaceNum != HostCtl[ index ].InterfaceNum ) )
     {
-        DUG_PRINTF("Get StringDesc2: ");
-        s = USBFSH_GetStrDescr( ep0_size, DevDesc_Buf[ 15 ], Com_Buf );
-        if( s == ERR_SUCCESS )
-        {
-            /* Print USB product string descriptor */
-#if DEF_DEBUG_PRINTF
-            for( i = 0; i < Com_Buf[ 0 ]; i++ )
-            {
-                DUG_PRINTF( "%02x ", Com_Buf[ i ] );
-            }
-            DUG_PRINTF("\r\n");
-#endif
-        }
-        else
-        {
-            DUG_PRINTF( "Err(%02x)\r\n", s );
-        }
+        return ERR_USB_UNAVAILABLE;
     }
-
-    /* Get USB serial number string descriptor */
-    if( DevDesc_Buf[ 16 ] )
+    for( num = 0; num < HostCtl[ index ].InterfaceNum; num++ )
     {
-        DUG_PRINTF("Get StringDesc3: ");
-        s = USBFSH_GetStrDescr( ep0_size, DevDesc_Buf[ 16 ], Com_Buf );
-        if( s == ERR_SUCCESS )
+        if( prec->Itf[ num ].HidDescLen != HostCtl[ index ].Interface[ num ].HidDescLen )
         {
-            /* Print USB serial number string descriptor */
-#if DEF_DEBUG_PRINTF
-            for( i = 0; i < Com_Buf[ 0 ]; i++ )
-            {
-                DUG_PRINTF( "%02x ", Com_Buf[ i ] );
-            }
-            DUG_PRINTF("\r\n");
-#endif
-        }
-        else
-        {
-            DUG_PRINTF( "Err(%02x)\r\n", s );
+            return ERR_USB_UNAVAILABLE;
         }
     }
 
-    /* Get USB serial number string descriptor */
-    for( intf_num = 0; intf_num < HostCtl[ index ].InterfaceNum; intf_num++ )
+    for( num = 0; num < HostCtl[ index ].InterfaceNum; num++ )
     {
-        if( HostCtl[ index ].Interface[ intf_num ].Type == DEC_KEY )
+        if( HostCtl[ index ].Interface[ num ].HidDescLen )
         {
-            HostCtl[ index ].Interface[ intf_num ].SetReport_Value = 0x00;
-            KB_SetReport( index, ep0_size, intf_num );
+            HostCtl[ index ].Interface[ num ].HIDRptDesc = prec->Itf[ num ].Layout;
+            KM_ApplyHidReportLayout( index, num );
+            FifoInit( &HostCtl[ index ].Interface[ num ].buffer );
         }
     }
 
@@ -986,52 +854,6 @@ uint8_t XBOX360_AnalyzeConfigDesc( uint8_t index )
     return s;
 }
 
-/*********************************************************************
- * @fn      USBH_EnumXbox360Device
- *
- * @brief   Enumerate Xbox 360 wired controller.
- *
- * @para    index: USB host port
- *
- * @return  The result of the enumeration.
- */
-uint8_t USBH_EnumXbox360Device( uint8_t index, uint8_t ep0_size )
-{
-    uint8_t  s;
-    uint8_t  intf_num;
-    uint8_t  led_init[ 3 ] = { 0x01, 0x03, 0x06 };
-
-    DUG_PRINTF( "Enum Xbox360:\r\n" );
-
-    DUG_PRINTF( "Analyze CfgDesc: " );
-    s = XBOX360_AnalyzeConfigDesc( index );
-    if( s == ERR_SUCCESS )
-    {
-        DUG_PRINTF( "OK\r\n" );
-    }
-    else
-    {
-        DUG_PRINTF( "Err(%02x)\r\n", s );
-        return s;
-    }
-
-    for( intf_num = 0; intf_num < HostCtl[ index ].InterfaceNum; intf_num++ )
-    {
-        if( ( HostCtl[ index ].Interface[ intf_num ].Type == DEC_XBOX360 ) &&
-            ( HostCtl[ index ].Interface[ intf_num ].OutEndpNum > 0 ) )
-        {
-            s = USBFSH_SendEndpData( HostCtl[ index ].Interface[ intf_num ].OutEndpAddr[ 0 ],
-                                     &HostCtl[ index ].Interface[ intf_num ].OutEndpTog[ 0 ], led_init, sizeof( led_init ) );
-            if( s != ERR_SUCCESS )
-            {
-                DUG_PRINTF( "Xbox LED Init Err(%02x)\r\n", s );
-            }
-        }
-    }
-
-    return ERR_SUCCESS;
-}
-
 /*********************************************************************
  * @fn      HUB_Analyse_ConfigDesc
  *
@@ -1113,1017 +935,2289 @@ uint8_t HUB_AnalyzeConfigDesc( uint8_t index )
 }
 
 /*********************************************************************
- * @fn      USBH_EnumHubDevice
+ * @fn      KB_AnalyzeKeyValue
  *
- * @brief   Enumerate HUB device.
+ * @brief   Handle keyboard lighting. Each lock key press toggles its LED,
+ *          holding the key across reports does not.
  *
  * @para    index: USB host port
+ *          intfnum: Interface number.
+ *          locks: KEY_LOCK_xxx of the lock keys just pressed, from the
+ *                 key engine.
  *
- * @return  The result of the enumeration.
+ * @return  none
  */
-uint8_t USBH_EnumHubDevice( void )
+void KB_AnalyzeKeyValue( uint8_t index, uint8_t intf_num, uint8_t locks )
 {
-    uint8_t  s, retry;
-    uint16_t len;
-    uint16_t  i;
+    uint8_t  i;
+    uint8_t  value;
+    uint8_t  bit_pos = 0x00;
 
-    DUG_PRINTF( "Enum Hub:\r\n" );
+    value = HostCtl[ index ].Interface[ intf_num ].SetReport_Value;
 
-    /* Analyze HID class device configuration descriptor and save relevant parameters */
-    DUG_PRINTF("Analyze CfgDesc: ");
-    s = HUB_AnalyzeConfigDesc( RootHubDev.DeviceIndex );
-    if( s == ERR_SUCCESS )
+    /* LED usages 1 .. 3 are Num, Caps and Scroll Lock, as KEY_LOCK_xxx */
+    for( i = HostCtl[ index ].Interface[ intf_num ].LED_Usage_Min; i <= HostCtl[ index ].Interface[ intf_num ].LED_Usage_Max; i++ )
     {
-        DUG_PRINTF( "OK\r\n" );
+        if( ( i >= 0x01 ) && ( i <= 0x03 ) && ( locks & ( 1 << ( i - 1 ) ) ) )
+        {
+            HostCtl[ index ].Interface[ intf_num ].SetReport_Value ^= ( 1 << bit_pos );
+        }
+
+        bit_pos++;
+    }
+
+    if( value != HostCtl[ index ].Interface[ intf_num ].SetReport_Value )
+    {
+        HostCtl[ index ].Interface[ intf_num ].SetReport_Flag = 1;           // Cleared by the main loop when queued
+    }
+}
+
+/*********************************************************************
+ * @fn      KB_SetReport
+ *
+ * @brief   Queue the keyboard lighting of an interface in the control
+ *          transfer slot, through endpoint 0 or the interrupt OUT
+ *          endpoint. It goes on the bus in what the periodic polls
+ *          leave of a frame, KM_DealPollEvents takes the result.
+ *
+ * @para    index: USB device number.
+ *          hub_port: Port node of the device, DEF_KM_ROOT_PORT for the
+ *                    root device.
+ *          intf_num: Interface number.
+ *
+ * @return  ERR_SUCCESS if queued or nothing to send, ERR_USB_BUSY if
+ *          the slot is taken.
+ */
+uint8_t KB_SetReport( uint8_t index, uint8_t hub_port, uint8_t intf_num )
+{
+    Interface     *itf = &HostCtl[ index ].Interface[ intf_num ];
+    USB_SETUP_REQ req;
+    uint8_t       addr, speed, ep0_size;
+    uint8_t       len;
+    uint8_t       s;
+
+    if( ( itf->SetReport_Swi != 1 ) && ( itf->SetReport_Swi != 0xFF ) )
+    {
+        itf->SetReport_Flag = 0;                                                // No lighting output
+        return ERR_SUCCESS;
+    }
+
+    if( hub_port == DEF_KM_ROOT_PORT )
+    {
+        addr = RootHubDev.bAddress;
+        speed = RootHubDev.bSpeed;
+        ep0_size = RootHubDev.bEp0MaxPks;
     }
     else
     {
-        DUG_PRINTF( "Err(%02x)\r\n", s );
-        return s;
+        addr = RootHubDev.Device[ hub_port ].bAddress;
+        speed = RootHubDev.Device[ hub_port ].bSpeed;
+        ep0_size = RootHubDev.Device[ hub_port ].bEp0MaxPks;
     }
 
-    /* Get the string descriptor contained in the configuration descriptor if it exists */
-    if( Com_Buf[ 6 ] )
+    /* Take the latest value, a toggle from here on sets the flag again */
+    NVIC_DisableIRQ( USBHD_IRQn );
+    itf->SetReport_Flag = 0;
+    if( itf->IDFlag )
     {
-        DUG_PRINTF("Get StringDesc4: ");
-        s = USBFSH_GetStrDescr( RootHubDev.bEp0MaxPks, Com_Buf[ 6 ], Com_Buf );
-        if( s == ERR_SUCCESS )
-        {
-            /* Print the string descriptor contained in the configuration descriptor */
-#if DEF_DEBUG_PRINTF
-            for( i = 0; i < Com_Buf[ 0 ]; i++ )
-            {
-                DUG_PRINTF( "%02x ", Com_Buf[ i ] );
-            }
-            DUG_PRINTF("\r\n");
-#endif
-        }
-        else
-        {
-            DUG_PRINTF( "Err(%02x)\r\n", s );
-        }
+        KM_Led.Buf[ 0 ] = itf->ReportID;
+        KM_Led.Buf[ 1 ] = itf->SetReport_Value;
+        len = 2;
+    }
+    else
+    {
+        KM_Led.Buf[ 0 ] = itf->SetReport_Value;
+        len = 1;
     }
+    NVIC_EnableIRQ( USBHD_IRQn );
 
-    /* Get USB vendor string descriptor  */
-    if( DevDesc_Buf[ 14 ] )
+    if( itf->SetReport_Swi == 1 )                                               // Perform lighting operation through endpoint0
     {
-        DUG_PRINTF("Get StringDesc1: ");
-        s = USBFSH_GetStrDescr( RootHubDev.bEp0MaxPks, DevDesc_Buf[ 14 ], Com_Buf );
-        if( s == ERR_SUCCESS )
-        {
-            /* Print USB vendor string descriptor */
-#if DEF_DEBUG_PRINTF
-            for( i = 0; i < Com_Buf[ 0 ]; i++ )
-            {
-                DUG_PRINTF( "%02x ", Com_Buf[ i ]);
-            }
-            DUG_PRINTF("\r\n");
-#endif
-        }
-        else
-        {
-            DUG_PRINTF( "Err(%02x)\r\n", s );
-        }
+        memcpy( &req, SetupSetReport, sizeof( USB_SETUP_REQ ) );
+        req.wValue |= itf->IDFlag ? itf->ReportID : 0;
+        req.wIndex = intf_num;
+        req.wLength = len;
+        s = USBFSH_SubmitCtrlTransfer( addr, speed, RootHubDev.bSpeed, ep0_size, &req, KM_Led.Buf );
+    }
+    else                                                                        // Perform lighting operation through other endpoint
+    {
+        s = USBFSH_SubmitEndpOut( addr, speed, RootHubDev.bSpeed, itf->OutEndpAddr[ 0 ],
+                                  &itf->OutEndpTog[ 0 ], KM_Led.Buf, len );
     }
 
-    /* Get USB product string descriptor */
-    if( DevDesc_Buf[ 15 ] )
+    if( s != ERR_SUCCESS )
     {
-        DUG_PRINTF("Get StringDesc2: ");
-        s = USBFSH_GetStrDescr( RootHubDev.bEp0MaxPks, DevDesc_Buf[ 15 ], Com_Buf );
-        if( s == ERR_SUCCESS )
-        {
-            /* Print USB product string descriptor */
-#if DEF_DEBUG_PRINTF
-            for( i = 0; i < Com_Buf[ 0 ]; i++ )
-            {
-                DUG_PRINTF( "%02x ", Com_Buf[ i ] );
-            }
-            DUG_PRINTF("\r\n");
-#endif
-        }
-        else
-        {
-            DUG_PRINTF( "Err(%02x)\r\n", s );
-        }
+        itf->SetReport_Flag = 1;
+        return ERR_USB_BUSY;
     }
+    KM_Led.Issued = 1;
+    KM_Led.Index = index;
+    KM_Led.IntfNum = intf_num;
+    return ERR_SUCCESS;
+}
+
+/*********************************************************************
+ * @fn      KM_PollDone
+ *
+ * @brief   Completion of a scheduled interrupt endpoint poll, called
+ *          from the USBFS interrupt. Reports go straight into the
+ *          interface ring, keyboard reports into the key engine along
+ *          with the lighting state; everything that needs a control
+ *          transfer is posted to KM_DealPollEvents.
+ *
+ * @return  none
+ */
+static void KM_PollDone( SCHED_ENDP *pep, uint8_t s, uint8_t *pbuf, uint16_t len )
+{
+    Interface *itf = &HostCtl[ pep->Index ].Interface[ pep->IntfNum ];
+    uint8_t   state, locks;
 
-    /* Get USB serial number string descriptor */
-    if( DevDesc_Buf[ 16 ] )
+    if( s == ERR_SUCCESS )
     {
-        DUG_PRINTF("Get StringDesc3: ");
-        s = USBFSH_GetStrDescr( RootHubDev.bEp0MaxPks, DevDesc_Buf[ 16 ], Com_Buf );
-        if( s == ERR_SUCCESS )
+        if( KM_NodeIsHub( pep->HubPort ) )
         {
-            /* Print USB serial number string descriptor */
-#if DEF_DEBUG_PRINTF
-            for( i = 0; i < Com_Buf[ 0 ]; i++ )
+            /* HUB status change endpoint, taken by HUB_DealChange */
+            if( pep->HubPort == DEF_KM_ROOT_PORT )
             {
-                DUG_PRINTF( "%02x ", Com_Buf[ i ] );
+                RootHubDev.bHubDat |= pbuf[ 0 ];
             }
-            DUG_PRINTF("\r\n");
-#endif
+            else
+            {
+                RootHubDev.Device[ pep->HubPort ].bHubDat |= pbuf[ 0 ];
+            }
+            EVT_Post( EVT_USB_POLL );
+            return;
         }
-        else
+
+        /* A state report equal to the previous one carries nothing new */
+        state = ( itf->Type == DEC_KEY ) || ( itf->Type == DEC_XBOX360 ) ||
+                ( itf->HIDRptDesc.type == REPORT_TYPE_KEYBOARD ) || ( itf->HIDRptDesc.type == REPORT_TYPE_JOYSTICK );
+        if( state && ( len == itf->LastRptLen ) && ( memcmp( pbuf, itf->LastRpt, len ) == 0 ) )
         {
-            DUG_PRINTF( "Err(%02x)\r\n", s );
+            return;
         }
-    }
 
-    /* Get hub descriptor */
-    DUG_PRINTF("Get Hub Desc: ");
-    for( retry = 0; retry < 5; retry++ )
-    {
-        s = HUB_GetClassDevDescr( RootHubDev.bEp0MaxPks, Com_Buf, &len );
-        if( s == ERR_SUCCESS )
+        /* Keyboards go through the key engine, the main loop takes events */
+        if( itf->KeySlot )
         {
-            /* Print USB device device descriptor */
-#if DEF_DEBUG_PRINTF
-            for( i = 0; i < len; i++ )
+            locks = KEY_Report( itf->KeySlot, &itf->HIDRptDesc, pbuf, len );
+            if( state )
             {
-                DUG_PRINTF( "%02x ", Com_Buf[ i ] );
+                /* Changes left out of a full queue go with the next report, even an equal one */
+                itf->LastRptLen = ( ( len <= DEF_KM_LAST_RPT_LEN ) && !( locks & KEY_PARTIAL ) ) ? len : 0;
+                memcpy( itf->LastRpt, pbuf, itf->LastRptLen );
             }
-            DUG_PRINTF("\r\n");
-#endif
+            locks &= ~KEY_PARTIAL;
+            EVT_Post( EVT_KEY );
 
-            RootHubDev.bPortNum = ( (PUSB_HUB_DESCR)Com_Buf)->bNbrPorts;
-            if( RootHubDev.bPortNum > DEF_NEXT_HUB_PORT_NUM_MAX )
+            if( itf->Type == DEC_KEY )
             {
-                RootHubDev.bPortNum = DEF_NEXT_HUB_PORT_NUM_MAX;
+                KB_AnalyzeKeyValue( pep->Index, pep->IntfNum, locks );
+                if( itf->SetReport_Flag )
+                {
+                    EVT_Post( EVT_USB_POLL );
+                }
             }
-            DUG_PRINTF( "RootHubDev.bPortNum: %02x\r\n", RootHubDev.bPortNum );
-            break;
+            return;
         }
-        else
-        {
-            /* Determine whether the maximum number of retries has been reached, and retry if not reached */
-            DUG_PRINTF( "Err(%02x)\r\n", s );
 
-            if( retry == 4 )
+        //Add value to circular
+        itf->HidRptLen = len;
+        if( FifoWrite( &itf->buffer, pbuf, len ) )
+        {
+            if( state )
             {
-                return ERR_USB_UNKNOWN;
+                itf->LastRptLen = ( len <= DEF_KM_LAST_RPT_LEN ) ? len : 0;
+                memcpy( itf->LastRpt, pbuf, itf->LastRptLen );
             }
-        }
-    }
-
-    /* Set the HUB port to power on */
-    for( retry = 0, i = 1; i <= RootHubDev.bPortNum; i++ )
-    {
-        s = HUB_SetPortFeature( RootHubDev.bEp0MaxPks, i, HUB_PORT_POWER );
-        if( s == ERR_SUCCESS )
-        {
-            continue;
-        }
-        else
-        {
-            Delay_Ms( 5 );
-
-            i--;
-            retry++;
-            if( retry >= 5 )
+            if( itf->LiveSlot )
             {
-                return ERR_USB_UNKNOWN;
+                KM_LiveReady |= 1UL << ( itf->LiveSlot - 1 );
+                EVT_Post( EVT_REPORT );
             }
         }
     }
-
-    return ERR_SUCCESS;
+    else if( s == ( USB_PID_STALL | ERR_USB_TRANSFER ) )
+    {
+        /* Stop polling until the main loop has recovered the endpoint */
+        pep->Hold = 1;
+        itf->InEndpStall[ pep->InNum ] = 1;
+        EVT_Post( EVT_USB_POLL );
+    }
 }
 
 /*********************************************************************
- * @fn      HUB_Port_PreEnum1
+ * @fn      KM_SchedInit
  *
- * @brief
+ * @brief   Hook the interrupt endpoint polling to the SOF scheduler.
  *
- * @para
+ * @return  none
+ */
+void KM_SchedInit( void )
+{
+    SCHED_Init( KM_PollDone );
+}
+
+/*********************************************************************
+ * @fn      KM_LiveClear
+ *
+ * @brief   Empty the live interface list, goes with SCHED_Clear. Keys
+ *          still held on the keyboards are released, and the game
+ *          controllers.
  *
  * @return  none
  */
-uint8_t HUB_Port_PreEnum1( uint8_t hub_port, uint8_t *pbuf )
+static void KM_LiveClear( void )
 {
-    uint8_t  s;
-    uint8_t  buf[ 4 ];
-    uint8_t  retry;
+    Interface *itf;
+    uint8_t   n;
 
-    if( ( *pbuf ) & ( 1 << hub_port ) )
+    NVIC_DisableIRQ( USBHD_IRQn );
+    for( n = 0; n < KM_LiveNum; n++ )
     {
-        s = HUB_GetPortStatus( RootHubDev.bEp0MaxPks, hub_port, &buf[ 0 ] );
-        if( s != ERR_SUCCESS )
-        {
-            DUG_PRINTF( "HUB_PE1_ERR1:%x\r\n", s );
-            return s;
-        }
-        else
-        {
-            if( buf[ 2 ] & 0x01 )
-            {
-                s = HUB_ClearPortFeature( RootHubDev.bEp0MaxPks, hub_port, HUB_C_PORT_CONNECTION );
-                if( s != ERR_SUCCESS )
-                {
-                    DUG_PRINTF( "HUB_PE1_ERR2:%x\r\n", s );
-                    return s;
-                }
-
-                retry = 0;
-                do
-                {
-                    s = HUB_GetPortStatus( RootHubDev.bEp0MaxPks, hub_port, &buf[ 0 ] );
-                    if( s != ERR_SUCCESS )
-                    {
-                        DUG_PRINTF( "HUB_PE1_ERR3:%x\r\n", s );
-                        return s;
-                    }
-                    retry++;
-                }while( ( buf[ 2 ] & 0x01 ) && ( retry < 10 ) );
-
-                if( retry != 10 )
-                {
-                    if( !( buf[ 0 ] & 0x01 ) )
-                    {
-                        DUG_PRINTF( "Hub Port%x Out\r\n", hub_port );
-                        return ERR_USB_DISCON;
-                    }
-                }
-            }
-        }
+        itf = &HostCtl[ KM_Live[ n ].Index ].Interface[ KM_Live[ n ].IntfNum ];
+        itf->LiveSlot = 0;
+        KEY_Detach( itf->KeySlot );
+        itf->KeySlot = 0;
     }
-
-    return ERR_USB_UNKNOWN;
+    KM_LiveNum = 0;
+    KM_LiveReady = 0;
+    NVIC_EnableIRQ( USBHD_IRQn );
+    EVT_Post( EVT_KEY );
+    ReleaseGamepad( );
 }
 
 /*********************************************************************
- * @fn      HUB_Port_PreEnum2
+ * @fn      KM_LiveAdd
  *
- * @brief
+ * @brief   List the mouse, keyboard and game controller interfaces of
+ *          a device just enumerated, before its endpoints are scheduled.
  *
- * @para
+ * @para    index: HostCtl index of the device.
  *
  * @return  none
  */
-uint8_t HUB_Port_PreEnum2( uint8_t hub_port, uint8_t *pbuf )
+static void KM_LiveAdd( uint8_t index )
 {
-    uint8_t  s;
-    uint8_t  buf[ 4 ];
-    uint8_t  retry = 0;
+    Interface *itf;
+    uint8_t   intf_num, kind;
 
-    if( ( *pbuf ) & ( 1 << hub_port ) )
+    for( intf_num = 0; intf_num < HostCtl[ index ].InterfaceNum; intf_num++ )
     {
-        s = HUB_SetPortFeature( RootHubDev.bEp0MaxPks, hub_port, HUB_PORT_RESET );
-        if( s != ERR_SUCCESS )
+        itf = &HostCtl[ index ].Interface[ intf_num ];
+        if( itf->InEndpNum == 0 )
+        {
+            continue;
+        }
+        if( KM_LiveNum >= DEF_KM_LIVE_MAX )
         {
-            DUG_PRINTF( "HUB_PE2_ERR1:%x\r\n", s );
-            return s;
+            DUG_PRINTF( "Live list full\r\n" );
+            return;
         }
-
-        Delay_Ms( 10 );
-        do
+        if( itf->HIDRptDesc.type == REPORT_TYPE_MOUSE )
         {
-            s = HUB_GetPortStatus( RootHubDev.bEp0MaxPks, hub_port, &buf[ 0 ] );
-            if( s != ERR_SUCCESS )
-            {
-                DUG_PRINTF( "HUB_PE2_ERR2:%x\r\n", s );
-                return s;
-            }
-            retry++;
-        }while( ( !( buf[ 2 ] & 0x10 ) ) && ( retry <= 10 ) );
-
-        if( retry != 10 )
+            kind = KM_LIVE_MOUSE;
+        }
+        else if( ( itf->Type == DEC_KEY ) || ( itf->HIDRptDesc.type == REPORT_TYPE_KEYBOARD ) )
         {
-            retry = 0;
-            s = HUB_ClearPortFeature( RootHubDev.bEp0MaxPks, hub_port, HUB_C_PORT_RESET  );
-
-            do
-            {
-                s = HUB_GetPortStatus( RootHubDev.bEp0MaxPks, hub_port, &buf[ 0 ] );
-                if( s != ERR_SUCCESS )
-                {
-                    DUG_PRINTF( "HUB_PE2_ERR3:%x\r\n", s );
-                    return s;
-                }
-                retry++;
-            }while( ( buf[ 2 ] & 0x10 ) && ( retry <= 10 ) );
-
-            if( retry != 10 )
+            itf->KeySlot = KEY_Attach( );
+            if( itf->KeySlot == 0 )
             {
-                if( buf[ 0 ] & 0x01 )
-                {
-                    DUG_PRINTF( "Hub Port%x In\r\n", hub_port );
-                    return ERR_USB_CONNECT;
-                }
+                DUG_PRINTF( "Key slots full\r\n" );
+                continue;
             }
+            kind = KM_LIVE_KEYBOARD;
+        }
+        else if( ( itf->HIDRptDesc.type == REPORT_TYPE_JOYSTICK ) || ( itf->Type == DEC_XBOX360 ) )
+        {
+            kind = KM_LIVE_PAD;
+        }
+        else
+        {
+            continue;
         }
-    }
 
-    return ERR_USB_UNKNOWN;
+        KM_Live[ KM_LiveNum ].Index = index;
+        KM_Live[ KM_LiveNum ].IntfNum = intf_num;
+        KM_Live[ KM_LiveNum ].Kind = kind;
+        KM_LiveNum++;
+        itf->LiveSlot = KM_LiveNum;
+    }
 }
 
 /*********************************************************************
- * @fn      HUB_CheckPortSpeed
+ * @fn      KM_LiveRemove
  *
- * @brief
+ * @brief   Drop the interfaces of a device from the live list. The slots
+ *          behind them move up and take their ready bits along. Keys
+ *          still held on a keyboard of the device are released, and so
+ *          is a game controller.
  *
- * @para
+ * @para    index: HostCtl index of the device.
  *
  * @return  none
  */
-uint8_t HUB_CheckPortSpeed( uint8_t hub_port, uint8_t *pbuf )
+static void KM_LiveRemove( uint8_t index )
 {
-    uint8_t  s;
+    Interface *itf;
+    uint32_t  ready = 0;
+    uint8_t   n, m;
+    uint8_t   pad = 0;
 
-    s = HUB_GetPortStatus( RootHubDev.bEp0MaxPks, hub_port, pbuf );
-    if( s )
+    NVIC_DisableIRQ( USBHD_IRQn );
+    for( n = 0, m = 0; n < KM_LiveNum; n++ )
     {
-        return s;
+        itf = &HostCtl[ KM_Live[ n ].Index ].Interface[ KM_Live[ n ].IntfNum ];
+        if( KM_Live[ n ].Index == index )
+        {
+            itf->LiveSlot = 0;
+            KEY_Detach( itf->KeySlot );
+            itf->KeySlot = 0;
+            pad |= ( KM_Live[ n ].Kind == KM_LIVE_PAD );
+            continue;
+        }
+        if( KM_LiveReady & ( 1UL << n ) )
+        {
+            ready |= 1UL << m;
+        }
+        KM_Live[ m ] = KM_Live[ n ];
+        itf->LiveSlot = ++m;
     }
+    KM_LiveNum = m;
+    KM_LiveReady = ready;
+    NVIC_EnableIRQ( USBHD_IRQn );
+    EVT_Post( EVT_KEY );
 
-    if( pbuf[ 1 ] & 0x02 )
+    /* A stick mouse must not keep moving */
+    if( pad )
     {
-        return USB_LOW_SPEED;
+        ReleaseGamepad( );
     }
-    else
+}
+
+/*********************************************************************
+ * @fn      KM_LiveTake
+ *
+ * @brief   Fetch and clear the ready bitmap of the live interface list.
+ *          Each interface whose bit is set has at least one report in
+ *          its FIFO, a bit may be set again while the FIFO is drained.
+ *
+ * @return  Bit n set = slot n has new reports.
+ */
+uint32_t KM_LiveTake( void )
+{
+    uint32_t ready;
+
+    NVIC_DisableIRQ( USBHD_IRQn );
+    ready = KM_LiveReady;
+    KM_LiveReady = 0;
+    NVIC_EnableIRQ( USBHD_IRQn );
+
+    return ready;
+}
+
+/*********************************************************************
+ * @fn      KM_LiveItf
+ *
+ * @brief   Interface of a live list slot.
+ *
+ * @para    slot: Slot, bit number of KM_LiveTake.
+ *          pkind: Receives KM_LIVE_xxx.
+ *
+ * @return  Interface, NULL if the slot is empty.
+ */
+Interface *KM_LiveItf( uint8_t slot, uint8_t *pkind )
+{
+    if( slot >= KM_LiveNum )
     {
-        if( pbuf[ 1 ] & 0x04 )
-        {
-            return USB_HIGH_SPEED;
-        }
-        else
+        return NULL;
+    }
+    *pkind = KM_Live[ slot ].Kind;
+    return &HostCtl[ KM_Live[ slot ].Index ].Interface[ KM_Live[ slot ].IntfNum ];
+}
+
+/*********************************************************************
+ * @fn      KM_PollOverride
+ *
+ * @brief   Forced poll interval of the device just enumerated, looked up
+ *          by the VID/PID still held in DevDesc_Buf.
+ *
+ * @para    speed: Device speed.
+ *
+ * @return  Interval in mS, 0 to keep the descriptor bInterval.
+ */
+static uint8_t KM_PollOverride( uint8_t speed )
+{
+    uint8_t interval = 0;
+#if ( DEF_POLL_OVERRIDE_MODE == 1 )
+    const KM_POLL_OVERRIDE *ptab;
+
+    for( ptab = KM_PollOverrideTab; ptab->Vid; ptab++ )
+    {
+        if( ( ptab->Vid == ( (PUSB_DEV_DESCR)DevDesc_Buf )->idVendor ) &&
+            ( ptab->Pid == ( (PUSB_DEV_DESCR)DevDesc_Buf )->idProduct ) )
         {
-            return USB_FULL_SPEED;
+            interval = ptab->Interval ? ptab->Interval : ( ( speed == USB_LOW_SPEED ) ? DEF_POLL_LS_INTERVAL : DEF_POLL_FS_INTERVAL );
+            break;
         }
     }
+#elif ( DEF_POLL_OVERRIDE_MODE == 2 )
+    interval = ( speed == USB_LOW_SPEED ) ? DEF_POLL_LS_INTERVAL : DEF_POLL_FS_INTERVAL;
+#endif
+
+    if( ( speed == USB_LOW_SPEED ) && interval && ( interval < DEF_POLL_LS_INTERVAL ) )
+    {
+        interval = DEF_POLL_LS_INTERVAL;
+    }
+    return interval;
 }
 
 /*********************************************************************
- * @fn      USBH_EnumHubPortDevice
+ * @fn      KM_SchedAddDevice
  *
- * @brief
+ * @brief   Schedule every interrupt IN endpoint of an enumerated device.
+ *          Pointing devices and game controllers poll first, keyboards
+ *          and the hub status endpoint fill the rest of the frame.
+ *          Must run right after enumeration, the poll interval override
+ *          reads the device descriptor from DevDesc_Buf.
  *
- * @para
+ * @para    index: USB device number.
+ *          hub_port: Port node of the device, DEF_KM_ROOT_PORT for the root device.
  *
  * @return  none
  */
-uint8_t USBH_EnumHubPortDevice( uint8_t hub_port, uint8_t *paddr, uint8_t *ptype )
+static void KM_SchedAddDevice( uint8_t index, uint8_t hub_port )
 {
-    uint8_t  s;
-    uint8_t  enum_cnt;
-    uint16_t len;
-    uint8_t  cfg_val;
-#if DEF_DEBUG_PRINTF
-    uint16_t i;
-#endif
+    SCHED_ENDP ep;
+    Interface  *itf;
+    uint8_t    intf_num, in_num;
+    uint8_t    interval = 0;
+
+    ep.Index = index;
+    ep.HubPort = hub_port;
+    ep.PortSpeed = RootHubDev.bSpeed;
+    if( hub_port == DEF_KM_ROOT_PORT )
+    {
+        ep.Addr = RootHubDev.bAddress;
+        ep.Speed = RootHubDev.bSpeed;
+    }
+    else
+    {
+        ep.Addr = RootHubDev.Device[ hub_port ].bAddress;
+        ep.Speed = RootHubDev.Device[ hub_port ].bSpeed;
+    }
+    if( !KM_NodeIsHub( hub_port ) )
+    {
+        interval = KM_PollOverride( ep.Speed );
+        KM_LiveAdd( index );
+    }
 
-    /* Get USB device descriptor */
-    DUG_PRINTF("(S1)Get DevDesc: \r\n");
-    enum_cnt = 0;
-    do
+    for( intf_num = 0; intf_num < HostCtl[ index ].InterfaceNum; intf_num++ )
     {
-        enum_cnt++;
-        s = USBFSH_GetDeviceDescr( &RootHubDev.Device[ hub_port ].bEp0MaxPks, DevDesc_Buf );
-        if( s == ERR_SUCCESS )
-        {
-#if DEF_DEBUG_PRINTF
-            for( i = 0; i < 18; i++ )
+        itf = &HostCtl[ index ].Interface[ intf_num ];
+        for( in_num = 0; in_num < itf->InEndpNum; in_num++ )
+        {
+            ep.IntfNum = intf_num;
+            ep.InNum = in_num;
+            ep.EndpAddr = itf->InEndpAddr[ in_num ];
+            ep.pEndpTog = &itf->InEndpTog[ in_num ];
+            ep.NativeInterval = itf->InEndpInterval[ in_num ];
+            ep.Interval = ( interval && ( interval < ep.NativeInterval ) ) ? interval : ep.NativeInterval;
+            if( ( itf->Type == DEC_KEY ) || KM_NodeIsHub( hub_port ) )
             {
-                DUG_PRINTF( "%02x ", DevDesc_Buf[ i ] );
+                ep.Prio = SCHED_PRIO_LOW;
             }
-            DUG_PRINTF( "\r\n" );
-#endif
-        }
-        else
-        {
-            DUG_PRINTF( "Err(%02x)\r\n", s );
-            if( enum_cnt >= 10 )
+            else
             {
-                return DEF_DEV_DESCR_GETFAIL;
+                ep.Prio = SCHED_PRIO_HIGH;
             }
+            SCHED_AddEndp( &ep, itf->InEndpSize[ in_num ] );
         }
-    }while( ( s != ERR_SUCCESS ) && ( enum_cnt < 10 ) );
+    }
+}
+
+/*********************************************************************
+ * @fn      KM_LedScan
+ *
+ * @brief   Queue the lighting of the first keyboard interface of a
+ *          device that has a value not sent yet.
+ *
+ * @para    index: HostCtl index of the device.
+ *          hub_port: Port node of the device, DEF_KM_ROOT_PORT for the
+ *                    root device.
+ *
+ * @return  1 if a report was queued or the slot is taken.
+ */
+static uint8_t KM_LedScan( uint8_t index, uint8_t hub_port )
+{
+    uint8_t intf_num;
 
-    /* Set the USB device address */
-    DUG_PRINTF( "Set DevAddr: \r\n" );
-    enum_cnt = 0;
-    do
+    for( intf_num = 0; intf_num < HostCtl[ index ].InterfaceNum; intf_num++ )
     {
-        enum_cnt++;
-        s = USBFSH_SetUsbAddress( RootHubDev.Device[ hub_port ].bEp0MaxPks, \
-                                  RootHubDev.Device[ hub_port ].DeviceIndex + USB_DEVICE_ADDR );
-        if( s == ERR_SUCCESS )
-        {
-            /* Save address */
-            *paddr = RootHubDev.Device[ hub_port ].DeviceIndex + USB_DEVICE_ADDR;
-        }
-        else
+        if( HostCtl[ index ].Interface[ intf_num ].SetReport_Flag )
         {
-            DUG_PRINTF( "Err(%02x)\r\n", s );
-            if( enum_cnt >= 10 )
+            KB_SetReport( index, hub_port, intf_num );
+            if( KM_Led.Issued || HostCtl[ index ].Interface[ intf_num ].SetReport_Flag )
             {
-                return DEF_DEV_ADDR_SETFAIL;
+                return 1;
             }
         }
-    }while( ( s != ERR_SUCCESS ) && ( enum_cnt < 10 ) );
-    Delay_Ms( 5 );
+    }
+    return 0;
+}
+
+/*********************************************************************
+ * @fn      KM_DealPollEvents
+ *
+ * @brief   Main loop side of the endpoint polling: keyboard lighting
+ *          and the results of the STALL recovery requests, see
+ *          KM_StallProcess. One request at a time goes through the
+ *          control transfer slot, the main loop never waits for it.
+ *
+ * @return  none
+ */
+static void KM_DealPollEvents( void )
+{
+    Interface *itf;
+    uint8_t   hub_port;
+    uint8_t   s;
 
-    /* Get USB configuration descriptor */
-    DUG_PRINTF( "Get DevCfgDesc: \r\n" );
-    enum_cnt = 0;
-    do
+    /* Take the result of the recovery request in flight */
+    if( KM_Stall.Issued )
     {
-        enum_cnt++;
-        s = USBFSH_GetConfigDescr( RootHubDev.Device[ hub_port ].bEp0MaxPks, Com_Buf, DEF_COM_BUF_LEN, &len );
-        if( s == ERR_SUCCESS )
+        s = USBFSH_CtrlResult( NULL );
+        if( s == ERR_USB_BUSY )
         {
-#if DEF_DEBUG_PRINTF
-            for( i = 0; i < len; i++ )
-            {
-                DUG_PRINTF( "%02x ", Com_Buf[ i ] );
-            }
-            DUG_PRINTF( "\r\n" );
-#endif
-
-            /* Save configuration value */
-            cfg_val = ( (PUSB_CFG_DESCR)Com_Buf )->bConfigurationValue;
+            return;
+        }
+        KM_Stall.Issued = 0;
+        KM_StallDone( s );
+    }
 
-            /* Analyze USB device type */
-            USBH_AnalyseType( DevDesc_Buf, Com_Buf, ptype );
-            DUG_PRINTF( "DevType: %02x\r\n", *ptype );
+    /* Take the result of the report in flight, a failed one goes again */
+    if( KM_Led.Issued )
+    {
+        s = USBFSH_CtrlResult( NULL );
+        if( s == ERR_USB_BUSY )
+        {
+            return;
+        }
+        KM_Led.Issued = 0;
+        itf = &HostCtl[ KM_Led.Index ].Interface[ KM_Led.IntfNum ];
+        if( ( s == ERR_SUCCESS ) || ( s == ERR_USB_UNAVAILABLE ) )
+        {
+            KM_Led.Retry = 0;                                                   // Sent, or aborted with the device
+        }
+        else if( ( ++KM_Led.Retry <= DEF_KM_LED_RETRY ) && ( itf->Type == DEC_KEY ) )
+        {
+            itf->SetReport_Flag = 1;
         }
         else
         {
-            DUG_PRINTF( "Err(%02x)\r\n", s );
-            if( enum_cnt >= 10 )
-            {
-                return DEF_DEV_DESCR_GETFAIL;
-            }
+            DUG_PRINTF( "LED Err:%02x\r\n", s );
+            KM_Led.Retry = 0;
         }
-    }while( ( s != ERR_SUCCESS ) && ( enum_cnt < 10 ) );
+    }
 
-    /* Set USB device configuration value */
-    DUG_PRINTF( "Set CfgValue: \r\n" );
-    enum_cnt = 0;
-    do
+    /* The result of the slot belongs to whoever submitted the request until taken */
+    if( KM_CtrlTaken( ) || ( RootHubDev.bStatus < ROOT_DEV_SUCCESS ) )
     {
-        enum_cnt++;
-        s = USBFSH_SetUsbConfig( RootHubDev.Device[ hub_port ].bEp0MaxPks, cfg_val );
-        if( s != ERR_SUCCESS )
+        return;
+    }
+
+    if( RootHubDev.bType == USB_DEV_CLASS_HID )
+    {
+        KM_LedScan( RootHubDev.DeviceIndex, DEF_KM_ROOT_PORT );
+    }
+    else if( RootHubDev.bType == USB_DEV_CLASS_HUB )
+    {
+        for( hub_port = 0; hub_port < DEF_KM_PORT_NODE_NUM; hub_port++ )
         {
-            DUG_PRINTF( "Err(%02x)\r\n", s );
-            if( enum_cnt >= 10 )
+            if( ( RootHubDev.Device[ hub_port ].bPort == 0 ) ||
+                ( RootHubDev.Device[ hub_port ].bStatus != ROOT_DEV_SUCCESS ) || ( RootHubDev.Device[ hub_port ].bType != USB_DEV_CLASS_HID ) )
+            {
+                continue;
+            }
+            if( KM_LedScan( RootHubDev.Device[ hub_port ].DeviceIndex, hub_port ) )
             {
-                return DEF_CFG_VALUE_SETFAIL;
+                return;
             }
         }
-    }while( ( s != ERR_SUCCESS ) && ( enum_cnt < 10 ) );
-
-    return( ERR_SUCCESS );
+    }
 }
 
 /*********************************************************************
- * @fn      KB_AnalyzeKeyValue
+ * @fn      HUB_PortRemove
  *
- * @brief   Handle keyboard lighting.
+ * @brief   Drop the device of a port node and return the port to idle.
+ *          A HUB takes the devices behind it along and gives its port
+ *          nodes back to the pool.
  *
- * @para    index: USB host port
- *          intfnum: Interface number.
- *          pbuf: Data buffer.
- *          len: Data length.
+ * @para    hub_port: Port node.
  *
- * @return  The result of the analysis.
+ * @return  none
  */
-void KB_AnalyzeKeyValue( uint8_t index, uint8_t intf_num, uint8_t *pbuf, uint16_t len )
+static void HUB_PortRemove( uint8_t hub_port )
 {
-    uint8_t  i;
-    uint8_t  value;
-    uint8_t  bit_pos = 0x00;
-
-    value = HostCtl[ index ].Interface[ intf_num ].SetReport_Value;
+    HUB_DEVICE *pdev = &RootHubDev.Device[ hub_port ];
+    uint8_t    parent, port, tier;
+    uint8_t    node;
 
-    for( i = HostCtl[ index ].Interface[ intf_num ].LED_Usage_Min; i <= HostCtl[ index ].Interface[ intf_num ].LED_Usage_Max; i++ )
+    if( KM_Addr0Port == hub_port )
+    {
+        KM_Addr0Port = DEF_KM_NO_PORT;
+    }
+    if( ( KM_Enum.State != KM_ENUM_IDLE ) && ( KM_Enum.Node == hub_port ) )
     {
-        if( i == 0x01 )
+        if( KM_Enum.Issued )
         {
-            if( memchr( pbuf, DEF_KEY_NUM, len ) )
-            {
-                HostCtl[ index ].Interface[ intf_num ].SetReport_Value ^= ( 1 << bit_pos );
-            }
+            USBFSH_CtrlAbort( );
         }
-        else if( i == 0x02 )
+        KM_Enum.Issued = 0;
+        KM_Enum.State = KM_ENUM_IDLE;
+    }
+    if( KM_Hub.Node == hub_port )
+    {
+        if( KM_Hub.Issued )
         {
-            if( memchr( pbuf, DEF_KEY_CAPS, len ) )
-            {
-                HostCtl[ index ].Interface[ intf_num ].SetReport_Value ^= ( 1 << bit_pos );
-            }
+            USBFSH_CtrlAbort( );
+        }
+        KM_Hub.Issued = 0;
+        KM_Hub.Node = DEF_KM_NO_PORT;
+    }
+    if( ( KM_Stall.State != KM_STALL_IDLE ) && ( KM_Stall.HubPort == hub_port ) )
+    {
+        if( KM_Stall.Issued )
+        {
+            USBFSH_CtrlAbort( );
         }
-        else if( i == 0x03 )
+        KM_Stall.Issued = 0;
+        KM_Stall.State = KM_STALL_IDLE;
+    }
+    if( pdev->bType == USB_DEV_CLASS_HUB )
+    {
+        for( node = 0; node < DEF_KM_PORT_NODE_NUM; node++ )
         {
-            if( memchr( pbuf, DEF_KEY_SCROLL, len ) )
+            if( RootHubDev.Device[ node ].bPort && ( RootHubDev.Device[ node ].bParent == hub_port ) )
             {
-                HostCtl[ index ].Interface[ intf_num ].SetReport_Value ^= ( 1 << bit_pos );
+                HUB_PortRemove( node );
+                memset( &RootHubDev.Device[ node ].bStatus, 0, sizeof( HUB_DEVICE ) );
             }
         }
+    }
+    if( pdev->DeviceIndex )
+    {
+        SCHED_RemoveDevice( pdev->DeviceIndex );
+        KM_LiveRemove( pdev->DeviceIndex );
+        memset( &HostCtl[ pdev->DeviceIndex ], 0, sizeof( HOST_CTL ) );
+    }
 
-        bit_pos++;
+    /* The node stays a port of its HUB */
+    parent = pdev->bParent;
+    port = pdev->bPort;
+    tier = pdev->bTier;
+    memset( &pdev->bStatus, 0, sizeof( HUB_DEVICE ) );
+    pdev->bParent = parent;
+    pdev->bPort = port;
+    pdev->bTier = tier;
+}
+
+/*********************************************************************
+ * @fn      HUB_AddPorts
+ *
+ * @brief   Give the ports of a freshly enumerated HUB their nodes. Ports
+ *          the pool has no room for are not served.
+ *
+ * @para    hub: Port node of the HUB, DEF_KM_ROOT_PORT for the root HUB.
+ *          port_num: Ports of the HUB.
+ *
+ * @return  Ports served.
+ */
+static uint8_t HUB_AddPorts( uint8_t hub, uint8_t port_num )
+{
+    HUB_DEVICE *pdev;
+    uint8_t    port, node;
+
+    node = 0;
+    for( port = 1; port <= port_num; port++ )
+    {
+        while( ( node < DEF_KM_PORT_NODE_NUM ) && RootHubDev.Device[ node ].bPort )
+        {
+            node++;
+        }
+        if( node >= DEF_KM_PORT_NODE_NUM )
+        {
+            DUG_PRINTF( "Port pool full, %d of %d ports\r\n", port - 1, port_num );
+            break;
+        }
+        pdev = &RootHubDev.Device[ node ];
+        memset( &pdev->bStatus, 0, sizeof( HUB_DEVICE ) );
+        pdev->bParent = hub;
+        pdev->bPort = port;
+        pdev->bTier = ( hub == DEF_KM_ROOT_PORT ) ? 1 : ( RootHubDev.Device[ hub ].bTier + 1 );
     }
+    return port - 1;
+}
 
-    if( value != HostCtl[ index ].Interface[ intf_num ].SetReport_Value )
+/*********************************************************************
+ * @fn      HUB_DealChange
+ *
+ * @brief   Hand a HUB status change report to the port nodes it names.
+ *          A port busy with reset or enumeration keeps its change bits,
+ *          the HUB reports them again once the port is idle.
+ *
+ * @para    hub: Port node of the HUB, DEF_KM_ROOT_PORT for the root HUB.
+ *          pdat: Change bitmap filled by the poll, cleared here.
+ *
+ * @return  none
+ */
+static void HUB_DealChange( uint8_t hub, volatile uint8_t *pdat )
+{
+    HUB_DEVICE *pdev;
+    uint8_t    hub_dat = *pdat;
+    uint8_t    node;
+
+    if( hub_dat == 0 )
     {
-        HostCtl[ index ].Interface[ intf_num ].SetReport_Flag = 1;
+        return;
     }
-    else
+    *pdat = 0;
+    DUG_PRINTF( "Hub%02x Int Data:%02x\r\n", hub, hub_dat );
+
+    for( node = 0; node < DEF_KM_PORT_NODE_NUM; node++ )
     {
-        HostCtl[ index ].Interface[ intf_num ].SetReport_Flag = 0;
+        pdev = &RootHubDev.Device[ node ];
+        if( pdev->bPort && ( pdev->bParent == hub ) && ( hub_dat & ( 1 << pdev->bPort ) ) && ( KM_Hub.Node != node ) &&
+            ( ( pdev->bPortState == HUB_PS_IDLE ) || ( pdev->bPortState == HUB_PS_DEBOUNCE ) ) )
+        {
+            pdev->bPortState = HUB_PS_CHANGE;
+        }
     }
 }
 
 /*********************************************************************
- * @fn      KB_SetReport
+ * @fn      KM_StallRecover
  *
- * @brief   Handle keyboard lighting.
+ * @brief   Start the recovery of one STALLed interrupt IN endpoint. The
+ *          step depends on how often the endpoint stalled recently, see
+ *          DEF_KM_STALL_DECAY_TIME; the device is reset only when the
+ *          cheaper steps did not help or a request fails. The requests
+ *          go through the control transfer slot, see KM_StallSubmit.
  *
- * @para    index: USB device number.
- *          intf_num: Interface number.
+ * @para    index: HostCtl index of the device.
+ *          hub_port: Port node of the device, DEF_KM_ROOT_PORT for the
+ *                    root device.
+ *          intf_num: Interface.
+ *          in_num: IN endpoint number within the interface.
  *
- * @return  The result of the handling keyboard lighting.
+ * @return  none
  */
-uint8_t KB_SetReport( uint8_t index, uint8_t ep0_size, uint8_t intf_num )
+static void KM_StallRecover( uint8_t index, uint8_t hub_port, uint8_t intf_num, uint8_t in_num )
 {
-    uint8_t  dat[ 2 ];
-    uint16_t len;
-    uint8_t  s = ERR_SUCCESS;
+    Interface *itf = &HostCtl[ index ].Interface[ intf_num ];
+    uint8_t   cnt;
 
-    if( HostCtl[ index ].Interface[ intf_num ].IDFlag )
+    if( (uint16_t)( KM_TickMs - itf->InEndpStallTime[ in_num ] ) >= DEF_KM_STALL_DECAY_TIME )
     {
-        dat[ 0 ] = HostCtl[ index ].Interface[ intf_num ].ReportID;
-        dat[ 1 ] = HostCtl[ index ].Interface[ intf_num ].SetReport_Value;
-        len = 2;
+        itf->InEndpStallCnt[ in_num ] = 0;
     }
-    else
+    itf->InEndpStallTime[ in_num ] = KM_TickMs;
+    if( itf->InEndpStallCnt[ in_num ] < DEF_KM_STALL_TIER_RESET )
     {
-        dat[ 0 ] = HostCtl[ index ].Interface[ intf_num ].SetReport_Value;
-        len = 1;
+        itf->InEndpStallCnt[ in_num ]++;
     }
-
-    if( HostCtl[ index ].Interface[ intf_num ].SetReport_Swi == 1 ) // Perform lighting operation through endpoint0
+    cnt = itf->InEndpStallCnt[ in_num ];
+    HostCtl[ index ].ErrorCount++;
+    DUG_PRINTF( "Stall:%02x Itf%x Ep%02x Cnt%d\r\n", index, intf_num, itf->InEndpAddr[ in_num ], cnt );
+
+    KM_Stall.Index = index;
+    KM_Stall.HubPort = hub_port;
+    KM_Stall.IntfNum = intf_num;
+    KM_Stall.Cnt = cnt;
+    if( cnt < DEF_KM_STALL_TIER_INTF )
     {
-        /* Send set report command */
-        s = HID_SetReport( ep0_size, intf_num, dat, &len );
+        /* Clear halt, the device restarts the endpoint at DATA0 */
+        KM_Stall.InNum = in_num;
+        KM_Stall.State = KM_STALL_CLEAR;
     }
-    else if( HostCtl[ index ].Interface[ intf_num ].SetReport_Swi == 0xFF )  // Perform lighting operation through other endpoint
+    else if( cnt < DEF_KM_STALL_TIER_RESET )
     {
-        s = USBFSH_SendEndpData( HostCtl[ index ].Interface[ intf_num ].OutEndpAddr[ 0 ],
-                                 &HostCtl[ index ].Interface[ intf_num ].OutEndpTog[ 0 ], dat, len);
+        /* Re-initialize the interface: alternate setting 0, every IN endpoint halt free */
+        KM_Stall.InNum = 0;
+        KM_Stall.State = KM_STALL_SET_ITF;
+    }
+    else
+    {
+        KM_StallReset( ERR_USB_UNSUPPORT );
     }
-
-    return s;
 }
 
 /*********************************************************************
- * @fn      USBH_MainDeal
+ * @fn      KM_StallSubmit
  *
- * @brief   Provide a simple enumeration process for USB devices and
- *          obtain keyboard and mouse data at regular intervals.
+ * @brief   Submit the request of the current recovery step, unless the
+ *          control transfer slot is taken or its result not collected.
  *
  * @return  none
  */
-void USBH_MainDeal( void )
+static void KM_StallSubmit( void )
 {
-    uint8_t  s;
-    uint8_t  index;
-    uint8_t  hub_port;
-    uint8_t  hub_dat;
-    uint8_t  intf_num, in_num;
-    uint16_t len;
-#if DEF_DEBUG_PRINTF
-    uint16_t i;
-#endif
-    
-    s = USBFSH_CheckRootHubPortStatus( RootHubDev.bStatus ); // Check USB device connection or disconnection
-    if( s == ROOT_DEV_CONNECTED )
+    Interface     *itf = &HostCtl[ KM_Stall.Index ].Interface[ KM_Stall.IntfNum ];
+    USB_SETUP_REQ req;
+    uint8_t       addr, speed;
+
+    if( KM_CtrlTaken( ) )
     {
-        DUG_PRINTF( "USB Port Dev In.\r\n" );
+        return;
+    }
 
-        /* Set root device state parameters */
-        RootHubDev.bStatus = ROOT_DEV_CONNECTED;
-        RootHubDev.DeviceIndex = DEF_USBFS_PORT_INDEX * DEF_ONE_USB_SUP_DEV_TOTAL;
+    switch( KM_Stall.State )
+    {
+        case KM_STALL_CLEAR:
+            memcpy( &req, SetupClearEndpStall, sizeof( USB_SETUP_REQ ) );
+            req.wIndex = itf->InEndpAddr[ KM_Stall.InNum ] | 0x80;
+            break;
+
+        case KM_STALL_SET_ITF:
+            memcpy( &req, SetupSetInterface, sizeof( USB_SETUP_REQ ) );
+            req.wIndex = KM_Stall.IntfNum;
+            break;
+
+        case KM_STALL_SET_IDLE:
+            memcpy( &req, SetupSetidle, sizeof( USB_SETUP_REQ ) );
+            req.wValue = (uint16_t)KM_HidIdleDuration( itf ) << 8;
+            req.wIndex = KM_Stall.IntfNum;
+            break;
+
+        default:
+            return;
+    }
+
+    if( KM_Stall.HubPort == DEF_KM_ROOT_PORT )
+    {
+        addr = RootHubDev.bAddress;
+        speed = RootHubDev.bSpeed;
+    }
+    else
+    {
+        addr = RootHubDev.Device[ KM_Stall.HubPort ].bAddress;
+        speed = RootHubDev.Device[ KM_Stall.HubPort ].bSpeed;
+    }
+    if( USBFSH_SubmitCtrlTransfer( addr, speed, RootHubDev.bSpeed, KM_NodeEp0( KM_Stall.HubPort ), &req, NULL ) == ERR_SUCCESS )
+    {
+        KM_Stall.Issued = 1;
+    }
+}
+
+/*********************************************************************
+ * @fn      KM_StallDone
+ *
+ * @brief   Result of a recovery request, collected by KM_DealPollEvents.
+ *          Moves to the next step; the polls resume after the last one.
+ *
+ * @para    s: Request result.
+ *
+ * @return  none
+ */
+static void KM_StallDone( uint8_t s )
+{
+    Interface *itf = &HostCtl[ KM_Stall.Index ].Interface[ KM_Stall.IntfNum ];
+    uint8_t   idle = KM_HidIdleDuration( itf );
+    uint8_t   n;
+    uint16_t  backoff;
+
+    if( s == ERR_USB_UNAVAILABLE )
+    {
+        KM_Stall.State = KM_STALL_IDLE;                                         // Aborted with the device
+        return;
+    }
+
+    switch( KM_Stall.State )
+    {
+        case KM_STALL_SET_ITF:
+            KM_Stall.State = KM_STALL_CLEAR;                                    // May STALL with a single setting
+            return;
+
+        case KM_STALL_CLEAR:
+            itf->InEndpTog[ KM_Stall.InNum ] = 0x00;
+            if( s != ERR_SUCCESS )
+            {
+                KM_StallReset( s );
+                return;
+            }
+            if( ( KM_Stall.Cnt >= DEF_KM_STALL_TIER_INTF ) && ( ++KM_Stall.InNum < itf->InEndpNum ) )
+            {
+                return;
+            }
+            if( ( KM_Stall.Cnt >= DEF_KM_STALL_TIER_IDLE ) && ( idle != DEF_HID_IDLE_NONE ) )
+            {
+                KM_Stall.State = KM_STALL_SET_IDLE;
+                return;
+            }
+            break;
+
+        case KM_STALL_SET_IDLE:
+            break;                                                              // Optional request, errors are ignored
+
+        default:
+            return;
+    }
+
+    KM_Stall.State = KM_STALL_IDLE;
+    backoff = DEF_KM_STALL_BACKOFF << ( KM_Stall.Cnt - 1 );
+    if( backoff > DEF_KM_STALL_BACKOFF_MAX )
+    {
+        backoff = DEF_KM_STALL_BACKOFF_MAX;
+    }
+    if( KM_Stall.Cnt < DEF_KM_STALL_TIER_INTF )
+    {
+        itf->InEndpStall[ KM_Stall.InNum ] = 0;
+        SCHED_ResumeEndp( KM_Stall.Index, KM_Stall.IntfNum, KM_Stall.InNum, backoff );
+        return;
+    }
+
+    itf->LastRptLen = 0;
+    if( itf->Type == DEC_KEY )
+    {
+        itf->SetReport_Flag = 1;                                                // Lighting is lost with the interface state
+    }
+    for( n = 0; n < itf->InEndpNum; n++ )
+    {
+        itf->InEndpStall[ n ] = 0;
+        SCHED_ResumeEndp( KM_Stall.Index, KM_Stall.IntfNum, n, backoff );
+    }
+}
+
+/*********************************************************************
+ * @fn      KM_StallReset
+ *
+ * @brief   Last resort of the recovery, reset and enumerate the device
+ *          again.
+ *
+ * @para    s: Reason, for the debug output.
+ *
+ * @return  none
+ */
+static void KM_StallReset( uint8_t s )
+{
+    uint8_t hub_port = KM_Stall.HubPort;
+
+    DUG_PRINTF( "Stall Reset:%02x\r\n", s );
+    KM_Stall.State = KM_STALL_IDLE;
+    if( hub_port == DEF_KM_ROOT_PORT )
+    {
+        SCHED_Clear( );
+        KM_LiveClear( );
+        KM_TreeReset( );
+        RootHubDev.bStatus = ROOT_DEV_CONNECTED;
+        RootHubDev.DeviceIndex = DEF_USBFS_PORT_INDEX * DEF_ONE_USB_SUP_DEV_TOTAL;
+        KM_EnumStart( );
+    }
+    else
+    {
+        /* Straight to the port reset, the device is known to be attached */
+        HUB_PortRemove( hub_port );
+        RootHubDev.Device[ hub_port ].bPortState = HUB_PS_DEBOUNCE;
+        RootHubDev.Device[ hub_port ].wPortTime = SCHED_GetFrame( ) - DEF_HUB_DEBOUNCE_TIME;
+    }
+}
+
+/*********************************************************************
+ * @fn      KM_StallScan
+ *
+ * @brief   Recover the first STALLed endpoint of a device.
+ *
+ * @para    index: HostCtl index of the device.
+ *          hub_port: Port node of the device, DEF_KM_ROOT_PORT for the
+ *                    root device.
+ *
+ * @return  1 if an endpoint was recovered.
+ */
+static uint8_t KM_StallScan( uint8_t index, uint8_t hub_port )
+{
+    uint8_t intf_num, in_num;
+
+    for( intf_num = 0; intf_num < HostCtl[ index ].InterfaceNum; intf_num++ )
+    {
+        for( in_num = 0; in_num < HostCtl[ index ].Interface[ intf_num ].InEndpNum; in_num++ )
+        {
+            if( HostCtl[ index ].Interface[ intf_num ].InEndpStall[ in_num ] )
+            {
+                KM_StallRecover( index, hub_port, intf_num, in_num );
+                KM_StallSubmit( );
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*********************************************************************
+ * @fn      KM_StallProcess
+ *
+ * @brief   Recover an endpoint that STALLed. One endpoint at a time,
+ *          the others stay held until their turn.
+ *
+ * @return  none
+ */
+static void KM_StallProcess( void )
+{
+    uint8_t hub_port;
+
+    if( RootHubDev.bStatus < ROOT_DEV_SUCCESS )
+    {
+        return;
+    }
+    if( KM_Stall.State != KM_STALL_IDLE )
+    {
+        KM_StallSubmit( );
+        return;
+    }
+    if( KM_StallScan( RootHubDev.DeviceIndex, DEF_KM_ROOT_PORT ) || ( RootHubDev.bType != USB_DEV_CLASS_HUB ) )
+    {
+        return;
+    }
+
+    for( hub_port = 0; hub_port < DEF_KM_PORT_NODE_NUM; hub_port++ )
+    {
+        if( RootHubDev.Device[ hub_port ].bPort && ( RootHubDev.Device[ hub_port ].bStatus == ROOT_DEV_SUCCESS ) &&
+            RootHubDev.Device[ hub_port ].DeviceIndex &&
+            KM_StallScan( RootHubDev.Device[ hub_port ].DeviceIndex, hub_port ) )
+        {
+            return;
+        }
+    }
+}
+
+/*********************************************************************
+ * @fn      HUB_PortRequest
+ *
+ * @brief   Send a port request to the HUB of a port node through the
+ *          control transfer slot. The node holds the HUB request
+ *          sequence from its first submission until HUB_PortRelease,
+ *          so the status it read stays in KM_Hub.Buf meanwhile.
+ *
+ * @para    hub_port: Port node.
+ *          preq: Setup request, wIndex is set to the port.
+ *          pbuf: Data buffer, NULL for no data stage.
+ *
+ * @return  ERR_USB_BUSY until the request has finished.
+ */
+static uint8_t HUB_PortRequest( uint8_t hub_port, USB_SETUP_REQ *preq, uint8_t *pbuf )
+{
+    uint8_t hub = RootHubDev.Device[ hub_port ].bParent;
+    uint8_t addr, speed;
+    uint8_t s;
+
+    if( ( KM_Hub.Node != DEF_KM_NO_PORT ) && ( KM_Hub.Node != hub_port ) )
+    {
+        return ERR_USB_BUSY;                                                    // Another port's sequence
+    }
+    if( KM_Hub.Issued == 0 )
+    {
+        if( KM_CtrlTaken( ) )
+        {
+            return ERR_USB_BUSY;
+        }
+        if( hub == DEF_KM_ROOT_PORT )
+        {
+            addr = RootHubDev.bAddress;
+            speed = RootHubDev.bSpeed;
+        }
+        else
+        {
+            addr = RootHubDev.Device[ hub ].bAddress;
+            speed = RootHubDev.Device[ hub ].bSpeed;
+        }
+        preq->wIndex = RootHubDev.Device[ hub_port ].bPort;
+        if( USBFSH_SubmitCtrlTransfer( addr, speed, RootHubDev.bSpeed, KM_NodeEp0( hub ), preq, pbuf ) == ERR_SUCCESS )
+        {
+            KM_Hub.Issued = 1;
+            KM_Hub.Node = hub_port;
+        }
+        return ERR_USB_BUSY;
+    }
+
+    s = USBFSH_CtrlResult( NULL );
+    if( s != ERR_USB_BUSY )
+    {
+        KM_Hub.Issued = 0;
+    }
+    return s;
+}
+
+/*********************************************************************
+ * @fn      HUB_PortRelease
+ *
+ * @brief   End the HUB request sequence of a port node.
+ *
+ * @para    hub_port: Port node.
+ *
+ * @return  none
+ */
+static void HUB_PortRelease( uint8_t hub_port )
+{
+    if( KM_Hub.Node == hub_port )
+    {
+        KM_Hub.Node = DEF_KM_NO_PORT;
+    }
+}
+
+/*********************************************************************
+ * @fn      HUB_PortFeature
+ *
+ * @brief   SET_FEATURE or CLEAR_FEATURE of a HUB port, through
+ *          HUB_PortRequest.
+ *
+ * @para    hub_port: Port node.
+ *          ptemplate: SetPortFeature or ClearPortFeature.
+ *          selector: Feature selector.
+ *
+ * @return  ERR_USB_BUSY until the request has finished.
+ */
+static uint8_t HUB_PortFeature( uint8_t hub_port, const uint8_t *ptemplate, uint8_t selector )
+{
+    USB_SETUP_REQ req;
+
+    memcpy( &req, ptemplate, sizeof( USB_SETUP_REQ ) );
+    req.wValue = selector;
+    return HUB_PortRequest( hub_port, &req, NULL );
+}
+
+/*********************************************************************
+ * @fn      HUB_PortStatus
+ *
+ * @brief   GET_STATUS of a HUB port into KM_Hub.Buf, through
+ *          HUB_PortRequest.
+ *
+ * @para    hub_port: Port node.
+ *
+ * @return  ERR_USB_BUSY until the request has finished.
+ */
+static uint8_t HUB_PortStatus( uint8_t hub_port )
+{
+    USB_SETUP_REQ req;
+
+    memcpy( &req, GetPortStatus, sizeof( USB_SETUP_REQ ) );
+    return HUB_PortRequest( hub_port, &req, KM_Hub.Buf );
+}
+
+/*********************************************************************
+ * @fn      HUB_PortProcess
+ *
+ * @brief   Advance the state machine of one HUB port by at most one
+ *          step. Waits are timestamps against the SOF frame counter
+ *          and port requests go through the control transfer slot, a
+ *          state that sent one stays until its result is in. The main
+ *          loop and the polls of enumerated devices keep running
+ *          between the steps of connect debounce, port reset and
+ *          enumeration. One port at a time goes from its reset to
+ *          SET_ADDRESS, see KM_Addr0Port.
+ *
+ * @para    hub_port: Port node. Port requests go to the HUB the node
+ *                    belongs to, at any tier.
+ *
+ * @return  none
+ */
+static void HUB_PortProcess( uint8_t hub_port )
+{
+    HUB_DEVICE *pdev = &RootHubDev.Device[ hub_port ];
+    uint16_t   elapsed = SCHED_GetFrame( ) - pdev->wPortTime;
+    uint8_t    s, n;
+
+    switch( pdev->bPortState )
+    {
+        case HUB_PS_CHANGE:
+            s = HUB_PortStatus( hub_port );
+            if( s == ERR_USB_BUSY )
+            {
+                break;
+            }
+            if( s != ERR_SUCCESS )
+            {
+                DUG_PRINTF( "HUB_PS_ERR1:%x\r\n", s );
+                HUB_PortRelease( hub_port );
+                pdev->bPortState = HUB_PS_IDLE;
+                break;
+            }
+            KM_Hub.Chg = KM_Hub.Buf[ 2 ] & 0x1F;
+            pdev->bPortState = HUB_PS_CHANGE_ACK;
+            break;
+
+        case HUB_PS_CHANGE_ACK:
+            /* Acknowledge all change bits, C_PORT_CONNECTION to C_PORT_RESET */
+            if( KM_Hub.Chg )
+            {
+                n = __builtin_ctz( KM_Hub.Chg );
+                if( HUB_PortFeature( hub_port, ClearPortFeature, HUB_C_PORT_CONNECTION + n ) != ERR_USB_BUSY )
+                {
+                    KM_Hub.Chg &= ~( 1 << n );
+                }
+                break;
+            }
+            HUB_PortRelease( hub_port );
+
+            if( ( KM_Hub.Buf[ 2 ] & 0x01 ) || !( KM_Hub.Buf[ 0 ] & 0x02 ) )
+            {
+                /* Connection changed or the port got disabled, start over */
+                n = KM_Hub.Buf[ 0 ];
+                HUB_PortRemove( hub_port );
+                if( n & 0x01 )
+                {
+                    DUG_PRINTF( "Hub Port%x In\r\n", hub_port );
+                    EPROF_MARK( hub_port, EPROF_STAGE_START, 0 );
+                    pdev->bPortState = HUB_PS_DEBOUNCE;
+                    pdev->wPortTime = SCHED_GetFrame( );
+                }
+                else
+                {
+                    DUG_PRINTF( "Hub Port%x Out\r\n", hub_port );
+                }
+            }
+            else
+            {
+                pdev->bPortState = HUB_PS_IDLE;
+            }
+            break;
+
+        case HUB_PS_DEBOUNCE:
+            /* The reset puts the device at address 0, wait until that is free */
+            if( ( KM_Hub.Node != hub_port ) &&
+                ( ( elapsed < DEF_HUB_DEBOUNCE_TIME ) || ( KM_Addr0Port != DEF_KM_NO_PORT ) ) )
+            {
+                break;
+            }
+            s = HUB_PortFeature( hub_port, SetPortFeature, HUB_PORT_RESET );
+            if( s == ERR_USB_BUSY )
+            {
+                break;
+            }
+            HUB_PortRelease( hub_port );
+            if( s != ERR_SUCCESS )
+            {
+                DUG_PRINTF( "HUB_PS_ERR2:%x\r\n", s );
+                pdev->bPortState = HUB_PS_IDLE;
+                break;
+            }
+            KM_Addr0Port = hub_port;
+            EPROF_MARK( hub_port, EPROF_STAGE_RESET, 0 );
+            pdev->bPortState = HUB_PS_RESET;
+            pdev->wPortTime = SCHED_GetFrame( );
+            break;
+
+        case HUB_PS_RESET:
+            if( elapsed < DEF_HUB_RESET_TIME )
+            {
+                break;
+            }
+            s = HUB_PortStatus( hub_port );
+            if( s == ERR_USB_BUSY )
+            {
+                break;
+            }
+            if( ( s == ERR_SUCCESS ) && ( KM_Hub.Buf[ 2 ] & 0x10 ) )
+            {
+                pdev->bPortState = HUB_PS_RESET_ACK;
+                break;
+            }
+            HUB_PortRelease( hub_port );
+            if( elapsed >= DEF_HUB_RESET_TIMEOUT )
+            {
+                DUG_PRINTF( "HUB_PS_ERR3:%x\r\n", s );
+                EPROF_MARK( hub_port, EPROF_STAGE_DONE, ERR_USB_DISCON );
+                pdev->bStatus = ROOT_DEV_FAILED;
+                pdev->bPortState = HUB_PS_IDLE;
+                KM_Addr0Port = DEF_KM_NO_PORT;
+            }
+            break;
+
+        case HUB_PS_RESET_ACK:
+            if( HUB_PortFeature( hub_port, ClearPortFeature, HUB_C_PORT_RESET ) == ERR_USB_BUSY )
+            {
+                break;
+            }
+            HUB_PortRelease( hub_port );
+            if( ( KM_Hub.Buf[ 0 ] & 0x03 ) != 0x03 )
+            {
+                HUB_PortRemove( hub_port );
+                break;
+            }
+            pdev->bSpeed = ( KM_Hub.Buf[ 1 ] & 0x02 ) ? USB_LOW_SPEED : USB_FULL_SPEED;
+            EPROF_MARK( hub_port, EPROF_STAGE_RECOVERY, 0 );
+            pdev->bPortState = HUB_PS_RECOVERY;
+            pdev->wPortTime = SCHED_GetFrame( );
+            break;
+
+        case HUB_PS_RECOVERY:
+            if( elapsed < DEF_HUB_RESET_RECOVERY_TIME )
+            {
+                break;
+            }
+            pdev->bStatus = ROOT_DEV_CONNECTED;
+            pdev->bEp0MaxPks = DEFAULT_ENDP0_SIZE;
+            pdev->bPortState = HUB_PS_ENUM;
+            EPROF_MARK( hub_port, EPROF_STAGE_ENUM, pdev->bSpeed );
+            DUG_PRINTF( "Dev Speed:%x\r\n", pdev->bSpeed );
+            break;
+
+        case HUB_PS_ENUM:
+            /* The enumeration pipeline takes one device at a time and
+             * returns the port to idle when it is done */
+            if( KM_Enum.State != KM_ENUM_IDLE )
+            {
+                break;
+            }
+            DUG_PRINTF( "Enum_HubDevice\r\n" );
+            KM_EnumStartPort( hub_port );
+            break;
+
+        case HUB_PS_DISABLE:
+            /* Enumeration failed at address 0, off the bus before the next port resets */
+            if( HUB_PortFeature( hub_port, ClearPortFeature, HUB_PORT_ENABLE ) == ERR_USB_BUSY )
+            {
+                break;
+            }
+            HUB_PortRelease( hub_port );
+            if( KM_Addr0Port == hub_port )
+            {
+                KM_Addr0Port = DEF_KM_NO_PORT;
+            }
+            pdev->bPortState = HUB_PS_IDLE;
+            break;
+
+        default:
+            break;
+    }
+}
+
+/*********************************************************************
+ * @fn      KM_EnumStart
+ *
+ * @brief   Start enumerating the device on the USB host port.
+ *
+ * @return  none
+ */
+static void KM_EnumStart( void )
+{
+    DUG_PRINTF( "Enum:\r\n" );
+    if( KM_Enum.Issued )
+    {
+        USBFSH_CtrlAbort( );                                                    // Request of a HUB port device
+    }
+    memset( &KM_Enum, 0, sizeof( KM_Enum ) );
+    KM_Enum.Node = DEF_KM_ROOT_PORT;
+    KM_Enum.State = KM_ENUM_SETTLE;
+    KM_Enum.Time = KM_TickMs;
+    KM_Enum.Wait = DEF_ATTACH_SETTLE_TIME;
+    EPROF_MARK( DEF_EPROF_PORT_ROOT, EPROF_STAGE_START, 0 );
+}
+
+/*********************************************************************
+ * @fn      KM_EnumStartPort
+ *
+ * @brief   Start enumerating the device of a HUB port, reset and at
+ *          address 0.
+ *
+ * @para    hub_port: Port node.
+ *
+ * @return  none
+ */
+static void KM_EnumStartPort( uint8_t hub_port )
+{
+    memset( &KM_Enum, 0, sizeof( KM_Enum ) );
+    KM_Enum.Node = hub_port;
+    KM_Enum.Speed = RootHubDev.Device[ hub_port ].bSpeed;
+    KM_Enum.Ep0Size = DEFAULT_ENDP0_SIZE;
+    KM_Enum.State = KM_ENUM_DEV_DESC;
+    KM_Enum.Time = KM_TickMs;
+    EPROF_MARK( hub_port, EPROF_STAGE_DEV_DESC, 0 );
+    DUG_PRINTF( "Get DevDesc: " );
+}
+
+/*********************************************************************
+ * @fn      KM_EnumSetDev
+ *
+ * @brief   Copy the address, endpoint 0 size and type found so far to
+ *          the node of the device being enumerated.
+ *
+ * @return  none
+ */
+static void KM_EnumSetDev( void )
+{
+    if( KM_Enum.Node == DEF_KM_ROOT_PORT )
+    {
+        RootHubDev.bAddress = KM_Enum.Addr;
+        RootHubDev.bEp0MaxPks = KM_Enum.Ep0Size;
+        RootHubDev.bType = KM_Enum.Type;
+    }
+    else
+    {
+        RootHubDev.Device[ KM_Enum.Node ].bAddress = KM_Enum.Addr;
+        RootHubDev.Device[ KM_Enum.Node ].bEp0MaxPks = KM_Enum.Ep0Size;
+        RootHubDev.Device[ KM_Enum.Node ].bType = KM_Enum.Type;
+    }
+}
+
+/*********************************************************************
+ * @fn      KM_EnumIndex
+ *
+ * @brief   HostCtl index of the device being enumerated, 0 for a port
+ *          device before its class step.
+ *
+ * @return  HostCtl index.
+ */
+static uint8_t KM_EnumIndex( void )
+{
+    if( KM_Enum.Node == DEF_KM_ROOT_PORT )
+    {
+        return RootHubDev.DeviceIndex;
+    }
+    return RootHubDev.Device[ KM_Enum.Node ].DeviceIndex;
+}
+
+/*********************************************************************
+ * @fn      KM_EnumRetry
+ *
+ * @brief   Handle a failed standard request. The root device starts
+ *          over with a longer settle time each attempt, a port device
+ *          repeats the request: a new port reset would have to wait
+ *          for address 0 again.
+ *
+ * @para    s: Error code reported when out of attempts.
+ *
+ * @return  none
+ */
+static void KM_EnumRetry( uint8_t s )
+{
+    DUG_PRINTF( "Err(%02x)\r\n", s );
+    if( KM_Enum.Node != DEF_KM_ROOT_PORT )
+    {
+        if( ++KM_Enum.Retry <= 10 )
+        {
+            EPROF_MARK( KM_Enum.Node, EPROF_STAGE_RETRY, s );
+            return;
+        }
+        KM_EnumFinish( s );
+        return;
+    }
+
+    if( ++KM_Enum.Retry <= 5 )
+    {
+        EPROF_MARK( DEF_EPROF_PORT_ROOT, EPROF_STAGE_RETRY, s );
+        KM_Enum.State = KM_ENUM_SETTLE;
+        KM_Enum.Issued = 0;
+        KM_Enum.Time = KM_TickMs;
+        KM_Enum.Wait = DEF_ATTACH_SETTLE_TIME + ( 8 << KM_Enum.Retry );
+        return;
+    }
+
+    DUG_PRINTF( "Enum Fail with Error Code:%x\r\n", s );
+    EPROF_MARK( DEF_EPROF_PORT_ROOT, EPROF_STAGE_DONE, s );
+    KM_Enum.State = KM_ENUM_IDLE;
+    if( s != ERR_USB_DISCON )
+    {
+        RootHubDev.bStatus = ROOT_DEV_FAILED;
+    }
+}
+
+/*********************************************************************
+ * @fn      KM_EnumFinish
+ *
+ * @brief   End of the enumeration. HID, Xbox360 and HUB devices go to
+ *          the scheduler, a port node returns to idle.
+ *
+ * @para    s: Enumeration result.
+ *
+ * @return  none
+ */
+static void KM_EnumFinish( uint8_t s )
+{
+    HUB_DEVICE *pdev;
+    uint8_t    node = KM_Enum.Node;
+    uint8_t    status;
+
+    KM_Enum.State = KM_ENUM_IDLE;
+    KM_Enum.Issued = 0;
+    EPROF_MARK( node, EPROF_STAGE_DONE, s );
+
+    DUG_PRINTF( "Further Enum Result: " );
+    if( s == ERR_SUCCESS )
+    {
+        DUG_PRINTF( "OK\r\n" );
+        status = ROOT_DEV_SUCCESS;
+    }
+    else
+    {
+        DUG_PRINTF( "Err(%02x)\r\n", s );
+        status = ROOT_DEV_FAILED;
+        GPIO_WriteBit(LED_GPIO_Port,LED_Pin, Bit_SET);
+    }
+
+    if( node == DEF_KM_ROOT_PORT )
+    {
+        if( ( s == ERR_USB_DISCON ) && ( status == ROOT_DEV_FAILED ) )
+        {
+            return;
+        }
+        RootHubDev.bStatus = status;
+    }
+    else
+    {
+        pdev = &RootHubDev.Device[ node ];
+        pdev->bStatus = status;
+        if( ( status == ROOT_DEV_FAILED ) && ( pdev->bAddress == 0 ) )
+        {
+            pdev->bPortState = HUB_PS_DISABLE;                                  // Keeps address 0 until the port is off
+        }
+        else
+        {
+            pdev->bPortState = HUB_PS_IDLE;
+            if( KM_Addr0Port == node )
+            {
+                KM_Addr0Port = DEF_KM_NO_PORT;
+            }
+        }
+    }
+
+    /* HUB included: its status change endpoint is polled from now on */
+    if( ( status == ROOT_DEV_SUCCESS ) &&
+        ( ( KM_Enum.Type == USB_DEV_CLASS_HID ) || ( KM_Enum.Type == DEF_DEV_TYPE_XBOX360 ) || ( KM_Enum.Type == USB_DEV_CLASS_HUB ) ) )
+    {
+        KM_SchedAddDevice( KM_EnumIndex( ), node );
+        GPIO_WriteBit(LED_GPIO_Port,LED_Pin, Bit_RESET);
+    }
+}
+
+/*********************************************************************
+ * @fn      KM_EnumRequest
+ *
+ * @brief   Submit the control request of the current step on the first
+ *          pass, collect its result on a later one.
+ *
+ * @para    preq: Setup request.
+ *          pbuf: Data buffer, NULL for no data stage.
+ *          plen: Data stage length, may be NULL.
+ *
+ * @return  ERR_USB_BUSY until the request has finished.
+ */
+static uint8_t KM_EnumRequest( const USB_SETUP_REQ *preq, uint8_t *pbuf, uint16_t *plen )
+{
+    uint8_t s;
+
+    if( KM_Enum.Issued == 0 )
+    {
+        if( KM_CtrlTaken( ) )
+        {
+            return ERR_USB_BUSY;                                                // Result of another request not taken yet
+        }
+        if( USBFSH_SubmitCtrlTransfer( KM_Enum.Addr, KM_Enum.Speed, RootHubDev.bSpeed,
+                                       KM_Enum.Ep0Size, preq, pbuf ) == ERR_SUCCESS )
+        {
+            KM_Enum.Issued = 1;
+        }
+        return ERR_USB_BUSY;
+    }
+
+    s = USBFSH_CtrlResult( plen );
+    if( s != ERR_USB_BUSY )
+    {
+        KM_Enum.Issued = 0;
+    }
+    return s;
+}
+
+/*********************************************************************
+ * @fn      KM_EnumEndpOut
+ *
+ * @brief   Send data to an OUT endpoint of the device being enumerated,
+ *          through the control transfer slot like KM_EnumRequest.
+ *
+ * @para    endp: Endpoint number.
+ *          pendp_tog: Data toggle of the endpoint.
+ *          pbuf: Data, copied on submission.
+ *          len: Data length.
+ *
+ * @return  ERR_USB_BUSY until the transfer has finished.
+ */
+static uint8_t KM_EnumEndpOut( uint8_t endp, uint8_t *pendp_tog, const uint8_t *pbuf, uint16_t len )
+{
+    uint8_t s;
+
+    if( KM_Enum.Issued == 0 )
+    {
+        if( KM_CtrlTaken( ) )
+        {
+            return ERR_USB_BUSY;
+        }
+        if( USBFSH_SubmitEndpOut( KM_Enum.Addr, KM_Enum.Speed, RootHubDev.bSpeed,
+                                  endp, pendp_tog, pbuf, len ) == ERR_SUCCESS )
+        {
+            KM_Enum.Issued = 1;
+        }
+        return ERR_USB_BUSY;
+    }
+
+    s = USBFSH_CtrlResult( NULL );
+    if( s != ERR_USB_BUSY )
+    {
+        KM_Enum.Issued = 0;
+    }
+    return s;
+}
+
+/*********************************************************************
+ * @fn      KM_EnumProcess
+ *
+ * @brief   Advance the enumeration of the root device or of a HUB port
+ *          device by one step. Waits are timestamps and control
+ *          transfers run from the USBFS interrupt, so the main loop and
+ *          the polling of other endpoints carry on while a device
+ *          enumerates.
+ *
+ * @return  none
+ */
+static void KM_EnumProcess( void )
+{
+    USB_SETUP_REQ req;
+    uint8_t  s;
+    uint8_t  index = KM_EnumIndex( );
+    uint16_t len;
+    uint16_t elapsed = KM_TickMs - KM_Enum.Time;
+    Interface *itf;
+#if DEF_DEBUG_PRINTF
+    uint16_t i;
+#endif
+
+    switch( KM_Enum.State )
+    {
+        case KM_ENUM_SETTLE:
+            if( elapsed < KM_Enum.Wait )
+            {
+                break;
+            }
+            EPROF_MARK( DEF_EPROF_PORT_ROOT, EPROF_STAGE_RESET, KM_Enum.Retry );
+            USBFSH_ResetRootHubPort( 1 );
+            KM_Enum.State = KM_ENUM_RESET;
+            KM_Enum.Time = KM_TickMs;
+            break;
+
+        case KM_ENUM_RESET:
+            if( elapsed < DEF_BUS_RESET_TIME )
+            {
+                break;
+            }
+            USBFSH_ResetRootHubPort( 2 );
+            EPROF_MARK( DEF_EPROF_PORT_ROOT, EPROF_STAGE_ATTACH, 0 );
+            KM_Enum.State = KM_ENUM_ATTACH;
+            KM_Enum.Stable = 0;
+            KM_Enum.Time = KM_Enum.Poll = KM_TickMs;
+            break;
+
+        case KM_ENUM_ATTACH:
+            /* The device must stay attached for several consecutive checks */
+            if( KM_Enum.Poll == KM_TickMs )
+            {
+                break;
+            }
+            KM_Enum.Poll = KM_TickMs;
+            if( USBFSH_EnableRootHubPort( &RootHubDev.bSpeed ) == ERR_SUCCESS )
+            {
+                KM_Enum.Time = KM_TickMs;
+                if( ++KM_Enum.Stable > 6 )
+                {
+                    KM_Enum.Addr = 0;
+                    KM_Enum.Speed = RootHubDev.bSpeed;
+                    KM_Enum.Ep0Size = DEFAULT_ENDP0_SIZE;
+                    KM_EnumSetDev( );
+                    KM_Enum.State = KM_ENUM_DEV_DESC;
+                    EPROF_MARK( DEF_EPROF_PORT_ROOT, EPROF_STAGE_DEV_DESC, 0 );
+                    DUG_PRINTF( "Get DevDesc: " );
+                }
+            }
+            else if( elapsed >= DEF_RE_ATTACH_TIMEOUT )
+            {
+                KM_EnumRetry( ERR_USB_DISCON );
+            }
+            break;
+
+        case KM_ENUM_DEV_DESC:
+            memcpy( &req, SetupGetDevDesc, sizeof( USB_SETUP_REQ ) );
+            s = KM_EnumRequest( &req, DevDesc_Buf, &len );
+            if( s == ERR_USB_BUSY )
+            {
+                break;
+            }
+            if( ( s != ERR_SUCCESS ) || ( len < req.wLength ) )
+            {
+                KM_EnumRetry( DEF_DEV_DESCR_GETFAIL );
+                break;
+            }
+            KM_Enum.Ep0Size = ( (PUSB_DEV_DESCR)DevDesc_Buf )->bMaxPacketSize0;
+            KM_EnumSetDev( );
+#if DEF_DEBUG_PRINTF
+            for( i = 0; i < 18; i++ )
+            {
+                DUG_PRINTF( "%02x ", DevDesc_Buf[ i ] );
+            }
+            DUG_PRINTF( "\r\n" );
+#endif
+            EPROF_MARK( KM_Enum.Node, EPROF_STAGE_VID, ( (PUSB_DEV_DESCR)DevDesc_Buf )->idVendor );
+            EPROF_MARK( KM_Enum.Node, EPROF_STAGE_PID, ( (PUSB_DEV_DESCR)DevDesc_Buf )->idProduct );
+            EPROF_MARK( KM_Enum.Node, EPROF_STAGE_SET_ADDR, 0 );
+            KM_Enum.NewAddr = ( KM_Enum.Node == DEF_KM_ROOT_PORT )? USB_DEVICE_ADDR : KM_AddrAlloc( );
+            if( KM_Enum.NewAddr == 0 )
+            {
+                KM_EnumFinish( DEF_DEV_ADDR_SETFAIL );
+                break;
+            }
+            KM_Enum.State = KM_ENUM_SET_ADDR;
+            DUG_PRINTF( "Set DevAddr: " );
+            break;
+
+        case KM_ENUM_SET_ADDR:
+            memcpy( &req, SetupSetAddr, sizeof( USB_SETUP_REQ ) );
+            req.wValue = KM_Enum.NewAddr;
+            s = KM_EnumRequest( &req, NULL, NULL );
+            if( s == ERR_USB_BUSY )
+            {
+                break;
+            }
+            if( s != ERR_SUCCESS )
+            {
+                KM_EnumRetry( DEF_DEV_ADDR_SETFAIL );
+                break;
+            }
+            DUG_PRINTF( "OK\r\n" );
+            KM_Enum.Addr = KM_Enum.NewAddr;
+            KM_EnumSetDev( );
+            if( KM_Enum.Node == DEF_KM_ROOT_PORT )
+            {
+                USBFSH_SetSelfAddr( KM_Enum.Addr );
+            }
+            else if( KM_Addr0Port == KM_Enum.Node )
+            {
+                KM_Addr0Port = DEF_KM_NO_PORT;                                  // Next port may reset
+            }
+            EPROF_MARK( KM_Enum.Node, EPROF_STAGE_ADDR_WAIT, 0 );
+            KM_Enum.State = KM_ENUM_ADDR_WAIT;
+            KM_Enum.Time = KM_TickMs;
+            break;
+
+        case KM_ENUM_ADDR_WAIT:
+            if( elapsed >= DEF_SET_ADDR_RECOVERY_TIME )
+            {
+                EPROF_MARK( KM_Enum.Node, EPROF_STAGE_CFG_DESC, 0 );
+                KM_Enum.State = KM_ENUM_CFG_HEAD;
+                DUG_PRINTF( "Get CfgDesc: " );
+            }
+            break;
+
+        case KM_ENUM_CFG_HEAD:
+            memcpy( &req, SetupGetCfgDesc, sizeof( USB_SETUP_REQ ) );
+            s = KM_EnumRequest( &req, Com_Buf, &len );
+            if( s == ERR_USB_BUSY )
+            {
+                break;
+            }
+            if( ( s != ERR_SUCCESS ) || ( len < req.wLength ) )
+            {
+                KM_EnumRetry( DEF_CFG_DESCR_GETFAIL );
+                break;
+            }
+            KM_Enum.CfgLen = ( (PUSB_CFG_DESCR)Com_Buf )->wTotalLength;
+            if( KM_Enum.CfgLen > DEF_COM_BUF_LEN )
+            {
+                KM_Enum.CfgLen = DEF_COM_BUF_LEN;
+            }
+            KM_Enum.State = KM_ENUM_CFG_DESC;
+            break;
+
+        case KM_ENUM_CFG_DESC:
+            memcpy( &req, SetupGetCfgDesc, sizeof( USB_SETUP_REQ ) );
+            req.wLength = KM_Enum.CfgLen;
+            s = KM_EnumRequest( &req, Com_Buf, &len );
+            if( s == ERR_USB_BUSY )
+            {
+                break;
+            }
+            if( s != ERR_SUCCESS )
+            {
+                KM_EnumRetry( DEF_CFG_DESCR_GETFAIL );
+                break;
+            }
+            KM_Enum.CfgVal = ( (PUSB_CFG_DESCR)Com_Buf )->bConfigurationValue;
+#if DEF_DEBUG_PRINTF
+            for( i = 0; i < len; i++ )
+            {
+                DUG_PRINTF( "%02x ", Com_Buf[ i ] );
+            }
+            DUG_PRINTF( "\r\n" );
+#endif
 
-        s = USBH_EnumRootDevice( ); // Simply enumerate root device
-        if( s == ERR_SUCCESS )
-        {
-            if( ( RootHubDev.bType == USB_DEV_CLASS_HID ) || ( RootHubDev.bType == DEF_DEV_TYPE_XBOX360 ) ) // Further enumerate HID/Xbox devices
+            /* Simply analyze USB device type  */
+            USBH_AnalyseType( DevDesc_Buf, Com_Buf, &KM_Enum.Type );
+            KM_EnumSetDev( );
+            DUG_PRINTF( "DevType: %02x\r\n", KM_Enum.Type );
+            EPROF_MARK( KM_Enum.Node, EPROF_STAGE_SET_CFG, 0 );
+            KM_Enum.State = KM_ENUM_SET_CFG;
+            DUG_PRINTF( "Set Cfg: " );
+            break;
+
+        case KM_ENUM_SET_CFG:
+            memcpy( &req, SetupSetConfig, sizeof( USB_SETUP_REQ ) );
+            req.wValue = KM_Enum.CfgVal;
+            s = KM_EnumRequest( &req, NULL, NULL );
+            if( s == ERR_USB_BUSY )
+            {
+                break;
+            }
+            if( s != ERR_SUCCESS )
+            {
+                KM_EnumRetry( ERR_USB_UNSUPPORT );
+                break;
+            }
+            DUG_PRINTF( "OK\r\n" );
+            EPROF_MARK( KM_Enum.Node, EPROF_STAGE_CLASS, KM_Enum.Type );
+            KM_Enum.State = KM_ENUM_CLASS;
+            break;
+
+        case KM_ENUM_CLASS:
+            /* Com_Buf still holds the configuration descriptor */
+            if( ( KM_Enum.Type != USB_DEV_CLASS_HID ) && ( KM_Enum.Type != DEF_DEV_TYPE_XBOX360 ) && ( KM_Enum.Type != USB_DEV_CLASS_HUB ) )
             {
-                if( RootHubDev.bType == USB_DEV_CLASS_HID )
+                /* Detect that this device is a NON-HID device */
+                DUG_PRINTF( "Device Is " );
+                switch( KM_Enum.Type )
                 {
-                    DUG_PRINTF("Root Device Is HID. ");
-                    s = USBH_EnumHidDevice( RootHubDev.DeviceIndex, RootHubDev.bEp0MaxPks );
+                    case USB_DEV_CLASS_STORAGE:
+                        DUG_PRINTF("Storage. ");
+                        break;
+                    case USB_DEV_CLASS_PRINTER:
+                        DUG_PRINTF("Printer. ");
+                        break;
+                    case DEF_DEV_TYPE_UNKNOWN:
+                        DUG_PRINTF("Unknown. ");
+                        break;
                 }
-                else
+                DUG_PRINTF( "End Enum.\r\n" );
+                KM_EnumFinish( ERR_SUCCESS );
+                break;
+            }
+            if( KM_Enum.Node != DEF_KM_ROOT_PORT )
+            {
+                if( ( KM_Enum.Type == USB_DEV_CLASS_HUB ) && ( RootHubDev.Device[ KM_Enum.Node ].bTier >= DEF_KM_HUB_TIER_MAX ) )
+                {
+                    DUG_PRINTF( "HUB port%x device is hub! Too deep\r\n", KM_Enum.Node );
+                    KM_EnumFinish( ERR_USB_UNSUPPORT );
+                    break;
+                }
+
+                /* A nested HUB must not take the last structures from the devices behind it */
+                index = KM_DevAlloc( ( KM_Enum.Type == USB_DEV_CLASS_HUB ) ? DEF_KM_DEV_HID_RESERVE : 0 );
+                RootHubDev.Device[ KM_Enum.Node ].DeviceIndex = index;
+                if( index == 0 )
                 {
-                    DUG_PRINTF("Root Device Is Xbox360. ");
-                    s = USBH_EnumXbox360Device( RootHubDev.DeviceIndex, RootHubDev.bEp0MaxPks );
+                    DUG_PRINTF( "HUB port%x no device memory\r\n", KM_Enum.Node );
+                    KM_EnumFinish( ERR_USB_BUF_OVER );
+                    break;
                 }
+            }
 
-                DUG_PRINTF( "Further Enum Result: " );
-                if( s == ERR_SUCCESS )
+            if( KM_Enum.Type == USB_DEV_CLASS_HID )
+            {
+                DUG_PRINTF( "Device Is HID. Enum Hid:\r\n" );
+                KM_DescHash = LCACHE_DescHash( DevDesc_Buf, Com_Buf );
+                s = KM_AnalyzeConfigDesc( index );
+                if( s != ERR_SUCCESS )
                 {
-                    DUG_PRINTF( "OK\r\n" );
+                    KM_EnumFinish( s );
+                    break;
+                }
 
-                    /* Set the connection status of the device  */
-                    RootHubDev.bStatus = ROOT_DEV_SUCCESS;
-                    GPIO_WriteBit(LED_GPIO_Port,LED_Pin, Bit_RESET);
+                /* A known device skips the report descriptor requests and parsing */
+                DUG_PRINTF( "Layout cache: " );
+                KM_Enum.ItfNum = 0;
+                KM_Enum.RepRetry = 0;
+                if( KM_RestoreHidReportDesc( index ) == ERR_SUCCESS )
+                {
+                    DUG_PRINTF( "Hit\r\n" );
+                    EPROF_MARK( KM_Enum.Node, EPROF_STAGE_REP_DESC, 1 );
+                    EPROF_MARK( KM_Enum.Node, EPROF_STAGE_SET_IDLE, 0 );
+                    KM_Enum.State = KM_ENUM_SET_IDLE;
                 }
-                else if( s != ERR_USB_DISCON )
+                else
                 {
-                    DUG_PRINTF( "Err(%02x)\r\n", s );
-                    
-                    RootHubDev.bStatus = ROOT_DEV_FAILED;
+                    DUG_PRINTF( "Miss\r\n" );
+                    EPROF_MARK( KM_Enum.Node, EPROF_STAGE_REP_DESC, 0 );
+                    KM_Enum.State = KM_ENUM_REPORT_DESC;
                 }
             }
-            else if( RootHubDev.bType == USB_DEV_CLASS_HUB )
+            else if( KM_Enum.Type == DEF_DEV_TYPE_XBOX360 )
             {
-                DUG_PRINTF("Root Device Is HUB. ");
-
-                s = USBH_EnumHubDevice( );
-                DUG_PRINTF( "Further Enum Result: " );
-                if( s == ERR_SUCCESS )
+                DUG_PRINTF( "Device Is Xbox360. Analyze CfgDesc: " );
+                s = XBOX360_AnalyzeConfigDesc( index );
+                if( s != ERR_SUCCESS )
                 {
-                    DUG_PRINTF( "OK\r\n" );
-
-                    /* Set the connection status of the device  */
-                    RootHubDev.bStatus = ROOT_DEV_SUCCESS;
-                    GPIO_WriteBit(LED_GPIO_Port,LED_Pin, Bit_RESET);
+                    KM_EnumFinish( s );
+                    break;
                 }
-                else if( s != ERR_USB_DISCON )
-                {
-                    DUG_PRINTF( "Err(%02x)\r\n", s );
+                DUG_PRINTF( "OK\r\n" );
+                KM_Enum.ItfNum = 0;
+                KM_Enum.State = KM_ENUM_XBOX_LED;
+            }
+            else
+            {
+                DUG_PRINTF( "Device Is HUB. Get Hub Desc: " );
+                HUB_AnalyzeConfigDesc( index );
+                KM_Enum.RepRetry = 0;
+                KM_Enum.State = KM_ENUM_HUB_DESC;
+            }
+            break;
 
-                    RootHubDev.bStatus = ROOT_DEV_FAILED;
-                }
+        case KM_ENUM_REPORT_DESC:
+            while( ( KM_Enum.ItfNum < HostCtl[ index ].InterfaceNum ) && ( HostCtl[ index ].Interface[ KM_Enum.ItfNum ].HidDescLen == 0 ) )
+            {
+                KM_Enum.ItfNum++;
+            }
+            if( KM_Enum.ItfNum >= HostCtl[ index ].InterfaceNum )
+            {
+                /* Every report descriptor was fetched and parsed, queue the layouts for
+                 * the cache, the flash write waits until enumeration has settled */
+                LCACHE_Store( ( (PUSB_DEV_DESCR)DevDesc_Buf )->idVendor, ( (PUSB_DEV_DESCR)DevDesc_Buf )->idProduct, KM_DescHash, index );
+                EPROF_MARK( KM_Enum.Node, EPROF_STAGE_SET_IDLE, 0 );
+                KM_Enum.ItfNum = 0;
+                KM_Enum.State = KM_ENUM_SET_IDLE;
+                break;
+            }
+            itf = &HostCtl[ index ].Interface[ KM_Enum.ItfNum ];
+            memcpy( &req, SetupGetHidDes, sizeof( USB_SETUP_REQ ) );
+            req.wIndex = KM_Enum.ItfNum;
+            req.wLength = ( itf->HidDescLen < DEF_COM_BUF_LEN )? itf->HidDescLen : DEF_COM_BUF_LEN;
+            s = KM_EnumRequest( &req, Com_Buf, &len );
+            if( s == ERR_USB_BUSY )
+            {
+                break;
             }
-            else // Detect that this device is a NON-HID device
+            DUG_PRINTF( "Get Interface%x RepDesc: ", KM_Enum.ItfNum );
+            if( s != ERR_SUCCESS )
             {
-                DUG_PRINTF( "Root Device Is " );
-                switch( RootHubDev.bType )
+                DUG_PRINTF( "Err(%02x)\r\n", s );
+                EPROF_MARK( KM_Enum.Node, EPROF_STAGE_REP_RETRY, KM_Enum.ItfNum );
+                if( ++KM_Enum.RepRetry > 5 )
                 {
-                    case USB_DEV_CLASS_STORAGE:
-                        DUG_PRINTF("Storage. ");
-                        break;
-                    case USB_DEV_CLASS_PRINTER:
-                        DUG_PRINTF("Printer. ");
-                        break;
-                    case USB_DEV_CLASS_HUB:
-                        DUG_PRINTF("Hub. ");
-                        break;
-                    case DEF_DEV_TYPE_XBOX360:
-                        DUG_PRINTF("Xbox360. ");
-                        break;
-                    case DEF_DEV_TYPE_UNKNOWN:
-                        DUG_PRINTF("Unknown. ");
-                        break;
+                    KM_EnumFinish( DEF_REP_DESCR_GETFAIL );
                 }
-                DUG_PRINTF( "End Enum.\r\n" );
+                break;
+            }
+            itf->HidDescLen = len;
+#if DEF_DEBUG_PRINTF
+            for( i = 0; i < len; i++ )
+            {
+                DUG_PRINTF( "%02x " , Com_Buf[ i ] );
+            }
+            DUG_PRINTF( "\r\n" );
+#endif
+
+            /* Analyze Report Descriptor */
+            KM_AnalyzeHidReportDesc( index, KM_Enum.ItfNum );
+
+            //Init circular buffer
+            FifoInit( &itf->buffer );
+            KM_Enum.ItfNum++;
+            break;
 
-                RootHubDev.bStatus = ROOT_DEV_SUCCESS;
+        case KM_ENUM_SET_IDLE:
+            /* Idle rate by report class */
+            while( ( KM_Enum.ItfNum < HostCtl[ index ].InterfaceNum ) &&
+                   ( KM_HidIdleDuration( &HostCtl[ index ].Interface[ KM_Enum.ItfNum ] ) == DEF_HID_IDLE_NONE ) )
+            {
+                KM_Enum.ItfNum++;
             }
-        }
-        else if( s != ERR_USB_DISCON )
-        {
-            /* Enumeration failed */
-            DUG_PRINTF( "Enum Fail with Error Code:%x\r\n",s );
-            RootHubDev.bStatus = ROOT_DEV_FAILED;
-        }
-    }
-    else if( s == ROOT_DEV_DISCONNECT )
-    {
-        DUG_PRINTF( "USB Port Dev Out.\r\n" );
+            if( KM_Enum.ItfNum >= HostCtl[ index ].InterfaceNum )
+            {
+                EPROF_MARK( KM_Enum.Node, EPROF_STAGE_LED, 0 );
+                KM_Enum.ItfNum = 0;
+                KM_Enum.State = KM_ENUM_LED;
+                break;
+            }
+            memcpy( &req, SetupSetidle, sizeof( USB_SETUP_REQ ) );
+            req.wValue = (uint16_t)KM_HidIdleDuration( &HostCtl[ index ].Interface[ KM_Enum.ItfNum ] ) << 8;
+            req.wIndex = KM_Enum.ItfNum;
+            if( KM_EnumRequest( &req, NULL, NULL ) != ERR_USB_BUSY )
+            {
+                KM_Enum.ItfNum++; // Optional request, errors are ignored
+            }
+            break;
 
-        /* Clear parameters */
-        index = RootHubDev.DeviceIndex;
-        memset( &RootHubDev.bStatus, 0, sizeof( ROOT_HUB_DEVICE ) );
-        memset( &HostCtl[ index ].InterfaceNum, 0, sizeof( HOST_CTL ) );
-        GPIO_WriteBit(LED_GPIO_Port,LED_Pin, Bit_SET);
-    }
+        case KM_ENUM_LED:
+            /* Keyboard lighting starts off */
+            while( ( KM_Enum.ItfNum < HostCtl[ index ].InterfaceNum ) && ( HostCtl[ index ].Interface[ KM_Enum.ItfNum ].Type != DEC_KEY ) )
+            {
+                KM_Enum.ItfNum++;
+            }
+            if( KM_Enum.ItfNum >= HostCtl[ index ].InterfaceNum )
+            {
+                KM_EnumFinish( ERR_SUCCESS );
+                break;
+            }
+            itf = &HostCtl[ index ].Interface[ KM_Enum.ItfNum ];
+            itf->SetReport_Value = 0x00;
+            if( itf->SetReport_Swi != 1 )
+            {
+                itf->SetReport_Flag = 1;                                        // Through the OUT endpoint if any, once the device is up
+                KM_Enum.ItfNum++;
+                break;
+            }
+            memcpy( &req, SetupSetReport, sizeof( USB_SETUP_REQ ) );
+            req.wIndex = KM_Enum.ItfNum;
+            if( itf->IDFlag )
+            {
+                KM_Enum.LedBuf[ 0 ] = itf->ReportID;
+                KM_Enum.LedBuf[ 1 ] = 0x00;
+                req.wLength = 2;
+            }
+            else
+            {
+                KM_Enum.LedBuf[ 0 ] = 0x00;
+                req.wLength = 1;
+            }
+            if( KM_EnumRequest( &req, KM_Enum.LedBuf, NULL ) != ERR_USB_BUSY )
+            {
+                KM_Enum.ItfNum++;
+            }
+            break;
 
-    /* Get the data of the HID/Xbox device connected to the USB host port */
-    if( RootHubDev.bStatus >= ROOT_DEV_SUCCESS )
-    {
-        index = RootHubDev.DeviceIndex;
+        case KM_ENUM_XBOX_LED:
+            /* Player LED ring, a controller that refuses it still works */
+            while( ( KM_Enum.ItfNum < HostCtl[ index ].InterfaceNum ) &&
+                   ( ( HostCtl[ index ].Interface[ KM_Enum.ItfNum ].Type != DEC_XBOX360 ) ||
+                     ( HostCtl[ index ].Interface[ KM_Enum.ItfNum ].OutEndpNum == 0 ) ) )
+            {
+                KM_Enum.ItfNum++;
+            }
+            if( KM_Enum.ItfNum >= HostCtl[ index ].InterfaceNum )
+            {
+                KM_EnumFinish( ERR_SUCCESS );
+                break;
+            }
+            itf = &HostCtl[ index ].Interface[ KM_Enum.ItfNum ];
+            s = KM_EnumEndpOut( itf->OutEndpAddr[ 0 ], &itf->OutEndpTog[ 0 ], KM_XboxLedInit, sizeof( KM_XboxLedInit ) );
+            if( s == ERR_USB_BUSY )
+            {
+                break;
+            }
+            if( s != ERR_SUCCESS )
+            {
+                DUG_PRINTF( "Xbox LED Init Err(%02x)\r\n", s );
+            }
+            KM_Enum.ItfNum++;
+            break;
 
-        if( ( RootHubDev.bType == USB_DEV_CLASS_HID ) || ( RootHubDev.bType == DEF_DEV_TYPE_XBOX360 ) )
-        {
-            for( intf_num = 0; intf_num < HostCtl[ index ].InterfaceNum; intf_num++ )
+        case KM_ENUM_HUB_DESC:
+            memcpy( &req, GetHubDescr, sizeof( USB_SETUP_REQ ) );
+            req.wLength = sizeof( USB_HUB_DESCR );
+            s = KM_EnumRequest( &req, Com_Buf, &len );
+            if( s == ERR_USB_BUSY )
+            {
+                break;
+            }
+            if( ( s != ERR_SUCCESS ) || ( len < 3 ) )
             {
-                for( in_num = 0; in_num < HostCtl[ index ].Interface[ intf_num ].InEndpNum; in_num++ )
+                DUG_PRINTF( "Err(%02x)\r\n", s );
+                if( ++KM_Enum.RepRetry >= 5 )
                 {
-                    /* Get endpoint data based on the interval time of the device */
-                    if( HostCtl[ index ].Interface[ intf_num ].InEndpTimeCount[ in_num ] >= HostCtl[ index ].Interface[ intf_num ].InEndpInterval[ in_num ] )
-                    {
-                        HostCtl[ index ].Interface[ intf_num ].InEndpTimeCount[ in_num ] %= HostCtl[ index ].Interface[ intf_num ].InEndpInterval[ in_num ];
+                    KM_EnumFinish( ERR_USB_UNKNOWN );
+                }
+                break;
+            }
+            KM_Enum.PortNum = ( (PUSB_HUB_DESCR)Com_Buf )->bNbrPorts;
+            if( KM_Enum.PortNum > DEF_NEXT_HUB_PORT_NUM_MAX )
+            {
+                KM_Enum.PortNum = DEF_NEXT_HUB_PORT_NUM_MAX;
+            }
+            DUG_PRINTF( "Hub PortNum: %02x\r\n", KM_Enum.PortNum );
+            KM_Enum.ItfNum = 1;
+            KM_Enum.RepRetry = 0;
+            KM_Enum.Wait = 0;
+            KM_Enum.State = KM_ENUM_HUB_POWER;
+            break;
 
-                        /* Get endpoint data */
-                        s = USBFSH_GetEndpData( HostCtl[ index ].Interface[ intf_num ].InEndpAddr[ in_num ],
-                                                &HostCtl[ index ].Interface[ intf_num ].InEndpTog[ in_num ], Com_Buf, &len );
-                        if( s == ERR_SUCCESS )
-                        {
+        case KM_ENUM_HUB_POWER:
+            /* Power on the HUB ports, 5mS between the attempts of a port */
+            if( KM_Enum.ItfNum > KM_Enum.PortNum )
+            {
+                if( KM_Enum.Node == DEF_KM_ROOT_PORT )
+                {
+                    RootHubDev.bPortNum = HUB_AddPorts( DEF_KM_ROOT_PORT, KM_Enum.PortNum );
+                }
+                else
+                {
+                    RootHubDev.Device[ KM_Enum.Node ].bPortNum = HUB_AddPorts( KM_Enum.Node, KM_Enum.PortNum );
+                }
+                KM_EnumFinish( ERR_SUCCESS );
+                break;
+            }
+            if( ( KM_Enum.Issued == 0 ) && ( elapsed < KM_Enum.Wait ) )
+            {
+                break;
+            }
+            memcpy( &req, SetPortFeature, sizeof( USB_SETUP_REQ ) );
+            req.wValue = HUB_PORT_POWER;
+            req.wIndex = KM_Enum.ItfNum;
+            s = KM_EnumRequest( &req, NULL, NULL );
+            if( s == ERR_USB_BUSY )
+            {
+                break;
+            }
+            if( s == ERR_SUCCESS )
+            {
+                KM_Enum.ItfNum++;
+                KM_Enum.Wait = 0;
+                break;
+            }
+            if( ++KM_Enum.RepRetry >= 5 )
+            {
+                KM_EnumFinish( ERR_USB_UNKNOWN );
+                break;
+            }
+            KM_Enum.Time = KM_TickMs;
+            KM_Enum.Wait = 5;
+            break;
 
-                        	//Add value to circular
-                        	HostCtl[ index ].Interface[ intf_num ].HidRptLen = len;
-                        	FifoWrite(&HostCtl[ index ].Interface[ intf_num ].buffer, &Com_Buf, len);
+        default:
+            break;
+    }
+}
 
-#if DEF_DEBUG_PRINTF
-                        	DUG_PRINTF("Index:%x \r\n",index );
-                        	DUG_PRINTF("Buffer head%x \r\n", HostCtl[ index ].Interface[ intf_num ].buffer.head);
-                        	DUG_PRINTF("Buffer tail%x \r\n", HostCtl[ index ].Interface[ intf_num ].buffer.tail);
+/*********************************************************************
+ * @fn      KM_EnumSettled
+ *
+ * @brief   Check that no device is being enumerated, neither on the
+ *          root port nor behind a HUB.
+ *
+ * @return  1 if enumeration has settled, 0 otherwise.
+ */
+static uint8_t KM_EnumSettled( void )
+{
+    uint8_t hub_port;
 
-                        	DUG_PRINTF("Interface type:%x \r\n", HostCtl[ index ].Interface[ intf_num ].HIDRptDesc.type);
+    if( KM_Enum.State != KM_ENUM_IDLE )
+    {
+        return 0;
+    }
+    for( hub_port = 0; hub_port < DEF_KM_PORT_NODE_NUM; hub_port++ )
+    {
+        if( ( RootHubDev.Device[ hub_port ].bPortState != HUB_PS_IDLE ) &&
+            ( RootHubDev.Device[ hub_port ].bPortState != HUB_PS_CHANGE ) )
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
 
-                        	DUG_PRINTF("Len:%x \r\n", len);
+/*********************************************************************
+ * @fn      USBH_MainDeal
+ *
+ * @brief   Provide a simple enumeration process for USB devices and
+ *          obtain keyboard and mouse data at regular intervals.
+ *
+ * @return  none
+ */
+void USBH_MainDeal( void )
+{
+    uint8_t  s;
+    uint8_t  hub_port;
+    uint8_t  state, issued;
 
+    KM_DealPollEvents( );
+    KM_StallProcess( );
 
-                            for( i = 0; i < len; i++ )
-                            {
+    /* Check USB device connection or disconnection, only after the detect interrupt */
+    s = ROOT_DEV_FAILED;
+    if( USBFSH_DetectEvent )
+    {
+        s = USBFSH_CheckRootHubPortStatus( RootHubDev.bStatus );
+    }
+    if( s == ROOT_DEV_CONNECTED )
+    {
+        DUG_PRINTF( "USB Port Dev In.\r\n" );
 
-                                DUG_PRINTF( "%02x ", Com_Buf[ i ] );
-                            }
-                            DUG_PRINTF( "\r\n" );
-#endif
+        /* Set root device state parameters */
+        SCHED_Clear( );
+        KM_LiveClear( );
+        RootHubDev.bStatus = ROOT_DEV_CONNECTED;
+        RootHubDev.DeviceIndex = DEF_USBFS_PORT_INDEX * DEF_ONE_USB_SUP_DEV_TOTAL;
 
-                            /* Handle keyboard lighting */
-                            if( HostCtl[ index ].Interface[ intf_num ].Type == DEC_KEY )
-                            {
-                                KB_AnalyzeKeyValue( index, intf_num, Com_Buf, len );
+        KM_EnumStart( );
+    }
+    else if( s == ROOT_DEV_DISCONNECT )
+    {
+        DUG_PRINTF( "USB Port Dev Out.\r\n" );
 
-                                if( HostCtl[ index ].Interface[ intf_num ].SetReport_Flag )
-                                {
-                                    KB_SetReport( index, RootHubDev.bEp0MaxPks, intf_num );
-                                }
-                            }
-                        }
-                        else if( s == ERR_USB_DISCON )
-                        {
-                            break;
-                        }
-                        else if( s == ( USB_PID_STALL | ERR_USB_TRANSFER ) )
-                        {
-                            /* USB device abnormal event */
-                            DUG_PRINTF("Abnormal\r\n");
+        /* Clear parameters */
+        SCHED_Clear( );
+        KM_LiveClear( );
+        USBFSH_CtrlAbort( );
+        KM_Enum.State = KM_ENUM_IDLE;
+        KM_Stall.State = KM_STALL_IDLE;
+        KM_Stall.Issued = 0;
+        KM_TreeReset( );
+        GPIO_WriteBit(LED_GPIO_Port,LED_Pin, Bit_SET);
+    }
 
-                            /* Clear endpoint */
-                            USBFSH_ClearEndpStall( RootHubDev.bEp0MaxPks, HostCtl[ index ].Interface[ intf_num ].InEndpAddr[ in_num ] | 0x80 );
-                            HostCtl[ index ].Interface[ intf_num ].InEndpTog[ in_num ] = 0x00;
+    /* Enumerate the root device or a HUB port device. A step that ended without
+     * waiting for a transfer or a timestamp lets the next one go in the next pass. */
+    if( KM_Enum.State != KM_ENUM_IDLE )
+    {
+        state = KM_Enum.State;
+        issued = KM_Enum.Issued;
+        KM_EnumProcess( );
+        if( ( KM_Enum.State != state ) || ( issued && ( KM_Enum.Issued == 0 ) ) )
+        {
+            EVT_Post( EVT_HOST );
+        }
+    }
 
-                            /* Judge the number of error */
-                            HostCtl[ index ].ErrorCount++;
-                            if( HostCtl[ index ].ErrorCount >= 10 )
-                            {
-                                /* Re-enumerate the device and clear the endpoint again */
-                                memset( &RootHubDev.bStatus, 0, sizeof( struct _ROOT_HUB_DEVICE ) );
-                                s = USBH_EnumRootDevice( );
-                                if( s == ERR_SUCCESS )
-                                {
-                                    USBFSH_ClearEndpStall( RootHubDev.bEp0MaxPks, HostCtl[ index ].Interface[ intf_num ].InEndpAddr[ in_num ] | 0x80 );
-                                    HostCtl[ index ].ErrorCount = 0x00;
-
-                                    RootHubDev.bStatus = ROOT_DEV_CONNECTED;
-                                    RootHubDev.DeviceIndex = DEF_USBFS_PORT_INDEX * DEF_ONE_USB_SUP_DEV_TOTAL;
-
-                                    memset( &HostCtl[ index ].InterfaceNum, 0, sizeof( struct __HOST_CTL ) );
-                                    if( RootHubDev.bType == USB_DEV_CLASS_HID )
-                                    {
-                                        s = USBH_EnumHidDevice( index, RootHubDev.bEp0MaxPks );
-                                    }
-                                    else if( RootHubDev.bType == DEF_DEV_TYPE_XBOX360 )
-                                    {
-                                        s = USBH_EnumXbox360Device( index, RootHubDev.bEp0MaxPks );
-                                    }
-                                    else
-                                    {
-                                        s = ERR_USB_UNSUPPORT;
-                                    }
-
-                                    if( s == ERR_SUCCESS )
-                                    {
-                                        RootHubDev.bStatus = ROOT_DEV_SUCCESS; 
-                                        GPIO_WriteBit(LED_GPIO_Port,LED_Pin, Bit_RESET);
-                                    }
-                                    else if( s != ERR_USB_DISCON )
-                                    {
-                                        RootHubDev.bStatus = ROOT_DEV_FAILED;
-                                    }
-                                }
-                                else if( s != ERR_USB_DISCON )
-                                {
-                                    RootHubDev.bStatus = ROOT_DEV_FAILED;
-                                }
-                            }
-                        }
-                    }
-                }
+    /* Run the port state machines of every HUB in the tree, the status change
+     * endpoints of the HUBs and all device endpoints are polled by the scheduler */
+    if( ( RootHubDev.bStatus >= ROOT_DEV_SUCCESS ) && ( RootHubDev.bType == USB_DEV_CLASS_HUB ) )
+    {
+        HUB_DealChange( DEF_KM_ROOT_PORT, &RootHubDev.bHubDat );
+        for( hub_port = 0; hub_port < DEF_KM_PORT_NODE_NUM; hub_port++ )
+        {
+            if( RootHubDev.Device[ hub_port ].bPort && ( RootHubDev.Device[ hub_port ].bType == USB_DEV_CLASS_HUB ) &&
+                ( RootHubDev.Device[ hub_port ].bStatus == ROOT_DEV_SUCCESS ) )
+            {
+                HUB_DealChange( hub_port, &RootHubDev.Device[ hub_port ].bHubDat );
+            }
+        }
 
-                if( s == ERR_USB_DISCON )
-                {
-                    break;
-                }
+        for( hub_port = 0; hub_port < DEF_KM_PORT_NODE_NUM; hub_port++ )
+        {
+            if( RootHubDev.Device[ hub_port ].bPort )
+            {
+                HUB_PortProcess( hub_port );
             }
         }
-        else if( RootHubDev.bType == USB_DEV_CLASS_HUB )
-        {
-           /* Query port status change */
-           if( HostCtl[ index ].Interface[ 0 ].InEndpTimeCount[ 0 ] >= HostCtl[ index ].Interface[ 0 ].InEndpInterval[ 0 ] )
-           {
-               HostCtl[ index ].Interface[ 0 ].InEndpTimeCount[ 0 ] %= HostCtl[ index ].Interface[ 0 ].InEndpInterval[ 0 ];
-
-               /* Select HUB port */
-               USBFSH_SetSelfAddr( RootHubDev.bAddress );
-               USBFSH_SetSelfSpeed( RootHubDev.bSpeed );
-
-               /* Get HUB interrupt endpoint data */
-               s = USBFSH_GetEndpData( HostCtl[ index ].Interface[ 0 ].InEndpAddr[ 0 ], &HostCtl[ index ].Interface[ 0 ].InEndpTog[ 0 ], Com_Buf, &len );
-               if( s == ERR_SUCCESS )
-               {
-                   hub_dat = Com_Buf[ 0 ];
-                   DUG_PRINTF( "Hub Int Data:%02x\r\n", hub_dat );
-
-                   for( hub_port = 0; hub_port < RootHubDev.bPortNum; hub_port++ )
-                   {
-                       /* HUB Port PreEnumate Step 1: C_PORT_CONNECTION */
-                       s = HUB_Port_PreEnum1( ( hub_port + 1 ), &hub_dat );
-                       if( s == ERR_USB_DISCON )
-                       {
-                           hub_dat &= ~( 1 << ( hub_port + 1 ) );
-
-                           /* Clear parameters */
-                           memset( &HostCtl[ RootHubDev.Device[ hub_port ].DeviceIndex ], 0, sizeof( HOST_CTL ) );
-                           memset( &RootHubDev.Device[ hub_port ].bStatus, 0, sizeof( HUB_DEVICE ) );
-                           continue;
-                       }
-
-                       /* HUB Port PreEnumate Step 2: Set/Clear PORT_RESET */
-                       Delay_Ms( 100 );
-                       s = HUB_Port_PreEnum2( ( hub_port + 1 ), &hub_dat );
-                       if( s == ERR_USB_CONNECT )
-                       {
-                           /* Set parameters */
-                           RootHubDev.Device[ hub_port ].bStatus = ROOT_DEV_CONNECTED;
-                           RootHubDev.Device[ hub_port ].bEp0MaxPks = DEFAULT_ENDP0_SIZE;
-                           RootHubDev.Device[ hub_port ].DeviceIndex = DEF_USBFS_PORT_INDEX * DEF_ONE_USB_SUP_DEV_TOTAL + hub_port + 1;
-                       }
-                       else
-                       {
-                           hub_dat &= ~( 1 << ( hub_port + 1 ) );
-                       }
-
-                       /* Enumerate HUB Device */
-                       if( RootHubDev.Device[ hub_port ].bStatus == ROOT_DEV_CONNECTED )
-                       {
-                           /* Check device speed */
-                           RootHubDev.Device[ hub_port ].bSpeed = HUB_CheckPortSpeed( ( hub_port + 1 ), Com_Buf );
-                           DUG_PRINTF( "Dev Speed:%x\r\n", RootHubDev.Device[ hub_port ].bSpeed );
-
-                           /* Select the specified port */
-                           USBFSH_SetSelfAddr( RootHubDev.Device[ hub_port ].bAddress );
-                           USBFSH_SetSelfSpeed( RootHubDev.Device[ hub_port ].bSpeed );
-                           if( RootHubDev.bSpeed != USB_LOW_SPEED )
-                           {
-                               USBOTG_H_FS->HOST_CTRL &= ~USBFS_UH_LOW_SPEED;
-                           }
-
-                           /* Enumerate the USB device of the current HUB port */
-                           DUG_PRINTF("Enum_HubDevice\r\n");
-                           s = USBH_EnumHubPortDevice( hub_port, &RootHubDev.Device[ hub_port ].bAddress, \
-                                                       &RootHubDev.Device[ hub_port ].bType );
-                           if( s == ERR_SUCCESS )
-                           {
-                               if( ( RootHubDev.Device[ hub_port ].bType == USB_DEV_CLASS_HID ) || ( RootHubDev.Device[ hub_port ].bType == DEF_DEV_TYPE_XBOX360 ) )
-                               {
-                                   if( RootHubDev.Device[ hub_port ].bType == USB_DEV_CLASS_HID )
-                                   {
-                                       DUG_PRINTF( "HUB port%x device is HID! Further Enum:\r\n", hub_port );
-                                       s = USBH_EnumHidDevice( RootHubDev.Device[ hub_port ].DeviceIndex, \
-                                                               RootHubDev.Device[ hub_port ].bEp0MaxPks );
-                                   }
-                                   else
-                                   {
-                                       DUG_PRINTF( "HUB port%x device is Xbox360! Further Enum:\r\n", hub_port );
-                                       s = USBH_EnumXbox360Device( RootHubDev.Device[ hub_port ].DeviceIndex, \
-                                                                   RootHubDev.Device[ hub_port ].bEp0MaxPks );
-                                   }
-
-                                   if( s == ERR_SUCCESS )
-                                   {
-                                        RootHubDev.Device[ hub_port ].bStatus = ROOT_DEV_SUCCESS;
-					GPIO_WriteBit(LED_GPIO_Port,LED_Pin, Bit_RESET);                                       
-					DUG_PRINTF( "OK!\r\n" );
-                                   }
-                               }
-                               else // Detect that this device is a Non-HID device
-                               {
-                                   DUG_PRINTF( "HUB port%x device is ", hub_port );
-                                   switch( RootHubDev.Device[ hub_port ].bType )
-                                   {
-                                       case USB_DEV_CLASS_STORAGE:
-                                           DUG_PRINTF("storage!\r\n");
-                                           break;
-                                       case USB_DEV_CLASS_PRINTER:
-                                           DUG_PRINTF("printer!\r\n");
-                                           break;
-                                       case USB_DEV_CLASS_HUB:
-                                           DUG_PRINTF("printer!\r\n");
-                                           break;
-                                       case DEF_DEV_TYPE_XBOX360:
-                                           DUG_PRINTF("xbox360!\r\n");
-                                           break;
-                                       case DEF_DEV_TYPE_UNKNOWN:
-                                           DUG_PRINTF("unknown!\r\n");
-                                           break;
-                                   }
-                                   RootHubDev.Device[ hub_port ].bStatus = ROOT_DEV_SUCCESS;
-                               }
-                           }
-                           else
-                           {
-                               RootHubDev.Device[ hub_port ].bStatus = ROOT_DEV_FAILED;
-                               DUG_PRINTF( "HUB Port%x Enum Err!\r\n", hub_port );
-			       GPIO_WriteBit(LED_GPIO_Port,LED_Pin, Bit_SET);
-                           }
-                       }
-                   }
-               }
-           }
-
-           /* Get HUB port HID device data */
-           for( hub_port = 0; hub_port < RootHubDev.bPortNum; hub_port++ )
-           {
-               if( RootHubDev.Device[ hub_port ].bStatus == ROOT_DEV_SUCCESS )
-               {
-                   index = RootHubDev.Device[ hub_port ].DeviceIndex;
-
-                   if( ( RootHubDev.Device[ hub_port ].bType == USB_DEV_CLASS_HID ) || ( RootHubDev.Device[ hub_port ].bType == DEF_DEV_TYPE_XBOX360 ) )
-                   {
-                       for( intf_num = 0; intf_num < HostCtl[ index ].InterfaceNum; intf_num++ )
-                       {
-                           for( in_num = 0; in_num < HostCtl[ index ].Interface[ intf_num ].InEndpNum; in_num++ )
-                           {
-                               /* Get endpoint data based on the interval time of the device */
-                               if( HostCtl[ index ].Interface[ intf_num ].InEndpTimeCount[ in_num ] >= HostCtl[ index ].Interface[ intf_num ].InEndpInterval[ in_num ] )
-                               {
-                                   HostCtl[ index ].Interface[ intf_num ].InEndpTimeCount[ in_num ] %= HostCtl[ index ].Interface[ intf_num ].InEndpInterval[ in_num ];
-
-                                   /* Select HUB device port */
-                                   USBFSH_SetSelfAddr( RootHubDev.Device[ hub_port ].bAddress );
-                                   USBFSH_SetSelfSpeed( RootHubDev.Device[ hub_port ].bSpeed );
-                                   if( RootHubDev.bSpeed != USB_LOW_SPEED )
-                                   {
-                                       USBOTG_H_FS->HOST_CTRL &= ~USBFS_UH_LOW_SPEED;
-                                   }
-
-                                   /* Get endpoint data */
-                                   s = USBFSH_GetEndpData( HostCtl[ index ].Interface[ intf_num ].InEndpAddr[ in_num ], \
-                                                           &HostCtl[ index ].Interface[ intf_num ].InEndpTog[ in_num ], Com_Buf, &len );
-                                   if( s == ERR_SUCCESS )
-                                   {
-					//Add value to circular
-                                    	HostCtl[ index ].Interface[ intf_num ].HidRptLen = len;
-                                    	FifoWrite(&HostCtl[ index ].Interface[ intf_num ].buffer, &Com_Buf, len);
-#if DEF_DEBUG_PRINTF
-					                                    	DUG_PRINTF("Index:%x \r\n",index );
-                                    	DUG_PRINTF("Buffer head%x \r\n", HostCtl[ index ].Interface[ intf_num ].buffer.head);
-                                    	DUG_PRINTF("Buffer tail%x \r\n", HostCtl[ index ].Interface[ intf_num ].buffer.tail);
-
-                                    	DUG_PRINTF("Interface type:%x \r\n", HostCtl[ index ].Interface[ intf_num ].HIDRptDesc.type);
-
-                                    	DUG_PRINTF("Len:%x \r\n", len);
-                                       for( i = 0; i < len; i++ )
-                                       {
-                                           DUG_PRINTF( "%02x ", Com_Buf[ i ] );
-                                       }
-                                       DUG_PRINTF( "\r\n" );
+    }
+
+    /* Layout cache records go to flash one page per pass once nothing
+     * enumerates, the page erase stalls the CPU for milliseconds */
+    if( KM_EnumSettled( ) )
+    {
+        LCACHE_Process( );
+    }
+
+#if DEF_SCHED_RATE_EN
+    SCHED_RateDump( );
 #endif
 
-                                       if( HostCtl[ index ].Interface[ intf_num ].Type == DEC_KEY )
-                                       {
-                                           KB_AnalyzeKeyValue( index, intf_num, Com_Buf, len );
-
-                                           if( HostCtl[ index ].Interface[ intf_num ].SetReport_Flag )
-                                           {
-                                               KB_SetReport( index, RootHubDev.Device[ hub_port ].bEp0MaxPks, intf_num );
-                                           }
-                                       }
-                                   }
-                                   else if( s == ERR_USB_DISCON )
-                                   {
-                                       break;
-                                   }
-                               }
-                           }
-
-                           if( s == ERR_USB_DISCON )
-                           {
-                               break;
-                           }
-                       }
-                   }
-               }
-           }
-        }
+#if DEF_EPROF_EN
+    /* Print the profile while nothing enumerates, the UART output would skew the timing */
+    if( KM_EnumSettled( ) )
+    {
+        EPROF_Dump( );
     }
+#endif
 }
-
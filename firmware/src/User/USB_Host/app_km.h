@@ -35,10 +35,10 @@ extern "C" {
 #define DEC_XBOX360                     0x03
 #define DEC_UNKNOW                      0xFF
 
-/* USB Keyboard Lighting Key */
-#define DEF_KEY_NUM                     0x53
-#define DEF_KEY_CAPS                    0x39
-#define DEF_KEY_SCROLL                  0x47
+/* Live Interface Kind */
+#define KM_LIVE_MOUSE                   0x01
+#define KM_LIVE_PAD                     0x02                                    // Joystick, gamepad, Xbox 360 controller
+#define KM_LIVE_KEYBOARD                0x03                                    // Keyboard, reports go through the key engine
 
 
 /*******************************************************************************/
@@ -50,19 +50,14 @@ extern uint8_t  Com_Buf[ ];
 /* Function Declaration */
 extern void TIM3_Init( uint16_t arr, uint16_t psc );
 extern void USBH_AnalyseType( uint8_t *pdev_buf, uint8_t *pcfg_buf, uint8_t *ptype );
-extern uint8_t USBH_EnumRootDevice( void );
-extern uint8_t KM_AnalyzeConfigDesc( uint8_t index, uint8_t ep0_size );
+extern uint8_t KM_AnalyzeConfigDesc( uint8_t index );
 extern void KM_AnalyzeHidReportDesc( uint8_t index, uint8_t intf_num );
-extern uint8_t KM_DealHidReportDesc( uint8_t index, uint8_t ep0_size );
-extern uint8_t USBH_EnumHidDevice( uint8_t index, uint8_t ep0_size );
-extern uint8_t USBH_EnumXbox360Device( uint8_t index, uint8_t ep0_size );
 extern uint8_t HUB_AnalyzeConfigDesc( uint8_t index );
-extern uint8_t HUB_Port_PreEnum1( uint8_t hub_port, uint8_t *pbuf );
-extern uint8_t HUB_Port_PreEnum2( uint8_t hub_port, uint8_t *pbuf );
-extern uint8_t HUB_CheckPortSpeed( uint8_t hub_port, uint8_t *pbuf );
-extern uint8_t USBH_EnumHubPortDevice( uint8_t hub_port, uint8_t *paddr, uint8_t *ptype );
-extern void KB_AnalyzeKeyValue( uint8_t index, uint8_t intf_num, uint8_t *pbuf, uint16_t len );
-extern uint8_t KB_SetReport( uint8_t index, uint8_t ep0_size, uint8_t intf_num );
+extern void KB_AnalyzeKeyValue( uint8_t index, uint8_t intf_num, uint8_t locks );
+extern uint8_t KB_SetReport( uint8_t index, uint8_t hub_port, uint8_t intf_num );
+extern void KM_SchedInit( void );
+extern uint32_t KM_LiveTake( void );
+extern struct interface *KM_LiveItf( uint8_t slot, uint8_t *pkind );
 extern void USBH_MainDeal( void );
 
 
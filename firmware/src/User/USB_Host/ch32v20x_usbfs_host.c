@@ -14,11 +14,69 @@
 /*******************************************************************************/
 /* Header File */
 #include "usb_host_config.h"
+#include "event.h"
+#include "irq.h"
 
 /*******************************************************************************/
 /* Variable Definition */
 __attribute__((aligned(4))) uint8_t  USBFS_RX_Buf[ USBFS_MAX_PACKET_SIZE ];     // IN, must even address
 __attribute__((aligned(4))) uint8_t  USBFS_TX_Buf[ USBFS_MAX_PACKET_SIZE ];     // OUT, must even address
+volatile uint8_t USBFSH_DetectEvent;                                            // Attach/detach seen by the interrupt, not yet handled
+
+/* Asynchronous transaction in flight, one at a time */
+static struct
+{
+    volatile uint8_t Busy;
+    volatile uint8_t FgDepth;                                                   // Foreground (blocking) transfers holding the bus
+    uint8_t          EndpPid;
+    uint8_t          Elapsed;
+    uint8_t          *pEndpTog;
+    USBFSH_TRANS_CB  Cb;
+    void             *pCtx;
+    uint8_t          SaveAddr;                                                  // Foreground device selection
+    uint8_t          SaveBaseCtrl;
+    uint8_t          SaveHostCtrl;
+    uint16_t         SaveHostSetup;
+} USBFSH_Async;
+static void ( *USBFSH_SofCb )( void );
+static void ( *USBFSH_IdleCb )( void );
+
+/* Asynchronous control transfer stage */
+#define USBFSH_CTRL_IDLE            0
+#define USBFSH_CTRL_SETUP           1
+#define USBFSH_CTRL_DATA            2
+#define USBFSH_CTRL_STATUS          3
+#define USBFSH_CTRL_DONE            4
+#define USBFSH_CTRL_OUT             5                                           // Single OUT to an interrupt endpoint
+
+/* Asynchronous control transfer, one stage per transaction. It has its own
+ * OUT buffer so a foreground request being built in USBFS_TX_Buf is safe.
+ * An interrupt OUT report takes the same slot, as a transfer of one stage. */
+static struct
+{
+    volatile uint8_t  Stage;
+    volatile uint8_t  Pending;                                                  // Stage waits for the bus
+    uint8_t           Result;
+    uint8_t           Addr;
+    uint8_t           Speed;
+    uint8_t           PortSpeed;
+    uint8_t           Ep0Size;
+    uint8_t           Tog;
+    uint8_t           *pTog;                                                    // Tog, the endpoint toggle for an OUT report
+    uint8_t           Endp;                                                     // Endpoint of an OUT report
+    uint8_t           DirIn;
+    uint8_t           StatusPid;                                                // Opposite direction of the data stage, IN without one
+    uint8_t           *pBuf;
+    uint16_t          RemLen;
+    uint16_t          Len;
+    volatile uint16_t Timeout;
+} USBFSH_Ctrl;
+__attribute__((aligned(4))) static uint8_t USBFSH_CtrlTxBuf[ USBFS_MAX_PACKET_SIZE ];
+
+static uint8_t USBFSH_TransactLocked( uint8_t endp_pid, uint8_t endp_tog, uint16_t timeout );
+static uint8_t USBFSH_CtrlTransferLocked( uint8_t ep0_size, uint8_t *pbuf, uint16_t *plen );
+
+void USBHD_IRQHandler( void ) __attribute__((interrupt("WCH-Interrupt-fast")));
 
 /*********************************************************************
  * @fn      USBFS_RCC_Init
@@ -56,6 +114,8 @@ void USBFS_RCC_Init( void )
  */
 void USBFS_Host_Init( FunctionalState sta )
 {
+    NVIC_InitTypeDef NVIC_InitStructure = { 0 };
+
     if( sta == ENABLE )
     {
         /* Reset USB module */
@@ -68,20 +128,64 @@ void USBFS_Host_Init( FunctionalState sta )
         USBOTG_H_FS->HOST_EP_MOD = USBFS_UH_EP_TX_EN | USBFS_UH_EP_RX_EN;
         USBOTG_H_FS->HOST_RX_DMA = (uint32_t)USBFS_RX_Buf;
         USBOTG_H_FS->HOST_TX_DMA = (uint32_t)USBFS_TX_Buf;
+
+        /* Transfer completion, SOF and attach/detach interrupt, same preemption level
+         * as the TIM3 tick so the timeout in USBFSH_AsyncTick never nests with it (irq.h) */
+        USBFSH_Async.Busy = 0;
+        USBFSH_Async.FgDepth = 0;
+        USBFSH_DetectEvent = 0;
+        USBOTG_H_FS->INT_FG = USBFS_UIF_DETECT;
+        USBOTG_H_FS->INT_EN = USBFS_UIE_HST_SOF | USBFS_UIE_DETECT;
+        NVIC_InitStructure.NVIC_IRQChannel = USBHD_IRQn;
+        NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = IRQ_PREEMPT_USB;
+        NVIC_InitStructure.NVIC_IRQChannelSubPriority = IRQ_SUB_USB;
+        NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+        NVIC_Init( &NVIC_InitStructure );
     }
     else
     {
+        NVIC_DisableIRQ( USBHD_IRQn );
         USBOTG_H_FS->BASE_CTRL = USBFS_UC_RESET_SIE | USBFS_UC_CLR_ALL;
         Delay_Us( 10 );
         USBOTG_H_FS->BASE_CTRL = 0;
+        USBFSH_Async.Busy = 0;
     }
 }
 
+/*********************************************************************
+ * @fn      USBFSH_BusAcquire
+ *
+ * @brief   Claim the bus for a blocking (foreground) transfer. No new
+ *          asynchronous transaction starts until the matching release,
+ *          the one in flight is waited for. Calls may nest.
+ *
+ * @return  none
+ */
+static void USBFSH_BusAcquire( void )
+{
+    USBFSH_Async.FgDepth++;
+    while( USBFSH_Async.Busy );
+}
+
+/*********************************************************************
+ * @fn      USBFSH_BusRelease
+ *
+ * @brief   Release the bus claimed by USBFSH_BusAcquire.
+ *
+ * @return  none
+ */
+static void USBFSH_BusRelease( void )
+{
+    USBFSH_Async.FgDepth--;
+}
+
 /*********************************************************************
  * @fn      USBFSH_CheckRootHubPortStatus
  *
  * @brief   Check the current status of the USB port in combination with 
  *          the saved status of the root device connected to this port.
+ *          The detect flag is taken by the interrupt, callers may skip
+ *          this check while USBFSH_DetectEvent is 0.
  *
  * @para    dev_sta: The saved status of the root device.
  *
@@ -89,9 +193,9 @@ void USBFS_Host_Init( FunctionalState sta )
  */
 uint8_t USBFSH_CheckRootHubPortStatus( uint8_t dev_sta )
 {
-    if( USBOTG_H_FS->INT_FG & USBFS_UIF_DETECT )// Check that there is a device connection or disconnection event on the port
+    if( USBFSH_DetectEvent )// Check that there is a device connection or disconnection event on the port
     {
-        USBOTG_H_FS->INT_FG = USBFS_UIF_DETECT; // Clear flag
+        USBFSH_DetectEvent = 0; // Clear event
         if( USBOTG_H_FS->MIS_ST & USBFS_UMS_DEV_ATTACH ) // Check that there is a device connection to the port
         {
             if( ( dev_sta == ROOT_DEV_DISCONNECT ) || ( ( dev_sta != ROOT_DEV_FAILED ) && ( USBFSH_CheckRootHubPortEnable( ) == 0x00 ) ) )
@@ -150,32 +254,88 @@ uint8_t USBFSH_CheckRootHubPortSpeed( void )
  */
 void USBFSH_SetSelfAddr( uint8_t addr )
 {
+    USBFSH_BusAcquire( );
     USBOTG_H_FS->DEV_ADDR = ( USBOTG_H_FS->DEV_ADDR & USBFS_UDA_GP_BIT ) | ( addr & USBFS_USB_ADDR_MASK );
+    USBFSH_BusRelease( );
 }
 
 /*********************************************************************
- * @fn      USBFSH_SetSelfSpeed
+ * @fn      USBFSH_SpeedApply
  *
- * @brief   Set USB speed.
+ * @brief   Program the signalling of the next transactions. The SIE
+ *          runs at the device speed, the port at the speed of whatever
+ *          is attached to it. A low-speed device behind a full-speed
+ *          HUB is reached through a full-speed port with a PRE preamble
+ *          ahead of every downstream low-speed packet.
  *
- * @para    speed: USB speed.
+ * @para    speed: Device speed.
+ *          port_speed: Speed of the root port the device hangs off.
  *
  * @return  none
  */
-void USBFSH_SetSelfSpeed( uint8_t speed )
+static void USBFSH_SpeedApply( uint8_t speed, uint8_t port_speed )
 {
-    if( speed == USB_FULL_SPEED )
+    if( speed == USB_LOW_SPEED )
     {
-        USBOTG_H_FS->BASE_CTRL &= ~USBFS_UC_LOW_SPEED;
-        USBOTG_H_FS->HOST_CTRL &= ~USBFS_UH_LOW_SPEED;
-        USBOTG_H_FS->HOST_SETUP &= ~USBFS_UH_PRE_PID_EN;
+        USBOTG_H_FS->BASE_CTRL |= USBFS_UC_LOW_SPEED;
     }
     else
     {
-        USBOTG_H_FS->BASE_CTRL |= USBFS_UC_LOW_SPEED;
+        USBOTG_H_FS->BASE_CTRL &= ~USBFS_UC_LOW_SPEED;
+    }
+    if( port_speed == USB_LOW_SPEED )
+    {
         USBOTG_H_FS->HOST_CTRL |= USBFS_UH_LOW_SPEED;
+    }
+    else
+    {
+        USBOTG_H_FS->HOST_CTRL &= ~USBFS_UH_LOW_SPEED;
+    }
+    if( ( speed == USB_LOW_SPEED ) && ( port_speed != USB_LOW_SPEED ) )
+    {
         USBOTG_H_FS->HOST_SETUP |= USBFS_UH_PRE_PID_EN;
     }
+    else
+    {
+        USBOTG_H_FS->HOST_SETUP &= ~USBFS_UH_PRE_PID_EN;
+    }
+}
+
+/*********************************************************************
+ * @fn      USBFSH_SetSelfSpeed
+ *
+ * @brief   Set USB speed of a device attached directly to the port.
+ *
+ * @para    speed: USB speed.
+ *
+ * @return  none
+ */
+void USBFSH_SetSelfSpeed( uint8_t speed )
+{
+    USBFSH_BusAcquire( );
+    USBFSH_SpeedApply( speed, speed );
+    USBFSH_BusRelease( );
+}
+
+/*********************************************************************
+ * @fn      USBFSH_SelectDevice
+ *
+ * @brief   Select the device of the following blocking transfers:
+ *          address, device speed and port speed. Use it for devices
+ *          behind a HUB, where the two speeds may differ.
+ *
+ * @para    addr: USB device address.
+ *          speed: Device speed.
+ *          port_speed: Speed of the root port the device hangs off.
+ *
+ * @return  none
+ */
+void USBFSH_SelectDevice( uint8_t addr, uint8_t speed, uint8_t port_speed )
+{
+    USBFSH_BusAcquire( );
+    USBOTG_H_FS->DEV_ADDR = ( USBOTG_H_FS->DEV_ADDR & USBFS_UDA_GP_BIT ) | ( addr & USBFS_USB_ADDR_MASK );
+    USBFSH_SpeedApply( speed, port_speed );
+    USBFSH_BusRelease( );
 }
 
 /*********************************************************************
@@ -184,38 +344,35 @@ void USBFSH_SetSelfSpeed( uint8_t speed )
  * @brief   Reset USB port.
  *
  * @para    mod: Reset host port operating mode.
- *               0 -> reset and wait end
  *               1 -> begin reset
  *               2 -> end reset
+ *          The caller times the reset (DEF_BUS_RESET_TIME) between the
+ *          two calls and waits for the port to settle after it ends.
  *
  * @return  none
  */
 void USBFSH_ResetRootHubPort( uint8_t mode )
 {
+    USBFSH_BusAcquire( );
     USBFSH_SetSelfAddr( 0x00 );
     USBFSH_SetSelfSpeed( USB_FULL_SPEED );
 
-    if( mode <= 1 )
+    if( mode == 1 )
     {
         USBOTG_H_FS->HOST_CTRL |= USBFS_UH_BUS_RESET; // Start reset
     }
-    if( mode == 0 )
-    {
-        Delay_Ms( DEF_BUS_RESET_TIME ); // Reset time from 10mS to 20mS
-    }
-    if( mode != 1 )
+    else
     {
         USBOTG_H_FS->HOST_CTRL &= ~USBFS_UH_BUS_RESET; // End reset
     }
-    Delay_Ms( 2 );
 
-    if( USBOTG_H_FS->INT_FG & USBFS_UIF_DETECT )
+    /* The reset itself is no attach event */
+    if( USBOTG_H_FS->MIS_ST & USBFS_UMS_DEV_ATTACH )
     {
-        if( USBOTG_H_FS->MIS_ST & USBFS_UMS_DEV_ATTACH )
-        {
-            USBOTG_H_FS->INT_FG = USBFS_UIF_DETECT;
-        }
+        USBOTG_H_FS->INT_FG = USBFS_UIF_DETECT;
+        USBFSH_DetectEvent = 0;
     }
+    USBFSH_BusRelease( );
 }
 
 /*********************************************************************
@@ -239,8 +396,10 @@ uint8_t USBFSH_EnableRootHubPort( uint8_t *pspeed )
                 USBFSH_SetSelfSpeed( USB_LOW_SPEED );
             }
         }
+        USBFSH_BusAcquire( );
         USBOTG_H_FS->HOST_CTRL |= USBFS_UH_PORT_EN;
         USBOTG_H_FS->HOST_SETUP |= USBFS_UH_SOF_EN;
+        USBFSH_BusRelease( );
 
         return ERR_SUCCESS;
     }
@@ -260,6 +419,29 @@ uint8_t USBFSH_EnableRootHubPort( uint8_t *pspeed )
  * @return  USB transfer result.
  */
 uint8_t USBFSH_Transact( uint8_t endp_pid, uint8_t endp_tog, uint16_t timeout )
+{
+    uint8_t s;
+
+    /* Let an asynchronous transaction finish, it is bounded by its timeout */
+    USBFSH_BusAcquire( );
+    s = USBFSH_TransactLocked( endp_pid, endp_tog, timeout );
+    USBFSH_BusRelease( );
+
+    return s;
+}
+
+/*********************************************************************
+ * @fn      USBFSH_TransactLocked
+ *
+ * @brief   Perform USB transaction, the bus is already held.
+ *
+ * @para    endp_pid: Token PID.
+ *          endp_tog: Toggle
+ *          timeout: Timeout time.
+ *
+ * @return  USB transfer result.
+ */
+static uint8_t USBFSH_TransactLocked( uint8_t endp_pid, uint8_t endp_tog, uint16_t timeout )
 {
     uint8_t  r, trans_retry;
     uint16_t i;
@@ -327,7 +509,7 @@ uint8_t USBFSH_Transact( uint8_t endp_pid, uint8_t endp_tog, uint16_t timeout )
         } 
         Delay_Us( 20 );
 
-        if( USBOTG_H_FS->INT_FG & USBFS_UIF_DETECT )
+        if( USBFSH_DetectEvent )
         {
             Delay_Us( 200 );
 
@@ -337,7 +519,7 @@ uint8_t USBFSH_Transact( uint8_t endp_pid, uint8_t endp_tog, uint16_t timeout )
             }
             else
             {
-                USBOTG_H_FS->INT_FG = USBFS_UIF_DETECT;
+                USBFSH_DetectEvent = 0;
             }
         }
     }while( ++trans_retry < 10 );
@@ -345,6 +527,550 @@ uint8_t USBFSH_Transact( uint8_t endp_pid, uint8_t endp_tog, uint16_t timeout )
     return ERR_USB_TRANSFER; // Reply timeout
 }
 
+/*********************************************************************
+ * @fn      USBFSH_TransStatus
+ *
+ * @brief   Decode the handshake of a finished asynchronous transaction.
+ *          Unlike USBFSH_Transact nothing is retried here, the next
+ *          poll of the endpoint is the retry.
+ *
+ * @para    endp_pid: Token PID.
+ *
+ * @return  USB transfer result.
+ */
+static uint8_t USBFSH_TransStatus( uint8_t endp_pid )
+{
+    uint8_t r;
+
+    if( USBOTG_H_FS->INT_ST & USBFS_UIS_TOG_OK )
+    {
+        return ERR_SUCCESS;
+    }
+    r = USBOTG_H_FS->INT_ST & USBFS_UIS_H_RES_MASK;
+    if( ( r == 0 ) || ( ( ( endp_pid >> 4 ) == USB_PID_IN ) && ( ( r == USB_PID_DATA0 ) || ( r == USB_PID_DATA1 ) ) ) )
+    {
+        return ERR_USB_TRANSFER; // No response or toggle mismatch
+    }
+    return ( r | ERR_USB_TRANSFER );
+}
+
+/*********************************************************************
+ * @fn      USBFSH_AsyncDone
+ *
+ * @brief   Finish the asynchronous transaction and run its callback.
+ *          The engine is released first so the callback may submit
+ *          the next transaction.
+ *
+ * @para    s: Transfer result.
+ *
+ * @return  none
+ */
+static void USBFSH_AsyncDone( uint8_t s )
+{
+    uint16_t len = 0;
+
+    USBOTG_H_FS->HOST_EP_PID = 0x00; // Stop USB transfer
+    USBOTG_H_FS->INT_EN &= ~USBFS_UIE_TRANSFER;
+
+    /* Give the foreground its device selection back */
+    USBOTG_H_FS->DEV_ADDR = USBFSH_Async.SaveAddr;
+    USBOTG_H_FS->BASE_CTRL = ( USBOTG_H_FS->BASE_CTRL & ~USBFS_UC_LOW_SPEED ) | USBFSH_Async.SaveBaseCtrl;
+    USBOTG_H_FS->HOST_CTRL = ( USBOTG_H_FS->HOST_CTRL & ~USBFS_UH_LOW_SPEED ) | USBFSH_Async.SaveHostCtrl;
+    USBOTG_H_FS->HOST_SETUP = ( USBOTG_H_FS->HOST_SETUP & ~USBFS_UH_PRE_PID_EN ) | USBFSH_Async.SaveHostSetup;
+    USBOTG_H_FS->HOST_TX_DMA = (uint32_t)USBFS_TX_Buf;
+
+    if( s == ERR_SUCCESS )
+    {
+        if( ( USBFSH_Async.EndpPid >> 4 ) == USB_PID_IN )
+        {
+            len = USBOTG_H_FS->RX_LEN;
+            *USBFSH_Async.pEndpTog ^= USBFS_UH_R_TOG;
+        }
+        else
+        {
+            *USBFSH_Async.pEndpTog ^= USBFS_UH_T_TOG;
+        }
+    }
+
+    USBFSH_Async.Busy = 0;
+    if( USBFSH_Async.Cb )
+    {
+        USBFSH_Async.Cb( s, USBFS_RX_Buf, len, USBFSH_Async.pCtx );
+    }
+}
+
+/*********************************************************************
+ * @fn      USBFSH_SubmitDevTransact
+ *
+ * @brief   Start a single USB transaction to the given device and return
+ *          immediately. Completion is reported from the USBFS interrupt.
+ *          The foreground device selection is saved here and restored
+ *          on completion, so transactions may be started from interrupt
+ *          context between foreground transfers.
+ *
+ * @para    addr: Device address.
+ *          speed: Device speed.
+ *          port_speed: Speed of the root port, a low speed device behind
+ *                      a full speed hub is reached with PRE.
+ *          endp_pid: Token PID.
+ *          pendp_tog: Endpoint toggle, flipped on success.
+ *          cb: Completion callback.
+ *          pctx: Callback context.
+ *
+ * @return  ERR_SUCCESS if started, ERR_USB_UNAVAILABLE if a transaction
+ *          is in flight or a foreground transfer holds the bus.
+ */
+uint8_t USBFSH_SubmitDevTransact( uint8_t addr, uint8_t speed, uint8_t port_speed, uint8_t endp_pid,
+                                  uint8_t *pendp_tog, USBFSH_TRANS_CB cb, void *pctx )
+{
+    if( USBFSH_Async.Busy || USBFSH_Async.FgDepth )
+    {
+        return ERR_USB_UNAVAILABLE;
+    }
+
+    USBFSH_Async.EndpPid = endp_pid;
+    USBFSH_Async.Elapsed = 0;
+    USBFSH_Async.pEndpTog = pendp_tog;
+    USBFSH_Async.Cb = cb;
+    USBFSH_Async.pCtx = pctx;
+    USBFSH_Async.Busy = 1;
+
+    /* Save the foreground selection and select the device */
+    USBFSH_Async.SaveAddr = USBOTG_H_FS->DEV_ADDR;
+    USBFSH_Async.SaveBaseCtrl = USBOTG_H_FS->BASE_CTRL & USBFS_UC_LOW_SPEED;
+    USBFSH_Async.SaveHostCtrl = USBOTG_H_FS->HOST_CTRL & USBFS_UH_LOW_SPEED;
+    USBFSH_Async.SaveHostSetup = USBOTG_H_FS->HOST_SETUP & USBFS_UH_PRE_PID_EN;
+    USBOTG_H_FS->DEV_ADDR = ( USBOTG_H_FS->DEV_ADDR & USBFS_UDA_GP_BIT ) | ( addr & USBFS_USB_ADDR_MASK );
+    USBFSH_SpeedApply( speed, port_speed );
+
+    USBOTG_H_FS->HOST_TX_CTRL = USBOTG_H_FS->HOST_RX_CTRL = *pendp_tog;
+    USBOTG_H_FS->HOST_EP_PID = endp_pid;       // Specify token PID and endpoint number
+    USBOTG_H_FS->INT_FG = USBFS_UIF_TRANSFER;  // Allow transfer
+    USBOTG_H_FS->INT_EN |= USBFS_UIE_TRANSFER;
+
+    return ERR_SUCCESS;
+}
+
+/*********************************************************************
+ * @fn      USBFSH_SetSofCallback
+ *
+ * @brief   Register the function called from the host SOF interrupt at
+ *          the start of every frame.
+ *
+ * @para    cb: SOF callback, NULL to remove.
+ *
+ * @return  none
+ */
+void USBFSH_SetSofCallback( void ( *cb )( void ) )
+{
+    USBFSH_SofCb = cb;
+}
+
+/*********************************************************************
+ * @fn      USBFSH_SetIdleCallback
+ *
+ * @brief   Register the function that hands out the bus, called from
+ *          interrupt context when a control stage waits for it. Without
+ *          one the control transfer takes the bus itself.
+ *
+ * @para    cb: Idle callback, NULL to remove.
+ *
+ * @return  none
+ */
+void USBFSH_SetIdleCallback( void ( *cb )( void ) )
+{
+    USBFSH_IdleCb = cb;
+}
+
+/*********************************************************************
+ * @fn      USBFSH_CtrlIdle
+ *
+ * @brief   Pass the idle bus on, so periodic traffic can go between
+ *          the stages of a control transfer.
+ *
+ * @return  none
+ */
+static void USBFSH_CtrlIdle( void )
+{
+    if( USBFSH_IdleCb )
+    {
+        USBFSH_IdleCb( );
+    }
+    else
+    {
+        USBFSH_CtrlKick( );
+    }
+}
+
+/*********************************************************************
+ * @fn      USBFSH_CtrlStageDone
+ *
+ * @brief   Completion of one control transfer stage. A NAK leaves the
+ *          stage pending for the next turn on the bus.
+ *
+ * @return  none
+ */
+static void USBFSH_CtrlStageDone( uint8_t s, uint8_t *pbuf, uint16_t len, void *pctx )
+{
+    uint16_t n;
+
+    (void)pctx;
+    if( USBFSH_Ctrl.Stage == USBFSH_CTRL_IDLE )
+    {
+        return; // Aborted
+    }
+    if( ( s == ( USB_PID_NAK | ERR_USB_TRANSFER ) ) && USBFSH_Ctrl.Timeout )
+    {
+        USBFSH_Ctrl.Pending = 1;
+        USBFSH_CtrlIdle( );
+        return;
+    }
+    if( s != ERR_SUCCESS )
+    {
+        USBFSH_Ctrl.Result = s;
+        USBFSH_Ctrl.Stage = USBFSH_CTRL_DONE;
+        EVT_Post( EVT_USB_CTRL );
+        USBFSH_CtrlIdle( );
+        return;
+    }
+
+    switch( USBFSH_Ctrl.Stage )
+    {
+        case USBFSH_CTRL_SETUP:
+            USBFSH_Ctrl.Tog = USBFS_UH_T_TOG | USBFS_UH_R_TOG; // Default DATA1
+            USBFSH_Ctrl.Stage = USBFSH_Ctrl.RemLen? USBFSH_CTRL_DATA : USBFSH_CTRL_STATUS;
+            break;
+
+        case USBFSH_CTRL_DATA:
+            if( USBFSH_Ctrl.DirIn )
+            {
+                n = ( len < USBFSH_Ctrl.RemLen )? len : USBFSH_Ctrl.RemLen;
+                memcpy( USBFSH_Ctrl.pBuf, pbuf, n );
+                if( ( len == 0 ) || ( len & ( USBFSH_Ctrl.Ep0Size - 1 ) ) )
+                {
+                    USBFSH_Ctrl.RemLen = n; // Short package, data stage ends
+                }
+            }
+            else
+            {
+                n = ( USBFSH_Ctrl.RemLen >= USBFSH_Ctrl.Ep0Size )? USBFSH_Ctrl.Ep0Size : USBFSH_Ctrl.RemLen;
+            }
+            USBFSH_Ctrl.pBuf += n;
+            USBFSH_Ctrl.RemLen -= n;
+            USBFSH_Ctrl.Len += n;
+            if( USBFSH_Ctrl.RemLen == 0 )
+            {
+                USBFSH_Ctrl.Tog = USBFS_UH_T_TOG | USBFS_UH_R_TOG;
+                USBFSH_Ctrl.Stage = USBFSH_CTRL_STATUS;
+            }
+            break;
+
+        case USBFSH_CTRL_OUT:
+            USBFSH_Ctrl.Len = USBFSH_Ctrl.RemLen;
+            USBFSH_Ctrl.Result = ERR_SUCCESS;
+            USBFSH_Ctrl.Stage = USBFSH_CTRL_DONE;
+            EVT_Post( EVT_USB_CTRL );
+            USBFSH_CtrlIdle( );
+            return;
+
+        default:
+            /* An IN status stage must be a zero length packet */
+            USBFSH_Ctrl.Result = ( ( USBFSH_Ctrl.StatusPid != USB_PID_IN ) || ( len == 0 ) )? ERR_SUCCESS : ERR_USB_BUF_OVER;
+            USBFSH_Ctrl.Stage = USBFSH_CTRL_DONE;
+            EVT_Post( EVT_USB_CTRL );
+            USBFSH_CtrlIdle( );
+            return;
+    }
+
+    USBFSH_Ctrl.Pending = 1;
+    USBFSH_CtrlIdle( );
+}
+
+/*********************************************************************
+ * @fn      USBFSH_SubmitCtrlTransfer
+ *
+ * @brief   Start an asynchronous control transfer. The stages run from
+ *          the USBFS interrupt whenever the bus is handed to them, the
+ *          caller polls USBFSH_CtrlResult.
+ *
+ * @para    addr: Device address.
+ *          speed: Device speed.
+ *          port_speed: Speed of the root port.
+ *          ep0_size: Device endpoint 0 size.
+ *          preq: Setup request, copied.
+ *          pbuf: Data buffer of wLength bytes, NULL for no data stage.
+ *
+ * @return  ERR_SUCCESS, ERR_USB_BUSY if a control transfer is running.
+ */
+uint8_t USBFSH_SubmitCtrlTransfer( uint8_t addr, uint8_t speed, uint8_t port_speed, uint8_t ep0_size,
+                                   const USB_SETUP_REQ *preq, uint8_t *pbuf )
+{
+    if( ( USBFSH_Ctrl.Stage != USBFSH_CTRL_IDLE ) && ( USBFSH_Ctrl.Stage != USBFSH_CTRL_DONE ) )
+    {
+        return ERR_USB_BUSY;
+    }
+
+    memcpy( USBFSH_CtrlTxBuf, preq, sizeof( USB_SETUP_REQ ) );
+    USBFSH_Ctrl.Addr = addr;
+    USBFSH_Ctrl.Speed = speed;
+    USBFSH_Ctrl.PortSpeed = port_speed;
+    USBFSH_Ctrl.Ep0Size = ep0_size;
+    USBFSH_Ctrl.Tog = 0x00;
+    USBFSH_Ctrl.pTog = &USBFSH_Ctrl.Tog;
+    USBFSH_Ctrl.DirIn = ( preq->bRequestType & USB_REQ_TYP_IN )? 1 : 0;
+    USBFSH_Ctrl.pBuf = pbuf;
+    USBFSH_Ctrl.RemLen = pbuf? preq->wLength : 0;
+    USBFSH_Ctrl.StatusPid = ( USBFSH_Ctrl.DirIn && USBFSH_Ctrl.RemLen )? USB_PID_OUT : USB_PID_IN;
+    USBFSH_Ctrl.Len = 0;
+    USBFSH_Ctrl.Result = ERR_USB_BUSY;
+    USBFSH_Ctrl.Timeout = DEF_ASYNC_CTRL_TIMEOUT;
+    USBFSH_Ctrl.Stage = USBFSH_CTRL_SETUP;
+    USBFSH_Ctrl.Pending = 1;
+
+    /* Start it from the interrupt if the bus is free now */
+    NVIC_SetPendingIRQ( USBHD_IRQn );
+
+    return ERR_SUCCESS;
+}
+
+/*********************************************************************
+ * @fn      USBFSH_SubmitEndpOut
+ *
+ * @brief   Start an asynchronous single packet OUT to an interrupt
+ *          endpoint. It takes the control transfer slot and goes on the
+ *          bus the same way, in what the periodic polls leave of a
+ *          frame; the caller polls USBFSH_CtrlResult.
+ *
+ * @para    addr: Device address.
+ *          speed: Device speed.
+ *          port_speed: Speed of the root port.
+ *          endp: Endpoint number.
+ *          pendp_tog: Endpoint toggle, flipped on success. Must stay
+ *                     valid until the transfer is done or aborted.
+ *          pbuf: Data, copied.
+ *          len: Data length, up to one packet.
+ *
+ * @return  ERR_SUCCESS, ERR_USB_BUSY if a control transfer is running.
+ */
+uint8_t USBFSH_SubmitEndpOut( uint8_t addr, uint8_t speed, uint8_t port_speed, uint8_t endp,
+                              uint8_t *pendp_tog, const uint8_t *pbuf, uint16_t len )
+{
+    if( ( USBFSH_Ctrl.Stage != USBFSH_CTRL_IDLE ) && ( USBFSH_Ctrl.Stage != USBFSH_CTRL_DONE ) )
+    {
+        return ERR_USB_BUSY;
+    }
+    if( len > USBFS_MAX_PACKET_SIZE )
+    {
+        return ERR_USB_BUF_OVER;
+    }
+
+    memcpy( USBFSH_CtrlTxBuf, pbuf, len );
+    USBFSH_Ctrl.Addr = addr;
+    USBFSH_Ctrl.Speed = speed;
+    USBFSH_Ctrl.PortSpeed = port_speed;
+    USBFSH_Ctrl.pTog = pendp_tog;
+    USBFSH_Ctrl.Endp = endp & 0x0F;
+    USBFSH_Ctrl.DirIn = 0;
+    USBFSH_Ctrl.pBuf = NULL;
+    USBFSH_Ctrl.RemLen = len;
+    USBFSH_Ctrl.Len = 0;
+    USBFSH_Ctrl.Result = ERR_USB_BUSY;
+    USBFSH_Ctrl.Timeout = DEF_ASYNC_CTRL_TIMEOUT;
+    USBFSH_Ctrl.Stage = USBFSH_CTRL_OUT;
+    USBFSH_Ctrl.Pending = 1;
+
+    NVIC_SetPendingIRQ( USBHD_IRQn );
+
+    return ERR_SUCCESS;
+}
+
+/*********************************************************************
+ * @fn      USBFSH_CtrlKick
+ *
+ * @brief   Put the pending control stage on the bus. Interrupt context
+ *          only, the bus owner calls it when it has nothing more urgent.
+ *
+ * @return  1 if a stage was started.
+ */
+uint8_t USBFSH_CtrlKick( void )
+{
+    uint8_t endp_pid;
+    uint8_t tx_len = 0;
+
+    if( ( USBFSH_Ctrl.Pending == 0 ) || USBFSH_Async.Busy || USBFSH_Async.FgDepth )
+    {
+        return 0;
+    }
+
+    switch( USBFSH_Ctrl.Stage )
+    {
+        case USBFSH_CTRL_SETUP:
+            endp_pid = USB_PID_SETUP << 4;
+            tx_len = sizeof( USB_SETUP_REQ );
+            break;
+
+        case USBFSH_CTRL_DATA:
+            if( USBFSH_Ctrl.DirIn )
+            {
+                endp_pid = USB_PID_IN << 4;
+            }
+            else
+            {
+                endp_pid = USB_PID_OUT << 4;
+                tx_len = ( USBFSH_Ctrl.RemLen >= USBFSH_Ctrl.Ep0Size )? USBFSH_Ctrl.Ep0Size : USBFSH_Ctrl.RemLen;
+                memcpy( USBFSH_CtrlTxBuf, USBFSH_Ctrl.pBuf, tx_len );
+            }
+            break;
+
+        case USBFSH_CTRL_STATUS:
+            endp_pid = USBFSH_Ctrl.StatusPid << 4;
+            break;
+
+        case USBFSH_CTRL_OUT:
+            endp_pid = ( USB_PID_OUT << 4 ) | USBFSH_Ctrl.Endp;
+            tx_len = USBFSH_Ctrl.RemLen;                                        // Already in USBFSH_CtrlTxBuf
+            break;
+
+        default:
+            USBFSH_Ctrl.Pending = 0;
+            return 0;
+    }
+
+    USBOTG_H_FS->HOST_TX_DMA = (uint32_t)USBFSH_CtrlTxBuf;
+    USBOTG_H_FS->HOST_TX_LEN = tx_len;
+    USBFSH_Ctrl.Pending = 0;
+    USBFSH_SubmitDevTransact( USBFSH_Ctrl.Addr, USBFSH_Ctrl.Speed, USBFSH_Ctrl.PortSpeed, endp_pid,
+                              USBFSH_Ctrl.pTog, USBFSH_CtrlStageDone, NULL );
+    return 1;
+}
+
+/*********************************************************************
+ * @fn      USBFSH_CtrlResult
+ *
+ * @brief   Result of the last asynchronous control transfer.
+ *
+ * @para    plen: Data stage length, may be NULL.
+ *
+ * @return  ERR_USB_BUSY while running, the transfer result otherwise.
+ */
+uint8_t USBFSH_CtrlResult( uint16_t *plen )
+{
+    if( USBFSH_Ctrl.Stage != USBFSH_CTRL_DONE )
+    {
+        return ( USBFSH_Ctrl.Stage == USBFSH_CTRL_IDLE )? ERR_USB_UNAVAILABLE : ERR_USB_BUSY;
+    }
+    if( plen )
+    {
+        *plen = USBFSH_Ctrl.Len;
+    }
+    return USBFSH_Ctrl.Result;
+}
+
+/*********************************************************************
+ * @fn      USBFSH_CtrlAbort
+ *
+ * @brief   Drop the asynchronous control transfer, e.g. on disconnect.
+ *
+ * @return  none
+ */
+void USBFSH_CtrlAbort( void )
+{
+    USBFSH_Ctrl.Pending = 0;
+    USBFSH_Ctrl.Stage = USBFSH_CTRL_IDLE;
+    while( USBFSH_Async.Busy );
+}
+
+/*********************************************************************
+ * @fn      USBFSH_AsyncBusy
+ *
+ * @brief   Check whether an asynchronous transaction is in flight.
+ *
+ * @return  1 if busy.
+ */
+uint8_t USBFSH_AsyncBusy( void )
+{
+    return USBFSH_Async.Busy;
+}
+
+/*********************************************************************
+ * @fn      USBFSH_AsyncTick
+ *
+ * @brief   Abort an asynchronous transaction that got no completion
+ *          interrupt in time. Call every 1mS.
+ *
+ * @return  none
+ */
+void USBFSH_AsyncTick( void )
+{
+    if( USBFSH_Async.Busy && ( ++USBFSH_Async.Elapsed > DEF_ASYNC_TRANS_TIMEOUT ) )
+    {
+        USBFSH_AsyncDone( ERR_USB_UNKNOWN );
+    }
+
+    /* A control transfer that keeps getting NAKed or never gets the bus */
+    if( ( USBFSH_Ctrl.Stage != USBFSH_CTRL_IDLE ) && ( USBFSH_Ctrl.Stage != USBFSH_CTRL_DONE ) )
+    {
+        if( USBFSH_Ctrl.Timeout )
+        {
+            USBFSH_Ctrl.Timeout--;
+        }
+        else if( USBFSH_Ctrl.Pending )
+        {
+            USBFSH_Ctrl.Pending = 0;
+            USBFSH_Ctrl.Result = ERR_USB_TRANSFER;
+            USBFSH_Ctrl.Stage = USBFSH_CTRL_DONE;
+            EVT_Post( EVT_USB_CTRL );
+        }
+    }
+}
+
+/*********************************************************************
+ * @fn      USBHD_IRQHandler
+ *
+ * @brief   This function handles USBFS host interrupt request.
+ *
+ * @return  none
+ */
+void USBHD_IRQHandler( void )
+{
+    IRQ_STAT_ENTER( IRQ_ID_USB, IRQ_LAT_NONE );
+    if( ( USBOTG_H_FS->INT_EN & USBFS_UIE_TRANSFER ) && ( USBOTG_H_FS->INT_FG & USBFS_UIF_TRANSFER ) )
+    {
+        if( USBFSH_Async.Busy )
+        {
+            USBFSH_AsyncDone( USBFSH_TransStatus( USBFSH_Async.EndpPid ) );
+        }
+        else
+        {
+            USBOTG_H_FS->INT_EN &= ~USBFS_UIE_TRANSFER;
+        }
+    }
+
+    /* Attach or detach, handled by the main loop */
+    if( USBOTG_H_FS->INT_FG & USBFS_UIF_DETECT )
+    {
+        USBOTG_H_FS->INT_FG = USBFS_UIF_DETECT;
+        USBFSH_DetectEvent = 1;
+        EVT_Post( EVT_USB_DETECT );
+    }
+
+    if( USBOTG_H_FS->INT_FG & USBFS_UIF_HST_SOF )
+    {
+        USBOTG_H_FS->INT_FG = USBFS_UIF_HST_SOF;
+        if( USBFSH_SofCb )
+        {
+            USBFSH_SofCb( );
+        }
+    }
+
+    /* A newly submitted control transfer, or one whose stage could not go yet */
+    if( USBFSH_Ctrl.Pending && ( USBFSH_Async.Busy == 0 ) )
+    {
+        USBFSH_CtrlIdle( );
+    }
+    IRQ_STAT_EXIT( IRQ_ID_USB );
+}
+
 /*********************************************************************
  * @fn      USBFSH_CtrlTransfer
  *
@@ -357,17 +1083,39 @@ uint8_t USBFSH_Transact( uint8_t endp_pid, uint8_t endp_tog, uint16_t timeout )
  * @return  USB control transfer result.
  */
 uint8_t USBFSH_CtrlTransfer( uint8_t ep0_size, uint8_t *pbuf, uint16_t *plen )
+{
+    uint8_t s;
+
+    /* The stages keep their state in the toggle and length registers, hold the bus throughout */
+    USBFSH_BusAcquire( );
+    s = USBFSH_CtrlTransferLocked( ep0_size, pbuf, plen );
+    USBFSH_BusRelease( );
+
+    return s;
+}
+
+/*********************************************************************
+ * @fn      USBFSH_CtrlTransferLocked
+ *
+ * @brief   USB host control transfer, the bus is already held.
+ *
+ * @para    ep0_size: Device endpoint 0 size
+ *          pbuf: Data buffer
+ *          plen: Data length
+ *
+ * @return  USB control transfer result.
+ */
+static uint8_t USBFSH_CtrlTransferLocked( uint8_t ep0_size, uint8_t *pbuf, uint16_t *plen )
 {
     uint8_t  s;
     uint16_t rem_len, rx_len, rx_cnt, tx_cnt;
 
-    Delay_Us( 100 );
     if( plen )
     {
         *plen = 0;
     }
     USBOTG_H_FS->HOST_TX_LEN = sizeof( USB_SETUP_REQ );
-    s = USBFSH_Transact( ( USB_PID_SETUP << 4 ) | 0x00, 0x00, DEF_CTRL_TRANS_TIMEOVER_CNT );  // SETUP stage
+    s = USBFSH_TransactLocked( ( USB_PID_SETUP << 4 ) | 0x00, 0x00, DEF_CTRL_TRANS_TIMEOVER_CNT );  // SETUP stage
     if( s != ERR_SUCCESS )
     {
         return s;
@@ -381,8 +1129,7 @@ uint8_t USBFSH_CtrlTransfer( uint8_t ep0_size, uint8_t *pbuf, uint16_t *plen )
             /* Receive data */
             while( rem_len )
             {
-                Delay_Us( 100 );
-                s = USBFSH_Transact( ( USB_PID_IN << 4 ) | 0x00, USBOTG_H_FS->HOST_RX_CTRL, DEF_CTRL_TRANS_TIMEOVER_CNT );  // IN
+                s = USBFSH_TransactLocked( ( USB_PID_IN << 4 ) | 0x00, USBOTG_H_FS->HOST_RX_CTRL, DEF_CTRL_TRANS_TIMEOVER_CNT );  // IN
                 if( s != ERR_SUCCESS )
                 {
                     return s;
@@ -413,14 +1160,13 @@ uint8_t USBFSH_CtrlTransfer( uint8_t ep0_size, uint8_t *pbuf, uint16_t *plen )
             /* Send data */
             while( rem_len )
             {
-                Delay_Us( 100 );
                 USBOTG_H_FS->HOST_TX_LEN = ( rem_len >= ep0_size )? ep0_size : rem_len;
                 for( tx_cnt = 0; tx_cnt != USBOTG_H_FS->HOST_TX_LEN; tx_cnt++ )
                 {
                     USBFS_TX_Buf[ tx_cnt ] = *pbuf;
                     pbuf++;
                 }
-                s = USBFSH_Transact( USB_PID_OUT << 4 | 0x00, USBOTG_H_FS->HOST_TX_CTRL, DEF_CTRL_TRANS_TIMEOVER_CNT ); // OUT
+                s = USBFSH_TransactLocked( USB_PID_OUT << 4 | 0x00, USBOTG_H_FS->HOST_TX_CTRL, DEF_CTRL_TRANS_TIMEOVER_CNT ); // OUT
                 if( s != ERR_SUCCESS )
                 {
                     return s;
@@ -435,8 +1181,7 @@ uint8_t USBFSH_CtrlTransfer( uint8_t ep0_size, uint8_t *pbuf, uint16_t *plen )
             }
         }
     }
-    Delay_Us( 100 );
-    s = USBFSH_Transact( ( USBOTG_H_FS->HOST_TX_LEN )? ( USB_PID_IN << 4 | 0x00 ) : ( USB_PID_OUT << 4 | 0x00 ), USBFS_UH_R_TOG | USBFS_UH_T_TOG, DEF_CTRL_TRANS_TIMEOVER_CNT ); // STATUS stage
+    s = USBFSH_TransactLocked( ( USBOTG_H_FS->HOST_TX_LEN )? ( USB_PID_IN << 4 | 0x00 ) : ( USB_PID_OUT << 4 | 0x00 ), USBFS_UH_R_TOG | USBFS_UH_T_TOG, DEF_CTRL_TRANS_TIMEOVER_CNT ); // STATUS stage
     if( s != ERR_SUCCESS )
     {
         return s;
@@ -562,7 +1307,8 @@ uint8_t USBFSH_GetStrDescr( uint8_t ep0_size, uint8_t str_num, uint8_t *pbuf )
 /*********************************************************************
  * @fn      USBFSH_SetUsbAddress
  *
- * @brief   Set USB device address.
+ * @brief   Set USB device address. The caller waits out the
+ *          SET_ADDRESS recovery time before the next request.
  *
  * @para    ep0_size: Device endpoint 0 size
  *          addr: Device address
@@ -581,7 +1327,6 @@ uint8_t USBFSH_SetUsbAddress( uint8_t ep0_size, uint8_t addr )
         return s;
     }
     USBFSH_SetSelfAddr( addr );
-    Delay_Ms( DEF_BUS_RESET_TIME >> 1 ); // Wait for the USB device to complete its operation.
     return ERR_SUCCESS;
 }
 
@@ -602,6 +1347,25 @@ uint8_t USBFSH_SetUsbConfig( uint8_t ep0_size, uint8_t cfg_val )
     return USBFSH_CtrlTransfer( ep0_size, NULL, NULL );
 }
 
+/*********************************************************************
+ * @fn      USBFSH_SetUsbInterface
+ *
+ * @brief   Select an alternate setting of an interface.
+ *
+ * @para    ep0_size: Device endpoint 0 size
+ *          intf_num: Interface number.
+ *          alt: Alternate setting.
+ *
+ * @return  The result of setting the interface.
+ */
+uint8_t USBFSH_SetUsbInterface( uint8_t ep0_size, uint8_t intf_num, uint8_t alt )
+{
+    memcpy( pUSBFS_SetupRequest, SetupSetInterface, sizeof( USB_SETUP_REQ ) );
+    pUSBFS_SetupRequest->wValue = (uint16_t)alt;
+    pUSBFS_SetupRequest->wIndex = (uint16_t)intf_num;
+    return USBFSH_CtrlTransfer( ep0_size, NULL, NULL );
+}
+
 /*********************************************************************
  * @fn      USBFSH_ClearEndpStall
  *
@@ -635,7 +1399,8 @@ uint8_t USBFSH_GetEndpData( uint8_t endp_num, uint8_t *pendp_tog, uint8_t *pbuf,
 {
     uint8_t  s;
     
-    s = USBFSH_Transact( ( USB_PID_IN << 4 ) | endp_num, *pendp_tog, 0 );
+    USBFSH_BusAcquire( );
+    s = USBFSH_TransactLocked( ( USB_PID_IN << 4 ) | endp_num, *pendp_tog, 0 );
     if( s == ERR_SUCCESS )
     {
         *plen = USBOTG_H_FS->RX_LEN;
@@ -643,6 +1408,7 @@ uint8_t USBFSH_GetEndpData( uint8_t endp_num, uint8_t *pendp_tog, uint8_t *pbuf,
 
         *pendp_tog  ^= USBFS_UH_R_TOG;
     }
+    USBFSH_BusRelease( );
     
     return s;
 }
@@ -663,13 +1429,15 @@ uint8_t USBFSH_SendEndpData( uint8_t endp_num, uint8_t *pendp_tog, uint8_t *pbuf
 {
     uint8_t  s;
     
+    USBFSH_BusAcquire( );
     memcpy( USBFS_TX_Buf, pbuf, len );
     USBOTG_H_FS->HOST_TX_LEN = len;
-    s = USBFSH_Transact( ( USB_PID_OUT << 4 ) | endp_num, *pendp_tog, 0 );
+    s = USBFSH_TransactLocked( ( USB_PID_OUT << 4 ) | endp_num, *pendp_tog, 0 );
     if( s == ERR_SUCCESS )
     {
         *pendp_tog ^= USBFS_UH_T_TOG;
     }
+    USBFSH_BusRelease( );
 
     return s;
 }
@@ -35,6 +35,19 @@
 #define USBFS_MAX_PACKET_SIZE      64
 #endif
 
+/* Asynchronous transaction timeout, in 1mS ticks of USBFSH_AsyncTick */
+#define DEF_ASYNC_TRANS_TIMEOUT    3
+
+/* Asynchronous control transfer timeout (NAKs included), in 1mS ticks */
+#define DEF_ASYNC_CTRL_TIMEOUT     500
+
+/*******************************************************************************/
+/* Type Definition */
+
+/* Completion callback of an asynchronous transaction, called in interrupt context.
+ * pbuf/len hold the received data of an IN transaction. */
+typedef void ( *USBFSH_TRANS_CB )( uint8_t s, uint8_t *pbuf, uint16_t len, void *pctx );
+
 /*******************************************************************************/
 /* Constant Definition */
 #ifndef DEF_USB_GEN_ENUM_CMD
@@ -86,6 +99,7 @@ __attribute__((aligned(4))) static const uint8_t SetupSetInterface[ ] =
 /* Variable Declaration */
 extern __attribute__((aligned(4))) uint8_t  USBFS_RX_Buf[ ];
 extern __attribute__((aligned(4))) uint8_t  USBFS_TX_Buf[ ];
+extern volatile uint8_t USBFSH_DetectEvent;
 
 /*******************************************************************************/
 /* Function Declaration */
@@ -96,15 +110,30 @@ extern uint8_t USBFSH_CheckRootHubPortEnable( void );
 extern uint8_t USBFSH_CheckRootHubPortSpeed( void );
 extern void USBFSH_SetSelfAddr( uint8_t addr );
 extern void USBFSH_SetSelfSpeed( uint8_t speed );
+extern void USBFSH_SelectDevice( uint8_t addr, uint8_t speed, uint8_t port_speed );
 extern void USBFSH_ResetRootHubPort( uint8_t mode );
 extern uint8_t USBFSH_EnableRootHubPort( uint8_t *pspeed );
 extern uint8_t USBFSH_Transact( uint8_t endp_pid, uint8_t endp_tog, uint16_t timeout );
+extern uint8_t USBFSH_SubmitDevTransact( uint8_t addr, uint8_t speed, uint8_t port_speed, uint8_t endp_pid,
+                                         uint8_t *pendp_tog, USBFSH_TRANS_CB cb, void *pctx );
+extern void USBFSH_SetSofCallback( void ( *cb )( void ) );
+extern void USBFSH_SetIdleCallback( void ( *cb )( void ) );
+extern uint8_t USBFSH_SubmitCtrlTransfer( uint8_t addr, uint8_t speed, uint8_t port_speed, uint8_t ep0_size,
+                                          const USB_SETUP_REQ *preq, uint8_t *pbuf );
+extern uint8_t USBFSH_SubmitEndpOut( uint8_t addr, uint8_t speed, uint8_t port_speed, uint8_t endp,
+                                     uint8_t *pendp_tog, const uint8_t *pbuf, uint16_t len );
+extern uint8_t USBFSH_CtrlKick( void );
+extern uint8_t USBFSH_CtrlResult( uint16_t *plen );
+extern void USBFSH_CtrlAbort( void );
+extern uint8_t USBFSH_AsyncBusy( void );
+extern void USBFSH_AsyncTick( void );
 extern uint8_t USBFSH_CtrlTransfer( uint8_t ep0_size, uint8_t *pbuf, uint16_t *plen );
 extern uint8_t USBFSH_GetDeviceDescr( uint8_t *pep0_size, uint8_t *pbuf );
 extern uint8_t USBFSH_GetConfigDescr( uint8_t ep0_size, uint8_t *pbuf, uint16_t buf_len, uint16_t *pcfg_len );
 extern uint8_t USBFSH_GetStrDescr( uint8_t ep0_size, uint8_t str_num, uint8_t *pbuf );
 extern uint8_t USBFSH_SetUsbAddress( uint8_t ep0_size, uint8_t addr );
 extern uint8_t USBFSH_SetUsbConfig( uint8_t ep0_size, uint8_t cfg_val );
+extern uint8_t USBFSH_SetUsbInterface( uint8_t ep0_size, uint8_t intf_num, uint8_t alt );
 extern uint8_t USBFSH_ClearEndpStall( uint8_t ep0_size, uint8_t endp_num );
 extern uint8_t USBFSH_GetEndpData( uint8_t endp_num, uint8_t *pendp_tog, uint8_t *pbuf, uint16_t *plen );
 extern uint8_t USBFSH_SendEndpData( uint8_t endp_num, uint8_t *pendp_tog, uint8_t *pbuf, uint16_t len );
@@ -0,0 +1,89 @@
+
+/********************************************************************************/
+/* Header File */
+#include "usb_host_config.h"
+#include "usb_enum_prof.h"
+#include "event.h"
+
+#if DEF_EPROF_EN
+
+/*******************************************************************************/
+/* Variable Definition */
+static EPROF_REC         EPROF_Ring[ DEF_EPROF_RING_LEN ];
+static uint16_t          EPROF_Head;                                            // Records written
+static uint16_t          EPROF_Tail;                                            // Records printed
+static uint8_t           EPROF_HeadPrinted;
+
+static const char * const EPROF_StageName[ EPROF_STAGE_NUM ] =
+{
+    "start", "reset", "attach", "recovery", "dev_desc", "set_addr", "addr_wait", "cfg_desc",
+    "set_cfg", "enum", "class", "set_idle", "rep_desc", "led", "done", "retry", "rep_retry",
+    "vid", "pid"
+};
+
+/*********************************************************************
+ * @fn      EPROF_Mark
+ *
+ * @brief   Record the start of an enumeration phase. The ring keeps
+ *          the newest DEF_EPROF_RING_LEN records.
+ *
+ * @para    port: HUB port node, DEF_EPROF_PORT_ROOT for the root device.
+ *          stage: EPROF_STAGE_xxx.
+ *          arg: Stage specific value.
+ *
+ * @return  none
+ */
+void EPROF_Mark( uint8_t port, uint8_t stage, uint16_t arg )
+{
+    EPROF_REC *prec = &EPROF_Ring[ EPROF_Head & ( DEF_EPROF_RING_LEN - 1 ) ];
+
+    prec->Time = EVT_Now( );
+    prec->Arg = arg;
+    prec->Port = port;
+    prec->Stage = stage;
+    EPROF_Head++;
+}
+
+/*********************************************************************
+ * @fn      EPROF_Dump
+ *
+ * @brief   Print the records not printed yet over the debug UART, one
+ *          CSV line each:
+ *            EP,<seq>,<port>,<stage>,<t_us>,<arg>
+ *          Records overwritten before they were printed are reported
+ *          as one "EP,lost,<n>" line. Printing blocks on the UART, so
+ *          call it only when no enumeration is in progress.
+ *
+ * @return  none
+ */
+void EPROF_Dump( void )
+{
+    EPROF_REC *prec;
+
+    if( EPROF_Tail == EPROF_Head )
+    {
+        return;
+    }
+
+    if( EPROF_HeadPrinted == 0 )
+    {
+        EPROF_HeadPrinted = 1;
+        printf( "EP,seq,port,stage,t_us,arg\r\n" );
+    }
+    if( (uint16_t)( EPROF_Head - EPROF_Tail ) > DEF_EPROF_RING_LEN )
+    {
+        printf( "EP,lost,%u\r\n", (uint16_t)( EPROF_Head - EPROF_Tail - DEF_EPROF_RING_LEN ) );
+        EPROF_Tail = EPROF_Head - DEF_EPROF_RING_LEN;
+    }
+
+    while( EPROF_Tail != EPROF_Head )
+    {
+        prec = &EPROF_Ring[ EPROF_Tail & ( DEF_EPROF_RING_LEN - 1 ) ];
+        printf( "EP,%u,%u,%s,%lu,%u\r\n", EPROF_Tail, prec->Port,
+                ( prec->Stage < EPROF_STAGE_NUM ) ? EPROF_StageName[ prec->Stage ] : "?",
+                (unsigned long)prec->Time, prec->Arg );
+        EPROF_Tail++;
+    }
+}
+
+#endif
@@ -0,0 +1,68 @@
+
+#ifndef __USB_ENUM_PROF_H
+#define __USB_ENUM_PROF_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*******************************************************************************/
+/* Header File */
+#include "stdint.h"
+
+/* Note: include after usb_host_config.h, DEF_EPROF_EN is set there */
+
+/*******************************************************************************/
+/* Macro Definition */
+#define DEF_EPROF_RING_LEN              64                                      // Records kept, must be a power of 2
+#define DEF_EPROF_PORT_ROOT             0xFF                                    // Port field of the root device
+
+/* Enumeration phases. A record marks the start of a phase, the phase lasts
+ * until the next record of the same port. */
+#define EPROF_STAGE_START               0                                       // Attach seen, settle / debounce wait
+#define EPROF_STAGE_RESET               1                                       // Bus or HUB port reset
+#define EPROF_STAGE_ATTACH              2                                       // Wait for a stable attach after reset
+#define EPROF_STAGE_RECOVERY            3                                       // HUB port reset recovery
+#define EPROF_STAGE_DEV_DESC            4
+#define EPROF_STAGE_SET_ADDR            5
+#define EPROF_STAGE_ADDR_WAIT           6
+#define EPROF_STAGE_CFG_DESC            7
+#define EPROF_STAGE_SET_CFG             8
+#define EPROF_STAGE_ENUM                9                                       // Synchronous standard enumeration (HUB port)
+#define EPROF_STAGE_CLASS               10                                      // Class specific enumeration
+#define EPROF_STAGE_SET_IDLE            11
+#define EPROF_STAGE_REP_DESC            12                                      // Arg: 1 on a layout cache hit
+#define EPROF_STAGE_LED                 13
+#define EPROF_STAGE_DONE                14                                      // Arg: result code
+#define EPROF_STAGE_RETRY               15                                      // Arg: error code, enumeration starts over
+#define EPROF_STAGE_REP_RETRY           16                                      // Arg: interface, report descriptor refetched
+#define EPROF_STAGE_VID                 17                                      // Arg: idVendor, not a phase
+#define EPROF_STAGE_PID                 18                                      // Arg: idProduct, not a phase
+#define EPROF_STAGE_NUM                 19
+
+#if DEF_EPROF_EN
+#define EPROF_MARK( port, stage, arg )  EPROF_Mark( port, stage, arg )
+#else
+#define EPROF_MARK( port, stage, arg )  do{ }while( 0 )
+#endif
+
+/*******************************************************************************/
+/* Struct Definition */
+typedef struct _EPROF_REC
+{
+    uint32_t Time;                                                              // uS
+    uint16_t Arg;
+    uint8_t  Port;                                                              // HUB port node, DEF_EPROF_PORT_ROOT for the root device
+    uint8_t  Stage;
+} EPROF_REC;
+
+/*******************************************************************************/
+/* Function Declaration */
+extern void EPROF_Mark( uint8_t port, uint8_t stage, uint16_t arg );
+extern void EPROF_Dump( void );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
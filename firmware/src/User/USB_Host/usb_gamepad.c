@@ -8,28 +8,39 @@
 #define JOYSTICK_AXIS_TRIGGER_MIN   64
 #define JOYSTICK_AXIS_TRIGGER_MAX   192
 
-#define JOY_RIGHT       0x01
-#define JOY_LEFT        0x02
-#define JOY_DOWN        0x04
-#define JOY_UP          0x08
-#define JOY_BTN_SHIFT   4
-#define JOY_BTN1        0x10
-#define JOY_BTN2        0x20
-#define JOY_BTN3        0x40
-#define JOY_BTN4        0x80
-#define JOY_MOVE        (JOY_RIGHT | JOY_LEFT | JOY_UP | JOY_DOWN)
-
 #define XBOX360_INPUT_REPORT_LEN   20
 #define XBOX360_STICK_DEADZONE     12000
 
 HID_gamepad_Info_TypeDef gamepad_info;
 static uint8_t gamepad_report_data[64];
 
+// Generic pad buttons 5..12 in the usual order (L1 R1 L2 R2 Select Start L3 R3) to JOY_EXTRA_xxx
+static const uint8_t generic_extra_map[8] = {
+    JOY_EXTRA_L, JOY_EXTRA_R, JOY_EXTRA_TRIG, JOY_EXTRA_TRIG,
+    JOY_EXTRA_BACK, JOY_EXTRA_START, JOY_EXTRA_L3, JOY_EXTRA_R3
+};
+
+// Hat position from the logical minimum to directions, clockwise from up in
+// eighths. A 4 way hat is looked up at twice its position. Positions 8 and
+// up, the null state included, are centred.
+static const uint8_t hat_map[16] = {
+    JOY_UP, JOY_UP | JOY_RIGHT, JOY_RIGHT, JOY_DOWN | JOY_RIGHT,
+    JOY_DOWN, JOY_DOWN | JOY_LEFT, JOY_LEFT, JOY_UP | JOY_LEFT,
+    0, 0, 0, 0, 0, 0, 0, 0
+};
+
 static int16_t Xbox360_ReadLE16S(const uint8_t *buf)
 {
     return (int16_t)((uint16_t)buf[0] | ((uint16_t)buf[1] << 8));
 }
 
+// Stick axis to -127..127, full scale -32768 clamped
+static int8_t Xbox360_Stick8(int16_t v)
+{
+    v >>= 8;
+    return (int8_t)((v < -127) ? -127 : v);
+}
+
 static USB_Status GamepadDecodeXbox360(uint16_t report_len)
 {
     uint8_t jmap = 0;
@@ -77,20 +88,21 @@ static USB_Status GamepadDecodeXbox360(uint16_t report_len)
     if (ly > XBOX360_STICK_DEADZONE) jmap |= JOY_UP;
     if (ly < -XBOX360_STICK_DEADZONE) jmap |= JOY_DOWN;
 
-    if (buttons_high & (1U << 0)) btn_extra |= (1U << 0); // LB
-    if (buttons_high & (1U << 1)) btn_extra |= (1U << 1); // RB
-    if (buttons_low & (1U << 4)) btn_extra |= (1U << 2);  // Start
-    if (buttons_low & (1U << 5)) btn_extra |= (1U << 3);  // Back
-    if (buttons_high & (1U << 2)) btn_extra |= (1U << 4); // Guide
-    if (buttons_low & (1U << 6)) btn_extra |= (1U << 5);  // L3
-    if (buttons_low & (1U << 7)) btn_extra |= (1U << 6);  // R3
-    if ((lt > 0U) || (rt > 0U)) btn_extra |= (1U << 7);
+    if (buttons_high & (1U << 0)) btn_extra |= JOY_EXTRA_L;
+    if (buttons_high & (1U << 1)) btn_extra |= JOY_EXTRA_R;
+    if (buttons_low & (1U << 4)) btn_extra |= JOY_EXTRA_START;
+    if (buttons_low & (1U << 5)) btn_extra |= JOY_EXTRA_BACK;
+    if (buttons_high & (1U << 2)) btn_extra |= JOY_EXTRA_GUIDE;
+    if (buttons_low & (1U << 6)) btn_extra |= JOY_EXTRA_L3;
+    if (buttons_low & (1U << 7)) btn_extra |= JOY_EXTRA_R3;
+    if ((lt > 0U) || (rt > 0U)) btn_extra |= JOY_EXTRA_TRIG;
 
     gamepad_info.gamepad_data = jmap;
     gamepad_info.gamepad_extraBtn = btn_extra;
 
-    (void)rx;
-    (void)ry;
+    // Right stick for the mouse, its y axis points up
+    gamepad_info.stick_x = Xbox360_Stick8(rx);
+    gamepad_info.stick_y = -Xbox360_Stick8(ry);
 
     return USB_OK;
 }
@@ -135,7 +147,8 @@ USB_Status GamepadDecode(Interface *Itf)
         uint8_t jmap = 0;
         uint8_t btn = 0;
         uint8_t btn_extra = 0;
-        int16_t a[2];
+        int16_t a[4];
+        uint8_t axes;
         uint8_t i;
 
         hid_report_t conf = Itf->HIDRptDesc;
@@ -143,8 +156,11 @@ USB_Status GamepadDecode(Interface *Itf)
         // skip report id if present
         uint8_t *p = gamepad_report_data + (conf.report_id ? 1 : 0);
 
+        // second stick if the descriptor has one
+        axes = (conf.joystick_mouse.axis[2].size && conf.joystick_mouse.axis[3].size) ? 4 : 2;
+
         // process axis
-        for (i = 0; i < 2; i++)
+        for (i = 0; i < axes; i++)
         {
             // if logical minimum is > logical maximum then logical minimum
             // is signed. This means that the value itself is also signed
@@ -170,11 +186,11 @@ USB_Status GamepadDecode(Interface *Itf)
             if (p[conf.joystick_mouse.button[i].byte_offset] &
                 conf.joystick_mouse.button[i].bitmask)
             {
-                btn_extra |= (1U << (i - 4));
+                btn_extra |= generic_extra_map[i - 4];
             }
         }
 
-        for (i = 0; i < 2; i++)
+        for (i = 0; i < axes; i++)
         {
             int hrange = (conf.joystick_mouse.axis[i].logical.max -
                           abs(conf.joystick_mouse.axis[i].logical.min)) / 2;
@@ -199,6 +215,20 @@ USB_Status GamepadDecode(Interface *Itf)
             a[i] = a[i] + 127; // mist wants a value in the range [0..255]
         }
 
+        // process hat, the d-pad of many pads and arcade sticks
+        if (conf.joystick_mouse.hat.size)
+        {
+            uint16_t pos = collect_bits(p, conf.joystick_mouse.hat.offset,
+                                        conf.joystick_mouse.hat.size, 0) -
+                           conf.joystick_mouse.hat.logical.min;
+
+            if (conf.joystick_mouse.hat.logical.max - conf.joystick_mouse.hat.logical.min == 3)
+            {
+                pos <<= 1;
+            }
+            jmap |= hat_map[(pos < 16) ? pos : 8];
+        }
+
         if (a[0] < JOYSTICK_AXIS_TRIGGER_MIN) jmap |= JOY_LEFT;
         if (a[0] > JOYSTICK_AXIS_TRIGGER_MAX) jmap |= JOY_RIGHT;
         if (a[1] < JOYSTICK_AXIS_TRIGGER_MIN) jmap |= JOY_UP;
@@ -207,6 +237,10 @@ USB_Status GamepadDecode(Interface *Itf)
 
         gamepad_info.gamepad_data = jmap;
         gamepad_info.gamepad_extraBtn = btn_extra;
+
+        // Mouse stick: the second one, else the only one
+        gamepad_info.stick_x = a[axes - 2] - JOYSTICK_AXIS_MID;
+        gamepad_info.stick_y = a[axes - 1] - JOYSTICK_AXIS_MID;
     }
 
     return USB_OK;
@@ -5,10 +5,34 @@
 #include <stdint.h>
 #include "usb_host_config.h"
 
+/* gamepad_data: directions and the four face buttons */
+#define JOY_RIGHT       0x01
+#define JOY_LEFT        0x02
+#define JOY_DOWN        0x04
+#define JOY_UP          0x08
+#define JOY_BTN_SHIFT   4
+#define JOY_BTN1        0x10        // Xbox A, bottom face button
+#define JOY_BTN2        0x20        // Xbox B, right
+#define JOY_BTN3        0x40        // Xbox X, left
+#define JOY_BTN4        0x80        // Xbox Y, top
+#define JOY_MOVE        (JOY_RIGHT | JOY_LEFT | JOY_UP | JOY_DOWN)
+
+/* gamepad_extraBtn, the same for every kind of pad */
+#define JOY_EXTRA_L     0x01        // Left shoulder
+#define JOY_EXTRA_R     0x02        // Right shoulder
+#define JOY_EXTRA_START 0x04
+#define JOY_EXTRA_BACK  0x08        // Back, Select
+#define JOY_EXTRA_GUIDE 0x10
+#define JOY_EXTRA_L3    0x20
+#define JOY_EXTRA_R3    0x40
+#define JOY_EXTRA_TRIG  0x80        // Either trigger
+
  typedef struct _HID_gamepad_Info
  {
    uint8_t gamepad_data;
    uint8_t gamepad_extraBtn;
+   int8_t stick_x;          // Mouse stick, -127..127, +x right, +y down
+   int8_t stick_y;
  }
  HID_gamepad_Info_TypeDef;
 
@@ -38,6 +38,9 @@
 #define USAGE_X       48
 #define USAGE_Y       49
 #define USAGE_Z       50
+#define USAGE_RX      51
+#define USAGE_RY      52
+#define USAGE_RZ      53
 #define USAGE_WHEEL   56
 #define USAGE_HAT     57
 
@@ -87,11 +90,21 @@ int parse_report_descriptor(uint8_t *rep, uint16_t rep_size,hid_report_t *conf)
   uint8_t report_complete = 0;
 
   // joystick/mouse components
-  int8_t axis[2] = { -1, -1};
+  int8_t axis[4] = { -1, -1, -1, -1};
   uint8_t btns = 0;
   int8_t hat = -1;
   int8_t wheel = -1;
 
+  // second stick pair, fixed by the first Z (Z/Rz) or Rx (Rx/Ry) usage
+  uint8_t stick2_x = 0, stick2_y = 0;
+
+  // set while the current usage page is LEDs (keyboard output report)
+  uint8_t led_page = 0;
+
+  // keyboard page input fields
+  uint8_t key_page = 0;
+  uint16_t key_usage_min = 0;
+
 
   while(rep_size) {
     // extract short item
@@ -177,7 +190,7 @@ int parse_report_descriptor(uint8_t *rep, uint16_t rep_size,hid_report_t *conf)
 
            	  // handle found axes
            	  uint8_t c;
-           	  for(c=0;c<2;c++) {
+           	  for(c=0;c<4;c++) {
            	    if(axis[c] >= 0) {
            	      uint16_t cnt = bit_count + report_size * axis[c];
 
@@ -200,6 +213,8 @@ int parse_report_descriptor(uint8_t *rep, uint16_t rep_size,hid_report_t *conf)
            	    if(conf->type == REPORT_TYPE_JOYSTICK) {
            	      conf->joystick_mouse.hat.offset = cnt;
            	      conf->joystick_mouse.hat.size = report_size;
+           	      conf->joystick_mouse.hat.logical.min = logical_minimum;
+           	      conf->joystick_mouse.hat.logical.max = logical_maximum;
            	    }
            	  }
 
@@ -218,15 +233,45 @@ int parse_report_descriptor(uint8_t *rep, uint16_t rep_size,hid_report_t *conf)
            	  }
 
 
+           	  // handle keyboard fields, constant (padding) fields are skipped
+           	  if(key_page && (conf->type == REPORT_TYPE_KEYBOARD) && !(value & 1)) {
+           	    if((value & 2) && (report_size == 1)) {
+           	      // variable: modifier byte or NKRO bitmap
+           	      if((key_usage_min == 0xE0) && (report_count == 8) &&
+           	         !(conf->keyboard.fields & KEYBOARD_HAS_MODS)) {
+           	        conf->keyboard.mod_offset = bit_count;
+           	        conf->keyboard.fields |= KEYBOARD_HAS_MODS;
+           	      } else if(!(conf->keyboard.fields & KEYBOARD_HAS_BITMAP)) {
+           	        conf->keyboard.bitmap_offset = bit_count;
+           	        conf->keyboard.bitmap_count = report_count;
+           	        conf->keyboard.bitmap_min = key_usage_min;
+           	        conf->keyboard.fields |= KEYBOARD_HAS_BITMAP;
+           	      }
+           	    } else if(!(value & 2) && (report_size == 8) &&
+           	              !(conf->keyboard.fields & KEYBOARD_HAS_ARRAY)) {
+           	      // array of pressed usages
+           	      conf->keyboard.array_offset = bit_count;
+           	      conf->keyboard.array_count = report_count;
+           	      conf->keyboard.fields |= KEYBOARD_HAS_ARRAY;
+           	    }
+           	  }
+           	  key_usage_min = 0;
+
            	  // reset for next inputs
            	  bit_count += report_count * report_size;
            	  usage_count = 0;
            	  btns = 0;
-           	  axis[0] = axis[1] = -1;
+           	  axis[0] = axis[1] = axis[2] = axis[3] = -1;
            	  hat = -1;
            	  break;
 
            	case 9:
+           	  // output item, only the keyboard LED report is of interest
+           	  if(led_page) {
+           	    conf->led.bits += report_count * report_size;
+           	    if(conf->report_id && !conf->led.report_id)
+           	      conf->led.report_id = conf->report_id;
+           	  }
            	  break;
 
            	case 11:
@@ -285,6 +330,8 @@ int parse_report_descriptor(uint8_t *rep, uint16_t rep_size,hid_report_t *conf)
            	// global item
            	switch(tag) {
            	case 0:
+           	  led_page = (value == USAGE_PAGE_LEDS);
+           	  key_page = (value == USAGE_PAGE_KEYBOARD);
 
            	  if(value == USAGE_PAGE_KEYBOARD) {
            	  } else if(value == USAGE_PAGE_GAMING) {
@@ -378,6 +425,25 @@ int parse_report_descriptor(uint8_t *rep, uint16_t rep_size,hid_report_t *conf)
            	    }
            	  }
 
+           	  else if(((value == USAGE_Z) || (value == USAGE_RX) ||
+           	           (value == USAGE_RY) || (value == USAGE_RZ)) && app_collection) {
+           	    // second stick of a pad, Z/Rz or Rx/Ry, whichever pair comes first
+           	    if(conf->type == REPORT_TYPE_JOYSTICK) {
+           	      if(!stick2_x && ((value == USAGE_Z) || (value == USAGE_RX))) {
+           		stick2_x = value;
+           		stick2_y = (value == USAGE_Z)? USAGE_RZ : USAGE_RY;
+           	      }
+           	      if(stick2_x && (value == stick2_x) &&
+           	         (axis[2] < 0) && !conf->joystick_mouse.axis[2].size) {
+           		axis[2] = usage_count;
+           	      }
+           	      if(stick2_y && (value == stick2_y) &&
+           	         (axis[3] < 0) && !conf->joystick_mouse.axis[3].size) {
+           		axis[3] = usage_count;
+           	      }
+           	    }
+           	  }
+
            	  else if((value == USAGE_HAT) && app_collection) {
            	    // usage(hat) is allowed within the app collection
            	    // we support hat on joysticks only
@@ -400,11 +466,14 @@ int parse_report_descriptor(uint8_t *rep, uint16_t rep_size,hid_report_t *conf)
            	  break;
 
            	case 1:
+           	  if(led_page) conf->led.usage_min = value;
+           	  if(key_page) key_usage_min = value;
 
            	  usage_count -= (value-1);
            	  break;
 
            	case 2:
+           	  if(led_page) conf->led.usage_max = value;
 
            	  usage_count += value;
            	  break;
@@ -6,6 +6,11 @@
 #define REPORT_TYPE_KEYBOARD 2
 #define REPORT_TYPE_JOYSTICK 3
 
+// keyboard input fields found, none means the boot layout is assumed
+#define KEYBOARD_HAS_MODS    0x01  // 8 bit modifier bitmap, usages 0xE0..0xE7
+#define KEYBOARD_HAS_ARRAY   0x02  // 8 bit usage array, boot style 6KRO
+#define KEYBOARD_HAS_BITMAP  0x04  // one bit per usage, NKRO
+
 // currently only joysticks are supported
 typedef struct {
   uint8_t type: 2;             // REPORT_TYPE_...
@@ -16,6 +21,14 @@ typedef struct {
   uint16_t vid;
   uint16_t pid;
 
+  // keyboard LED output report, collected in the same pass as the inputs
+  struct {
+    uint8_t report_id;         // 0 if the output report carries no id
+    uint8_t usage_min;
+    uint8_t usage_max;
+    uint8_t bits;              // total output bits on the LED usage page
+  } led;
+
   union {
     struct {
       struct {
@@ -25,7 +38,7 @@ typedef struct {
 					uint16_t min;
 					uint16_t max;
 				} logical;
-      } axis[2];               // x and y axis
+      } axis[4];               // x and y axis, then the second stick of a pad
 
       struct {
 				uint8_t byte_offset;
@@ -35,7 +48,11 @@ typedef struct {
       struct {
 				uint16_t offset;
 				uint8_t size;
-      } hat;                   // 1 hat (joystick only)
+				struct {
+					uint16_t min;
+					uint16_t max;
+				} logical;
+      } hat;                   // 1 hat (joystick only), size 0 if none
 
       struct {
                 uint16_t offset;
@@ -49,6 +66,16 @@ typedef struct {
 			uint8_t button_count;
 
     } joystick_mouse;
+
+    struct {
+      uint8_t fields;          // KEYBOARD_HAS_...
+      uint8_t array_count;
+      uint16_t mod_offset;     // bit offsets, behind the report id
+      uint16_t array_offset;
+      uint16_t bitmap_offset;
+      uint16_t bitmap_count;
+      uint8_t bitmap_min;      // usage of the first bitmap bit
+    } keyboard;
   };
 } hid_report_t;
 
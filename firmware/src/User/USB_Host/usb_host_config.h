@@ -40,6 +40,27 @@ extern "C" {
 #define DUG_PRINTF( format, arg... )    do{ if( 0 )printf( format, ##arg ); }while( 0 );
 #endif
 
+/* Enumeration profiler: phase timestamps printed as CSV over the debug UART,
+ * see firmware/tools/enum_profile.py */
+#define DEF_EPROF_EN                0
+
+/* Poll rate statistics: per endpoint poll and report counts printed as CSV
+ * once per DEF_SCHED_RATE_PERIOD frames, see firmware/tools/poll_rate.py */
+#define DEF_SCHED_RATE_EN           0
+#define DEF_SCHED_RATE_PERIOD       1000
+
+/* Main loop duty cycle: busy time and wake-up sources printed as CSV once
+ * per DEF_EVT_DUTY_PERIOD mS, see firmware/tools/duty_cycle.py */
+#define DEF_EVT_DUTY_EN             0
+#define DEF_EVT_DUTY_PERIOD         1000
+
+/* Interrupt timing: worst entry latency and execution time of every handler
+ * printed as CSV once per DEF_IRQ_STAT_PERIOD mS, see firmware/tools/irq_latency.py.
+ * Priorities are set in irq.h. */
+#define DEF_IRQ_STAT_EN             0
+#define DEF_IRQ_STAT_PERIOD         1000
+#define DEF_IRQ_LAT_TARGET_US       20          // Entry latency counted as late
+
 
 /******************************************************************************/
 /* USB Host Communication Related Macro Definition */
@@ -48,17 +69,41 @@ extern "C" {
 #define DEF_TOTAL_ROOT_HUB          1
 #define DEF_USBFS_PORT_EN           1
 #define DEF_USBFS_PORT_INDEX        0x00
-#define DEF_ONE_USB_SUP_DEV_TOTAL   5
-#define DEF_NEXT_HUB_PORT_NUM_MAX   4
+#define DEF_NEXT_HUB_PORT_NUM_MAX   7           // Ports served per HUB
 #define DEF_INTERFACE_NUM_MAX       4
 
+/* Device tree. The HUB on the USB host port and every HUB behind it hand out
+ * their ports from one node pool; HID, Xbox and HUB devices each take a
+ * HOST_CTL from a second pool, index 0 is the root device. The device pool
+ * is a count, checked against its share of the 20K RAM in app_km.c; the
+ * node pool is sized by RAM budget. A HUB behind a HUB only gets a HOST_CTL
+ * while DEF_KM_DEV_HID_RESERVE more stay free for the devices behind it. */
+#define DEF_KM_DEV_NUM              6           // HOST_CTL pool, root device and 5 devices behind HUBs
+#define DEF_KM_DEV_RAM_MAX          9216        // RAM share of the HOST_CTL pool, bytes
+#define DEF_KM_DEV_HID_RESERVE      2           // HOST_CTLs a nested HUB leaves free
+#define DEF_KM_PORT_RAM             256         // HUB port node pool, bytes
+#define DEF_KM_HUB_TIER_MAX         5           // HUBs chained from the USB host port, the USB limit
+#define DEF_ONE_USB_SUP_DEV_TOTAL   DEF_KM_DEV_NUM
+#define DEF_KM_PORT_NODE_NUM        ( DEF_KM_PORT_RAM / sizeof( HUB_DEVICE ) )
+
 /* USB Root Device Status */
 #define ROOT_DEV_DISCONNECT         0
 #define ROOT_DEV_CONNECTED          1
 #define ROOT_DEV_FAILED             2
 #define ROOT_DEV_SUCCESS            3
 
-/* USB Device Address */
+/* HUB Port State, a state that sends a port request stays until its result is in */
+#define HUB_PS_IDLE                 0
+#define HUB_PS_CHANGE               1           // Status change reported, read and acknowledge it
+#define HUB_PS_DEBOUNCE             2           // Connected, wait for the contacts to settle
+#define HUB_PS_RESET                3           // Port reset issued, wait for C_PORT_RESET
+#define HUB_PS_RECOVERY             4           // Reset recovery before the first request
+#define HUB_PS_ENUM                 5           // In the enumeration pipeline, or waiting for it
+#define HUB_PS_CHANGE_ACK           6           // Clear the change bits just read, one request each
+#define HUB_PS_RESET_ACK            7           // Clear C_PORT_RESET, then check the port
+#define HUB_PS_DISABLE              8           // Enumeration failed at address 0, disable the port
+
+/* USB Device Address, the root device. Devices behind a HUB take the next free ones */
 #define USB_DEVICE_ADDR             0x02
 
 /* USB Speed */
@@ -78,6 +123,7 @@ extern "C" {
 #define ERR_USB_CONNECT             0x15
 #define ERR_USB_DISCON              0x16
 #define ERR_USB_BUF_OVER            0x17
+#define ERR_USB_BUSY                0x18        // Asynchronous transfer still running
 #define ERR_USB_DISK_ERR            0x1F
 #define ERR_USB_TRANSFER            0x20
 #define ERR_USB_UNSUPPORT           0xFB
@@ -96,15 +142,67 @@ extern "C" {
 /* USB Communication Time */
 #define DEF_BUS_RESET_TIME          11          // USB bus reset time
 #define DEF_RE_ATTACH_TIMEOUT       100         // Wait for the USB device to reconnect after reset, 100mS timeout
+#define DEF_ATTACH_SETTLE_TIME      100         // Attach debounce before the first bus reset, mS
+#define DEF_SET_ADDR_RECOVERY_TIME  5           // SET_ADDRESS recovery interval, mS
 #define DEF_WAIT_USB_TRANSFER_CNT   1000        // Wait for the USB transfer to complete
 #define DEF_CTRL_TRANS_TIMEOVER_CNT 200000/20   // Control transmission delay timing
+#define DEF_HUB_DEBOUNCE_TIME       100         // HUB port connect debounce, mS
+#define DEF_HUB_RESET_TIME          10          // First C_PORT_RESET check after the reset, mS
+#define DEF_HUB_RESET_TIMEOUT       100         // Give up on a HUB port reset, mS
+#define DEF_HUB_RESET_RECOVERY_TIME 10          // Reset recovery of the HUB port device, mS
+
+/* Interrupt endpoint STALL recovery. Each STALL of an endpoint within
+ * DEF_KM_STALL_DECAY_TIME of the previous one moves it one step up:
+ * clear halt, then also SET_IDLE, then re-initialize the whole interface,
+ * then reset the device. Polling resumes after a backoff that doubles
+ * with every step. */
+#define DEF_KM_STALL_DECAY_TIME     1000        // Quiet time that restarts at clear halt, mS
+#define DEF_KM_STALL_TIER_IDLE      3           // STALL count that adds SET_IDLE
+#define DEF_KM_STALL_TIER_INTF      4           // STALL count that re-initializes the interface
+#define DEF_KM_STALL_TIER_RESET     6           // STALL count that resets the device
+#define DEF_KM_STALL_BACKOFF        2           // Poll pause after the first STALL, frames
+#define DEF_KM_STALL_BACKOFF_MAX    64          // Upper bound of the poll pause, frames
+
+/* Keyboard lighting reports go through the asynchronous control transfer
+ * slot, a failed one is sent again up to this many times */
+#define DEF_KM_LED_RETRY            3
+
+/* Interrupt Endpoint Poll Interval Override
+ * 0: Poll at the descriptor bInterval
+ * 1: Override the devices listed in KM_PollOverrideTab (app_km.c)
+ * 2: Override every HID/Xbox device
+ * An override only ever shortens the interval, and falls back towards
+ * bInterval on its own when the device NAKs most polls. */
+#define DEF_POLL_OVERRIDE_MODE      1
+#define DEF_POLL_FS_INTERVAL        1           // Full-speed devices, mS
+#define DEF_POLL_LS_INTERVAL        10          // Low-speed devices, the shortest interval USB allows them
+
+/* SET_IDLE duration per interface class, in 4mS units. 0 = report only on
+ * change, DEF_HID_IDLE_NONE = no request. A non-zero duration makes the
+ * device repeat its last report, for relative mice that repeats motion. */
+#define DEF_HID_IDLE_NONE           0xFF
+#define DEF_HID_IDLE_KEYBOARD       0
+#define DEF_HID_IDLE_MOUSE          0
+#define DEF_HID_IDLE_JOYSTICK       0
+#define DEF_HID_IDLE_OTHER          DEF_HID_IDLE_NONE
+
+/* Reports of state (keyboard, joystick) equal to the previous one are dropped
+ * before they reach the FIFO, longer reports are always passed on */
+#define DEF_KM_LAST_RPT_LEN         32
+
+/* Mouse, keyboard and game controller interfaces of the enumerated devices,
+ * listed for the main loop. A report sets the ready bit of its slot, so the
+ * dispatch only visits interfaces with new data. At most 32, one bit per
+ * slot, and no fewer than DEF_KM_DEV_NUM * DEF_INTERFACE_NUM_MAX. Keyboards
+ * set no ready bit, their reports become key events. */
+#define DEF_KM_LIVE_MAX             24
 
 
 /*******************************************************************************/
 /* Struct Definition */
 /* Note: Please modify it according to your project. */
 
-/* HUB Port Device  */
+/* HUB Port Device, one node of the device tree */
 typedef struct _HUB_DEVICE
 {
     uint8_t  bStatus;
@@ -112,7 +210,14 @@ typedef struct _HUB_DEVICE
     uint8_t  bAddress;
     uint8_t  bSpeed;
     uint8_t  bEp0MaxPks;
-    uint8_t  DeviceIndex;
+    uint8_t  DeviceIndex;                       // HostCtl index, 0 = none
+    uint8_t  bPortState;
+    uint16_t wPortTime;                         // Frame the current port state was entered
+    uint8_t  bParent;                           // Node of the HUB this port belongs to, 0xFF for the root HUB
+    uint8_t  bPort;                             // Port number on that HUB, 0 = node free
+    uint8_t  bTier;                             // HUBs between the USB host port and this port
+    uint8_t  bPortNum;                          // Ports of an attached HUB
+    volatile uint8_t bHubDat;                   // Status change bitmap of an attached HUB, 0 = none pending
 }HUB_DEVICE, *PHUB_DEVICE;
 
 /* Root HUB Device Structure */
@@ -125,7 +230,8 @@ typedef struct _ROOT_HUB_DEVICE
     uint8_t  bEp0MaxPks;
     uint8_t  DeviceIndex;
     uint8_t  bPortNum;
-    HUB_DEVICE Device[ DEF_NEXT_HUB_PORT_NUM_MAX ];
+    volatile uint8_t bHubDat;                   // Status change bitmap of a root HUB, 0 = none pending
+    HUB_DEVICE Device[ DEF_KM_PORT_NODE_NUM ];  // Port node pool of all HUBs
 } ROOT_HUB_DEVICE, *PROOT_HUB_DEVICE;
 
 typedef struct interface
@@ -141,7 +247,9 @@ typedef struct interface
     uint16_t InEndpSize[ 4 ];
     uint8_t  InEndpTog[ 4 ];
     uint8_t  InEndpInterval[ 4 ];
-    uint8_t  InEndpTimeCount[ 4 ];
+    volatile uint8_t InEndpStall[ 4 ];          // STALL seen by the poll, recovery pending
+    uint8_t  InEndpStallCnt[ 4 ];               // Recovery step reached
+    uint16_t InEndpStallTime[ 4 ];              // Last STALL, mS
 
     uint8_t  OutEndpNum;
     uint8_t  OutEndpAddr[ 4 ];
@@ -158,6 +266,10 @@ typedef struct interface
     uint8_t  SetReport_Swi;
     uint8_t  SetReport_Value;
     uint8_t  SetReport_Flag;
+    uint8_t  LastRptLen;                        // Previous report of a state interface, 0 = none
+    uint8_t  LastRpt[ DEF_KM_LAST_RPT_LEN ];
+    uint8_t  LiveSlot;                          // Slot in the live interface list + 1, 0 = not listed
+    uint8_t  KeySlot;                           // Key engine slot + 1, 0 = none
     hid_report_t HIDRptDesc;
     FIFO_Utils_TypeDef buffer;
     uint8_t	HidRptLen;
@@ -167,7 +279,7 @@ typedef struct interface
 typedef struct __HOST_CTL
 {
     uint8_t  InterfaceNum;
-    uint8_t  ErrorCount;
+    uint8_t  ErrorCount;                        // STALL recoveries
     Interface Interface[DEF_INTERFACE_NUM_MAX ];
 } HOST_CTL, *PHOST_CTL;
 
@@ -0,0 +1,464 @@
+
+/********************************************************************************/
+/* Header File */
+#include "usb_host_config.h"
+#include "usb_host_sched.h"
+
+/*******************************************************************************/
+/* Variable Definition */
+static SCHED_ENDP       SCHED_Endp[ DEF_SCHED_ENDP_MAX ];
+static uint8_t          SCHED_EndpNum;
+static volatile uint8_t SCHED_Locked;
+static uint16_t         SCHED_Frame;
+static uint16_t         SCHED_BudgetUs;                                         // Bus time left in the current frame
+static SCHED_DONE_CB    SCHED_DoneCb;
+
+static void SCHED_Kick( void );
+
+/*********************************************************************
+ * @fn      SCHED_Account
+ *
+ * @brief   NAK statistics of an endpoint polled faster than its
+ *          descriptor asks for. Falls back one step towards the
+ *          descriptor interval when the device cannot keep up.
+ *
+ * @para    pep: Endpoint.
+ *          s: Poll result.
+ *
+ * @return  none
+ */
+static void SCHED_Account( SCHED_ENDP *pep, uint8_t s )
+{
+    uint8_t fallback = 0;
+
+#if DEF_SCHED_RATE_EN
+    pep->RatePolls++;
+    if( s == ERR_SUCCESS )
+    {
+        pep->RateData++;
+    }
+    else if( s == ( USB_PID_NAK | ERR_USB_TRANSFER ) )
+    {
+        pep->RateNak++;
+    }
+    else
+    {
+        pep->RateErr++;
+    }
+#endif
+
+    if( pep->Interval >= pep->NativeInterval )
+    {
+        return;
+    }
+
+    if( s == ERR_SUCCESS )
+    {
+        pep->WinData++;
+    }
+    else if( s == ( USB_PID_NAK | ERR_USB_TRANSFER ) )
+    {
+        pep->WinNak++;
+    }
+    else
+    {
+        pep->WinErr++;
+        fallback = ( pep->WinErr >= DEF_SCHED_STAT_ERR_MAX );
+    }
+
+    if( ++pep->WinPolls >= DEF_SCHED_STAT_WINDOW )
+    {
+        if( ( pep->WinData >= DEF_SCHED_STAT_DATA_MIN ) &&
+            ( (uint16_t)pep->WinNak * 100 >= (uint16_t)pep->WinPolls * DEF_SCHED_STAT_NAK_PCT ) )
+        {
+            fallback = 1;
+        }
+        pep->WinPolls = 0;
+        pep->WinData = 0;
+        pep->WinNak = 0;
+        pep->WinErr = 0;
+    }
+
+    if( fallback )
+    {
+        pep->Interval = ( pep->Interval * 2 < pep->NativeInterval ) ? ( pep->Interval * 2 ) : pep->NativeInterval;
+        pep->WinPolls = 0;
+        pep->WinData = 0;
+        pep->WinNak = 0;
+        pep->WinErr = 0;
+    }
+}
+
+/*********************************************************************
+ * @fn      SCHED_Done
+ *
+ * @brief   Engine completion of a scheduled poll. Hands the result to
+ *          the application and fills the rest of the frame.
+ *
+ * @return  none
+ */
+static void SCHED_Done( uint8_t s, uint8_t *pbuf, uint16_t len, void *pctx )
+{
+    SCHED_Account( (SCHED_ENDP *)pctx, s );
+    SCHED_DoneCb( (SCHED_ENDP *)pctx, s, pbuf, len );
+    SCHED_Kick( );
+}
+
+/*********************************************************************
+ * @fn      SCHED_Kick
+ *
+ * @brief   Start the next due endpoint of this frame, highest priority
+ *          first, as long as its estimated bus time still fits. With
+ *          no poll to start the bus goes to the pending control stage,
+ *          charged against the same budget.
+ *
+ * @return  none
+ */
+static void SCHED_Kick( void )
+{
+    SCHED_ENDP *pep;
+    uint8_t    prio, n;
+
+    if( SCHED_Locked || USBFSH_AsyncBusy( ) )
+    {
+        return;
+    }
+
+    for( prio = SCHED_PRIO_HIGH; prio <= SCHED_PRIO_LOW; prio++ )
+    {
+        for( n = 0; n < SCHED_EndpNum; n++ )
+        {
+            pep = &SCHED_Endp[ n ];
+            if( ( pep->Due == 0 ) || ( pep->Prio != prio ) )
+            {
+                continue;
+            }
+            if( pep->CostUs > SCHED_BudgetUs )
+            {
+                return; // Frame full, stays due for the next one
+            }
+            if( USBFSH_SubmitDevTransact( pep->Addr, pep->Speed, pep->PortSpeed,
+                                          ( USB_PID_IN << 4 ) | pep->EndpAddr, pep->pEndpTog, SCHED_Done, pep ) != ERR_SUCCESS )
+            {
+                return; // Bus held by a foreground transfer
+            }
+            pep->Due = 0;
+            SCHED_BudgetUs -= pep->CostUs;
+            return;
+        }
+    }
+
+    /* Control transfers use what the periodic budget leaves of the frame */
+    if( ( SCHED_BudgetUs >= DEF_SCHED_CTRL_STAGE_US ) && USBFSH_CtrlKick( ) )
+    {
+        SCHED_BudgetUs -= DEF_SCHED_CTRL_STAGE_US;
+    }
+}
+
+/*********************************************************************
+ * @fn      SCHED_SOF
+ *
+ * @brief   Host SOF interrupt: build the poll list of the new frame and
+ *          start it. An endpoint is due once per interval; when the
+ *          schedule falls behind it is re-phased instead of polled
+ *          twice back to back.
+ *
+ * @return  none
+ */
+static void SCHED_SOF( void )
+{
+    SCHED_ENDP *pep;
+    uint8_t    n;
+
+    SCHED_Frame++;
+    SCHED_BudgetUs = DEF_SCHED_FRAME_US;
+    if( SCHED_Locked )
+    {
+        return;
+    }
+
+    for( n = 0; n < SCHED_EndpNum; n++ )
+    {
+        pep = &SCHED_Endp[ n ];
+        if( pep->Hold )
+        {
+            continue;
+        }
+        if( (int16_t)( SCHED_Frame - pep->NextFrame ) >= 0 )
+        {
+#if DEF_SCHED_RATE_EN
+            if( pep->Due )
+            {
+                pep->RateMiss++; // Previous poll never got the bus
+            }
+#endif
+            pep->Due = 1;
+            pep->NextFrame += pep->Interval;
+            if( (int16_t)( SCHED_Frame - pep->NextFrame ) >= 0 )
+            {
+#if DEF_SCHED_RATE_EN
+                pep->RateMiss += (uint16_t)( SCHED_Frame - pep->NextFrame ) / pep->Interval + 1;
+#endif
+                pep->NextFrame = SCHED_Frame + pep->Interval;
+            }
+        }
+    }
+
+    SCHED_Kick( );
+}
+
+/*********************************************************************
+ * @fn      SCHED_Init
+ *
+ * @brief   Empty the schedule and hook it to the host SOF interrupt.
+ *          The scheduler also hands the bus to asynchronous control
+ *          transfers between polls.
+ *
+ * @para    cb: Poll completion callback.
+ *
+ * @return  none
+ */
+void SCHED_Init( SCHED_DONE_CB cb )
+{
+    SCHED_DoneCb = cb;
+    SCHED_EndpNum = 0;
+    SCHED_Locked = 0;
+    USBFSH_SetSofCallback( SCHED_SOF );
+    USBFSH_SetIdleCallback( SCHED_Kick );
+}
+
+/*********************************************************************
+ * @fn      SCHED_Lock
+ *
+ * @brief   Stop starting polls and wait for the one in flight, so the
+ *          caller may change the schedule or the device tables.
+ *
+ * @return  none
+ */
+void SCHED_Lock( void )
+{
+    SCHED_Locked = 1;
+    while( USBFSH_AsyncBusy( ) );
+}
+
+/*********************************************************************
+ * @fn      SCHED_Unlock
+ *
+ * @brief   Resume polling from the next SOF.
+ *
+ * @return  none
+ */
+void SCHED_Unlock( void )
+{
+    SCHED_Locked = 0;
+}
+
+/*********************************************************************
+ * @fn      SCHED_Clear
+ *
+ * @brief   Remove all endpoints.
+ *
+ * @return  none
+ */
+void SCHED_Clear( void )
+{
+    SCHED_Lock( );
+    SCHED_EndpNum = 0;
+    SCHED_Unlock( );
+}
+
+/*********************************************************************
+ * @fn      SCHED_RemoveDevice
+ *
+ * @brief   Remove all endpoints of one device.
+ *
+ * @para    index: HostCtl index of the device.
+ *
+ * @return  none
+ */
+void SCHED_RemoveDevice( uint8_t index )
+{
+    uint8_t n, m;
+
+    SCHED_Lock( );
+    for( n = 0, m = 0; n < SCHED_EndpNum; n++ )
+    {
+        if( SCHED_Endp[ n ].Index != index )
+        {
+            SCHED_Endp[ m++ ] = SCHED_Endp[ n ];
+        }
+    }
+    SCHED_EndpNum = m;
+    SCHED_Unlock( );
+}
+
+/*********************************************************************
+ * @fn      SCHED_AddEndp
+ *
+ * @brief   Add an interrupt IN endpoint. The first poll is due in the
+ *          next frame.
+ *
+ * @para    pep: Endpoint, Interval of 0 is taken as 1. An Interval
+ *               below NativeInterval is an override and is watched
+ *               by SCHED_Account.
+ *          max_pkt: wMaxPacketSize, used for the bus time estimate.
+ *
+ * @return  ERR_SUCCESS, ERR_USB_BUF_OVER if the table is full.
+ */
+uint8_t SCHED_AddEndp( const SCHED_ENDP *pep, uint16_t max_pkt )
+{
+    SCHED_ENDP *pnew;
+    uint32_t   bits;
+
+    if( SCHED_EndpNum >= DEF_SCHED_ENDP_MAX )
+    {
+        return ERR_USB_BUF_OVER;
+    }
+
+    SCHED_Lock( );
+    pnew = &SCHED_Endp[ SCHED_EndpNum ];
+    *pnew = *pep;
+    if( pnew->Interval == 0 )
+    {
+        pnew->Interval = 1;
+    }
+    if( pnew->NativeInterval < pnew->Interval )
+    {
+        pnew->NativeInterval = pnew->Interval;
+    }
+    pnew->WinPolls = 0;
+    pnew->WinData = 0;
+    pnew->WinNak = 0;
+    pnew->WinErr = 0;
+#if DEF_SCHED_RATE_EN
+    pnew->RatePolls = 0;
+    pnew->RateData = 0;
+    pnew->RateNak = 0;
+    pnew->RateErr = 0;
+    pnew->RateMiss = 0;
+#endif
+    pnew->Due = 0;
+    pnew->Hold = 0;
+    pnew->NextFrame = SCHED_Frame + 1;
+
+    /* Token, data packet with worst case bit stuffing and handshake */
+    bits = 32 + ( ( max_pkt + 3 ) * 8 * 7 / 6 ) + 16 + 32;
+    if( pnew->Speed == USB_LOW_SPEED )
+    {
+        pnew->CostUs = (uint16_t)( bits * 2 / 3 ) + DEF_SCHED_TRANS_OVERHEAD_US;
+        if( pnew->PortSpeed != USB_LOW_SPEED )
+        {
+            /* Full-speed PRE preamble and HUB setup ahead of the token and the handshake */
+            pnew->CostUs += 2 * ( 16 + 4 ) / 12 + 1;
+        }
+    }
+    else
+    {
+        pnew->CostUs = (uint16_t)( bits / 12 ) + DEF_SCHED_TRANS_OVERHEAD_US;
+    }
+
+    SCHED_EndpNum++;
+    SCHED_Unlock( );
+
+    return ERR_SUCCESS;
+}
+
+/*********************************************************************
+ * @fn      SCHED_ResumeEndp
+ *
+ * @brief   Poll a held endpoint again.
+ *
+ * @para    index: HostCtl index of the device.
+ *          intf_num: Interface.
+ *          in_num: IN endpoint number within the interface.
+ *          delay: Frames until the first poll, 0 for the next frame.
+ *
+ * @return  none
+ */
+void SCHED_ResumeEndp( uint8_t index, uint8_t intf_num, uint8_t in_num, uint16_t delay )
+{
+    SCHED_ENDP *pep;
+    uint8_t    n;
+
+    SCHED_Lock( );
+    for( n = 0; n < SCHED_EndpNum; n++ )
+    {
+        pep = &SCHED_Endp[ n ];
+        if( ( pep->Index == index ) && ( pep->IntfNum == intf_num ) && ( pep->InNum == in_num ) )
+        {
+            pep->Due = 0;
+            pep->NextFrame = SCHED_Frame + 1 + delay;
+            pep->Hold = 0;
+        }
+    }
+    SCHED_Unlock( );
+}
+
+/*********************************************************************
+ * @fn      SCHED_GetFrame
+ *
+ * @brief   Current frame number, counted from the host SOF interrupt.
+ *
+ * @return  Frame number.
+ */
+uint16_t SCHED_GetFrame( void )
+{
+    return SCHED_Frame;
+}
+
+#if DEF_SCHED_RATE_EN
+/*********************************************************************
+ * @fn      SCHED_RateDump
+ *
+ * @brief   Once per DEF_SCHED_RATE_PERIOD frames, print the poll
+ *          statistics of every endpoint over the debug UART and start
+ *          a new period, one CSV line per endpoint:
+ *            PR,<frame>,<port>,<addr>,<speed>,<endp>,<interval>,<polls>,<data>,<nak>,<err>,<miss>
+ *          Call it from the main loop, printing blocks on the UART.
+ *
+ * @return  none
+ */
+void SCHED_RateDump( void )
+{
+    static uint16_t last_frame;
+    static uint8_t  head_printed;
+    SCHED_ENDP snap[ DEF_SCHED_ENDP_MAX ];
+    SCHED_ENDP *pep;
+    uint16_t   frame;
+    uint8_t    n, num;
+
+    frame = SCHED_Frame;
+    if( (uint16_t)( frame - last_frame ) < DEF_SCHED_RATE_PERIOD )
+    {
+        return;
+    }
+    last_frame = frame;
+
+    /* Counters change in the SOF and completion interrupts */
+    NVIC_DisableIRQ( USBHD_IRQn );
+    num = SCHED_EndpNum;
+    for( n = 0; n < num; n++ )
+    {
+        pep = &SCHED_Endp[ n ];
+        snap[ n ] = *pep;
+        pep->RatePolls = 0;
+        pep->RateData = 0;
+        pep->RateNak = 0;
+        pep->RateErr = 0;
+        pep->RateMiss = 0;
+    }
+    NVIC_EnableIRQ( USBHD_IRQn );
+
+    if( head_printed == 0 )
+    {
+        head_printed = 1;
+        printf( "PR,frame,port,addr,speed,endp,interval,polls,data,nak,err,miss\r\n" );
+    }
+    for( n = 0; n < num; n++ )
+    {
+        pep = &snap[ n ];
+        printf( "PR,%u,%u,%u,%u,%02x,%u,%u,%u,%u,%u,%u\r\n", frame, pep->HubPort, pep->Addr, pep->Speed,
+                pep->EndpAddr, pep->Interval, pep->RatePolls, pep->RateData, pep->RateNak, pep->RateErr, pep->RateMiss );
+    }
+}
+#endif
@@ -0,0 +1,87 @@
+
+#ifndef __USB_HOST_SCHED_H
+#define __USB_HOST_SCHED_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*******************************************************************************/
+/* Header File */
+#include "stdint.h"
+
+/* Note: include after usb_host_config.h, DEF_SCHED_RATE_EN is set there */
+
+/*******************************************************************************/
+/* Macro Definition */
+#define DEF_SCHED_ENDP_MAX              16                                      // Interrupt IN endpoints scheduled at once
+#define DEF_SCHED_FRAME_US              900                                     // Bus time handed out per 1mS frame, the rest is EOF guard
+#define DEF_SCHED_TRANS_OVERHEAD_US     12                                      // Interrupt turnaround per transaction
+#define DEF_SCHED_CTRL_STAGE_US         140                                     // Control stage, worst case 8 bytes low speed behind a HUB
+
+/* Poll interval override fallback. An endpoint polled faster than its
+ * descriptor interval is watched in windows of DEF_SCHED_STAT_WINDOW polls;
+ * if it is active but mostly NAKs, or keeps failing, its interval is doubled
+ * until it is back at the descriptor value. */
+#define DEF_SCHED_STAT_WINDOW           64
+#define DEF_SCHED_STAT_DATA_MIN         8                                       // Reports per window to count as active
+#define DEF_SCHED_STAT_NAK_PCT          75                                      // NAK share that triggers the fallback
+#define DEF_SCHED_STAT_ERR_MAX          4                                       // Failed polls per window that trigger it
+
+/* Endpoint priority, every HIGH endpoint due in a frame goes before any LOW one */
+#define SCHED_PRIO_HIGH                 0                                       // Mouse, joystick, gamepad
+#define SCHED_PRIO_LOW                  1                                       // Keyboard, hub status change
+
+/*******************************************************************************/
+/* Struct Definition */
+typedef struct _SCHED_ENDP
+{
+    uint8_t  Index;                                                             // HostCtl index
+    uint8_t  IntfNum;
+    uint8_t  InNum;                                                             // IN endpoint number within the interface
+    uint8_t  HubPort;                                                           // Port node, 0xFF for the root device
+    uint8_t  Addr;
+    uint8_t  Speed;
+    uint8_t  PortSpeed;                                                         // Speed of the root port the device hangs off
+    uint8_t  EndpAddr;
+    uint8_t  *pEndpTog;
+    uint8_t  Prio;
+    uint8_t  Interval;                                                          // Poll period in frames
+    uint8_t  NativeInterval;                                                    // Descriptor bInterval, 0 = Interval
+    uint8_t  Due;
+    volatile uint8_t Hold;                                                      // Not polled, set by the completion callback, cleared by SCHED_ResumeEndp
+    uint16_t NextFrame;
+    uint16_t CostUs;                                                            // Estimated bus time of one poll
+    uint8_t  WinPolls;                                                          // Override statistics of the current window
+    uint8_t  WinData;
+    uint8_t  WinNak;
+    uint8_t  WinErr;
+#if DEF_SCHED_RATE_EN
+    uint16_t RatePolls;                                                         // Poll rate statistics of the current period
+    uint16_t RateData;
+    uint16_t RateNak;
+    uint16_t RateErr;
+    uint16_t RateMiss;                                                          // Polls due but not made
+#endif
+} SCHED_ENDP;
+
+/* Poll completion, called in interrupt context */
+typedef void ( *SCHED_DONE_CB )( SCHED_ENDP *pep, uint8_t s, uint8_t *pbuf, uint16_t len );
+
+/*******************************************************************************/
+/* Function Declaration */
+extern void SCHED_Init( SCHED_DONE_CB cb );
+extern void SCHED_Lock( void );
+extern void SCHED_Unlock( void );
+extern void SCHED_Clear( void );
+extern void SCHED_RemoveDevice( uint8_t index );
+extern uint8_t SCHED_AddEndp( const SCHED_ENDP *pep, uint16_t max_pkt );
+extern void SCHED_ResumeEndp( uint8_t index, uint8_t intf_num, uint8_t in_num, uint16_t delay );
+extern uint16_t SCHED_GetFrame( void );
+extern void SCHED_RateDump( void );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,337 @@
+
+/********************************************************************************/
+/* Header File */
+#include "usb_key.h"
+#include <string.h>
+
+_Static_assert( ( DEF_KEY_QUEUE_SIZE & ( DEF_KEY_QUEUE_SIZE - 1 ) ) == 0, "DEF_KEY_QUEUE_SIZE must be a power of 2" );
+
+/*******************************************************************************/
+/* Variable Definition */
+typedef struct
+{
+    uint8_t Used;
+    KEY_SET Held;                                                               // Keys whose down event was queued
+} KEY_KBD;
+
+static KEY_KBD KEY_Kbd[ DEF_KEY_KBD_MAX ];
+
+/* Event queue, single producer (the poll completion, or the main loop with
+ * the USB interrupt disabled) and single consumer (the main loop). The
+ * indexes run free and are masked on access. */
+static uint16_t KEY_Queue[ DEF_KEY_QUEUE_SIZE ];
+static uint16_t KEY_Head;                                                       // Written by the producer only
+static uint16_t KEY_Tail;                                                       // Written by the consumer only
+
+/*********************************************************************
+ * @fn      KEY_Put
+ *
+ * @brief   Queue one key event.
+ *
+ * @para    evt: Usage, with KEY_EVT_UP on release.
+ *
+ * @return  0 if the queue is full.
+ */
+static uint8_t KEY_Put( uint16_t evt )
+{
+    uint16_t head = KEY_Head;
+
+    if( (uint16_t)( head - __atomic_load_n( &KEY_Tail, __ATOMIC_ACQUIRE ) ) >= DEF_KEY_QUEUE_SIZE )
+    {
+        return 0;
+    }
+    KEY_Queue[ head & ( DEF_KEY_QUEUE_SIZE - 1 ) ] = evt;
+    __atomic_store_n( &KEY_Head, (uint16_t)( head + 1 ), __ATOMIC_RELEASE );
+    return 1;
+}
+
+/*********************************************************************
+ * @fn      KEY_Take
+ *
+ * @brief   Take the oldest key event, main loop only.
+ *
+ * @para    pevt: Receives the event.
+ *
+ * @return  0 if the queue is empty.
+ */
+uint8_t KEY_Take( uint16_t *pevt )
+{
+    uint16_t tail = KEY_Tail;
+
+    if( tail == __atomic_load_n( &KEY_Head, __ATOMIC_ACQUIRE ) )
+    {
+        return 0;
+    }
+    *pevt = KEY_Queue[ tail & ( DEF_KEY_QUEUE_SIZE - 1 ) ];
+    __atomic_store_n( &KEY_Tail, (uint16_t)( tail + 1 ), __ATOMIC_RELEASE );
+    return 1;
+}
+
+/*********************************************************************
+ * @fn      KEY_Attach
+ *
+ * @brief   Take a slot for a keyboard interface, nothing held.
+ *
+ * @return  Slot + 1, 0 if all slots are in use.
+ */
+uint8_t KEY_Attach( void )
+{
+    uint8_t n;
+
+    for( n = 0; n < DEF_KEY_KBD_MAX; n++ )
+    {
+        if( KEY_Kbd[ n ].Used == 0 )
+        {
+            memset( &KEY_Kbd[ n ].Held, 0, sizeof( KEY_SET ) );
+            KEY_Kbd[ n ].Used = 1;
+            return n + 1;
+        }
+    }
+    return 0;
+}
+
+/*********************************************************************
+ * @fn      KEY_Detach
+ *
+ * @brief   Free the slot of a keyboard that went away. Its held keys are
+ *          released, so nothing stays stuck down downstream. Call with
+ *          the producer side of the queue locked out.
+ *
+ * @para    slot: Slot + 1 from KEY_Attach, 0 is ignored.
+ *
+ * @return  none
+ */
+void KEY_Detach( uint8_t slot )
+{
+    KEY_SET none;
+
+    if( ( slot == 0 ) || ( slot > DEF_KEY_KBD_MAX ) )
+    {
+        return;
+    }
+    memset( &none, 0, sizeof( none ) );
+    KEY_Diff( &KEY_Kbd[ slot - 1 ].Held, &none );
+    KEY_Kbd[ slot - 1 ].Used = 0;
+}
+
+/*********************************************************************
+ * @fn      KEY_Decode
+ *
+ * @brief   Collect the keys pressed in one input report. Without parsed
+ *          keyboard fields the boot layout is assumed: modifier byte,
+ *          reserved byte, 6 usages.
+ *
+ * @para    layout: Parsed report layout.
+ *          pbuf: Report, behind the report id.
+ *          len: Report length.
+ *          pset: Receives the pressed set.
+ *
+ * @return  0 if the report tells no key state: too short, or a rollover
+ *          error in the usage array.
+ */
+uint8_t KEY_Decode( const hid_report_t *layout, const uint8_t *pbuf, uint16_t len, KEY_SET *pset )
+{
+    uint16_t bits = len * 8;
+    uint16_t off, cnt, n;
+    uint8_t  fields, usage, min;
+
+    memset( pset, 0, sizeof( KEY_SET ) );
+
+    fields = ( layout->type == REPORT_TYPE_KEYBOARD ) ? layout->keyboard.fields : 0;
+    if( fields == 0 )
+    {
+        if( len < 8 )
+        {
+            return 0;
+        }
+        pset->Word[ KEY_USAGE_MOD_FIRST / 32 ] = pbuf[ 0 ];
+        off = 16;
+        cnt = 6;
+        fields = KEYBOARD_HAS_ARRAY;
+    }
+    else
+    {
+        off = layout->keyboard.array_offset;
+        cnt = layout->keyboard.array_count;
+    }
+
+    if( fields & KEYBOARD_HAS_MODS )
+    {
+        n = layout->keyboard.mod_offset;
+        if( n + 8 > bits )
+        {
+            return 0;
+        }
+        pset->Word[ KEY_USAGE_MOD_FIRST / 32 ] = ( pbuf[ n / 8 ] >> ( n % 8 ) ) |
+                                                 ( ( n % 8 ) ? (uint8_t)( pbuf[ n / 8 + 1 ] << ( 8 - n % 8 ) ) : 0 );
+    }
+
+    /* Usage array, boot style: 0 = empty entry */
+    if( fields & KEYBOARD_HAS_ARRAY )
+    {
+        if( off + cnt * 8 > bits )
+        {
+            cnt = ( off < bits ) ? ( bits - off ) / 8 : 0;
+        }
+        for( n = 0; n < cnt; n++, off += 8 )
+        {
+            usage = ( off % 8 ) ? (uint8_t)( ( pbuf[ off / 8 ] >> ( off % 8 ) ) | ( pbuf[ off / 8 + 1 ] << ( 8 - off % 8 ) ) )
+                                : pbuf[ off / 8 ];
+            if( ( usage >= KEY_USAGE_ERR_FIRST ) && ( usage <= KEY_USAGE_ERR_LAST ) )
+            {
+                return 0;
+            }
+            if( usage )
+            {
+                pset->Word[ usage / 32 ] |= 1UL << ( usage % 32 );
+            }
+        }
+    }
+
+    /* NKRO bitmap, copied a byte at a time when it is byte aligned */
+    if( fields & KEYBOARD_HAS_BITMAP )
+    {
+        off = layout->keyboard.bitmap_offset;
+        cnt = layout->keyboard.bitmap_count;
+        min = layout->keyboard.bitmap_min;
+        if( off + cnt > bits )
+        {
+            cnt = ( off < bits ) ? ( bits - off ) : 0;
+        }
+        if( (uint16_t)min + cnt > 256 )
+        {
+            cnt = 256 - min;
+        }
+        if( ( ( off | min ) % 8 ) == 0 )
+        {
+            for( n = 0; n + 8 <= cnt; n += 8 )
+            {
+                pset->Byte[ ( min + n ) / 8 ] |= pbuf[ ( off + n ) / 8 ];
+            }
+        }
+        else
+        {
+            n = 0;
+        }
+        for( ; n < cnt; n++ )
+        {
+            if( pbuf[ ( off + n ) / 8 ] & ( 1 << ( ( off + n ) % 8 ) ) )
+            {
+                usage = min + n;
+                pset->Word[ usage / 32 ] |= 1UL << ( usage % 32 );
+            }
+        }
+    }
+
+    /* Usage 0 is no key, the error usages never count as held */
+    pset->Word[ 0 ] &= ~0x0FUL;
+    return 1;
+}
+
+/*********************************************************************
+ * @fn      KEY_Diff
+ *
+ * @brief   Queue the difference between the held set and a new one, one
+ *          XOR per 32 usages. Releases go first, then presses with the
+ *          modifiers ahead of the keys they modify. Only keys whose event
+ *          fit in the queue change in the held set, the rest go with the
+ *          next report.
+ *
+ * @para    pheld: Held set, updated.
+ *          pnow: Keys pressed now.
+ *
+ * @return  KEY_LOCK_xxx of the lock keys just pressed, with KEY_PARTIAL
+ *          if not every change was queued.
+ */
+uint8_t KEY_Diff( KEY_SET *pheld, const KEY_SET *pnow )
+{
+    uint32_t chg;
+    uint8_t  w, n, b, usage;
+    uint8_t  locks = 0;
+
+    for( w = 0; w < KEY_SET_WORDS; w++ )
+    {
+        chg = pheld->Word[ w ] & ~pnow->Word[ w ];
+        while( chg )
+        {
+            b = __builtin_ctz( chg );
+            chg &= chg - 1;
+            if( KEY_Put( KEY_EVT_UP | ( w * 32 + b ) ) == 0 )
+            {
+                return locks | KEY_PARTIAL;
+            }
+            pheld->Word[ w ] &= ~( 1UL << b );
+        }
+    }
+
+    /* Word 7 holds the modifiers */
+    for( n = 0; n < KEY_SET_WORDS; n++ )
+    {
+        w = ( n + KEY_SET_WORDS - 1 ) % KEY_SET_WORDS;
+        chg = pnow->Word[ w ] & ~pheld->Word[ w ];
+        while( chg )
+        {
+            b = __builtin_ctz( chg );
+            chg &= chg - 1;
+            usage = w * 32 + b;
+            if( KEY_Put( usage ) == 0 )
+            {
+                return locks | KEY_PARTIAL;
+            }
+            pheld->Word[ w ] |= 1UL << b;
+
+            if( usage == KEY_USAGE_NUM_LOCK )
+            {
+                locks |= KEY_LOCK_NUM;
+            }
+            else if( usage == KEY_USAGE_CAPS_LOCK )
+            {
+                locks |= KEY_LOCK_CAPS;
+            }
+            else if( usage == KEY_USAGE_SCROLL_LOCK )
+            {
+                locks |= KEY_LOCK_SCROLL;
+            }
+        }
+    }
+    return locks;
+}
+
+/*********************************************************************
+ * @fn      KEY_Report
+ *
+ * @brief   Turn an input report of a keyboard interface into key events.
+ *          Reports of another report id on the interface (consumer keys,
+ *          system control) are ignored.
+ *
+ * @para    slot: Slot + 1 from KEY_Attach.
+ *          layout: Parsed report layout of the interface.
+ *          pbuf: Report.
+ *          len: Report length.
+ *
+ * @return  KEY_LOCK_xxx of the lock keys just pressed, with KEY_PARTIAL
+ *          if not every change was queued.
+ */
+uint8_t KEY_Report( uint8_t slot, const hid_report_t *layout, const uint8_t *pbuf, uint16_t len )
+{
+    KEY_SET now;
+
+    if( ( slot == 0 ) || ( slot > DEF_KEY_KBD_MAX ) )
+    {
+        return 0;
+    }
+    if( layout->report_id )
+    {
+        if( ( len == 0 ) || ( pbuf[ 0 ] != layout->report_id ) )
+        {
+            return 0;
+        }
+        pbuf++;
+        len--;
+    }
+    if( KEY_Decode( layout, pbuf, len, &now ) == 0 )
+    {
+        return 0;
+    }
+    return KEY_Diff( &KEY_Kbd[ slot - 1 ].Held, &now );
+}
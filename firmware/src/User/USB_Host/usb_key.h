@@ -0,0 +1,64 @@
+
+#ifndef __USB_KEY_H
+#define __USB_KEY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*******************************************************************************/
+/* Header File */
+#include "stdint.h"
+#include "usb_hid_reportparser.h"
+
+/* Note: no hardware dependency, tools/key_bench.c builds this module on the
+ * host as well */
+
+/*******************************************************************************/
+/* Macro Definition */
+#define DEF_KEY_KBD_MAX                 4                                       // Keyboard interfaces tracked at once
+#define DEF_KEY_QUEUE_SIZE              64                                      // Events, power of 2
+
+#define KEY_SET_WORDS                   8                                       // 256 usages of the keyboard page
+#define KEY_EVT_UP                      0x0100                                  // Event: usage in bits 0-7, this bit set on release
+#define KEY_EVT_USAGE( evt )            ( (uint8_t)( evt ) )
+
+/* Keyboard page usages */
+#define KEY_USAGE_ERR_FIRST             0x01                                    // ErrorRollOver, POSTFail, ErrorUndefined
+#define KEY_USAGE_ERR_LAST              0x03
+#define KEY_USAGE_NUM_LOCK              0x53
+#define KEY_USAGE_CAPS_LOCK             0x39
+#define KEY_USAGE_SCROLL_LOCK           0x47
+#define KEY_USAGE_MOD_FIRST             0xE0                                    // LCtrl .. RGUI, the boot modifier byte
+
+/* Lock keys pressed by a report, in keyboard LED usage order */
+#define KEY_LOCK_NUM                    0x01
+#define KEY_LOCK_CAPS                   0x02
+#define KEY_LOCK_SCROLL                 0x04
+#define KEY_PARTIAL                     0x80                                    // Queue full, some changes wait for the next report
+
+/*******************************************************************************/
+/* Struct Definition */
+
+/* Pressed keys, bit n = usage n. The byte view is only used on the little
+ * endian targets this runs on, where byte k holds usages 8k .. 8k+7. */
+typedef union _KEY_SET
+{
+    uint32_t Word[ KEY_SET_WORDS ];
+    uint8_t  Byte[ KEY_SET_WORDS * 4 ];
+} KEY_SET;
+
+/*******************************************************************************/
+/* Function Declaration */
+extern uint8_t KEY_Attach( void );
+extern void KEY_Detach( uint8_t slot );
+extern uint8_t KEY_Decode( const hid_report_t *layout, const uint8_t *pbuf, uint16_t len, KEY_SET *pset );
+extern uint8_t KEY_Diff( KEY_SET *pheld, const KEY_SET *pnow );
+extern uint8_t KEY_Report( uint8_t slot, const hid_report_t *layout, const uint8_t *pbuf, uint16_t len );
+extern uint8_t KEY_Take( uint16_t *pevt );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
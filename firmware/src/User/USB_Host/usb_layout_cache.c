@@ -0,0 +1,273 @@
+
+/********************************************************************************/
+/* Header File */
+#include "usb_host_config.h"
+#include "usb_layout_cache.h"
+#include "ch32v20x_flash.h"
+#include <stddef.h>
+
+_Static_assert( sizeof( LCACHE_RECORD ) <= DEF_LCACHE_REC_SIZE, "layout cache record exceeds its slot" );
+
+/*******************************************************************************/
+/* Variable Definition */
+static uint8_t  LCACHE_NextSlot;                                                // Ring write position, holds the oldest record
+static uint32_t LCACHE_NextSeq;
+static uint8_t  LCACHE_ValidMask;                                               // Slots holding a complete record
+static uint8_t  LCACHE_WriteCnt;                                                // Records written since power-up
+static uint8_t  LCACHE_PendSlot;                                                // Slot of the record waiting in LCACHE_Buf
+static uint8_t  LCACHE_PendLeft;                                                // Pages of it still to write, 0 if none
+
+/* Page program buffer, word aligned as required by FLASH_ProgramPage_Fast */
+static union
+{
+    LCACHE_RECORD Rec;
+    uint32_t      Word[ DEF_LCACHE_REC_SIZE / 4 ];
+} LCACHE_Buf;
+
+#define LCACHE_SLOT( n )    ( (const LCACHE_RECORD *)( DEF_LCACHE_BASE_ADDR + (uint32_t)( n ) * DEF_LCACHE_REC_SIZE ) )
+
+/*********************************************************************
+ * @fn      LCACHE_Hash
+ *
+ * @brief   Continue a 32-bit FNV-1a hash over a buffer.
+ *
+ * @para    hash: Running hash, 0x811C9DC5 to start.
+ *          pbuf: Data.
+ *          len: Data length.
+ *
+ * @return  Updated hash.
+ */
+uint32_t LCACHE_Hash( uint32_t hash, const uint8_t *pbuf, uint16_t len )
+{
+    while( len-- )
+    {
+        hash ^= *pbuf++;
+        hash *= 0x01000193;
+    }
+    return hash;
+}
+
+/*********************************************************************
+ * @fn      LCACHE_DescHash
+ *
+ * @brief   Hash the device descriptor and the full configuration
+ *          descriptor. A firmware update on the device that changes
+ *          its interfaces also changes this key.
+ *
+ * @para    pdev_buf: Device descriptor (18 bytes).
+ *          pcfg_buf: Configuration descriptor, wTotalLength bytes.
+ *
+ * @return  Descriptor hash.
+ */
+uint32_t LCACHE_DescHash( const uint8_t *pdev_buf, const uint8_t *pcfg_buf )
+{
+    uint32_t hash;
+    uint16_t len;
+
+    len = pcfg_buf[ 2 ] | ( (uint16_t)pcfg_buf[ 3 ] << 8 );
+    if( len > DEF_COM_BUF_LEN )
+    {
+        len = DEF_COM_BUF_LEN;
+    }
+
+    hash = LCACHE_Hash( 0x811C9DC5, pdev_buf, 18 );
+    return LCACHE_Hash( hash, pcfg_buf, len );
+}
+
+/*********************************************************************
+ * @fn      LCACHE_RecordValid
+ *
+ * @brief   Check that a slot holds a completely written record of the
+ *          current layout format.
+ *
+ * @return  1 if valid.
+ */
+static uint8_t LCACHE_RecordValid( const LCACHE_RECORD *prec )
+{
+    if( ( prec->Magic != DEF_LCACHE_MAGIC ) || ( prec->LayoutSize != sizeof( hid_report_t ) ) )
+    {
+        return 0;
+    }
+    if( prec->InterfaceNum > DEF_INTERFACE_NUM_MAX )
+    {
+        return 0;
+    }
+    return prec->Check == LCACHE_Hash( 0x811C9DC5, (const uint8_t *)prec, offsetof( LCACHE_RECORD, Check ) );
+}
+
+/*********************************************************************
+ * @fn      LCACHE_Init
+ *
+ * @brief   Scan the cache region once, mark the valid slots and place
+ *          the ring write position after the newest record.
+ *
+ * @return  none
+ */
+void LCACHE_Init( void )
+{
+    uint8_t  n;
+    uint8_t  newest = DEF_LCACHE_SLOT_NUM - 1;
+    uint32_t seq = 0;
+
+    LCACHE_ValidMask = 0;
+    LCACHE_WriteCnt = 0;
+    LCACHE_PendLeft = 0;
+    for( n = 0; n < DEF_LCACHE_SLOT_NUM; n++ )
+    {
+        if( LCACHE_RecordValid( LCACHE_SLOT( n ) ) )
+        {
+            LCACHE_ValidMask |= 1 << n;
+            if( LCACHE_SLOT( n )->Seq >= seq )
+            {
+                seq = LCACHE_SLOT( n )->Seq;
+                newest = n;
+            }
+        }
+    }
+
+    LCACHE_NextSlot = ( newest + 1 ) % DEF_LCACHE_SLOT_NUM;
+    LCACHE_NextSeq = seq + 1;
+}
+
+/*********************************************************************
+ * @fn      LCACHE_Find
+ *
+ * @brief   Look up a cached layout. Only the newest matching record
+ *          is returned.
+ *
+ * @para    vid, pid: Device IDs.
+ *          hash: Descriptor hash from LCACHE_DescHash.
+ *
+ * @return  Record in flash, NULL on a miss.
+ */
+const LCACHE_RECORD *LCACHE_Find( uint16_t vid, uint16_t pid, uint32_t hash )
+{
+    const LCACHE_RECORD *prec = NULL;
+    uint8_t n;
+
+    for( n = 0; n < DEF_LCACHE_SLOT_NUM; n++ )
+    {
+        if( ( LCACHE_ValidMask & ( 1 << n ) ) &&
+            ( LCACHE_SLOT( n )->Vid == vid ) && ( LCACHE_SLOT( n )->Pid == pid ) &&
+            ( LCACHE_SLOT( n )->Hash == hash ) )
+        {
+            if( ( prec == NULL ) || ( LCACHE_SLOT( n )->Seq > prec->Seq ) )
+            {
+                prec = LCACHE_SLOT( n );
+            }
+        }
+    }
+    return prec;
+}
+
+/*********************************************************************
+ * @fn      LCACHE_Store
+ *
+ * @brief   Queue the parsed report layouts of a device for saving. The
+ *          record is built in RAM here, LCACHE_Process writes it to
+ *          flash later. Records are written round robin over the slots
+ *          so every page sees the same number of erase cycles, and the
+ *          slot written next is always the oldest one (eviction).
+ *
+ * @para    vid, pid: Device IDs.
+ *          hash: Descriptor hash from LCACHE_DescHash.
+ *          index: HostCtl index of the enumerated device.
+ *
+ * @return  ERR_SUCCESS, ERR_USB_BUSY if a record is still waiting to be
+ *          written, ERR_USB_UNAVAILABLE if the write budget for this
+ *          power cycle is used up.
+ */
+uint8_t LCACHE_Store( uint16_t vid, uint16_t pid, uint32_t hash, uint8_t index )
+{
+    uint8_t  n;
+
+    if( LCACHE_PendLeft )
+    {
+        return ERR_USB_BUSY;
+    }
+    if( LCACHE_WriteCnt >= DEF_LCACHE_WRITE_MAX )
+    {
+        return ERR_USB_UNAVAILABLE;
+    }
+    LCACHE_WriteCnt++;
+
+    /* Build the record, unused bytes stay erased (0xFF) */
+    memset( LCACHE_Buf.Word, 0xFF, sizeof( LCACHE_Buf ) );
+    LCACHE_Buf.Rec.Magic = DEF_LCACHE_MAGIC;
+    LCACHE_Buf.Rec.Seq = LCACHE_NextSeq;
+    LCACHE_Buf.Rec.Hash = hash;
+    LCACHE_Buf.Rec.Vid = vid;
+    LCACHE_Buf.Rec.Pid = pid;
+    LCACHE_Buf.Rec.LayoutSize = sizeof( hid_report_t );
+    LCACHE_Buf.Rec.InterfaceNum = HostCtl[ index ].InterfaceNum;
+    LCACHE_Buf.Rec.Reserved = 0;
+    for( n = 0; n < DEF_INTERFACE_NUM_MAX; n++ )
+    {
+        LCACHE_Buf.Rec.Itf[ n ].HidDescLen = HostCtl[ index ].Interface[ n ].HidDescLen;
+        LCACHE_Buf.Rec.Itf[ n ].Layout = HostCtl[ index ].Interface[ n ].HIDRptDesc;
+    }
+    LCACHE_Buf.Rec.Check = LCACHE_Hash( 0x811C9DC5, (const uint8_t *)&LCACHE_Buf.Rec, offsetof( LCACHE_RECORD, Check ) );
+
+    /* The slot is invalid from now on, LCACHE_Find skips it until the write is verified */
+    LCACHE_PendSlot = LCACHE_NextSlot;
+    LCACHE_PendLeft = DEF_LCACHE_REC_SIZE / DEF_LCACHE_PAGE_SIZE;
+    LCACHE_NextSlot = ( LCACHE_PendSlot + 1 ) % DEF_LCACHE_SLOT_NUM;
+    LCACHE_NextSeq++;
+    LCACHE_ValidMask &= ~( 1 << LCACHE_PendSlot );
+
+    return ERR_SUCCESS;
+}
+
+/*********************************************************************
+ * @fn      LCACHE_Process
+ *
+ * @brief   Write one page of the record queued by LCACHE_Store, call it
+ *          from the main loop while nothing enumerates. Each call stalls
+ *          the CPU for one fast page erase and program at most. Pages
+ *          that are already blank are not erased again.
+ *
+ * @return  ERR_SUCCESS once the record is written and verified,
+ *          ERR_USB_BUSY while pages are left, ERR_USB_UNAVAILABLE if
+ *          nothing is queued, ERR_USB_UNKNOWN on a verify error.
+ */
+uint8_t LCACHE_Process( void )
+{
+    uint8_t  n;
+    uint32_t addr, page;
+    const uint32_t *pflash;
+
+    if( LCACHE_PendLeft == 0 )
+    {
+        return ERR_USB_UNAVAILABLE;
+    }
+
+    /* Pages go in order, the check sits in the last one so a torn write never validates */
+    addr = (uint32_t)LCACHE_SLOT( LCACHE_PendSlot );
+    page = DEF_LCACHE_REC_SIZE - (uint32_t)LCACHE_PendLeft * DEF_LCACHE_PAGE_SIZE;
+    pflash = (const uint32_t *)( addr + page );
+    FLASH_Unlock_Fast();
+    for( n = 0; n < DEF_LCACHE_PAGE_SIZE / 4; n++ )
+    {
+        if( pflash[ n ] != 0xFFFFFFFF )
+        {
+            FLASH_ErasePage_Fast( addr + page );
+            break;
+        }
+    }
+    FLASH_ProgramPage_Fast( addr + page, &LCACHE_Buf.Word[ page / 4 ] );
+    FLASH_Lock_Fast();
+
+    LCACHE_PendLeft--;
+    if( LCACHE_PendLeft )
+    {
+        return ERR_USB_BUSY;
+    }
+
+    if( memcmp( (const void *)addr, LCACHE_Buf.Word, sizeof( LCACHE_Buf ) ) != 0 )
+    {
+        return ERR_USB_UNKNOWN;
+    }
+    LCACHE_ValidMask |= 1 << LCACHE_PendSlot;
+
+    return ERR_SUCCESS;
+}
@@ -0,0 +1,67 @@
+
+#ifndef __USB_LAYOUT_CACHE_H
+#define __USB_LAYOUT_CACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*******************************************************************************/
+/* Header File */
+#include "stdint.h"
+#include "usb_hid_reportparser.h"
+
+/* Note: include after usb_host_config.h, the record is sized by DEF_INTERFACE_NUM_MAX */
+
+/*******************************************************************************/
+/* Macro Definition */
+
+/* Cache region, the top 2K of the 64K flash. Link.ld stops the application
+ * image below DEF_LCACHE_BASE_ADDR, keep both in sync. */
+#define DEF_LCACHE_BASE_ADDR            0x0800F800
+#define DEF_LCACHE_SIZE                 0x0800
+#define DEF_LCACHE_PAGE_SIZE            256                                     // Fast erase/program page
+#define DEF_LCACHE_REC_SIZE             512                                     // One record = two fast pages
+#define DEF_LCACHE_SLOT_NUM             ( DEF_LCACHE_SIZE / DEF_LCACHE_REC_SIZE )
+#define DEF_LCACHE_MAGIC                0x3248434C                              // "LCH2", keyboard fields added
+
+/* Upper bound of flash writes per power cycle, protects the cache pages from
+ * a device that keeps re-enumerating with changing descriptors */
+#define DEF_LCACHE_WRITE_MAX            8
+
+/*******************************************************************************/
+/* Struct Definition */
+typedef struct _LCACHE_ITF
+{
+    uint16_t     HidDescLen;
+    hid_report_t Layout;
+} LCACHE_ITF;
+
+typedef struct _LCACHE_RECORD
+{
+    uint32_t   Magic;
+    uint32_t   Seq;                                                             // Write order, the ring evicts the lowest
+    uint32_t   Hash;                                                            // Device + configuration descriptor hash
+    uint16_t   Vid;
+    uint16_t   Pid;
+    uint16_t   LayoutSize;                                                      // sizeof( hid_report_t ) of the writer
+    uint8_t    InterfaceNum;
+    uint8_t    Reserved;
+    LCACHE_ITF Itf[ DEF_INTERFACE_NUM_MAX ];
+    uint32_t   Check;                                                           // Hash of all fields above
+} LCACHE_RECORD;
+
+/*******************************************************************************/
+/* Function Declaration */
+extern void LCACHE_Init( void );
+extern uint32_t LCACHE_Hash( uint32_t hash, const uint8_t *pbuf, uint16_t len );
+extern uint32_t LCACHE_DescHash( const uint8_t *pdev_buf, const uint8_t *pcfg_buf );
+extern const LCACHE_RECORD *LCACHE_Find( uint16_t vid, uint16_t pid, uint32_t hash );
+extern uint8_t LCACHE_Store( uint16_t vid, uint16_t pid, uint32_t hash, uint8_t index );
+extern uint8_t LCACHE_Process( void );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -11,6 +11,10 @@
 *******************************************************************************/
 #include "ch32v20x_it.h"
 #include "mouse.h"
+#include "keyboard.h"
+#include "gamepad.h"
+#include "event.h"
+#include "irq.h"
 
 
 void NMI_Handler(void) __attribute__((interrupt("WCH-Interrupt-fast")));
@@ -44,10 +48,32 @@ void HardFault_Handler(void)
 
 void EXTI15_10_IRQHandler(void)
 {
+    IRQ_STAT_ENTER(IRQ_ID_SCROLL, IRQ_LAT_NONE);
+    /* CD32 clock first, the Amiga samples the next bit a few uS later */
+    if(EXTI->INTFR & EXTI->INTENR & EXTI_Line15)
+    {
+        EXTI->INTFR = EXTI_Line15;
+        ProcessCD32Clock_IRQ();
+    }
     if(EXTI_GetITStatus(EXTI_Line10) != RESET)
     {
-        ProcessScrollIRQ();
-        EXTI_ClearITPendingBit(EXTI_Line10); /* Clear Flag */
+        if(pin5Owner == PIN5_CD32)
+        {
+            EXTI_ClearITPendingBit(EXTI_Line10);
+            ProcessCD32Select_IRQ();
+        }
+        else
+        {
+            ProcessScrollIRQ();
+            EXTI_ClearITPendingBit(EXTI_Line10); /* Clear Flag */
+            EVT_Post(EVT_SCROLL);
+        }
+    }
+    if(EXTI_GetITStatus(EXTI_Line11) != RESET)
+    {
+        EXTI_ClearITPendingBit(EXTI_Line11); /* Clear Flag */
+        ProcessKeyboardAck_IRQ();
     }
+    IRQ_STAT_EXIT(IRQ_ID_SCROLL);
 }
 
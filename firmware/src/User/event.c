@@ -0,0 +1,166 @@
+
+/********************************************************************************/
+/* Header File */
+#include "usb_host_config.h"
+#include "event.h"
+
+/*******************************************************************************/
+/* Variable Definition */
+static volatile uint32_t EVT_Flags;                                             // Events posted, not taken yet
+static volatile uint32_t EVT_Ms;                                                // 1mS tick of TIM3
+
+#if DEF_EVT_DUTY_EN
+static uint32_t EVT_WinStart;                                                   // Start of the statistics window, uS
+static uint32_t EVT_SleepUs;                                                    // Time spent in WFI within the window
+static uint32_t EVT_Wakeups;                                                    // WFI wake-ups within the window
+static uint32_t EVT_Count[ EVT_NUM ];                                           // Passes each event took part in
+#endif
+
+/*********************************************************************
+ * @fn      EVT_Post
+ *
+ * @brief   Post events. Interrupts and the main loop may both post, so
+ *          the flags are updated with one atomic OR.
+ *
+ * @para    evt: EVT_xxx.
+ *
+ * @return  none
+ */
+void EVT_Post( uint32_t evt )
+{
+    __atomic_fetch_or( &EVT_Flags, evt, __ATOMIC_RELAXED );
+}
+
+/*********************************************************************
+ * @fn      EVT_Tick
+ *
+ * @brief   1mS time base, called from the TIM3 update interrupt.
+ *
+ * @return  none
+ */
+void EVT_Tick( void )
+{
+    EVT_Ms++;
+    EVT_Post( EVT_TICK );
+}
+
+/*********************************************************************
+ * @fn      EVT_Now
+ *
+ * @brief   Microseconds since power-up, from the 1mS tick and the TIM3
+ *          counter that runs at 1MHz beneath it. A counter wrap whose
+ *          interrupt is still pending is accounted for here.
+ *
+ * @return  Timestamp, uS.
+ */
+uint32_t EVT_Now( void )
+{
+    uint32_t ms;
+    uint16_t cnt;
+
+    do
+    {
+        ms = EVT_Ms;
+        cnt = TIM3->CNT;
+    } while( ms != EVT_Ms );
+
+    if( ( TIM3->INTFR & TIM_IT_Update ) && ( cnt < 500 ) )
+    {
+        ms++;
+    }
+    return ms * 1000 + cnt;
+}
+
+/*********************************************************************
+ * @fn      EVT_Wait
+ *
+ * @brief   Take the pending events. With none pending the core sleeps
+ *          in WFI until an interrupt posts one. The check and the WFI
+ *          run with interrupts masked, a pending interrupt still ends
+ *          the WFI and is taken right after.
+ *
+ * @return  EVT_xxx taken.
+ */
+uint32_t EVT_Wait( void )
+{
+    uint32_t evt;
+#if DEF_EVT_DUTY_EN
+    uint32_t t;
+    uint8_t  n;
+#endif
+
+    __disable_irq( );
+    while( EVT_Flags == 0 )
+    {
+#if DEF_EVT_DUTY_EN
+        t = EVT_Now( );
+        __WFI( );
+        EVT_SleepUs += EVT_Now( ) - t;
+        EVT_Wakeups++;
+#else
+        __WFI( );
+#endif
+        __enable_irq( );
+        __disable_irq( );
+    }
+    evt = EVT_Flags;
+    EVT_Flags = 0;
+    __enable_irq( );
+
+#if DEF_EVT_DUTY_EN
+    for( n = 0; n < EVT_NUM; n++ )
+    {
+        if( evt & ( 1UL << n ) )
+        {
+            EVT_Count[ n ]++;
+        }
+    }
+#endif
+    return evt;
+}
+
+#if DEF_EVT_DUTY_EN
+/*********************************************************************
+ * @fn      EVT_DutyDump
+ *
+ * @brief   Once per DEF_EVT_DUTY_PERIOD mS print the main loop duty
+ *          cycle over the debug UART, one CSV line:
+ *            DU,<t_ms>,<window_us>,<busy_us>,<wakeups>,<tick>,<detect>,
+ *               <ctrl>,<poll>,<report>,<scroll>,<host>,<key>
+ *          Busy is the window minus the time spent in WFI, interrupts
+ *          included. The window restarts after the line is printed,
+ *          the blocking UART output is not counted.
+ *
+ * @return  none
+ */
+void EVT_DutyDump( void )
+{
+    static uint8_t head_printed;
+    uint32_t now = EVT_Now( );
+    uint32_t window = now - EVT_WinStart;
+    uint8_t  n;
+
+    if( window < (uint32_t)DEF_EVT_DUTY_PERIOD * 1000 )
+    {
+        return;
+    }
+
+    if( head_printed == 0 )
+    {
+        head_printed = 1;
+        printf( "DU,t_ms,window_us,busy_us,wakeups,tick,detect,ctrl,poll,report,scroll,host,key\r\n" );
+    }
+    printf( "DU,%lu,%lu,%lu,%lu", (unsigned long)( now / 1000 ), (unsigned long)window,
+            (unsigned long)( window - EVT_SleepUs ), (unsigned long)EVT_Wakeups );
+    for( n = 0; n < EVT_NUM; n++ )
+    {
+        printf( ",%lu", (unsigned long)EVT_Count[ n ] );
+        EVT_Count[ n ] = 0;
+    }
+    printf( "\r\n" );
+
+    EVT_SleepUs = 0;
+    EVT_Wakeups = 0;
+    EVT_WinStart = EVT_Now( );
+}
+#endif
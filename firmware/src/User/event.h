@@ -0,0 +1,44 @@
+
+#ifndef __EVENT_H
+#define __EVENT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*******************************************************************************/
+/* Header File */
+#include "stdint.h"
+
+/* Note: include after usb_host_config.h, DEF_EVT_DUTY_EN is set there */
+
+/*******************************************************************************/
+/* Macro Definition */
+
+/* Main loop events, posted by the interrupts, taken by EVT_Wait */
+#define EVT_TICK                        0x01                                    // 1mS tick of TIM3, waits and timeouts
+#define EVT_USB_DETECT                  0x02                                    // Attach or detach on the USB host port
+#define EVT_USB_CTRL                    0x04                                    // Asynchronous control transfer finished
+#define EVT_USB_POLL                    0x08                                    // Poll result for the main loop: STALL, keyboard LEDs, HUB port change
+#define EVT_REPORT                      0x10                                    // New reports in the live interface list
+#define EVT_SCROLL                      0x20                                    // Amiga took a scroll code
+#define EVT_HOST                        0x40                                    // Host step finished without waiting, run the next one
+#define EVT_KEY                         0x80                                    // Key events queued by the key engine
+#define EVT_NUM                         8
+
+/* Events handled by USBH_MainDeal */
+#define EVT_MASK_HOST                   ( EVT_TICK | EVT_USB_DETECT | EVT_USB_CTRL | EVT_USB_POLL | EVT_HOST )
+
+/*******************************************************************************/
+/* Function Declaration */
+extern void EVT_Post( uint32_t evt );
+extern void EVT_Tick( void );
+extern uint32_t EVT_Now( void );
+extern uint32_t EVT_Wait( void );
+extern void EVT_DutyDump( void );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
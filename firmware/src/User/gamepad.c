@@ -1,16 +1,299 @@
 #include "gamepad.h"
+#include "mouse.h"
+
+/* Pin 9 level for each bit of a read and pins 6 and 9 outside of it, as
+ * GPIOB BSHR words. The main loop fills a free set and publishes it, the
+ * select edge takes the published one, so a read never sees a mix. */
+typedef struct {
+	uint32_t shift[CD32_SHIFT_LEN];
+	uint32_t idle;
+} CD32_Set_TypeDef;
+
+static CD32_Set_TypeDef cd32Sets[3];
+static volatile uint8_t cd32Ready = 0;				// Set taken by the next read
+static CD32_Set_TypeDef * volatile cd32Out = &cd32Sets[0];	// Set of the read going on
+static uint8_t cd32Pos = 0;							// Next bit to put on pin 9
+
+// Autofire periods in mS, off first: 5, 8, 12, 16, 20 and 25 Hz. Duty in %
+static const uint16_t autofirePeriods[] = { 0, 200, 125, 83, 62, 50, 40 };
+static const uint8_t autofireDuty[] = { 50, 25, 75 };
+static const uint32_t firePins[AUTOFIRE_BUTTONS] = { LB_Pin, RB_Pin, MB_Pin };
+
+typedef struct {
+	uint16_t period;			// mS, 0 = off
+	uint16_t on;				// Pressed part of the period, mS
+	uint16_t phase;
+	uint8_t rate;				// Index in autofirePeriods
+	uint8_t duty;				// Index in autofireDuty
+} Autofire_TypeDef;
+
+static Autofire_TypeDef autofire[AUTOFIRE_BUTTONS];
+static volatile uint8_t autofireHeld = 0;			// Autofire buttons held on the pad, bit n = fire n + 1
+static volatile uint32_t autofirePins = 0;			// GPIOB pins the tick drives
+static uint8_t autofireLast = 0;					// Button the duty key applies to
+static uint8_t padPrevFire = 0;						// Previous report, for the config presses
+static uint8_t padPrevExtra = 0;
+static uint8_t stickMouse = 0;						// The pad drives the mouse outputs
+static uint8_t cd32Pad = CD32_PAD;					// CD32 pad, else three fire buttons
+
+// Pin 6 and pin 9 outputs, pressed is low
+#define pinWord(pin, pressed)	((pressed) ? ((uint32_t)(pin) << 16) : (uint32_t)(pin))
+
+// CD32 buttons of a pad: the face buttons in the same places, Start is Play
+static uint8_t cd32Buttons(HID_gamepad_Info_TypeDef* joymap)
+{
+	uint8_t btn = 0;
+
+	if (joymap->gamepad_data & JOY_BTN1) btn |= CD32_RED;
+	if (joymap->gamepad_data & JOY_BTN2) btn |= CD32_BLUE;
+	if (joymap->gamepad_data & JOY_BTN3) btn |= CD32_GREEN;
+	if (joymap->gamepad_data & JOY_BTN4) btn |= CD32_YELLOW;
+	if (joymap->gamepad_extraBtn & JOY_EXTRA_R) btn |= CD32_FORWARD;
+	if (joymap->gamepad_extraBtn & JOY_EXTRA_L) btn |= CD32_REVERSE;
+	if (joymap->gamepad_extraBtn & JOY_EXTRA_START) btn |= CD32_PLAY;
+	return btn;
+}
+
+// Precompute the next read, then show the idle buttons unless a read is going on.
+// Pins driven by autofire are left to the tick.
+static void updateCD32(uint8_t btn)
+{
+	CD32_Set_TypeDef *set;
+	uint8_t i;
+	uint8_t bits = (uint8_t)~btn | CD32_ID;
+
+	for (i = 0; i < 3; i++) {
+		if ((i != cd32Ready) && (&cd32Sets[i] != cd32Out)) {
+			break;
+		}
+	}
+	set = &cd32Sets[i];
+	for (i = 0; i < CD32_SHIFT_LEN; i++) {
+		set->shift[i] = pinWord(RB_Pin, (i >= 8) || !(bits & (1 << i)));
+	}
+	set->idle = pinWord(LB_Pin, btn & CD32_RED) | pinWord(RB_Pin, btn & CD32_BLUE);
+	set->idle &= ~(autofirePins | (autofirePins << 16));
+
+	NVIC_DisableIRQ(EXTI15_10_IRQn);
+	cd32Ready = set - cd32Sets;
+	if (GPIO_ReadInputDataBit(MB_GPIO_Port, MB_Pin)) {
+		GPIOB->BSHR = set->idle;
+	}
+	NVIC_EnableIRQ(EXTI15_10_IRQn);
+}
+
+// New rate or duty of one button, the tick starts it over
+static void setAutofire(uint8_t i)
+{
+	uint16_t period = autofirePeriods[autofire[i].rate];
+
+	NVIC_DisableIRQ(TIM3_IRQn);
+	autofire[i].period = period;
+	autofire[i].on = (uint32_t)period * autofireDuty[autofire[i].duty] / 100;
+	autofire[i].phase = 0;
+	NVIC_EnableIRQ(TIM3_IRQn);
+}
+
+// Config presses while AUTOFIRE_CONFIG is held. Returns 1 while it is held
+static uint8_t configurePad(HID_gamepad_Info_TypeDef* pad)
+{
+	uint8_t fire = (pad->gamepad_data >> JOY_BTN_SHIFT) & ((1 << AUTOFIRE_BUTTONS) - 1);
+	uint8_t press = fire & ~padPrevFire;
+	uint8_t dutyPress = pad->gamepad_extraBtn & ~padPrevExtra & AUTOFIRE_DUTY_KEY;
+	uint8_t mousePress = pad->gamepad_extraBtn & ~padPrevExtra & STICK_MOUSE_KEY;
+	uint8_t modePress = pad->gamepad_extraBtn & ~padPrevExtra & PAD_MODE_KEY;
+	uint8_t i;
+
+	padPrevFire = fire;
+	padPrevExtra = pad->gamepad_extraBtn;
+	if (!(pad->gamepad_extraBtn & AUTOFIRE_CONFIG)) {
+		return 0;
+	}
+
+	for (i = 0; i < AUTOFIRE_BUTTONS; i++) {
+		if (press & (1 << i)) {
+			autofire[i].rate = (autofire[i].rate + 1) % (sizeof(autofirePeriods) / sizeof(autofirePeriods[0]));
+			autofireLast = i;
+			setAutofire(i);
+		}
+	}
+	if (dutyPress) {
+		autofire[autofireLast].duty = (autofire[autofireLast].duty + 1) % sizeof(autofireDuty);
+		setAutofire(autofireLast);
+	}
+	if (mousePress) {
+		stickMouse = !stickMouse;
+		if (stickMouse) {
+			// The quadrature outputs start from released direction pins
+			GPIO_WriteBit(RHQ_GPIO_Port, RHQ_Pin, Bit_SET);
+			GPIO_WriteBit(LVQ_GPIO_Port, LVQ_Pin, Bit_SET);
+			GPIO_WriteBit(BH_GPIO_Port, BH_Pin, Bit_SET);
+			GPIO_WriteBit(FV_GPIO_Port, FV_Pin, Bit_SET);
+		} else {
+			// Stop the cursor, the direction pins are the joystick's again
+			SetMouseSpeed(0, 0);
+			FlushMouse();
+		}
+	}
+	if (modePress) {
+		// ProcessGamepad hands pin 5 over with the next report
+		cd32Pad = !cd32Pad;
+	}
+	return 1;
+}
+
+// Stick deflection to counts per second: deadzone, then a square curve for
+// fine control near the centre
+static int16_t stickSpeed(int8_t v)
+{
+	int32_t m = (v < 0) ? -v : v;
+	int32_t range = 127 - STICK_MOUSE_DEADZONE;
+	int32_t speed;
+
+	if (m <= STICK_MOUSE_DEADZONE) {
+		return 0;
+	}
+	m -= STICK_MOUSE_DEADZONE;
+	if (m > range) {
+		m = range;
+	}
+	speed = STICK_MOUSE_MIN_SPEED + (STICK_MOUSE_MAX_SPEED - STICK_MOUSE_MIN_SPEED) * m * m / (range * range);
+	return (int16_t)((v < 0) ? -speed : speed);
+}
+
+// The pad as a two button mouse, pin 5 is the mouse's for the scroll handshake
+static void processStickMouse(HID_gamepad_Info_TypeDef* pad)
+{
+	SetPin5Owner(PIN5_SCROLL);
+	autofireHeld = 0;
+	autofirePins = 0;
+	SetMouseSpeed(stickSpeed(pad->stick_x), stickSpeed(pad->stick_y));
+	GPIO_WriteBit(LB_GPIO_Port, LB_Pin, !(pad->gamepad_data & JOY_BTN1));
+	GPIO_WriteBit(RB_GPIO_Port, RB_Pin, !(pad->gamepad_data & JOY_BTN2));
+}
 
 void ProcessGamepad(HID_gamepad_Info_TypeDef* joymap)
 {
+	HID_gamepad_Info_TypeDef pad;
+	uint32_t pins = 0;
+	uint8_t enabled = 0;
+	uint8_t i;
+
+	if (joymap == NULL) return;
+
+	// The config presses do not reach the Amiga
+	pad = *joymap;
+	if (configurePad(&pad)) {
+		pad.gamepad_data &= JOY_MOVE;
+		pad.gamepad_extraBtn = 0;
+	}
+	if (stickMouse) {
+		processStickMouse(&pad);
+		return;
+	}
+
+	GPIO_WriteBit(RHQ_GPIO_Port, RHQ_Pin, !(pad.gamepad_data & 0x1));
+	GPIO_WriteBit(LVQ_GPIO_Port, LVQ_Pin, !(pad.gamepad_data >> 1 & 0x1));
+	GPIO_WriteBit(BH_GPIO_Port, BH_Pin, !(pad.gamepad_data >> 2 & 0x1));
+	GPIO_WriteBit(FV_GPIO_Port, FV_Pin, !(pad.gamepad_data >> 3 & 0x1));
+
+	for (i = 0; i < AUTOFIRE_BUTTONS; i++) {
+		if (autofire[i].period) {
+			enabled |= 1 << i;
+		}
+	}
+	if (cd32Pad) {
+		enabled &= (1 << 2) - 1;	// Pin 5 selects, fire 3 has no pin
+	}
+	for (i = 0; i < AUTOFIRE_BUTTONS; i++) {
+		if (enabled & (1 << i)) {
+			pins |= firePins[i];
+		}
+	}
+
+	if (cd32Pad) {
+		// Pins 6 and 9 belong to the shift register
+		SetPin5Owner(PIN5_CD32);
+		autofireHeld = (pad.gamepad_data >> JOY_BTN_SHIFT) & enabled;
+		autofirePins = pins;
+		updateCD32(cd32Buttons(&pad));
+	} else {
+		// Pin 5 is an output now, the scroll handshake is off until a mouse reports
+		SetPin5Owner(PIN5_BUTTON);
+		autofireHeld = (pad.gamepad_data >> JOY_BTN_SHIFT) & enabled;
+		autofirePins = pins;
+		if (!(pins & LB_Pin)) GPIO_WriteBit(LB_GPIO_Port, LB_Pin, !(pad.gamepad_data & JOY_BTN1));
+		if (!(pins & RB_Pin)) GPIO_WriteBit(RB_GPIO_Port, RB_Pin, !(pad.gamepad_data & JOY_BTN2));
+		if (!(pins & MB_Pin)) GPIO_WriteBit(MB_GPIO_Port, MB_Pin, !(pad.gamepad_data & JOY_BTN3));
+	}
+}
+
+// The pad went away: nothing keeps moving or firing
+void ReleaseGamepad()
+{
+	SetMouseSpeed(0, 0);
+	autofireHeld = 0;
+}
+
+/*
+ * 1mS tick: step every autofire button and drive all of their pins with one
+ * masked store, so the rate does not depend on the main loop. Nothing is
+ * driven while a mouse owns the port or during a CD32 read.
+ */
+void ProcessAutofire_IRQ()
+{
+	uint32_t pins = autofirePins;
+	uint32_t word = 0;
+	uint8_t held = autofireHeld;
+	uint8_t i;
 
-			if (joymap == NULL) return;
+	if ((pins == 0) || (pin5Owner == PIN5_SCROLL)) {
+		return;
+	}
 
-				GPIO_WriteBit(RHQ_GPIO_Port, RHQ_Pin, !(joymap->gamepad_data & 0x1));
-				GPIO_WriteBit(LVQ_GPIO_Port, LVQ_Pin, !(joymap->gamepad_data >> 1 & 0x1));
-				GPIO_WriteBit(BH_GPIO_Port, BH_Pin, !(joymap->gamepad_data >> 2 & 0x1));
-				GPIO_WriteBit(FV_GPIO_Port, FV_Pin, !(joymap->gamepad_data >> 3 & 0x1));
-				GPIO_WriteBit(LB_GPIO_Port, LB_Pin, !(joymap->gamepad_data >> 4 & 0x1));
-				//GPIO_WriteBit(MB_GPIO_Port, RB_Pin, !(joymap->gamepad_data >> 5 & 0x1));
-				GPIO_WriteBit(RB_GPIO_Port, RB_Pin, !(joymap->gamepad_data >> 6 & 0x1));
+	for (i = 0; i < AUTOFIRE_BUTTONS; i++) {
+		if (!(pins & firePins[i])) {
+			continue;
+		}
+		if (held & (1 << i)) {
+			word |= pinWord(firePins[i], autofire[i].phase < autofire[i].on);
+			if (++autofire[i].phase >= autofire[i].period) {
+				autofire[i].phase = 0;
+			}
+		} else {
+			word |= firePins[i];
+			autofire[i].phase = 0;		// The next press starts pressed
+		}
+	}
 
+	NVIC_DisableIRQ(EXTI15_10_IRQn);
+	if ((pin5Owner != PIN5_CD32) || (MB_GPIO_Port->INDR & MB_Pin)) {
+		GPIOB->BSHR = word;
+	}
+	NVIC_EnableIRQ(EXTI15_10_IRQn);
+}
+
+/*
+ * Pin 5 edge. Falling: latch the published buttons, put the first bit on
+ * pin 9 and release pin 6, the Amiga drives the clock on it now. Rising:
+ * back to a two button joystick.
+ */
+void ProcessCD32Select_IRQ()
+{
+	if (MB_GPIO_Port->INDR & MB_Pin) {
+		EXTI->INTENR &= ~EXTI_Line15;
+		GPIOB->BSHR = cd32Out->idle;
+		return;
+	}
+	cd32Out = &cd32Sets[cd32Ready];
+	GPIOB->BSHR = cd32Out->shift[0] | LB_Pin;
+	cd32Pos = 1;
+	EXTI->INTFR = EXTI_Line15;
+	EXTI->INTENR |= EXTI_Line15;
+}
+
+// Pin 6 rising edge: next bit, one lookup and one store
+void ProcessCD32Clock_IRQ()
+{
+	GPIOB->BSHR = cd32Out->shift[cd32Pos++ & (CD32_SHIFT_LEN - 1)];
 }
@@ -4,6 +4,53 @@
 #include "usb_gamepad.h"
 #include "gpio.h"
 
+/*
+ * CD32 pad: while the Amiga holds pin 5 low the seven buttons are read
+ * through a shift register, pin 6 clocks it and pin 9 carries the data.
+ * With pin 5 high the pad is a plain two button joystick. The other mode
+ * drives fire buttons 1, 2, 3 on pins 6, 9, 5 for three button games.
+ * Hold Back (Select) and press the left shoulder to switch modes.
+ */
+#define CD32_PAD                1           // Mode at power-up, 0: three fire buttons
+#define PAD_MODE_KEY            JOY_EXTRA_L
+#define CD32_SHIFT_LEN          16          // Bits per read, power of 2; only 9 are clocked
+
+/* CD32 shift order, a pressed button reads 0. Bit 7 reads 1 and the bits
+ * after it 0, that tells the Amiga a CD32 pad is attached. */
+#define CD32_BLUE               0x01
+#define CD32_RED                0x02
+#define CD32_YELLOW             0x04
+#define CD32_GREEN              0x08
+#define CD32_FORWARD            0x10        // Right shoulder
+#define CD32_REVERSE            0x20        // Left shoulder
+#define CD32_PLAY               0x40
+#define CD32_ID                 0x80
+
+/*
+ * Autofire of fire buttons 1 to 3, stepped by the 1mS tick. Hold Back
+ * (Select) and press a fire button to step its rate, off first; the right
+ * shoulder then steps the duty of that button. In CD32 mode it applies to
+ * the red and blue buttons outside of a read.
+ */
+#define AUTOFIRE_BUTTONS        3
+#define AUTOFIRE_CONFIG         JOY_EXTRA_BACK
+#define AUTOFIRE_DUTY_KEY       JOY_EXTRA_R
+
+/*
+ * Stick mouse: hold Back and press Start to turn the pad into a mouse. The
+ * mouse stick (the right one, or the only one) sets the speed through a
+ * deadzone and a square curve, the 1mS tick integrates it into quadrature
+ * counts. Fire 1 is the left button, fire 2 the right one.
+ */
+#define STICK_MOUSE_KEY         JOY_EXTRA_START
+#define STICK_MOUSE_DEADZONE    16          // Of 127
+#define STICK_MOUSE_MIN_SPEED   20          // Counts per second just outside the deadzone
+#define STICK_MOUSE_MAX_SPEED   1200        // At full deflection
+
 void ProcessGamepad(HID_gamepad_Info_TypeDef* joymap);
+void ProcessAutofire_IRQ();
+void ReleaseGamepad();
+void ProcessCD32Select_IRQ();
+void ProcessCD32Clock_IRQ();
 
 #endif
@@ -1,4 +1,7 @@
 #include "gpio.h"
+#include "irq.h"
+
+volatile uint8_t pin5Owner = PIN5_SCROLL;
 
 void GPIO_Config()
 {
@@ -32,8 +35,9 @@ void GPIO_Config()
     GPIO_Init(LED_GPIO_Port, &GPIO_InitStructure);
 
 
+    //Open drain: the Amiga drives pin 6 as the CD32 clock, its pull-up sets the level when released
     GPIO_InitStructure.GPIO_Pin = LB_Pin;
-    GPIO_InitStructure.GPIO_Mode = GPIO_Mode_Out_PP;
+    GPIO_InitStructure.GPIO_Mode = GPIO_Mode_Out_OD;
     GPIO_InitStructure.GPIO_Speed = GPIO_Speed_50MHz;
     GPIO_Init(LB_GPIO_Port, &GPIO_InitStructure);
 
@@ -105,9 +109,64 @@ void GPIO_Config()
 	EXTI_InitStructure.EXTI_LineCmd = ENABLE;
 	EXTI_Init(&EXTI_InitStructure);
 
+	//KBD_DATA falling edge - Amiga keyboard handshake
+	//Masked here, the keyboard transmitter unmasks it while it waits
+	GPIO_EXTILineConfig(GPIO_PortSourceGPIOA, GPIO_PinSource11);
+	EXTI_InitStructure.EXTI_Line = EXTI_Line11;
+	EXTI_InitStructure.EXTI_Mode = EXTI_Mode_Interrupt;
+	EXTI_InitStructure.EXTI_Trigger = EXTI_Trigger_Falling;
+	EXTI_InitStructure.EXTI_LineCmd = ENABLE;
+	EXTI_Init(&EXTI_InitStructure);
+	EXTI->INTENR &= ~EXTI_Line11;
+
+	//Pin 6 rising edge - CD32 pad clock
+	//Masked here, unmasked while the Amiga reads a CD32 pad
+	GPIO_EXTILineConfig(GPIO_PortSourceGPIOB, GPIO_PinSource15);
+	EXTI_InitStructure.EXTI_Line = EXTI_Line15;
+	EXTI_InitStructure.EXTI_Mode = EXTI_Mode_Interrupt;
+	EXTI_InitStructure.EXTI_Trigger = EXTI_Trigger_Rising;
+	EXTI_InitStructure.EXTI_LineCmd = ENABLE;
+	EXTI_Init(&EXTI_InitStructure);
+	EXTI->INTENR &= ~EXTI_Line15;
+
 	NVIC_InitStructure.NVIC_IRQChannel = EXTI15_10_IRQn;
-	NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 1;
-	NVIC_InitStructure.NVIC_IRQChannelSubPriority = 1;
+	NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = IRQ_PREEMPT_SCROLL;
+	NVIC_InitStructure.NVIC_IRQChannelSubPriority = IRQ_SUB_SCROLL;
 	NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
 	NVIC_Init(&NVIC_InitStructure);
 }
+
+/*
+ * Hand DB9 pin 5 to another user. The pin is released and its edge
+ * interrupts masked before the mode changes, so driving it as a button
+ * never starts a scroll handshake and a scroll handshake never sees a
+ * button. Pin 6 clock edges only count inside a CD32 read and start masked.
+ */
+void SetPin5Owner(uint8_t owner)
+{
+    GPIO_InitTypeDef GPIO_InitStructure = {0};
+
+    if (owner == pin5Owner) {
+        return;
+    }
+
+    NVIC_DisableIRQ(EXTI15_10_IRQn);
+    EXTI->INTENR &= ~(EXTI_Line10 | EXTI_Line15);
+    EXTI->RTENR &= ~EXTI_Line10;
+    GPIO_WriteBit(MB_GPIO_Port, MB_Pin, Bit_SET);
+
+    GPIO_InitStructure.GPIO_Pin = MB_Pin;
+    GPIO_InitStructure.GPIO_Mode = (owner == PIN5_BUTTON) ? GPIO_Mode_Out_OD : GPIO_Mode_IPU;
+    GPIO_InitStructure.GPIO_Speed = GPIO_Speed_50MHz;
+    GPIO_Init(MB_GPIO_Port, &GPIO_InitStructure);
+
+    if (owner != PIN5_BUTTON) {
+        if (owner == PIN5_CD32) {
+            EXTI->RTENR |= EXTI_Line10;
+        }
+        EXTI->INTFR = EXTI_Line10 | EXTI_Line15;
+        EXTI->INTENR |= EXTI_Line10;
+    }
+    pin5Owner = owner;
+    NVIC_EnableIRQ(EXTI15_10_IRQn);
+}
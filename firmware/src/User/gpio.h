@@ -38,8 +38,15 @@
 #define KB_RESET_GPIO_Port GPIOA
 #define KB_RESET_GPIO_Pin GPIO_Pin_10
 
+/* Users of DB9 pin 5, one at a time */
+#define PIN5_SCROLL 0       // Input, the Amiga pulls it low for the scroll handshake, EXTI10 falling
+#define PIN5_CD32   1       // Input, CD32 pad select driven by the Amiga, EXTI10 both edges
+#define PIN5_BUTTON 2       // Open drain output, third fire button, EXTI10 masked
+
+extern volatile uint8_t pin5Owner;
 
 void GPIO_Config();
+void SetPin5Owner(uint8_t owner);
 
 
 #endif
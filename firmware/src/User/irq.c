@@ -0,0 +1,151 @@
+
+/********************************************************************************/
+/* Header File */
+#include "usb_host_config.h"
+#include "event.h"
+#include "irq.h"
+
+#if DEF_IRQ_STAT_EN
+
+/*******************************************************************************/
+/* Struct Definition */
+typedef struct
+{
+    uint32_t Start;                                                             // Entry of the running handler, uS
+    uint32_t Count;
+    uint32_t ExecSum;                                                           // uS
+    uint16_t ExecMax;
+    uint16_t LatMax;
+    uint16_t LatOver;                                                           // Entries later than DEF_IRQ_LAT_TARGET_US
+} IRQ_STAT;
+
+/*******************************************************************************/
+/* Variable Definition */
+static IRQ_STAT IRQ_Stat[ IRQ_ID_NUM ];
+
+/* Handlers raised by a 1MHz timer, their entry latency is its counter */
+#define IRQ_LAT_TIMED                   ( ( 1 << IRQ_ID_QUAD_X ) | ( 1 << IRQ_ID_QUAD_Y ) | ( 1 << IRQ_ID_TICK ) | \
+                                          ( 1 << IRQ_ID_KBD ) )
+
+static const char * const IRQ_Name[ IRQ_ID_NUM ] =
+{
+    "quad_x", "quad_y", "scroll", "usb", "tick", "kbd"
+};
+
+/*********************************************************************
+ * @fn      IRQ_StatEnter
+ *
+ * @brief   Entry of a timed interrupt handler, call first thing.
+ *
+ * @para    id: IRQ_ID_xxx.
+ *          lat: Entry latency in uS, the counter of the timer that
+ *               raised the interrupt, IRQ_LAT_NONE if not measurable.
+ *
+ * @return  none
+ */
+void IRQ_StatEnter( uint8_t id, uint16_t lat )
+{
+    IRQ_STAT *pst = &IRQ_Stat[ id ];
+
+    pst->Start = EVT_Now( );
+    if( lat == IRQ_LAT_NONE )
+    {
+        return;
+    }
+    if( lat > pst->LatMax )
+    {
+        pst->LatMax = lat;
+    }
+    if( lat > DEF_IRQ_LAT_TARGET_US )
+    {
+        pst->LatOver++;
+    }
+}
+
+/*********************************************************************
+ * @fn      IRQ_StatExit
+ *
+ * @brief   Exit of a timed interrupt handler. The execution time of a
+ *          level 1 handler includes the level 0 handlers nested in it.
+ *
+ * @para    id: IRQ_ID_xxx.
+ *
+ * @return  none
+ */
+void IRQ_StatExit( uint8_t id )
+{
+    IRQ_STAT *pst = &IRQ_Stat[ id ];
+    uint32_t exec = EVT_Now( ) - pst->Start;
+
+    if( exec > 0xFFFF )
+    {
+        exec = 0xFFFF;
+    }
+    pst->Count++;
+    pst->ExecSum += exec;
+    if( exec > pst->ExecMax )
+    {
+        pst->ExecMax = exec;
+    }
+}
+
+/*********************************************************************
+ * @fn      IRQ_StatDump
+ *
+ * @brief   Once per DEF_IRQ_STAT_PERIOD mS print the interrupt timing
+ *          statistics over the debug UART, one CSV line per handler:
+ *            IS,<t_ms>,<irq>,<count>,<lat_max>,<lat_over>,<exec_max>,<exec_mean>
+ *          in uS, lat_max is "na" where the entry latency cannot be
+ *          measured. The figures are cleared after each report.
+ *
+ * @return  none
+ */
+void IRQ_StatDump( void )
+{
+    static uint8_t  head_printed;
+    static uint32_t last;
+    IRQ_STAT snap[ IRQ_ID_NUM ];
+    uint32_t now = EVT_Now( );
+    uint8_t  n;
+
+    if( ( now - last ) < (uint32_t)DEF_IRQ_STAT_PERIOD * 1000 )
+    {
+        return;
+    }
+
+    /* The handlers update the figures at both levels */
+    __disable_irq( );
+    memcpy( snap, IRQ_Stat, sizeof( snap ) );
+    for( n = 0; n < IRQ_ID_NUM; n++ )
+    {
+        IRQ_Stat[ n ].Count = 0;
+        IRQ_Stat[ n ].ExecSum = 0;
+        IRQ_Stat[ n ].ExecMax = 0;
+        IRQ_Stat[ n ].LatMax = 0;
+        IRQ_Stat[ n ].LatOver = 0;
+    }
+    __enable_irq( );
+
+    if( head_printed == 0 )
+    {
+        head_printed = 1;
+        printf( "IS,t_ms,irq,count,lat_max,lat_over,exec_max,exec_mean\r\n" );
+    }
+    for( n = 0; n < IRQ_ID_NUM; n++ )
+    {
+        printf( "IS,%lu,%s,%lu,", (unsigned long)( now / 1000 ), IRQ_Name[ n ], (unsigned long)snap[ n ].Count );
+        if( IRQ_LAT_TIMED & ( 1 << n ) )
+        {
+            printf( "%u", snap[ n ].LatMax );
+        }
+        else
+        {
+            printf( "na" );
+        }
+        printf( ",%u,%u,%lu\r\n", snap[ n ].LatOver, snap[ n ].ExecMax,
+                (unsigned long)( snap[ n ].Count ? snap[ n ].ExecSum / snap[ n ].Count : 0 ) );
+    }
+    last = EVT_Now( );
+}
+
+#endif
@@ -0,0 +1,74 @@
+
+#ifndef __IRQ_H
+#define __IRQ_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*******************************************************************************/
+/* Header File */
+#include "stdint.h"
+
+/* Note: include after usb_host_config.h, DEF_IRQ_STAT_EN is set there */
+
+/*******************************************************************************/
+/* Macro Definition */
+
+/* Interrupt priorities, set with NVIC_PriorityGroup_1. The core nests two
+ * levels: preemption priority 0 interrupts preemption priority 1, never its
+ * own level. Within a level the lower subpriority is taken first.
+ *
+ * Level 0 is the Amiga port. The X and Y quadrature step timers share one
+ * priority, so a step waits at most one other step handler. The scroll
+ * handshake drives the same pins and a step must not cut into it, so it
+ * sits on this level too. So does the keyboard line, TIM1 clocking the bits
+ * and EXTI11 catching the handshake on KDAT: the scroll handler rewrites all
+ * of GPIOA when it leaves, nothing may drive KDAT or KCLK meanwhile. With a
+ * pad attached the same EXTI handler serves the CD32 shift register, pin 5
+ * select on EXTI10 and pin 6 clock on EXTI15, one store per clock edge.
+ *
+ * Level 1 is the USB host. The USBFS interrupt and the TIM3 tick share it,
+ * because USBFSH_AsyncTick must never nest with a transfer completion. */
+#define IRQ_PRIO_GROUP                  NVIC_PriorityGroup_1
+#define IRQ_PREEMPT_QUAD                0                                       // TIM2 X, TIM4 Y
+#define IRQ_SUB_QUAD                    0
+#define IRQ_PREEMPT_SCROLL              0                                       // EXTI10, MMB scroll handshake
+#define IRQ_SUB_SCROLL                  1                                       // Also EXTI11 keyboard handshake, EXTI15 CD32 clock
+#define IRQ_PREEMPT_KBD                 0                                       // TIM1 keyboard bit clock
+#define IRQ_SUB_KBD                     2
+#define IRQ_PREEMPT_USB                 1                                       // USBFS host
+#define IRQ_SUB_USB                     0
+#define IRQ_PREEMPT_TICK                1                                       // TIM3 1mS tick, autofire, stick mouse
+#define IRQ_SUB_TICK                    1
+
+/* Timed interrupts */
+#define IRQ_ID_QUAD_X                   0
+#define IRQ_ID_QUAD_Y                   1
+#define IRQ_ID_SCROLL                   2
+#define IRQ_ID_USB                      3
+#define IRQ_ID_TICK                     4
+#define IRQ_ID_KBD                      5
+#define IRQ_ID_NUM                      6
+
+#define IRQ_LAT_NONE                    0xFFFF                                  // Entry latency not measurable
+
+#if DEF_IRQ_STAT_EN
+#define IRQ_STAT_ENTER( id, lat )       IRQ_StatEnter( id, lat )
+#define IRQ_STAT_EXIT( id )             IRQ_StatExit( id )
+#else
+#define IRQ_STAT_ENTER( id, lat )       do{ }while( 0 )
+#define IRQ_STAT_EXIT( id )             do{ }while( 0 )
+#endif
+
+/*******************************************************************************/
+/* Function Declaration */
+extern void IRQ_StatEnter( uint8_t id, uint16_t lat );
+extern void IRQ_StatExit( uint8_t id );
+extern void IRQ_StatDump( void );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
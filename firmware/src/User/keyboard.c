@@ -0,0 +1,366 @@
+#include "keyboard.h"
+#include "mouse.h"
+#include "gpio.h"
+#include "event.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Transmitter states, one TIM1 update per step */
+#define KB_ST_IDLE      0           // TIM1 stopped, nothing to send
+#define KB_ST_NEXT      1           // Take the next code
+#define KB_ST_DATA      2           // Drive KDAT with the next bit
+#define KB_ST_CLK_LOW   3           // Pull KCLK low
+#define KB_ST_CLK_HIGH  4           // Release KCLK, the Amiga samples KDAT on this edge
+#define KB_ST_ACK_ARM   5           // Release KDAT and watch it for the handshake
+#define KB_ST_ACK_CHECK 6           // First wait step, one bit time after the release: KDAT low is the handshake
+#define KB_ST_ACK_WAIT  7           // Count down the handshake timeout, 1mS steps
+#define KB_ST_ACK_END   8           // Handshake seen, wait for the Amiga to release KDAT
+
+/* Ctrl-Amiga-Amiga reset, run from the main loop tick */
+#define KB_RST_IDLE     0
+#define KB_RST_CHORD    1           // Chord down, debouncing
+#define KB_RST_HOLD     2           // Reset lines low
+
+// USB keyboard usage to Amiga raw key code, AMIGA_KEY_NONE if the Amiga has no such key
+static const uint8_t usbToAmiga[] = {
+	AMIGA_KEY_NONE, AMIGA_KEY_NONE, AMIGA_KEY_NONE, AMIGA_KEY_NONE,
+	0x20, 0x35, 0x33, 0x22, 0x12, 0x23, 0x24, 0x25,		// A B C D E F G H
+	0x17, 0x26, 0x27, 0x28, 0x37, 0x36, 0x18, 0x19,		// I J K L M N O P
+	0x10, 0x13, 0x21, 0x14, 0x16, 0x34, 0x11, 0x32,		// Q R S T U V W X
+	0x15, 0x31, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06,		// Y Z 1 2 3 4 5 6
+	0x07, 0x08, 0x09, 0x0A, 0x44, 0x45, 0x41, 0x42,		// 7 8 9 0 Return Esc Backspace Tab
+	0x40, 0x0B, 0x0C, 0x1A, 0x1B, 0x0D, 0x2B, 0x29,		// Space - = [ ] \ Non-US# ;
+	0x2A, 0x00, 0x38, 0x39, 0x3A, AMIGA_KEY_NONE, 0x50, 0x51,	// ' ` , . / CapsLock F1 F2
+	0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,		// F3 .. F10
+	AMIGA_KEY_NONE, AMIGA_KEY_NONE, AMIGA_KEY_NONE, 0x5B,		// F11 F12 PrintScreen ScrollLock=KP)
+	AMIGA_KEY_NONE, 0x5F, AMIGA_KEY_NONE, AMIGA_KEY_NONE,		// Pause Insert=Help Home PageUp
+	0x46, AMIGA_KEY_NONE, AMIGA_KEY_NONE, 0x4E,			// Delete End PageDown Right
+	0x4F, 0x4D, 0x4C, 0x5A,						// Left Down Up NumLock=KP(
+	0x5C, 0x5D, 0x4A, 0x5E, 0x43, 0x1D, 0x1E, 0x1F,		// KP/ KP* KP- KP+ KPEnter KP1 KP2 KP3
+	0x2D, 0x2E, 0x2F, 0x3D, 0x3E, 0x3F, 0x0F, 0x3C,		// KP4 KP5 KP6 KP7 KP8 KP9 KP0 KP.
+	0x30								// Non-US\ left of Z
+};
+
+// Modifier usages 0xE0..0xE7: LCtrl LShift LAlt LGUI RCtrl RShift RAlt RGUI, the Amiga has one Ctrl
+static const uint8_t modToAmiga[8] = { 0x63, 0x60, 0x64, 0x66, 0x63, 0x61, 0x65, 0x67 };
+
+FIFO_Utils_TypeDef KeyBuffer;		// Codes for the Amiga, written by the main loop, read by TIM1
+uint8_t keyHeld[AMIGA_KEY_COUNT];	// USB keys holding each Amiga key, over all keyboards
+uint8_t capsOn = 0;					// Amiga Caps Lock state, the key toggles it
+
+volatile uint8_t kbState = KB_ST_IDLE;
+uint8_t kbCode = 0;					// Code on the line, sent again after a resync
+uint8_t kbShift = 0;				// Bits left to clock out, next one in bit 7
+uint8_t kbBits = 0;					// Bits in this transfer, 8 or 1 while resyncing
+uint8_t kbBit = 0;
+uint16_t kbWait = 0;				// Handshake timeout left
+uint8_t kbResync = 0;				// Last transfer was a single resync bit
+uint8_t kbPowerUp = 0;				// Not in sync since power-up yet
+uint8_t kbSys[3];					// System codes queued ahead of the key codes
+uint8_t kbSysNum = 0;
+uint8_t kbSysPos = 0;
+uint8_t kbFromSys = 0;				// kbCode was taken from kbSys
+uint8_t kbReset = KB_RST_IDLE;
+uint32_t kbResetTime = 0;			// Start of the chord or of the pulse, uS
+
+
+
+static void startKeyboardTimer()
+{
+	TIM1->CNT = 0;
+	TIM1->ATRLR = KB_RELOAD_BIT;
+	TIM_Cmd(TIM1, ENABLE);
+}
+
+// Clock out single 1 bits until the Amiga answers with a handshake
+static void startResync()
+{
+	kbResync = 1;
+	kbShift = 0x80;
+	kbBits = 1;
+	kbBit = 0;
+	kbState = KB_ST_DATA;
+}
+
+// Power-up: get in sync first, then send the (empty) power-up key stream
+static void startPowerUp()
+{
+	kbPowerUp = 1;
+	startResync();
+	startKeyboardTimer();
+}
+
+void InitKeyboard()
+{
+	FifoInit(&KeyBuffer);
+	memset(keyHeld, 0, sizeof(keyHeld));
+	startPowerUp();
+}
+
+// Stop the transmitter and drop every code not sent yet
+static void stopKeyboard()
+{
+	NVIC_DisableIRQ(TIM1_UP_IRQn);
+	TIM_Cmd(TIM1, DISABLE);
+	EXTI->INTENR &= ~EXTI_Line11;
+	kbState = KB_ST_IDLE;
+	kbSysNum = kbSysPos = 0;
+	kbResync = 0;
+	FifoInit(&KeyBuffer);
+	NVIC_EnableIRQ(TIM1_UP_IRQn);
+}
+
+// Queue one code and wake the transmitter if it is idle
+static uint8_t sendKeyboardCode(uint8_t code)
+{
+	if ((kbReset == KB_RST_HOLD) || (FifoWrite(&KeyBuffer, &code, 1) == 0)) {
+		return 0;
+	}
+
+	NVIC_DisableIRQ(TIM1_UP_IRQn);
+	if (kbState == KB_ST_IDLE) {
+		kbState = KB_ST_NEXT;
+		startKeyboardTimer();
+	}
+	NVIC_EnableIRQ(TIM1_UP_IRQn);
+	return 1;
+}
+
+/*
+ * Turn a USB key event into Amiga key codes. An Amiga key goes down with the
+ * first USB key mapped to it and up with the last, so both Ctrl keys or two
+ * keyboards holding Shift do not release it early. A code that does not fit
+ * the queue is lost, that only happens while the Amiga does not answer.
+ */
+void ProcessKeyEvent(uint16_t evt)
+{
+	uint8_t usage = KEY_EVT_USAGE(evt);
+	uint8_t code;
+
+	// The Amiga Caps Lock key latches: one code per press, down when it turns on
+	if (usage == KEY_USAGE_CAPS_LOCK) {
+		if (!(evt & KEY_EVT_UP) && sendKeyboardCode(capsOn ? (AMIGA_KEY_CAPS | AMIGA_KEY_UP) : AMIGA_KEY_CAPS)) {
+			capsOn ^= 1;
+		}
+		return;
+	}
+
+	if (usage >= KEY_USAGE_MOD_FIRST) {
+		code = (usage < KEY_USAGE_MOD_FIRST + 8) ? modToAmiga[usage - KEY_USAGE_MOD_FIRST] : AMIGA_KEY_NONE;
+	} else {
+		code = (usage < sizeof(usbToAmiga)) ? usbToAmiga[usage] : AMIGA_KEY_NONE;
+	}
+	if (code == AMIGA_KEY_NONE) {
+		return;
+	}
+
+	if (evt & KEY_EVT_UP) {
+		if (keyHeld[code] && (--keyHeld[code] == 0)) {
+			sendKeyboardCode(code | AMIGA_KEY_UP);
+		}
+	} else if (keyHeld[code]++ == 0) {
+		sendKeyboardCode(code);
+	}
+
+	// Ctrl-Amiga-Amiga starts the reset debounce, breaking it off stops it
+	if (keyHeld[AMIGA_KEY_CTRL] && keyHeld[AMIGA_KEY_LAMIGA] && keyHeld[AMIGA_KEY_RAMIGA]) {
+		if (kbReset == KB_RST_IDLE) {
+			kbReset = KB_RST_CHORD;
+			kbResetTime = EVT_Now();
+		}
+	} else if (kbReset == KB_RST_CHORD) {
+		kbReset = KB_RST_IDLE;
+	}
+}
+
+/*
+ * Reset sequencing, called on every main loop tick. Once the chord has been
+ * held KB_RESET_CHORD_MS the queued key codes, mouse motion and scroll codes
+ * are dropped and KB_RESET and KCLK go low, for at least KB_RESET_PULSE_MS
+ * and until the chord is let go. Then the lines are released, the queues
+ * dropped again and the keyboard syncs up as after power-up.
+ */
+void ProcessKeyboardTick()
+{
+	uint32_t elapsed;
+
+	if (kbReset == KB_RST_IDLE) {
+		return;
+	}
+	elapsed = EVT_Now() - kbResetTime;
+
+	if (kbReset == KB_RST_CHORD) {
+		if (elapsed < KB_RESET_CHORD_MS * 1000UL) {
+			return;
+		}
+		stopKeyboard();
+		FlushMouse();
+		GPIO_WriteBit(KBD_DATA_GPIO_Port, KBD_DATA_Pin, Bit_SET);
+		GPIO_WriteBit(KBD_CLOCK_GPIO_Port, KBD_CLOCK_Pin, Bit_RESET);
+		GPIO_WriteBit(KB_RESET_GPIO_Port, KB_RESET_GPIO_Pin, Bit_RESET);
+		kbReset = KB_RST_HOLD;
+		kbResetTime = EVT_Now();
+		return;
+	}
+
+	if ((elapsed < KB_RESET_PULSE_MS * 1000UL) ||
+		(keyHeld[AMIGA_KEY_CTRL] && keyHeld[AMIGA_KEY_LAMIGA] && keyHeld[AMIGA_KEY_RAMIGA])) {
+		return;
+	}
+	GPIO_WriteBit(KB_RESET_GPIO_Port, KB_RESET_GPIO_Pin, Bit_SET);
+	GPIO_WriteBit(KBD_CLOCK_GPIO_Port, KBD_CLOCK_Pin, Bit_SET);
+	kbReset = KB_RST_IDLE;
+
+	// The machine comes back with no key down and Caps Lock off
+	FlushMouse();
+	memset(keyHeld, 0, sizeof(keyHeld));
+	capsOn = 0;
+	startPowerUp();
+}
+
+// Pick the next code, system codes first. Returns 0 with nothing to send
+static uint8_t nextKeyboardCode()
+{
+	if (kbSysPos < kbSysNum) {
+		kbCode = kbSys[kbSysPos++];
+		kbFromSys = 1;
+		return 1;
+	}
+	kbSysNum = kbSysPos = 0;
+	kbFromSys = 0;
+	return FifoRead(&KeyBuffer, &kbCode, 1) != 0;
+}
+
+// Back in sync: lost sync code, then the code that failed and the system codes behind it
+static void queueResyncCodes()
+{
+	uint8_t list[3];
+	uint8_t n = 0;
+	uint8_t i;
+
+	if (kbPowerUp) {
+		kbPowerUp = 0;
+		list[n++] = AMIGA_CODE_INIT_POWERUP;
+		list[n++] = AMIGA_CODE_TERM_POWERUP;
+	} else {
+		list[n++] = AMIGA_CODE_LOST_SYNC;
+		if (kbFromSys) {
+			i = kbSysPos - 1;
+			if (kbSys[i] == AMIGA_CODE_LOST_SYNC) {
+				i++;
+			}
+			while (i < kbSysNum) {
+				list[n++] = kbSys[i++];
+			}
+		} else {
+			list[n++] = kbCode;
+		}
+	}
+	memcpy(kbSys, list, n);
+	kbSysNum = n;
+	kbSysPos = 0;
+}
+
+// Handshake seen: settle the code just sent
+static void ackKeyboard()
+{
+	EXTI->INTENR &= ~EXTI_Line11;
+
+	if (kbResync) {
+		kbResync = 0;
+		queueResyncCodes();
+	}
+
+	kbWait = (KB_ACK_TIMEOUT_MS * 1000) / KB_BIT_US;
+	kbState = KB_ST_ACK_END;
+}
+
+/*
+ * TIM1 update, one step of the transmitter. Each bit is KDAT set up, KCLK
+ * low, KCLK high, KB_BIT_US apart. The code is rotated left one bit so the
+ * up/down flag goes last, MSB first, and inverted on the line.
+ */
+void ProcessKeyboard_IRQ()
+{
+	switch (kbState) {
+	case KB_ST_NEXT:
+		if (!nextKeyboardCode()) {
+			TIM_Cmd(TIM1, DISABLE);
+			kbState = KB_ST_IDLE;
+			return;
+		}
+		kbShift = (kbCode << 1) | (kbCode >> 7);
+		kbBits = 8;
+		kbBit = 0;
+		/* fall through */
+
+	case KB_ST_DATA:
+		GPIO_WriteBit(KBD_DATA_GPIO_Port, KBD_DATA_Pin, (kbShift & 0x80) ? Bit_RESET : Bit_SET);
+		kbShift <<= 1;
+		kbState = KB_ST_CLK_LOW;
+		break;
+
+	case KB_ST_CLK_LOW:
+		GPIO_WriteBit(KBD_CLOCK_GPIO_Port, KBD_CLOCK_Pin, Bit_RESET);
+		kbState = KB_ST_CLK_HIGH;
+		break;
+
+	case KB_ST_CLK_HIGH:
+		GPIO_WriteBit(KBD_CLOCK_GPIO_Port, KBD_CLOCK_Pin, Bit_SET);
+		kbState = (++kbBit < kbBits) ? KB_ST_DATA : KB_ST_ACK_ARM;
+		break;
+
+	case KB_ST_ACK_ARM:
+		// KDAT may not have risen yet, its level is only read a bit time later
+		GPIO_WriteBit(KBD_DATA_GPIO_Port, KBD_DATA_Pin, Bit_SET);
+		EXTI->INTFR = EXTI_Line11;
+		EXTI->INTENR |= EXTI_Line11;
+		kbWait = KB_ACK_TIMEOUT_MS;
+		kbState = KB_ST_ACK_CHECK;
+		break;
+
+	case KB_ST_ACK_CHECK:
+		// The handshake may have started before the release, KDAT then stays low
+		if (GPIO_ReadInputDataBit(KBD_DATA_GPIO_Port, KBD_DATA_Pin) == 0) {
+			ackKeyboard();
+		} else {
+			kbState = KB_ST_ACK_WAIT;
+		}
+		break;
+
+	case KB_ST_ACK_WAIT:
+		if (--kbWait == 0) {
+			EXTI->INTENR &= ~EXTI_Line11;
+			startResync();
+		}
+		break;
+
+	case KB_ST_ACK_END:
+		if (GPIO_ReadInputDataBit(KBD_DATA_GPIO_Port, KBD_DATA_Pin) != 0) {
+			kbState = KB_ST_NEXT;
+		} else if (--kbWait == 0) {
+			// KDAT held low for good, the Amiga is off or resetting
+			startResync();
+		}
+		break;
+
+	default:
+		TIM_Cmd(TIM1, DISABLE);
+		kbState = KB_ST_IDLE;
+		return;
+	}
+
+	TIM1->ATRLR = (kbState == KB_ST_ACK_WAIT) ? KB_RELOAD_MS : KB_RELOAD_BIT;
+}
+
+// Falling edge on KDAT while waiting: the Amiga handshake
+void ProcessKeyboardAck_IRQ()
+{
+	if ((kbState != KB_ST_ACK_CHECK) && (kbState != KB_ST_ACK_WAIT)) {
+		return;
+	}
+	ackKeyboard();
+	TIM1->CNT = 0;
+	TIM1->ATRLR = KB_RELOAD_BIT;
+}
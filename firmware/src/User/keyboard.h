@@ -0,0 +1,41 @@
+#ifndef __KEYBOARD_H
+#define __KEYBOARD_H
+
+#include "stdint.h"
+#include "usb_key.h"
+#include "utils.h"
+
+
+
+/* Amiga keyboard serial line, KDAT and KCLK are open drain and active low */
+#define KB_BIT_US               20          // KDAT setup, KCLK low and KCLK high phases of one bit
+#define KB_ACK_TIMEOUT_MS       143         // No handshake within this time: resync
+#define KB_RELOAD_BIT           ((uint16_t)(KB_BIT_US - 1))     // TIM1 reload for one phase, 1uS counter
+#define KB_RELOAD_MS            ((uint16_t)(1000 - 1))          // TIM1 reload while waiting for the handshake
+
+/* Ctrl-Amiga-Amiga reset: KB_RESET (A500) and KCLK (A2000 and later) held low */
+#define KB_RESET_CHORD_MS       100         // Chord held this long before the reset starts
+#define KB_RESET_PULSE_MS       500         // Shortest reset pulse, held on while the chord is
+
+/* Amiga raw key codes, bit 7 set on release */
+#define AMIGA_KEY_UP            0x80
+#define AMIGA_KEY_CAPS          0x62
+#define AMIGA_KEY_CTRL          0x63
+#define AMIGA_KEY_LAMIGA        0x66
+#define AMIGA_KEY_RAMIGA        0x67
+#define AMIGA_KEY_NONE          0xFF
+#define AMIGA_KEY_COUNT         0x68        // Key codes 0x00 .. 0x67
+
+/* Amiga keyboard system codes */
+#define AMIGA_CODE_LOST_SYNC    0xF9
+#define AMIGA_CODE_INIT_POWERUP 0xFD        // Initiate power-up key stream
+#define AMIGA_CODE_TERM_POWERUP 0xFE        // Terminate key stream
+
+
+void InitKeyboard();
+void ProcessKeyEvent(uint16_t evt);
+void ProcessKeyboardTick();
+void ProcessKeyboard_IRQ();
+void ProcessKeyboardAck_IRQ();
+
+#endif
@@ -1,75 +1,93 @@
 #include <usb_gamepad.h>
 #include <usb_mouse.h>
+#include <usb_key.h>
 #include "usb_host_config.h"
+#include "usb_layout_cache.h"
 #include "utils.h"
 #include "tim.h"
 #include "mouse.h"
 #include "gpio.h"
 #include "gamepad.h"
+#include "keyboard.h"
+#include "event.h"
+#include "irq.h"
 
 int main (void) {
+    HID_MOUSE_Data *mousemap;
+    HID_gamepad_Info_TypeDef *gamepad;
+    Interface *itf;
+    uint32_t evt, ready;
+    uint16_t key;
+    uint8_t slot, kind;
+
+    NVIC_PriorityGroupConfig (IRQ_PRIO_GROUP);
     DUG_PRINTF ("SystemClk:%d\r\n", SystemCoreClock);
     Delay_Init();
-    TIM3_Init (9, SystemCoreClock / 10000 - 1);
+    TIM3_Init (999, SystemCoreClock / 1000000 - 1);
+#if DEF_EPROF_EN || DEF_SCHED_RATE_EN || DEF_EVT_DUTY_EN || DEF_IRQ_STAT_EN
+    USART_Printf_Init (115200);
+#endif
 
 #if DEF_USBFS_PORT_EN
     USBFS_RCC_Init();
     USBFS_Host_Init (ENABLE);
     memset (&RootHubDev.bStatus, 0, sizeof (ROOT_HUB_DEVICE));
     memset (&HostCtl[DEF_USBFS_PORT_INDEX * DEF_ONE_USB_SUP_DEV_TOTAL].InterfaceNum, 0, DEF_ONE_USB_SUP_DEV_TOTAL * sizeof (HOST_CTL));
+    LCACHE_Init();
+    KM_SchedInit();
 #endif
 
     TIM2_Init();
     TIM4_Init();
+    TIM1_Init();
     GPIO_Config();
     InitMouse();
+    InitKeyboard();
 
+    // Sleep until an interrupt posts an event
     while (1) {
-        USBH_MainDeal();
-        // Handle HID/Xbox root device
-        if ((RootHubDev.bType == USB_DEV_CLASS_HID) || (RootHubDev.bType == DEF_DEV_TYPE_XBOX360)) {
-
-            for (int itf = 0; itf < DEF_INTERFACE_NUM_MAX; itf++) {
-                // Handle mouse
-                if (HostCtl[0].Interface[itf].HIDRptDesc.type == REPORT_TYPE_MOUSE) {
-                    HID_MOUSE_Data *mousemap = USB_GetMouseInfo (
-                        &HostCtl[0].Interface[itf]);
-                    ProcessMouse (mousemap);
-                }
-
-                if ((HostCtl[0].Interface[itf].HIDRptDesc.type == REPORT_TYPE_JOYSTICK) || (HostCtl[0].Interface[itf].Type == DEC_XBOX360)) {
+        evt = EVT_Wait();
+        if (evt & EVT_MASK_HOST) {
+            USBH_MainDeal();
+        }
+        if (evt & EVT_TICK) {
+            ProcessKeyboardTick();
+        }
 
-                    HID_gamepad_Info_TypeDef *gamepad = GetGamepadInfo (
-                        &HostCtl[0].Interface[itf]);
-                    ProcessGamepad (gamepad);
-                }
+        // Key events of all keyboards, in order
+        if (evt & EVT_KEY) {
+            while (KEY_Take (&key)) {
+                ProcessKeyEvent (key);
             }
         }
 
-        // Handle HUB Device
-
-        if (RootHubDev.bType == USB_DEV_CLASS_HUB) {
-
-            // Iterate over all devices
-            for (uint8_t device = 1; device < 5; device++) {
-                // Iterate over all interfaces
-                for (int itf = 0; itf < DEF_INTERFACE_NUM_MAX; itf++) {
-
-                    // Handle mouse
-                    if (HostCtl[device].Interface[itf].HIDRptDesc.type == REPORT_TYPE_MOUSE) {
-                        HID_MOUSE_Data *mousemap = USB_GetMouseInfo (
-                            &HostCtl[device].Interface[itf]);
-                        ProcessMouse (mousemap);
-                    }
-
-                    if ((HostCtl[device].Interface[itf].HIDRptDesc.type == REPORT_TYPE_JOYSTICK) || (HostCtl[device].Interface[itf].Type == DEC_XBOX360)) {
+        // Handle the mouse and game controller interfaces that received reports
+        ready = (evt & EVT_REPORT) ? KM_LiveTake() : 0;
+        while (ready) {
+            slot = __builtin_ctz (ready);
+            ready &= ready - 1;
+            itf = KM_LiveItf (slot, &kind);
+            if (itf == NULL) {
+                continue;
+            }
 
-                        HID_gamepad_Info_TypeDef *gamepad = GetGamepadInfo (
-                            &HostCtl[device].Interface[itf]);
-                        ProcessGamepad (gamepad);
-                    }
+            // Drain the FIFO, reports landing meanwhile set the bit again
+            if (kind == KM_LIVE_MOUSE) {
+                while ((mousemap = USB_GetMouseInfo (itf)) != NULL) {
+                    ProcessMouse (mousemap);
+                }
+            } else if (kind == KM_LIVE_PAD) {
+                while ((gamepad = GetGamepadInfo (itf)) != NULL) {
+                    ProcessGamepad (gamepad);
                 }
             }
         }
+
+#if DEF_EVT_DUTY_EN
+        EVT_DutyDump();
+#endif
+#if DEF_IRQ_STAT_EN
+        IRQ_StatDump();
+#endif
     }
 }
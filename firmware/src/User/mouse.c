@@ -11,6 +11,10 @@ volatile int16_t mouseDistanceX = 0;		// Distance left for mouse to move
 volatile int16_t mouseDistanceY = 0;		// Distance left for mouse to move
 volatile uint8_t xTimerTop = 1;				// X axis timer TOP value
 volatile uint8_t yTimerTop = 1;				// Y axis timer TOP value
+static volatile int16_t mouseSpeedX = 0;	// Stick mouse speed, counts per second
+static volatile int16_t mouseSpeedY = 0;
+static int16_t mouseFracX = 0;				// Motion short of a whole count, 1/1000 counts
+static int16_t mouseFracY = 0;
 FIFO_Utils_TypeDef ScrollBuffer;
 uint8_t code = 0;
 volatile uint8_t AmigaACK = 0;
@@ -154,6 +158,9 @@ void ProcessMouse(HID_MOUSE_Data *mousemap) {
 
 
 	if (mousemap == NULL) return;
+
+		// A mouse takes pin 5 back for the scroll handshake
+		SetPin5Owner(PIN5_SCROLL);
 		// +X = Mouse going right
 		// -X = Mouse going left
 		// +Y = Mouse going down
@@ -229,6 +236,74 @@ void ProcessMouse(HID_MOUSE_Data *mousemap) {
 
 }
 
+// Drop buffered motion and scroll codes, the Amiga is being reset
+void FlushMouse()
+{
+	mouseDistanceX = 0;
+	mouseDistanceY = 0;
+
+	NVIC_DisableIRQ(EXTI15_10_IRQn);
+	FifoInit(&ScrollBuffer);
+	NVIC_EnableIRQ(EXTI15_10_IRQn);
+
+	GPIO_WriteBit(LB_GPIO_Port, LB_Pin, Bit_SET);
+	GPIO_WriteBit(RB_GPIO_Port, RB_Pin, Bit_SET);
+	previousMMB = 0;
+}
+
+// Stick mouse speed in counts per second, 0 stops. Integrated by the 1mS tick
+void SetMouseSpeed(int16_t x, int16_t y)
+{
+	mouseSpeedX = x;
+	mouseSpeedY = y;
+}
+
+// One axis of the 1mS step: whole counts go to the quadrature buffer, the
+// step time follows the speed so the output keeps up without bunching
+static void stepMouseAxis(int16_t speed, int16_t *frac, uint8_t axis)
+{
+	int16_t units;
+	uint32_t top;
+	volatile int16_t *distance = (axis == MOUSEX) ? &mouseDistanceX : &mouseDistanceY;
+	volatile int8_t *direction = (axis == MOUSEX) ? &mouseDirectionX : &mouseDirectionY;
+	IRQn_Type irq = (axis == MOUSEX) ? TIM2_IRQn : TIM4_IRQn;
+
+	if (speed == 0) {
+		*frac = 0;
+		return;
+	}
+	*frac += speed;
+	units = *frac / 1000;
+	*frac -= units * 1000;
+
+	top = 1000000UL / ((uint32_t)abs(speed) * Q_TICK_US);
+	top = (top > 256) ? 255 : ((top > 1) ? top - 1 : 0);
+	if (axis == MOUSEX)
+		xTimerTop = (uint8_t)top;
+	else
+		yTimerTop = (uint8_t)top;
+
+	if (units == 0)
+		return;
+
+	// The quadrature timer preempts this tick
+	NVIC_DisableIRQ(irq);
+	if ((units > 0) != (*direction == 1)) {
+		*distance = 0;
+		*direction = (units > 0);
+	}
+	*distance += abs(units);
+	if (*distance > Q_BUFFERLIMIT)
+		*distance = Q_BUFFERLIMIT;
+	NVIC_EnableIRQ(irq);
+}
+
+void ProcessMouseSpeed_IRQ()
+{
+	stepMouseAxis(mouseSpeedX, &mouseFracX, MOUSEX);
+	stepMouseAxis(mouseSpeedY, &mouseFracY, MOUSEY);
+}
+
 void ProcessX_IRQ() {
 
 
@@ -267,9 +342,9 @@ void ProcessX_IRQ() {
 
 	// Set the timer top value for the next interrupt
 	if (xTimerTop == 0) {
-		TIM2->ATRLR = 1;
+		TIM2->ATRLR = Q_RELOAD(1);
 	} else {
-		TIM2->ATRLR = xTimerTop;
+		TIM2->ATRLR = Q_RELOAD(xTimerTop);
 	}
 
 }
@@ -314,9 +389,9 @@ void ProcessY_IRQ() {
 
 // Set the timer top value for the next interrupt
 	if (yTimerTop == 0) {
-		TIM4->ATRLR = 1;
+		TIM4->ATRLR = Q_RELOAD(1);
 	} else {
-		TIM4->ATRLR = yTimerTop;
+		TIM4->ATRLR = Q_RELOAD(yTimerTop);
 	}
 
 }
@@ -13,6 +13,8 @@
 #define Q_RATELIMIT         500
 #define Q_BUFFERLIMIT       300
 #define DPI_DIVIDER         2
+#define Q_TICK_US           130         // Step time unit of the quadrature timers, xTimerTop counts these
+#define Q_RELOAD(top)       ((uint16_t)(((top) + 1) * Q_TICK_US - 1))   // Timer reload for top + 1 units, 1uS counter
 #define CODE_MMB_UP         0b1110
 #define CODE_MMB_DOWN       0b1101
 #define CODE_WHEEL_UP       0b1011
@@ -27,6 +29,9 @@
 
 void InitMouse();
 void ProcessMouse(HID_MOUSE_Data *mousemap);
+void FlushMouse();
+void SetMouseSpeed(int16_t x, int16_t y);
+void ProcessMouseSpeed_IRQ();
 void ProcessX_IRQ();
 void ProcessY_IRQ();
 void ProcessScrollIRQ();
@@ -1,8 +1,11 @@
 #include "tim.h"
 #include "mouse.h"
+#include "keyboard.h"
+#include "irq.h"
 
 void TIM2_IRQHandler(void) __attribute__((interrupt("WCH-Interrupt-fast")));
 void TIM4_IRQHandler(void) __attribute__((interrupt("WCH-Interrupt-fast")));
+void TIM1_UP_IRQHandler(void) __attribute__((interrupt("WCH-Interrupt-fast")));
 
 
 void TIM2_Init( void )
@@ -16,8 +19,8 @@ void TIM2_Init( void )
     RCC_APB1PeriphClockCmd( RCC_APB1Periph_TIM2, ENABLE );
 
     /* Initialize Timer2 */
-    TIM_TimeBaseStructure.TIM_Period = 1000;
-    TIM_TimeBaseStructure.TIM_Prescaler = 18720-1;
+    TIM_TimeBaseStructure.TIM_Period = Q_RELOAD( 1 );
+    TIM_TimeBaseStructure.TIM_Prescaler = SystemCoreClock / 1000000 - 1;
     TIM_TimeBaseStructure.TIM_ClockDivision = TIM_CKD_DIV1;
     TIM_TimeBaseStructure.TIM_CounterMode = TIM_CounterMode_Up;
     TIM_TimeBaseInit( TIM2, &TIM_TimeBaseStructure );
@@ -25,8 +28,8 @@ void TIM2_Init( void )
     TIM_ITConfig( TIM2, TIM_IT_Update, ENABLE );
 
     NVIC_InitStructure.NVIC_IRQChannel = TIM2_IRQn;
-    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 4;
-    NVIC_InitStructure.NVIC_IRQChannelSubPriority = 1;
+    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = IRQ_PREEMPT_QUAD;
+    NVIC_InitStructure.NVIC_IRQChannelSubPriority = IRQ_SUB_QUAD;
     NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
     NVIC_Init( &NVIC_InitStructure );
 
@@ -49,8 +52,8 @@ void TIM4_Init( void )
     RCC_APB1PeriphClockCmd( RCC_APB1Periph_TIM4, ENABLE );
 
     /* Initialize Timer4 */
-    TIM_TimeBaseStructure.TIM_Period = 1000;
-    TIM_TimeBaseStructure.TIM_Prescaler = 18720-1;
+    TIM_TimeBaseStructure.TIM_Period = Q_RELOAD( 1 );
+    TIM_TimeBaseStructure.TIM_Prescaler = SystemCoreClock / 1000000 - 1;
     TIM_TimeBaseStructure.TIM_ClockDivision = TIM_CKD_DIV1;
     TIM_TimeBaseStructure.TIM_CounterMode = TIM_CounterMode_Up;
     TIM_TimeBaseInit( TIM4, &TIM_TimeBaseStructure );
@@ -58,8 +61,8 @@ void TIM4_Init( void )
     TIM_ITConfig( TIM4, TIM_IT_Update, ENABLE );
 
     NVIC_InitStructure.NVIC_IRQChannel = TIM4_IRQn;
-    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = 3;
-    NVIC_InitStructure.NVIC_IRQChannelSubPriority = 1;
+    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = IRQ_PREEMPT_QUAD;
+    NVIC_InitStructure.NVIC_IRQChannelSubPriority = IRQ_SUB_QUAD;
     NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
     NVIC_Init( &NVIC_InitStructure );
 
@@ -71,26 +74,73 @@ void TIM4_Init( void )
 
 }
 
+void TIM1_Init( void )
+{
+
+
+    TIM_TimeBaseInitTypeDef TIM_TimeBaseStructure = { 0 };
+    NVIC_InitTypeDef NVIC_InitStructure = { 0 };
+
+    /* Enable Timer1 Clock */
+    RCC_APB2PeriphClockCmd( RCC_APB2Periph_TIM1, ENABLE );
+
+    /* Initialize Timer1, started by the keyboard transmitter when it has a code */
+    TIM_TimeBaseStructure.TIM_Period = KB_RELOAD_BIT;
+    TIM_TimeBaseStructure.TIM_Prescaler = SystemCoreClock / 1000000 - 1;
+    TIM_TimeBaseStructure.TIM_ClockDivision = TIM_CKD_DIV1;
+    TIM_TimeBaseStructure.TIM_CounterMode = TIM_CounterMode_Up;
+    TIM_TimeBaseStructure.TIM_RepetitionCounter = 0;
+    TIM_TimeBaseInit( TIM1, &TIM_TimeBaseStructure );
+
+    /* The init raised an update, drop it */
+    TIM_ClearITPendingBit( TIM1, TIM_IT_Update );
+    TIM_ITConfig( TIM1, TIM_IT_Update, ENABLE );
+
+    NVIC_InitStructure.NVIC_IRQChannel = TIM1_UP_IRQn;
+    NVIC_InitStructure.NVIC_IRQChannelPreemptionPriority = IRQ_PREEMPT_KBD;
+    NVIC_InitStructure.NVIC_IRQChannelSubPriority = IRQ_SUB_KBD;
+    NVIC_InitStructure.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init( &NVIC_InitStructure );
+
+    /* Enable timer1 interrupt */
+    NVIC_EnableIRQ( TIM1_UP_IRQn );
+
+}
+
 
 
 void TIM2_IRQHandler( void )
 {
-
+    IRQ_STAT_ENTER( IRQ_ID_QUAD_X, TIM2->CNT );
     if( TIM_GetITStatus( TIM2, TIM_IT_Update ) != RESET )
     {
     	ProcessX_IRQ();
         /* Clear interrupt flag */
         TIM_ClearITPendingBit( TIM2, TIM_IT_Update );
     }
+    IRQ_STAT_EXIT( IRQ_ID_QUAD_X );
 }
 
 void TIM4_IRQHandler( void )
 {
-
+    IRQ_STAT_ENTER( IRQ_ID_QUAD_Y, TIM4->CNT );
     if( TIM_GetITStatus( TIM4, TIM_IT_Update ) != RESET )
     {
     	 ProcessY_IRQ();
         /* Clear interrupt flag */
         TIM_ClearITPendingBit( TIM4, TIM_IT_Update );
     }
+    IRQ_STAT_EXIT( IRQ_ID_QUAD_Y );
+}
+
+void TIM1_UP_IRQHandler( void )
+{
+    IRQ_STAT_ENTER( IRQ_ID_KBD, TIM1->CNT );
+    if( TIM_GetITStatus( TIM1, TIM_IT_Update ) != RESET )
+    {
+        /* Clear first, the handler may restart the counter */
+        TIM_ClearITPendingBit( TIM1, TIM_IT_Update );
+        ProcessKeyboard_IRQ();
+    }
+    IRQ_STAT_EXIT( IRQ_ID_KBD );
 }
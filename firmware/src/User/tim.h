@@ -5,9 +5,11 @@
 
 void TIM2_Init( void );
 void TIM4_Init( void );
+void TIM1_Init( void );
 
 
 void TIM2_IRQHandler( void );
 void TIM4_IRQHandler( void );
+void TIM1_UP_IRQHandler( void );
 
 #endif /*__CH32V10x_SYSTEM_H */
@@ -1,87 +1,84 @@
 #include "utils.h"
 #include <stdint.h>
 
+// Compiler barrier: the ring bytes are not volatile, so without it the
+// copy could be moved past the index store that hands them to the other side
+#define FIFO_BARRIER()  __asm__ volatile("" ::: "memory")
+
 
 void FifoInit(FIFO_Utils_TypeDef *f)
 {
   f->head = 0U;
   f->tail = 0U;
-  f->lock = 0U;
   f->size = 128U;
   f->buf = f->buffArr;
 }
 
 
+// Single producer / single consumer: only FifoWrite moves head and only
+// FifoRead moves tail, so one side may run in an interrupt without a lock.
 uint16_t FifoRead(FIFO_Utils_TypeDef *f, void *buf, uint16_t nbytes)
 {
   uint16_t i;
+  uint16_t tail;
   uint8_t *p;
 
   p = (uint8_t *) buf;
+  tail = f->tail;
 
-  if (f->lock == 0U)
+  for (i = 0U; i < nbytes; i++)
   {
-    f->lock = 1U;
+    if (tail == f->head)
+    {
+      break;
+    }
 
-    for (i = 0U; i < nbytes; i++)
+    *p++ = f->buf[tail];
+    tail++;
+
+    if (tail == f->size)
     {
-      if (f->tail != f->head)
-      {
-        *p++ = f->buf[f->tail];
-        f->tail++;
-
-        if (f->tail == f->size)
-        {
-          f->tail = 0U;
-        }
-      }
-      else
-      {
-        f->lock = 0U;
-        return i;
-      }
+      tail = 0U;
     }
   }
 
-  f->lock = 0U;
+  FIFO_BARRIER();
+  f->tail = tail;
 
-  return nbytes;
+  return i;
 }
 
 
+// Writes all nbytes or nothing, so reports never get split in the ring
 uint16_t FifoWrite(FIFO_Utils_TypeDef *f, void *buf, uint16_t  nbytes)
 {
   uint16_t i;
+  uint16_t head;
+  uint16_t used;
   uint8_t *p;
 
   p = (uint8_t *) buf;
+  head = f->head;
+  used = (head >= f->tail) ? (head - f->tail) : (f->size - f->tail + head);
+
+  if (nbytes >= f->size - used)
+  {
+    return 0U;
+  }
 
-  if (f->lock == 0U)
+  for (i = 0U; i < nbytes; i++)
   {
-    f->lock = 1U;
+    f->buf[head] = *p++;
+    head++;
 
-    for (i = 0U; i < nbytes; i++)
+    if (head == f->size)
     {
-      if ((f->head + 1U == f->tail) ||
-          ((f->head + 1U == f->size) && (f->tail == 0U)))
-      {
-        f->lock = 0U;
-        return i;
-      }
-      else
-      {
-        f->buf[f->head] = *p++;
-        f->head++;
-
-        if (f->head == f->size)
-        {
-          f->head = 0U;
-        }
-      }
+      head = 0U;
     }
   }
 
-  f->lock = 0U;
+  FIFO_BARRIER();
+  f->head = head;
 
   return nbytes;
 }
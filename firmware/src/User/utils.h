@@ -12,10 +12,9 @@ typedef enum
 typedef struct
 {
   uint8_t  *buf;
-  uint16_t  head;
-  uint16_t tail;
+  volatile uint16_t head;
+  volatile uint16_t tail;
   uint16_t size;
-  uint8_t  lock;
   uint8_t  buffArr[128];
 } FIFO_Utils_TypeDef;
 
@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+"""Summarize the main loop duty cycle printed by the firmware.
+
+Build the firmware with DEF_EVT_DUTY_EN set to 1 in usb_host_config.h.
+Once per DEF_EVT_DUTY_PERIOD mS it then prints one CSV line
+
+    DU,<t_ms>,<window_us>,<busy_us>,<wakeups>,<tick>,<detect>,<ctrl>,<poll>,<report>,<scroll>,<host>,<key>
+
+over the debug UART. Busy is the time the core was not sleeping in WFI,
+interrupts included. The event columns count the main loop passes each
+event took part in, several events may wake the same pass.
+
+Usage:
+    duty_cycle.py capture.log [more.log ...]
+    duty_cycle.py --serial /dev/ttyUSB0 --baud 115200 > capture.log
+    duty_cycle.py --skip 2 capture.log
+"""
+
+import argparse
+import sys
+
+EVENTS = ("tick", "detect", "ctrl", "poll", "report", "scroll", "host", "key")
+KEYS = ("t_ms", "window_us", "busy_us", "wakeups") + EVENTS
+
+
+def parse_lines(lines):
+    """Yield one dict per DU record, ignoring other output."""
+    for line in lines:
+        line = line.strip()
+        if not line.startswith("DU,"):
+            continue
+        fields = line.split(",")
+        if fields[1] == "t_ms":
+            continue
+        try:
+            values = [int(v) for v in fields[1:]]
+        except ValueError:
+            sys.stderr.write("warning: bad line: %s\n" % line)
+            continue
+        if len(values) != len(KEYS):
+            sys.stderr.write("warning: bad line: %s\n" % line)
+            continue
+        yield dict(zip(KEYS, values))
+
+
+def read_serial(port, baud):
+    import serial                           # pyserial, only needed for live capture
+
+    with serial.Serial(port, baud, timeout=1) as ser:
+        while True:
+            line = ser.readline().decode("ascii", "replace")
+            if line:
+                sys.stdout.write(line)
+                sys.stdout.flush()
+
+
+def print_summary(records):
+    window = sum(r["window_us"] for r in records)
+    busy = sum(r["busy_us"] for r in records)
+    duty = [100.0 * r["busy_us"] / r["window_us"] for r in records if r["window_us"]]
+
+    print("windows %d  time %.1f s" % (len(records), window / 1e6))
+    print("busy    mean %.2f %%  min %.2f %%  max %.2f %%  headroom %.2f %%"
+          % (100.0 * busy / window, min(duty), max(duty), 100.0 - max(duty)))
+    print()
+    print("%-8s %10s %10s" % ("source", "total", "per s"))
+    for key in ("wakeups",) + EVENTS:
+        total = sum(r[key] for r in records)
+        print("%-8s %10d %10.1f" % (key, total, total * 1e6 / window))
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("logs", nargs="*", help="capture files, '-' for stdin")
+    ap.add_argument("--serial", help="capture live from this port and echo to stdout")
+    ap.add_argument("--baud", type=int, default=115200)
+    ap.add_argument("--skip", type=int, default=1, help="windows dropped, the first one starts at power-up")
+    args = ap.parse_args()
+
+    if args.serial:
+        read_serial(args.serial, args.baud)
+        return
+
+    lines = []
+    for name in args.logs or ["-"]:
+        if name == "-":
+            lines.extend(sys.stdin)
+        else:
+            with open(name, encoding="ascii", errors="replace") as f:
+                lines.extend(f)
+
+    records = list(parse_lines(lines))[args.skip:]
+    if not records:
+        sys.exit("no duty cycle record found")
+    print_summary(records)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,188 @@
+#!/usr/bin/env python3
+"""Aggregate enumeration profiles printed by the firmware.
+
+Build the firmware with DEF_EPROF_EN set to 1 in usb_host_config.h. Every
+enumeration then prints CSV lines of the form
+
+    EP,<seq>,<port>,<stage>,<t_us>,<arg>
+
+over the debug UART. A record marks the start of a phase; the phase lasts
+until the next record of the same port. Port 255 is the device on the USB
+host port, other values are HUB port nodes of the device tree.
+
+Usage:
+    enum_profile.py capture.log [more.log ...]
+    enum_profile.py --serial /dev/ttyUSB0 --baud 115200 > capture.log
+    enum_profile.py --runs runs.csv capture.log
+"""
+
+import argparse
+import csv
+import sys
+from collections import defaultdict
+
+
+class Run:
+    def __init__(self, port, start):
+        self.port = port
+        self.start = start
+        self.vid = None
+        self.pid = None
+        self.result = None
+        self.retries = 0
+        self.rep_retries = 0
+        self.cache_hit = False
+        self.phases = defaultdict(int)      # stage -> uS
+        self._stage = "start"
+        self._since = start
+
+    def mark(self, stage, t_us, arg):
+        if stage == "vid":
+            self.vid = arg
+            return
+        if stage == "pid":
+            self.pid = arg
+            return
+        if stage == "retry":
+            self.retries += 1
+            return
+        if stage == "rep_retry":
+            self.rep_retries += 1
+            return
+        self.phases[self._stage] += (t_us - self._since) & 0xFFFFFFFF
+        self._stage = stage
+        self._since = t_us
+        if stage == "rep_desc" and arg == 1:
+            self.cache_hit = True
+        if stage == "done":
+            self.result = arg
+
+    @property
+    def total(self):
+        return (self._since - self.start) & 0xFFFFFFFF
+
+    @property
+    def device(self):
+        if self.vid is None or self.pid is None:
+            return "unknown"
+        return "%04x:%04x" % (self.vid, self.pid)
+
+
+def parse_lines(lines):
+    """Yield (port, stage, t_us, arg) from a capture, ignoring other output."""
+    for line in lines:
+        line = line.strip()
+        if not line.startswith("EP,"):
+            continue
+        fields = line.split(",")
+        if fields[1] == "seq":
+            continue
+        if fields[1] == "lost":
+            sys.stderr.write("warning: %s records lost on the target\n" % fields[2])
+            continue
+        try:
+            yield int(fields[2]), fields[3], int(fields[4]), int(fields[5])
+        except (IndexError, ValueError):
+            sys.stderr.write("warning: bad line: %s\n" % line)
+
+
+def collect_runs(records):
+    runs = []
+    open_runs = {}
+    for port, stage, t_us, arg in records:
+        if stage == "start":
+            open_runs[port] = Run(port, t_us)
+            continue
+        run = open_runs.get(port)
+        if run is None:
+            continue
+        run.mark(stage, t_us, arg)
+        if stage == "done":
+            runs.append(run)
+            del open_runs[port]
+    return runs
+
+
+def read_serial(port, baud):
+    import serial                           # pyserial, only needed for live capture
+
+    with serial.Serial(port, baud, timeout=1) as ser:
+        while True:
+            line = ser.readline().decode("ascii", "replace")
+            if line:
+                sys.stdout.write(line)
+                sys.stdout.flush()
+
+
+def print_summary(runs):
+    by_device = defaultdict(list)
+    for run in runs:
+        by_device[run.device].append(run)
+
+    for device in sorted(by_device):
+        group = by_device[device]
+        ok = [r for r in group if r.result == 0]
+        print("%s  runs %d  ok %d  retries %d  rep_retries %d  cache hits %d"
+              % (device, len(group), len(ok), sum(r.retries for r in group),
+                 sum(r.rep_retries for r in group), sum(r.cache_hit for r in group)))
+        stages = []
+        for run in group:
+            for stage in run.phases:
+                if stage not in stages:
+                    stages.append(stage)
+        print("  %-10s %6s %10s %10s %10s" % ("phase", "n", "mean ms", "min ms", "max ms"))
+        for stage in stages + ["total"]:
+            if stage == "total":
+                values = [r.total for r in group]
+            else:
+                values = [r.phases[stage] for r in group if stage in r.phases]
+            print("  %-10s %6d %10.2f %10.2f %10.2f"
+                  % (stage, len(values), sum(values) / len(values) / 1000.0,
+                     min(values) / 1000.0, max(values) / 1000.0))
+        print()
+
+
+def write_runs(runs, path):
+    stages = []
+    for run in runs:
+        for stage in run.phases:
+            if stage not in stages:
+                stages.append(stage)
+    with open(path, "w", newline="") as f:
+        out = csv.writer(f)
+        out.writerow(["device", "port", "result", "retries", "rep_retries", "cache_hit", "total_us"] + stages)
+        for run in runs:
+            out.writerow([run.device, run.port, run.result, run.retries, run.rep_retries,
+                          int(run.cache_hit), run.total] + [run.phases.get(s, "") for s in stages])
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("logs", nargs="*", help="capture files, '-' for stdin")
+    ap.add_argument("--serial", help="capture live from this port and echo to stdout")
+    ap.add_argument("--baud", type=int, default=115200)
+    ap.add_argument("--runs", help="also write one CSV row per run to this file")
+    args = ap.parse_args()
+
+    if args.serial:
+        read_serial(args.serial, args.baud)
+        return
+
+    lines = []
+    for name in args.logs or ["-"]:
+        if name == "-":
+            lines.extend(sys.stdin)
+        else:
+            with open(name, encoding="ascii", errors="replace") as f:
+                lines.extend(f)
+
+    runs = collect_runs(parse_lines(lines))
+    if not runs:
+        sys.exit("no complete enumeration found")
+    print_summary(runs)
+    if args.runs:
+        write_runs(runs, args.runs)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+"""Summarize the interrupt timing statistics printed by the firmware.
+
+Build the firmware with DEF_IRQ_STAT_EN set to 1 in usb_host_config.h.
+Once per DEF_IRQ_STAT_PERIOD mS it then prints one CSV line per handler:
+
+    IS,<t_ms>,<irq>,<count>,<lat_max>,<lat_over>,<exec_max>,<exec_mean>
+
+over the debug UART, times in uS. The entry latency is only known for the
+timer interrupts (quad_x, quad_y, tick, kbd), the others print "na". lat_over
+counts entries later than DEF_IRQ_LAT_TARGET_US.
+
+Run a capture while devices enumerate and the wheel scrolls, then check the
+quadrature steps against the jitter budget:
+
+    irq_latency.py --target 20 capture.log
+
+The exit status is 1 if a quadrature step was later than the target.
+
+Usage:
+    irq_latency.py capture.log [more.log ...]
+    irq_latency.py --serial /dev/ttyUSB0 --baud 115200 > capture.log
+"""
+
+import argparse
+import sys
+from collections import OrderedDict
+
+QUAD = ("quad_x", "quad_y")
+
+
+def parse_lines(lines):
+    """Yield one dict per IS record, ignoring other output."""
+    keys = ("t_ms", "irq", "count", "lat_max", "lat_over", "exec_max", "exec_mean")
+    for line in lines:
+        line = line.strip()
+        if not line.startswith("IS,"):
+            continue
+        fields = line.split(",")
+        if fields[1] == "t_ms" or len(fields) != len(keys) + 1:
+            continue
+        try:
+            rec = dict(zip(keys, fields[1:]))
+            for k in keys:
+                if k == "irq":
+                    continue
+                rec[k] = None if rec[k] == "na" else int(rec[k])
+        except ValueError:
+            sys.stderr.write("warning: bad line: %s\n" % line)
+            continue
+        yield rec
+
+
+def read_serial(port, baud):
+    import serial                           # pyserial, only needed for live capture
+
+    with serial.Serial(port, baud, timeout=1) as ser:
+        while True:
+            line = ser.readline().decode("ascii", "replace")
+            if line:
+                sys.stdout.write(line)
+                sys.stdout.flush()
+
+
+def summarize(records):
+    by_irq = OrderedDict()
+    for rec in records:
+        by_irq.setdefault(rec["irq"], []).append(rec)
+
+    print("%-8s %7s %10s %9s %9s %9s %9s"
+          % ("irq", "periods", "count", "lat_max", "lat_over", "exec_max", "exec_mean"))
+    worst = {}
+    for irq, group in by_irq.items():
+        count = sum(r["count"] for r in group)
+        lats = [r["lat_max"] for r in group if r["lat_max"] is not None]
+        lat_max = max(lats) if lats else None
+        exec_sum = sum(r["exec_mean"] * r["count"] for r in group)
+        worst[irq] = (lat_max, sum(r["lat_over"] for r in group))
+        print("%-8s %7d %10d %9s %9d %9d %9.1f"
+              % (irq, len(group), count, "na" if lat_max is None else lat_max, worst[irq][1],
+                 max(r["exec_max"] for r in group), exec_sum / count if count else 0.0))
+    return worst
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("logs", nargs="*", help="capture files, '-' for stdin")
+    ap.add_argument("--serial", help="capture live from this port and echo to stdout")
+    ap.add_argument("--baud", type=int, default=115200)
+    ap.add_argument("--target", type=int, help="quadrature entry latency budget, uS")
+    args = ap.parse_args()
+
+    if args.serial:
+        read_serial(args.serial, args.baud)
+        return
+
+    lines = []
+    for name in args.logs or ["-"]:
+        if name == "-":
+            lines.extend(sys.stdin)
+        else:
+            with open(name, encoding="ascii", errors="replace") as f:
+                lines.extend(f)
+
+    records = list(parse_lines(lines))
+    if not records:
+        sys.exit("no interrupt timing record found")
+    worst = summarize(records)
+
+    if args.target is not None:
+        late = [irq for irq in QUAD if irq in worst and worst[irq][0] is not None and worst[irq][0] > args.target]
+        print()
+        if late:
+            print("FAIL: %s above %d uS" % (", ".join(late), args.target))
+            sys.exit(1)
+        print("PASS: quadrature entry latency within %d uS" % args.target)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,285 @@
+/*
+ * Host benchmark of the keyboard key engine (User/USB_Host/usb_key.c).
+ *
+ * Replays a keyboard report trace through KEY_Decode/KEY_Diff, drains the
+ * event queue after every report and checks that the events rebuild the
+ * pressed set exactly. Boot reports are also run through a naive diff of
+ * the 6-key arrays, the way two reports are compared by searching one in
+ * the other, for reference.
+ *
+ * Build:
+ *     cc -O2 -Wall -I../src/User/USB_Host -o key_bench key_bench.c ../src/User/USB_Host/usb_key.c
+ *
+ * Record a trace while typing, one report per line in hex, for example with
+ *     usbhid-dump -m 046d:c31c -i 0 -es > typing.txt
+ * (usbhid-dump header lines are skipped), then
+ *     key_bench typing.txt
+ *     key_bench -n 1 nkro.txt          NKRO: modifiers in byte 0, bitmap of
+ *                                      usages 0.. from byte 1
+ * Without a file a synthetic typing trace is generated:
+ *     key_bench -c 200000 -s 1
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include "usb_key.h"
+
+#define REPORT_MAX  64
+
+typedef struct {
+    uint8_t len;
+    uint8_t buf[REPORT_MAX];
+} report_t;
+
+static report_t *trace;
+static size_t trace_num, trace_cap;
+
+static void add_report(const uint8_t *buf, uint8_t len)
+{
+    if (trace_num == trace_cap) {
+        trace_cap = trace_cap ? trace_cap * 2 : 4096;
+        trace = realloc(trace, trace_cap * sizeof(report_t));
+        if (trace == NULL) {
+            perror("realloc");
+            exit(2);
+        }
+    }
+    trace[trace_num].len = len;
+    memcpy(trace[trace_num].buf, buf, len);
+    trace_num++;
+}
+
+/* One report per line of hex bytes, lines holding anything else are skipped */
+static void load_trace(FILE *f)
+{
+    char line[512];
+    uint8_t buf[REPORT_MAX];
+    unsigned v;
+    int len, n, pos;
+    char *p;
+
+    while (fgets(line, sizeof(line), f)) {
+        len = 0;
+        for (p = line; *p; p += pos) {
+            while (isspace((unsigned char)*p)) {
+                p++;
+            }
+            if (*p == 0) {
+                break;
+            }
+            n = sscanf(p, "%2x%n", &v, &pos);
+            if ((n != 1) || (pos != 2) || !(isspace((unsigned char)p[2]) || p[2] == 0) || (len == REPORT_MAX)) {
+                len = -1;
+                break;
+            }
+            buf[len++] = (uint8_t)v;
+        }
+        if (len > 0) {
+            add_report(buf, (uint8_t)len);
+        }
+    }
+}
+
+/* Typing: letters and digits with some shifted, the next key often goes
+ * down before the previous one is up, as in fast typing */
+static void synth_trace(size_t count, unsigned seed, int nkro_off)
+{
+    uint8_t held[6] = { 0 };
+    uint8_t buf[REPORT_MAX];
+    uint8_t mods = 0, key, len;
+    size_t n;
+    int i, j;
+
+    srand(seed);
+    len = nkro_off ? (uint8_t)(nkro_off + 32) : 8;
+    for (n = 0; n < count; n++) {
+        i = rand() % 6;
+        if (held[i]) {
+            held[i] = 0;                        /* release */
+            if ((rand() % 4) == 0) {
+                mods = 0;
+            }
+        } else {
+            key = 0x04 + rand() % 36;           /* a .. z, 1 .. 0 */
+            for (j = 0; j < 6; j++) {
+                if (held[j] == key) {
+                    break;
+                }
+            }
+            if (j == 6) {
+                held[i] = key;
+            }
+            if ((rand() % 8) == 0) {
+                mods = 0x02;                    /* left shift */
+            }
+        }
+
+        memset(buf, 0, sizeof(buf));
+        buf[0] = mods;
+        for (i = 0, j = 0; i < 6; i++) {
+            if (held[i] == 0) {
+                continue;
+            }
+            if (nkro_off) {
+                buf[nkro_off + held[i] / 8] |= 1 << (held[i] % 8);
+            } else {
+                buf[2 + j++] = held[i];
+            }
+        }
+        add_report(buf, len);
+    }
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Reference: for each key of the old report search the new one and the
+ * other way round, then rebuild the held modifier byte */
+static unsigned naive_diff(const uint8_t *prev, const uint8_t *cur)
+{
+    unsigned events = 0;
+    int i;
+
+    for (i = 0; i < 6; i++) {
+        if (prev[2 + i] > 3 && memchr(&cur[2], prev[2 + i], 6) == NULL) {
+            events++;
+        }
+    }
+    events += __builtin_popcount(prev[0] & ~cur[0]);
+    events += __builtin_popcount(cur[0] & ~prev[0]);
+    for (i = 0; i < 6; i++) {
+        if (cur[2 + i] > 3 && memchr(&prev[2], cur[2 + i], 6) == NULL) {
+            events++;
+        }
+    }
+    return events;
+}
+
+int main(int argc, char **argv)
+{
+    hid_report_t layout;
+    KEY_SET held, now, shadow;
+    uint8_t prev[REPORT_MAX] = { 0 };
+    size_t count = 100000, n;
+    unsigned seed = 1, repeat = 20, r;
+    unsigned long events = 0, skipped = 0;
+    uint16_t evt;
+    int nkro_off = 0, opt, boot;
+    double t0, t_engine, t_naive = 0;
+    volatile unsigned sink = 0;
+
+    while ((opt = getopt(argc, argv, "n:c:s:r:h")) != -1) {
+        switch (opt) {
+        case 'n': nkro_off = atoi(optarg); break;
+        case 'c': count = strtoul(optarg, NULL, 0); break;
+        case 's': seed = strtoul(optarg, NULL, 0); break;
+        case 'r': repeat = strtoul(optarg, NULL, 0); break;
+        default:
+            fprintf(stderr, "usage: %s [-n nkro_byte_offset] [-c count] [-s seed] [-r repeat] [trace.txt]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (optind < argc) {
+        FILE *f = strcmp(argv[optind], "-") ? fopen(argv[optind], "r") : stdin;
+        if (f == NULL) {
+            perror(argv[optind]);
+            return 2;
+        }
+        load_trace(f);
+        if (f != stdin) {
+            fclose(f);
+        }
+        printf("trace    %s, %zu reports\n", argv[optind], trace_num);
+    } else {
+        synth_trace(count, seed, nkro_off);
+        printf("trace    synthetic, %zu reports, seed %u\n", trace_num, seed);
+    }
+    if (trace_num == 0) {
+        fprintf(stderr, "no report in the trace\n");
+        return 2;
+    }
+
+    memset(&layout, 0, sizeof(layout));
+    layout.type = REPORT_TYPE_KEYBOARD;
+    if (nkro_off) {
+        layout.keyboard.fields = KEYBOARD_HAS_MODS | KEYBOARD_HAS_BITMAP;
+        layout.keyboard.mod_offset = 0;
+        layout.keyboard.bitmap_offset = nkro_off * 8;
+        layout.keyboard.bitmap_count = (REPORT_MAX - nkro_off) * 8 > KEY_USAGE_MOD_FIRST ? KEY_USAGE_MOD_FIRST : (REPORT_MAX - nkro_off) * 8;
+        layout.keyboard.bitmap_min = 0;
+    }
+    boot = (nkro_off == 0);
+
+    /* Correctness pass: the events must rebuild the decoded set */
+    memset(&held, 0, sizeof(held));
+    memset(&shadow, 0, sizeof(shadow));
+    for (n = 0; n < trace_num; n++) {
+        if (!KEY_Decode(&layout, trace[n].buf, trace[n].len, &now)) {
+            skipped++;
+            continue;
+        }
+        KEY_Diff(&held, &now);
+        while (KEY_Take(&evt)) {
+            uint8_t u = KEY_EVT_USAGE(evt);
+            if (evt & KEY_EVT_UP) {
+                shadow.Word[u / 32] &= ~(1UL << (u % 32));
+            } else {
+                shadow.Word[u / 32] |= 1UL << (u % 32);
+            }
+            events++;
+        }
+        if (memcmp(&shadow, &now, sizeof(now)) != 0) {
+            fprintf(stderr, "FAIL: events do not rebuild report %zu\n", n);
+            return 1;
+        }
+    }
+    printf("events   %lu, %lu reports without key state\n", events, skipped);
+
+    /* Timed passes */
+    t0 = now_ns();
+    for (r = 0; r < repeat; r++) {
+        memset(&held, 0, sizeof(held));
+        for (n = 0; n < trace_num; n++) {
+            if (KEY_Decode(&layout, trace[n].buf, trace[n].len, &now)) {
+                sink += KEY_Diff(&held, &now);
+            }
+            while (KEY_Take(&evt)) {
+                sink += evt;
+            }
+        }
+    }
+    t_engine = now_ns() - t0;
+
+    if (boot) {
+        t0 = now_ns();
+        for (r = 0; r < repeat; r++) {
+            memset(prev, 0, sizeof(prev));
+            for (n = 0; n < trace_num; n++) {
+                if (trace[n].len < 8) {
+                    continue;
+                }
+                sink += naive_diff(prev, trace[n].buf);
+                memcpy(prev, trace[n].buf, 8);
+            }
+        }
+        t_naive = now_ns() - t0;
+    }
+
+    printf("engine   %.1f ns/report (decode, diff, queue, drain)\n", t_engine / ((double)trace_num * repeat));
+    if (boot) {
+        printf("naive    %.1f ns/report (array search, count only)\n", t_naive / ((double)trace_num * repeat));
+    }
+    printf("PASS\n");
+    return (int)(sink & 0);
+}
@@ -0,0 +1,118 @@
+#!/usr/bin/env python3
+"""Summarize the interrupt endpoint poll rates printed by the firmware.
+
+Build the firmware with DEF_SCHED_RATE_EN set to 1 in usb_host_config.h.
+Once per DEF_SCHED_RATE_PERIOD frames it then prints one CSV line per
+scheduled endpoint:
+
+    PR,<frame>,<port>,<addr>,<speed>,<endp>,<interval>,<polls>,<data>,<nak>,<err>,<miss>
+
+over the debug UART. Port 255 is the device on the USB host port, other
+values are HUB port nodes of the device tree. Speed 0 is low speed, 1 full
+speed. A stable schedule shows the same poll count every period and no
+misses, whatever the mix of speeds.
+
+Usage:
+    poll_rate.py capture.log [more.log ...]
+    poll_rate.py --serial /dev/ttyUSB0 --baud 115200 > capture.log
+    poll_rate.py --period 1000 --skip 2 capture.log
+"""
+
+import argparse
+import math
+import sys
+from collections import defaultdict
+
+SPEED = {0: "low", 1: "full", 2: "high"}
+
+
+def parse_lines(lines):
+    """Yield one dict per PR record, ignoring other output."""
+    keys = ("frame", "port", "addr", "speed", "endp", "interval", "polls", "data", "nak", "err", "miss")
+    for line in lines:
+        line = line.strip()
+        if not line.startswith("PR,"):
+            continue
+        fields = line.split(",")
+        if fields[1] == "frame":
+            continue
+        try:
+            values = [int(v, 16) if k == "endp" else int(v) for k, v in zip(keys, fields[1:])]
+        except ValueError:
+            sys.stderr.write("warning: bad line: %s\n" % line)
+            continue
+        if len(values) != len(keys):
+            sys.stderr.write("warning: bad line: %s\n" % line)
+            continue
+        yield dict(zip(keys, values))
+
+
+def stats(values):
+    mean = sum(values) / len(values)
+    dev = math.sqrt(sum((v - mean) ** 2 for v in values) / len(values))
+    return mean, min(values), max(values), dev
+
+
+def read_serial(port, baud):
+    import serial                           # pyserial, only needed for live capture
+
+    with serial.Serial(port, baud, timeout=1) as ser:
+        while True:
+            line = ser.readline().decode("ascii", "replace")
+            if line:
+                sys.stdout.write(line)
+                sys.stdout.flush()
+
+
+def print_summary(records, period, skip):
+    by_endp = defaultdict(list)
+    for rec in records:
+        by_endp[(rec["port"], rec["addr"], rec["endp"])].append(rec)
+
+    print("%-5s %-4s %-4s %-5s %4s %7s %8s %8s %8s %7s %6s %6s %6s"
+          % ("port", "addr", "endp", "speed", "int", "periods", "poll/s", "min", "max", "stddev",
+             "data%", "err", "miss"))
+    for key in sorted(by_endp):
+        group = by_endp[key][skip:]
+        if not group:
+            continue
+        scale = 1000.0 / period
+        mean, lo, hi, dev = stats([r["polls"] * scale for r in group])
+        polls = sum(r["polls"] for r in group)
+        data = sum(r["data"] for r in group)
+        port, addr, endp = key
+        print("%-5d %-4d %-4s %-5s %4d %7d %8.1f %8.1f %8.1f %7.2f %6.1f %6d %6d"
+              % (port, addr, "%02x" % endp, SPEED.get(group[-1]["speed"], "?"), group[-1]["interval"],
+                 len(group), mean, lo, hi, dev, 100.0 * data / polls if polls else 0.0,
+                 sum(r["err"] for r in group), sum(r["miss"] for r in group)))
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    ap.add_argument("logs", nargs="*", help="capture files, '-' for stdin")
+    ap.add_argument("--serial", help="capture live from this port and echo to stdout")
+    ap.add_argument("--baud", type=int, default=115200)
+    ap.add_argument("--period", type=int, default=1000, help="DEF_SCHED_RATE_PERIOD of the firmware, frames")
+    ap.add_argument("--skip", type=int, default=1, help="periods dropped per endpoint, the first one is partial")
+    args = ap.parse_args()
+
+    if args.serial:
+        read_serial(args.serial, args.baud)
+        return
+
+    lines = []
+    for name in args.logs or ["-"]:
+        if name == "-":
+            lines.extend(sys.stdin)
+        else:
+            with open(name, encoding="ascii", errors="replace") as f:
+                lines.extend(f)
+
+    records = list(parse_lines(lines))
+    if not records:
+        sys.exit("no poll rate record found")
+    print_summary(records, args.period, args.skip)
+
+
+if __name__ == "__main__":
+    main()